@@ -46,6 +46,11 @@
 ///
 /// Accumulates samples, calculating mean, variance and low- and high-water
 /// marks on them.
+///
+/// Samples can be accumulated in several shards, each on its own cache line,
+/// with each thread always using the same shard.  The shards are only
+/// merged when the statistics are read, so threads that accumulate samples
+/// frequently don't fight over the cache line holding the totals.
 class Accumulator
 {
 public:
@@ -53,11 +58,13 @@ public:
   static const uint_fast64_t DEFAULT_PERIOD_US = 5 * 1000 * 1000;
 
   /// Constructor.
-  inline Accumulator(uint_fast64_t period_us = DEFAULT_PERIOD_US) :
-                     _target_period_us(period_us)
-  {
-    reset();
-  }
+  ///
+  /// @param period_us  period over which samples are accumulated.
+  /// @param num_shards number of shards to accumulate samples in.  One
+  ///                   shard shares the totals between all threads.
+  Accumulator(uint_fast64_t period_us = DEFAULT_PERIOD_US,
+              unsigned int num_shards = 1);
+  virtual ~Accumulator();
 
   /// Accumulate a sample into our results.
   void accumulate(unsigned long sample);
@@ -92,19 +99,31 @@ private:
   /// in frequently enough.
   uint_fast64_t _target_period_us;
 
-  /// Set of current statistics being accumulated.
-  struct {
+  /// Size of a cache line, which each shard is padded to.
+  static const size_t CACHE_LINE = 64;
+
+  /// Totals for one shard of the current statistics being accumulated.
+  struct Shard
+  {
     // We use a set of atomics here.  This isn't perfect, as reads are not
     // synchronized (e.g. we could read a value of _n that is more recent than
     // the value we read of _sigma).  However, given that _n is likely to be
     // quite large and only out by 1 or 2, it's not expected to matter.
-    std::atomic_uint_fast64_t _timestamp_us;
     std::atomic_uint_fast64_t _n;
     std::atomic_uint_fast64_t _sigma;
     std::atomic_uint_fast64_t _sigma_squared;
     std::atomic_uint_fast64_t _lwm;
     std::atomic_uint_fast64_t _hwm;
-  } _current;
+    char _pad[CACHE_LINE - 5 * sizeof(std::atomic_uint_fast64_t)];
+  };
+
+  /// Start of the current period, and the shards of the current statistics.
+  std::atomic_uint_fast64_t _timestamp_us;
+  Shard* _shards;
+  unsigned int _num_shards;
+
+  /// Get the shard for the calling thread.
+  Shard& thread_shard();
 
   /// Set of statistics accumulated over the previous period.
   struct {
@@ -140,8 +159,9 @@ class StatisticAccumulator : public Accumulator
 public:
   /// Constructor.
   inline StatisticAccumulator(std::string statname,
-                              uint_fast64_t period_us = DEFAULT_PERIOD_US) :
-                              Accumulator(period_us),
+                              uint_fast64_t period_us = DEFAULT_PERIOD_US,
+                              unsigned int num_shards = 1) :
+                              Accumulator(period_us, num_shards),
                               _statistic(statname) {}
 
   /// Callback whenever the accumulated statistics are refreshed.  Passes
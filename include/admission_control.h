@@ -0,0 +1,149 @@
+/**
+ * @file admission_control.h Overload control for received SIP requests
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ADMISSION_CONTROL_H__
+#define ADMISSION_CONTROL_H__
+
+#include <atomic>
+#include <time.h>
+
+#include "statistic.h"
+
+/// @class AdmissionControl
+///
+/// Decides whether to accept new out-of-dialog requests, based on how long
+/// received messages are spending on the receive queue.  When the smoothed
+/// queueing delay exceeds the target, an increasing fraction of new
+/// requests is rejected; once it falls back below the target the fraction
+/// decays back to zero.  Requests are also rejected outright if the queue
+/// depth reaches a hard limit.
+///
+/// Responses, ACKs, CANCELs and in-dialog requests are always admitted by
+/// the caller - they let existing work complete, so rejecting them only
+/// makes overload worse.
+class AdmissionControl
+{
+public:
+  /// Interval, in microseconds, between adjustments to the rejection rate.
+  static const uint_fast64_t ADJUST_PERIOD_US = 100 * 1000;
+
+  /// Constructor.
+  ///
+  /// @param target_latency_us  Target queueing delay, in microseconds, or
+  ///                           zero to only limit the queue depth.
+  /// @param max_queue_depth    Queue depth beyond which all new requests
+  ///                           are rejected, or zero for no limit.
+  /// @param retry_after        Value to return in Retry-After headers, in
+  ///                           seconds.
+  AdmissionControl(unsigned long target_latency_us,
+                   unsigned int max_queue_depth,
+                   int retry_after);
+  ~AdmissionControl();
+
+  /// Record the time a message spent on the receive queue.  Called by
+  /// worker threads as they dequeue each message.
+  void record_queue_delay(unsigned long delay_us);
+
+  /// Decide whether to admit a new out-of-dialog request, given the current
+  /// depth of the receive queue.
+  bool admit_request(unsigned int queue_depth);
+
+  /// Recalculate the rejection rate from the smoothed queueing delay - called
+  /// at the end of each adjustment period.
+  void adjust();
+
+  /// Whether any requests are currently being rejected.
+  inline bool is_throttled() { return (_reject_permille.load() > 0); }
+
+  /// Get the current proportion of requests rejected, in thousandths.
+  inline unsigned int get_reject_permille() { return _reject_permille.load(); }
+
+  /// Get the smoothed queueing delay, in microseconds.
+  inline unsigned long get_smoothed_delay_us() { return _smoothed_delay_us.load(); }
+
+  /// Get the Retry-After value to use on rejections, in seconds.
+  inline int get_retry_after() { return _retry_after; }
+
+private:
+  /// Increase the rejection rate by at least this much (in thousandths) each
+  /// period that the target is exceeded.
+  static const unsigned int REJECT_STEP_PERMILLE = 20;
+
+  /// Get a timestamp in microseconds.
+  inline uint_fast64_t get_timestamp_us()
+  {
+    uint_fast64_t timestamp = 0;
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+      timestamp = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+    }
+    return timestamp;
+  }
+
+  /// Adjust the rejection rate if the current period is over.
+  void maybe_adjust();
+
+  /// Report the current state as a statistic.
+  void report();
+
+  const unsigned long _target_latency_us;
+  const unsigned int _max_queue_depth;
+  const int _retry_after;
+
+  /// Exponentially-weighted moving average of the queueing delay.
+  std::atomic<unsigned long> _smoothed_delay_us;
+
+  /// Proportion of new requests to reject, in thousandths.
+  std::atomic<unsigned int> _reject_permille;
+
+  /// Count of requests seen, used to spread rejections evenly.
+  std::atomic<unsigned int> _request_count;
+
+  /// Number of queueing delays recorded in the current period.
+  std::atomic<unsigned int> _period_samples;
+
+  /// Receive queue depth when the last request arrived.
+  std::atomic<unsigned int> _queue_depth;
+
+  /// Start of the current adjustment period.
+  std::atomic_uint_fast64_t _period_start_us;
+
+  /// Statistic reporting the throttle state.
+  Statistic _statistic;
+};
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ * @file aorcache.h Declarations for the cache of AoRs read from the memcached store
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef AORCACHE_H__
+#define AORCACHE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "memcachedstore.h"
+#include "counter.h"
+
+namespace RegData {
+
+  /// @class RegData::AoRCache
+  ///
+  /// A size-bounded cache of the AoRs most recently read from memcached,
+  /// so they don't have to be fetched and decoded again for every request.
+  ///
+  /// Cached AoRs are returned without checking memcached for the TTL after
+  /// they were read.  After that, the store must check the CAS value in
+  /// memcached still matches before using the cached copy, which saves
+  /// decoding it again.
+  ///
+  /// The cache is split into shards, each with its own lock and LRU list,
+  /// so threads looking up different AoRs rarely contend.  Cached AoRs are
+  /// shared and never modified, so they are copied and freed outside the
+  /// locks.
+  class AoRCache
+  {
+  public:
+    /// Create a cache of up to max_entries AoRs, which are used without
+    /// checking memcached for ttl_ms milliseconds.
+    AoRCache(int max_entries, int ttl_ms, int num_shards=DEFAULT_SHARDS);
+    ~AoRCache();
+
+    static const int DEFAULT_SHARDS = 16;
+
+    /// Get a copy of the AoR if it was cached less than the TTL ago.  If
+    /// not, returns NULL, and if an older copy is cached, sets cas to its
+    /// CAS value so it can be passed to validate.  Otherwise sets cas to
+    /// zero.
+    MemcachedAoR* get(const std::string& aor_id, uint64_t& cas);
+
+    /// Get the latest expiry time of any of the AoR's bindings, without
+    /// copying it, if it was cached less than the TTL ago.  Returns false
+    /// if not.
+    bool get_max_expires(const std::string& aor_id, int& max_expires);
+
+    /// Called when the store has read the AoR's CAS value from memcached.
+    /// If the cached copy has the same CAS value, it is still up to date,
+    /// so this returns a copy and restarts its TTL.  If not, it is removed
+    /// and this returns NULL.
+    MemcachedAoR* validate(const std::string& aor_id, uint64_t cas);
+
+    /// Cache a copy of an AoR read and decoded from memcached, replacing
+    /// any older copy.
+    void put(const std::string& aor_id, MemcachedAoR* aor_data);
+
+    /// Remove the AoR from the cache, for example because this node has
+    /// just updated it.  If the write failed because the data had changed,
+    /// stale_cas is the CAS value it was read with, so we can tell whether
+    /// the cached copy was out of date.
+    void invalidate(const std::string& aor_id, uint64_t stale_cas=0);
+
+    /// Remove all AoRs from the cache.
+    void clear();
+
+    /// Returns the number of AoRs in the cache.
+    inline int size() const { return _size_gauge.get(); }
+
+  private:
+    typedef std::shared_ptr<const MemcachedAoR> AoRPtr;
+
+    struct Entry
+    {
+      std::string aor_id;
+      AoRPtr aor_data;
+      uint64_t cas;
+      int max_expires;
+      uint64_t cached_ms;
+    };
+
+    typedef std::list<Entry> LRUList;
+
+    /// Each shard holds its entries in an LRU list, most recently used
+    /// first, and a map to find them in the list.
+    struct Shard
+    {
+      pthread_mutex_t lock;
+      LRUList lru;
+      std::unordered_map<std::string, LRUList::iterator> map;
+    };
+
+    Shard* shard(const std::string& aor_id);
+    AoRPtr remove(Shard* shard, LRUList::iterator entry);
+    static uint64_t now_ms();
+
+    const int _ttl_ms;
+    int _max_shard_entries;
+    int _num_shards;
+    Shard* _shards;
+
+    /// AoRs returned without checking memcached.
+    StatisticCounter _hit_counter;
+
+    /// AoRs returned after checking memcached, but without decoding.
+    StatisticCounter _validated_counter;
+
+    /// AoRs that had to be decoded because they weren't cached, or the
+    /// cached copy was out of date.
+    StatisticCounter _miss_counter;
+
+    /// Cached AoRs found to be out of date, either when checking memcached
+    /// or because a write based on them was rejected.
+    StatisticCounter _stale_counter;
+
+    StatisticGauge _size_gauge;
+  };
+
+} // namespace RegData
+
+#endif
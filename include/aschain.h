@@ -51,6 +51,7 @@ extern "C" {
 #include "log.h"
 #include "sessioncase.h"
 #include "ifchandler.h"
+#include "counter.h"
 
 
 // Forward declarations.
@@ -337,4 +338,7 @@ private:
   /// Map from token to pair of (AsChain, index).
   std::map<std::string, AsChainLink> _t2c_map;
   pthread_mutex_t _lock;
+
+  /// Number of entries in the map.
+  StatisticGauge _size_gauge;
 };
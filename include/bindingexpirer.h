@@ -0,0 +1,121 @@
+/**
+ * @file bindingexpirer.h Declarations for the service that expires registration bindings
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef BINDINGEXPIRER_H__
+#define BINDINGEXPIRER_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <string>
+
+#include "regdata.h"
+#include "ifchandler.h"
+#include "expirywheel.h"
+#include "counter.h"
+
+/// @class BindingExpirer
+///
+/// Removes registration bindings from the store as they expire, rather
+/// than waiting for the AoR to be read or written again, and deregisters
+/// the user from their application servers when the last one goes.
+///
+/// The registrar tells the expirer whenever it writes an AoR, and the
+/// expirer keeps the time the AoR's first binding expires in a timing
+/// wheel.  Once a second, a thread reads all the AoRs that are due, in
+/// batches, and writes them back without their expired bindings.
+class BindingExpirer
+{
+public:
+  BindingExpirer(RegData::Store* store,
+                 IfcHandler* ifchandler,
+                 pj_pool_t* pool);
+  ~BindingExpirer();
+
+  /// Start the thread that expires bindings every second.
+  void init();
+
+  /// Stop the expiry thread, waiting for it to finish.  Does nothing if it
+  /// isn't running.
+  void stop();
+
+  /// Called once the AoR has been written to the store, to track when its
+  /// first binding expires.  If it has no bindings, stops tracking it.
+  void update(const std::string& aor, RegData::AoR* aor_data);
+
+  /// Remove the bindings of the tracked AoRs that have expired by now, and
+  /// deregister from their application servers those AoRs that have no
+  /// bindings left.
+  void expire(int now);
+
+  /// Returns the number of AoRs tracked.
+  inline size_t size() { return _wheel.size(); }
+
+  // Thread entry point for expiring bindings.
+  static int expiry_thread(void* p);
+
+  /// The number of AoRs read from the store at once.
+  static const size_t BATCH_SIZE = 100;
+
+  /// How long to wait before trying an AoR again if it can't be read, in
+  /// seconds.
+  static const int RETRY_INTERVAL = 10;
+
+private:
+  void expire_aor(const std::string& aor, RegData::AoR* aor_data, int now);
+
+  RegData::Store* _store;
+  IfcHandler* _ifchandler;
+  pj_pool_t* _pool;
+
+  ExpiryWheel _wheel;
+
+  pj_thread_t* _thread;
+  volatile bool _terminated;
+
+  /// The number of AoRs tracked.
+  StatisticGauge _tracked_gauge;
+
+  /// AoRs whose bindings all expired, so were deregistered from their
+  /// application servers.
+  StatisticCounter _expired_counter;
+};
+
+#endif
@@ -0,0 +1,125 @@
+/**
+ * @file counter.h Counter and gauge definitions
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef COUNTER_H__
+#define COUNTER_H__
+
+#include <atomic>
+#include <string>
+
+#include "statistic.h"
+
+/// @class Counter
+///
+/// Counts events, such as errors or retries.  The count only ever goes up,
+/// so the rate of events can be found from the difference between readings.
+class Counter
+{
+public:
+  inline Counter() : _value(0) {}
+  virtual ~Counter() {}
+
+  /// Count one or more events.
+  inline void increment(int_fast64_t n = 1)
+  {
+    _value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /// Get the number of events counted.
+  inline int_fast64_t get() const { return _value.load(); }
+
+protected:
+  std::atomic_int_fast64_t _value;
+};
+
+/// @class Gauge
+///
+/// Tracks the current level of something, such as the number of active
+/// transactions or the size of a table.
+class Gauge
+{
+public:
+  inline Gauge() : _value(0) {}
+  virtual ~Gauge() {}
+
+  inline void increment() { _value.fetch_add(1, std::memory_order_relaxed); }
+  inline void decrement() { _value.fetch_sub(1, std::memory_order_relaxed); }
+  inline void set(int_fast64_t value) { _value.store(value, std::memory_order_relaxed); }
+
+  /// Get the current level.
+  inline int_fast64_t get() const { return _value.load(); }
+
+protected:
+  std::atomic_int_fast64_t _value;
+};
+
+/// @class StatisticCounter
+///
+/// A counter reported as a zeroMQ-based statistic.  The statistics reporter
+/// polls the count, so counting an event is still just an atomic add.
+class StatisticCounter : public Counter
+{
+public:
+  inline StatisticCounter(std::string statname) :
+                          Counter(),
+                          _statistic(statname, &_value) {}
+
+private:
+  /// The zeroMQ-based statistic to report to.  This is destroyed before the
+  /// value it polls, which belongs to the base class.
+  Statistic _statistic;
+};
+
+/// @class StatisticGauge
+///
+/// A gauge reported as a zeroMQ-based statistic.  The statistics reporter
+/// polls the level, so changing it is still just an atomic operation.
+class StatisticGauge : public Gauge
+{
+public:
+  inline StatisticGauge(std::string statname) :
+                        Gauge(),
+                        _statistic(statname, &_value) {}
+
+private:
+  /// The zeroMQ-based statistic to report to.
+  Statistic _statistic;
+};
+
+#endif
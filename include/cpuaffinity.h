@@ -0,0 +1,114 @@
+/**
+ * @file cpuaffinity.h Placement of threads on CPUs and NUMA nodes
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef CPUAFFINITY_H__
+#define CPUAFFINITY_H__
+
+#include <string>
+#include <vector>
+
+/// @class CpuAffinity
+///
+/// Describes where a group of threads (for example the worker threads)
+/// should run.  The placement is specified as either
+///
+/// - a list of CPUs, for example "0-3,8,10", in which case each thread is
+///   bound to a single CPU from the list, or
+/// - a list of NUMA nodes, for example "node:0,1", in which case each
+///   thread is bound to all the CPUs on one of the nodes and prefers to
+///   allocate memory from that node.
+///
+/// Threads are assigned to the CPUs or nodes round-robin.  An empty
+/// specification leaves the threads wherever the scheduler puts them.
+class CpuAffinity
+{
+public:
+  CpuAffinity();
+
+  /// Parse a placement specification, returning false if it is invalid or
+  /// refers to CPUs or nodes that don't exist.
+  bool parse(const std::string& spec);
+
+  /// Indicates whether any placement has been specified.
+  inline bool is_set() const { return !_slots.empty(); }
+
+  /// Returns the NUMA node that the specified thread will run on, or -1 if
+  /// this is not known.
+  int node(unsigned int index) const;
+
+  /// Returns the highest NUMA node used by this placement, or -1 if none.
+  int max_node() const;
+
+  /// Binds the calling thread to the CPUs for the specified thread index,
+  /// and if these are all on one NUMA node, prefers that node for memory
+  /// allocations so that the pools the thread creates are local to it.
+  bool bind(unsigned int index) const;
+
+  /// Returns a description of where the specified thread will run, for
+  /// logging.
+  std::string describe(unsigned int index) const;
+
+  /// Parse a list of CPU or node numbers, for example "0-3,8".
+  static bool parse_list(const std::string& list, std::vector<int>& values);
+
+  /// Format a list of CPU or node numbers, collapsing runs into ranges.
+  static std::string format_list(const std::vector<int>& values);
+
+private:
+  /// The CPUs that a thread is bound to, and the node they are on.
+  struct Slot
+  {
+    std::vector<int> cpus;
+    int node;
+  };
+
+  /// Returns the NUMA node that a CPU is on, or -1 if this isn't known.
+  static int cpu_node(int cpu);
+
+  /// Reads the list of CPUs on a NUMA node.
+  static bool node_cpus(int node, std::vector<int>& cpus);
+
+  /// Root of the sysfs tree describing the CPUs and nodes.  Overridden by
+  /// the UTs.
+  static std::string _sysfs_root;
+
+  std::vector<Slot> _slots;
+};
+
+#endif
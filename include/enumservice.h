@@ -48,6 +48,8 @@
 #include "sas.h"
 #include "dnsresolver.h"
 
+class Histogram;
+
 /// @class EnumService
 ///
 /// Abstract base class for ENUM service implementations.  These perform an
@@ -55,10 +57,19 @@
 class EnumService
 {
 public:
+  EnumService() : _latency_histogram(NULL) {}
+
   /// Must define a destructor, even though it does nothing, to ensure there
   /// is an entry for it in the vtable.
   virtual ~EnumService() {}
 
+  /// Record the time taken by each lookup in the specified histogram, which
+  /// may be NULL.
+  inline void set_latency_histogram(Histogram* histogram)
+  {
+    _latency_histogram = histogram;
+  }
+
   /// Translate a PSTN number to a SIP URI.
   virtual std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const = 0;
 
@@ -74,6 +85,8 @@ public:
   static const boost::regex CHARS_TO_STRIP_FROM_UAS;
   static std::string user_to_aus(const std::string& user) { return boost::regex_replace(user, CHARS_TO_STRIP_FROM_UAS, std::string("")); };
 
+protected:
+  Histogram* _latency_histogram;
 };
 
 
@@ -107,6 +107,15 @@ public:
     return terminated;
   }
 
+  /// Returns the number of events currently in the queue.
+  unsigned int size()
+  {
+    pthread_mutex_lock(&_m);
+    unsigned int size = _q.size();
+    pthread_mutex_unlock(&_m);
+    return size;
+  }
+
   /// Purges all the events currently in the queue.
   void purge()
   {
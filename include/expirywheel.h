@@ -0,0 +1,123 @@
+/**
+ * @file expirywheel.h Declarations for the hierarchical timing wheel of expiry times
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef EXPIRYWHEEL_H__
+#define EXPIRYWHEEL_H__
+
+#include <pthread.h>
+
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+/// @class ExpiryWheel
+///
+/// Tracks an expiry time, in seconds since the epoch, for each of a set of
+/// keys, and returns the keys in batches as their times pass.
+///
+/// The keys are held in a hierarchical timing wheel.  The first level has
+/// a slot for each of the next 256 seconds, and each further level has 64
+/// slots, each covering a whole turn of the level below.  As time moves
+/// on, the keys in each slot of a higher level are moved down a level when
+/// the level below wraps.  Scheduling, rescheduling and cancelling a key
+/// take constant time, and memory is proportional to the number of keys,
+/// however far ahead their expiry times are.
+class ExpiryWheel
+{
+public:
+  /// Create an empty wheel, with time starting at now.
+  ExpiryWheel(int now);
+  ~ExpiryWheel();
+
+  /// Set the expiry time of a key, replacing any it already had.  If the
+  /// time has already passed, the key is returned by the next call to
+  /// pop_expired.
+  void schedule(const std::string& key, int expires);
+
+  /// Stop tracking a key.  Does nothing if the key isn't tracked.
+  void cancel(const std::string& key);
+
+  /// Move time on to now, and append every key whose expiry time is no
+  /// later than now to expired.  The keys are no longer tracked.
+  void pop_expired(int now, std::vector<std::string>& expired);
+
+  /// Returns the number of keys tracked.
+  size_t size();
+
+private:
+  struct Entry
+  {
+    std::string key;
+    int expires;
+    int level;
+    int slot;
+  };
+
+  typedef std::list<Entry> Slot;
+
+  static const int LEVELS = 4;
+  static const int LEVEL0_BITS = 8;
+  static const int LEVELN_BITS = 6;
+
+  /// Pseudo-level of the list of keys already due.
+  static const int DUE = -1;
+
+  void place(Slot& from, Slot::iterator entry);
+  void cascade(int level);
+  Slot& slot(int level, int slot);
+
+  pthread_mutex_t _lock;
+
+  /// The time up to which the wheel has been turned.  All keys with
+  /// earlier or equal expiry times are in _due.
+  int _now;
+
+  Slot _level0[1 << LEVEL0_BITS];
+  Slot _levels[LEVELS - 1][1 << LEVELN_BITS];
+  Slot _due;
+
+  /// The number of keys in the first level, so empty turns of it can be
+  /// skipped.
+  int _level0_size;
+
+  std::unordered_map<std::string, Slot::iterator> _index;
+};
+
+#endif
@@ -0,0 +1,213 @@
+/**
+ * @file histogram.h Log-bucketed histogram of samples, reporting percentiles
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef HISTOGRAM_H__
+#define HISTOGRAM_H__
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "statistic.h"
+
+/// @class Histogram
+///
+/// Accumulates samples into logarithmically-sized buckets (in the style of
+/// an HDR histogram), so that percentiles can be reported with a bounded
+/// relative error without storing the samples.  Each power of two is split
+/// into 2^(SUB_BUCKET_BITS - 1) linear sub-buckets, so reported values are
+/// within about 3% of the true value.
+///
+/// Like Accumulator, samples are accumulated over a period and the results
+/// for the last complete period are available through the accessors.
+class Histogram
+{
+public:
+  /// Default accumulation period, in microseconds.
+  static const uint_fast64_t DEFAULT_PERIOD_US = 5 * 1000 * 1000;
+
+  /// Constructor.
+  Histogram(uint_fast64_t period_us = DEFAULT_PERIOD_US);
+  virtual ~Histogram() {};
+
+  /// Accumulate a sample into our results.
+  void accumulate(unsigned long sample);
+  /// Refresh our calculations - called at the end of each period, or
+  /// optionally at other times to get an up-to-date result.
+  void refresh(bool force = false);
+  /// Resets the histogram.
+  void reset();
+
+  /// Get number of results in last period.
+  inline uint_fast64_t get_n()    { return _last._n; }
+  /// Get the median.
+  inline uint_fast64_t get_p50()  { return _last._p50; }
+  /// Get the 90th percentile.
+  inline uint_fast64_t get_p90()  { return _last._p90; }
+  /// Get the 99th percentile.
+  inline uint_fast64_t get_p99()  { return _last._p99; }
+  /// Get the 99.9th percentile.
+  inline uint_fast64_t get_p999() { return _last._p999; }
+  /// Get the maximum.
+  inline uint_fast64_t get_max()  { return _last._max; }
+
+  /// Callback whenever the statistics are refreshed.  Default is to do
+  /// nothing.
+  virtual void refreshed() {};
+
+  /// Get a timestamp in microseconds.
+  static inline uint_fast64_t get_timestamp_us()
+  {
+    uint_fast64_t timestamp = 0;
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+      timestamp = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+    }
+    return timestamp;
+  }
+
+  /// @class Histogram::Timer
+  ///
+  /// Records the time (in microseconds) from construction to destruction
+  /// in a histogram, which may be NULL.
+  class Timer
+  {
+  public:
+    inline Timer(Histogram* histogram) :
+      _histogram(histogram),
+      _start_us((histogram != NULL) ? get_timestamp_us() : 0)
+    {
+    }
+
+    inline ~Timer()
+    {
+      if (_histogram != NULL)
+      {
+        _histogram->accumulate(get_timestamp_us() - _start_us);
+      }
+    }
+
+  private:
+    Histogram* _histogram;
+    uint_fast64_t _start_us;
+  };
+
+private:
+  /// Number of bits of each sample that are significant.
+  static const unsigned int SUB_BUCKET_BITS = 5;
+  static const unsigned int SUB_BUCKET_HALF = 1 << (SUB_BUCKET_BITS - 1);
+
+  /// Samples of 2^MAX_VALUE_BITS or more are counted in the top bucket.
+  static const unsigned int MAX_VALUE_BITS = 36;
+  static const unsigned int NUM_BUCKETS =
+    (MAX_VALUE_BITS - SUB_BUCKET_BITS + 2) * SUB_BUCKET_HALF;
+
+  /// Get the index of the bucket holding the specified value.
+  static unsigned int bucket_index(uint_fast64_t value);
+  /// Get the highest value held in the specified bucket.
+  static uint_fast64_t bucket_max(unsigned int index);
+
+  /// Find the value at the specified percentile (in hundredths of a
+  /// percent).
+  static uint_fast64_t percentile(const uint_fast64_t* counts,
+                                  uint_fast64_t n,
+                                  unsigned int centipercent);
+
+  /// Read the accumulated samples, calculate their percentiles and report
+  /// them as the last set of statistics.
+  void read(uint_fast64_t period_us);
+
+  /// Target period (in microseconds) over which samples are accumulated.
+  uint_fast64_t _target_period_us;
+
+  /// Samples being accumulated in the current period.
+  struct {
+    std::atomic_uint_fast64_t _timestamp_us;
+    std::atomic_uint_fast64_t _max;
+    std::atomic_uint_fast64_t _buckets[NUM_BUCKETS];
+  } _current;
+
+  /// Statistics calculated over the previous period.
+  struct {
+    volatile uint_fast64_t _n;
+    volatile uint_fast64_t _p50;
+    volatile uint_fast64_t _p90;
+    volatile uint_fast64_t _p99;
+    volatile uint_fast64_t _p999;
+    volatile uint_fast64_t _max;
+  } _last;
+};
+
+/// @class StatisticHistogram
+///
+/// Accumulates a histogram and reports its percentiles as a zeroMQ-based
+/// statistic.  This is defined entirely in the header so that code which
+/// only uses Histogram (such as the store test tools) doesn't need to link
+/// with the statistics code.
+class StatisticHistogram : public Histogram
+{
+public:
+  /// Constructor.
+  inline StatisticHistogram(std::string statname,
+                            uint_fast64_t period_us = DEFAULT_PERIOD_US) :
+                            Histogram(period_us),
+                            _statistic(statname) {}
+
+  /// Callback whenever the statistics are refreshed.  Passes the sample
+  /// count, percentiles and maximum to zeroMQ.
+  virtual void refreshed()
+  {
+    std::vector<std::string> values;
+    values.push_back(std::to_string(get_n()));
+    values.push_back(std::to_string(get_p50()));
+    values.push_back(std::to_string(get_p90()));
+    values.push_back(std::to_string(get_p99()));
+    values.push_back(std::to_string(get_p999()));
+    values.push_back(std::to_string(get_max()));
+    _statistic.report_change(std::move(values));
+  }
+
+private:
+  /// The zeroMQ-based statistic to report to.
+  Statistic _statistic;
+};
+
+#endif
@@ -44,6 +44,8 @@
 #include <json/value.h>
 
 #include "httpconnection.h"
+#include "histogram.h"
+#include "counter.h"
 #include "sas.h"
 
 /// @class HSSConnection
@@ -70,6 +72,10 @@ private:
   virtual Json::Value* get_object(const std::string& path, SAS::TrailId trail);
 
   HttpConnection* _http;
+
+  /// Round trip times of requests to the HSS, and the number that failed.
+  StatisticHistogram _latency_histogram;
+  StatisticCounter _error_counter;
 };
 
 #endif
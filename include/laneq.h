@@ -0,0 +1,224 @@
+/**
+ * @file laneq.h Template definition for weighted priority lane queue
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef LANEQ__
+#define LANEQ__
+
+#include <vector>
+#include <atomic>
+
+#include "mpmcq.h"
+
+/// @class laneq
+///
+/// A queue made up of a number of priority lanes, each of which is a
+/// lock-free mpmcq.  Producers choose the lane for each item.  Consumers
+/// take items from the lanes in proportion to their weights while they
+/// are all backlogged, but never leave an item waiting if its lane's turn
+/// comes up and the lane is empty - the next lane in priority order is
+/// used instead.  So a low priority lane can't starve, and lane 0 (the
+/// highest priority) is served first whenever the others are empty.
+template<class T>
+class laneq
+{
+public:
+  /// Create a lane queue.
+  ///
+  /// @param weights   relative share of the consumers' time for each lane,
+  ///                  in priority order.  Each must be at least 1.
+  /// @param max_queue maximum size of each lane.
+  laneq(const std::vector<unsigned int>& weights, unsigned int max_queue) :
+    _lanes(weights.size()),
+    _ticket(0),
+    _terminated(false)
+  {
+    for (unsigned int ii = 0; ii < weights.size(); ++ii)
+    {
+      _lanes[ii] = new mpmcq<T>(max_queue);
+    }
+
+    // Build a schedule of which lane gets each turn, interleaving the
+    // lanes so that the turns for each lane are spread out.
+    unsigned int max_weight = 0;
+    for (unsigned int ii = 0; ii < weights.size(); ++ii)
+    {
+      max_weight = (weights[ii] > max_weight) ? weights[ii] : max_weight;
+    }
+    for (unsigned int round = 0; round < max_weight; ++round)
+    {
+      for (unsigned int ii = 0; ii < weights.size(); ++ii)
+      {
+        if (round < weights[ii])
+        {
+          _schedule.push_back(ii);
+        }
+      }
+    }
+  }
+
+  ~laneq()
+  {
+    for (unsigned int ii = 0; ii < _lanes.size(); ++ii)
+    {
+      delete _lanes[ii];
+    }
+  }
+
+  /// Returns the number of lanes.
+  unsigned int num_lanes() const
+  {
+    return _lanes.size();
+  }
+
+  /// Send a termination signal via the queue.
+  void terminate()
+  {
+    _terminated = true;
+    for (unsigned int ii = 0; ii < _lanes.size(); ++ii)
+    {
+      _lanes[ii]->terminate();
+    }
+    _not_empty.notify_all();
+  }
+
+  /// Indicates whether the queue has been terminated.
+  bool is_terminated()
+  {
+    return _terminated;
+  }
+
+  /// Returns the number of items in the given lane.
+  unsigned int size(unsigned int lane) const
+  {
+    return _lanes[lane]->size();
+  }
+
+  /// Returns the total number of items in all lanes.
+  unsigned int size() const
+  {
+    unsigned int total = 0;
+    for (unsigned int ii = 0; ii < _lanes.size(); ++ii)
+    {
+      total += _lanes[ii]->size();
+    }
+    return total;
+  }
+
+  /// Push an item on to the given lane.  This may block if the lane is
+  /// full.
+  bool push(T item, unsigned int lane)
+  {
+    bool rc = _lanes[lane]->push(item);
+    if (rc)
+    {
+      _not_empty.notify_one();
+    }
+    return rc;
+  }
+
+  /// Push an item on to the given lane without blocking.  Returns false,
+  /// without queuing the item, if the lane is full.
+  bool push_noblock(T item, unsigned int lane)
+  {
+    bool rc = _lanes[lane]->push_noblock(item);
+    if (rc)
+    {
+      _not_empty.notify_one();
+    }
+    return rc;
+  }
+
+  /// Pop an item from the queue, waiting indefinitely if it is empty.
+  ///
+  /// Returns false once the queue has been terminated.
+  ///
+  /// @param lane set to the lane the item was taken from.
+  bool pop(T& item, unsigned int& lane)
+  {
+    while (!_terminated)
+    {
+      if (try_pop(item, lane))
+      {
+        return true;
+      }
+
+      // All the lanes are empty, so wait for something to arrive.  Check
+      // again after registering as a waiter so we can't miss a wake-up.
+      uint32_t key = _not_empty.prepare_wait();
+      if ((size() == 0) && (!_terminated))
+      {
+        _not_empty.wait(key, -1);
+      }
+      _not_empty.cancel_wait(key);
+    }
+
+    return false;
+  }
+
+  /// Pop an item from the queue if there is one, without waiting.
+  bool try_pop(T& item, unsigned int& lane)
+  {
+    // Try the lane whose turn it is, then fall back to the others in
+    // priority order.
+    lane = _schedule[_ticket++ % _schedule.size()];
+    if (_lanes[lane]->try_pop(item))
+    {
+      return true;
+    }
+
+    for (lane = 0; lane < _lanes.size(); ++lane)
+    {
+      if (_lanes[lane]->try_pop(item))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+private:
+  std::vector<mpmcq<T>*> _lanes;
+  std::vector<unsigned int> _schedule;
+  std::atomic<unsigned int> _ticket;
+  volatile bool _terminated;
+  eventcount _not_empty;
+};
+
+#endif
@@ -43,6 +43,13 @@
 #ifndef LOCALSTORE_H__
 #define LOCALSTORE_H__
 
+#include <pthread.h>
+#include <stdint.h>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
 #include "regdata.h"
 
 namespace RegData {
@@ -83,19 +90,72 @@ namespace RegData {
     uint64_t _cas;
   };
 
+  /// @class RegData::LocalStore
+  ///
+  /// Stores AoRs in local memory, with the same semantics as storing them
+  /// in memcached: writes are rejected if the AoR has changed since it was
+  /// read, and AoRs with no unexpired bindings are removed.
+  ///
+  /// The AoRs are held in hash tables split into shards, each with its own
+  /// lock, so threads accessing different AoRs rarely contend.  Stored AoRs
+  /// are never modified, so readers take a reference to one under the lock
+  /// and copy it after releasing the lock.
   class LocalStore : public Store
   {
   public:
-    LocalStore();
+    LocalStore(int num_shards=DEFAULT_SHARDS);
     virtual ~LocalStore();
 
+    static const int DEFAULT_SHARDS = 64;
+
+    /// Number of hash buckets of a shard checked for AoRs whose bindings
+    /// have all expired each time the shard is written to.
+    static const size_t PURGE_BUCKETS = 4;
+
     void flush_all();
 
     AoR* get_aor_data(const std::string& aor_id);
     bool set_aor_data(const std::string& aor_id, AoR* aor_data);
+    bool has_active_bindings(const std::string& aor_id);
+
+    /// Remove every AoR whose bindings have all expired.  Each write also
+    /// checks a few buckets of the shard it writes to, so expired AoRs are
+    /// removed gradually without this being called.
+    void purge();
+
+    /// Returns the number of AoRs stored, including any that have expired
+    /// but not yet been purged.
+    int size();
 
   private:
-    std::map<std::string, LocalAoR> _db;
+    struct Record
+    {
+      std::shared_ptr<LocalAoR> aor_data;
+      int max_expires;
+    };
+
+    struct Shard
+    {
+      pthread_mutex_t lock;
+      std::unordered_map<std::string, Record> db;
+
+      /// The CAS value given to the next write to this shard.  Each AoR is
+      /// always in the same shard, so these are unique per AoR even if it
+      /// is removed and written again.
+      uint64_t next_cas;
+
+      /// The next hash bucket of this shard to check for expired AoRs.
+      size_t purge_bucket;
+    };
+
+    Shard* shard(const std::string& aor_id);
+    static void purge(Shard* s,
+                      int now,
+                      size_t num_buckets,
+                      std::vector<std::shared_ptr<LocalAoR> >& purged);
+
+    int _num_shards;
+    Shard* _shards;
   };
 
 } // namespace RegData
@@ -40,16 +40,36 @@
 
 #include "logger.h"
 
-#define LOG_ERROR(...) Log::write(0, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_WARNING(...) Log::write(1, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_STATUS(...) Log::write(2, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_INFO(...) Log::write(3, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_VERBOSE(...) Log::write(4, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_DEBUG(...) Log::write(5, __FILE__, __LINE__, __VA_ARGS__)
+// The level is checked inline before the arguments are evaluated, so
+// disabled log statements cost a load and a compare, even if their
+// arguments are expensive to compute.
+#define LOG_LEVEL(LEVEL, ...) do { if (Log::enabled(LEVEL)) { Log::write(LEVEL, __FILE__, __LINE__, __VA_ARGS__); } } while (0)
+
+#define LOG_ERROR(...) LOG_LEVEL(0, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_LEVEL(1, __VA_ARGS__)
+#define LOG_STATUS(...) LOG_LEVEL(2, __VA_ARGS__)
+#define LOG_INFO(...) LOG_LEVEL(3, __VA_ARGS__)
+#define LOG_VERBOSE(...) LOG_LEVEL(4, __VA_ARGS__)
+
+// Building with LOG_NO_DEBUG compiles debug logs out completely.  The
+// arguments are still type-checked, but never evaluated.
+#ifdef LOG_NO_DEBUG
+#define LOG_DEBUG(...) do { if (0) { Log::write(5, __FILE__, __LINE__, __VA_ARGS__); } } while (0)
+#else
+#define LOG_DEBUG(...) LOG_LEVEL(5, __VA_ARGS__)
+#endif
+
 #define LOG_BACKTRACE(...) Log::backtrace(__VA_ARGS__)
 
 namespace Log
 {
+  extern int loggingLevel;
+
+  inline bool enabled(int level)
+  {
+    return (level <= loggingLevel);
+  }
+
   void setLoggingLevel(int level);
   void setLogger(Logger *log);
   void write(int level, const char *module, int line_number, const char *fmt, ...);
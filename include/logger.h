@@ -41,7 +41,11 @@
 #define LOGGER_H__
 
 #include <string>
+#include <vector>
+#include <atomic>
 #include <pthread.h>
+#include <time.h>
+#include <stdio.h>
 
 class Logger
 {
@@ -60,18 +64,58 @@ public:
   virtual void write(const char* data);
   virtual void flush();
 
+  // Switches to writing asynchronously.  Each thread that logs copies its
+  // lines into its own ring buffer of the specified size without taking
+  // any locks, and a background thread drains the rings to the file in
+  // batches.  If a thread's ring is full, the line is dropped and counted.
+  // Lines from different threads may be written slightly out of order,
+  // but each keeps the timestamp from when it was logged.
+  static const unsigned int DEFAULT_RING_SIZE = 256 * 1024;
+  void start_async(unsigned int ring_size = DEFAULT_RING_SIZE);
+
+  // Stops the background thread, writing out anything left in the rings.
+  // No other threads may be logging when this is called.
+  void stop_async();
+
+  // Returns the number of lines dropped because a ring was full.
+  inline unsigned long dropped() const { return _dropped.load(); }
+
   // Dumps a backtrace.  Note that this is not thread-safe and should only be
   // called when no other threads are running - generally from a signal
   // handler.
   virtual void backtrace(const char* data);
 
 private:
+  struct Ring;
+
+  void rotate(const struct tm* dt);
+  static int format_timestamp(char* buf, size_t size, const struct timespec* ts, const struct tm* dt);
+
+  Ring* get_ring();
+  static void release_ring(void* ring);
+  static void* flusher_thread(void* p);
+  void flusher();
+  bool drain(Ring* ring);
+  void drain_all();
+
   int _flags;
   std::string _prefix;
   int _last_hour;
   bool _rotate;
   FILE* _fd;
   pthread_mutex_t _lock;
+
+  // Asynchronous mode state.  The rings list is protected by _lock, which
+  // the flusher thread holds while writing.
+  bool _async;
+  unsigned int _ring_size;
+  pthread_key_t _ring_key;
+  std::vector<Ring*> _rings;
+  pthread_t _flusher;
+  pthread_cond_t _flusher_cond;
+  bool _flusher_stop;
+  std::atomic<unsigned long> _dropped;
+  unsigned long _reported_dropped;
 };
 
 
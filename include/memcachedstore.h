@@ -44,6 +44,8 @@
 #define MEMCACHEDSTORE_H__
 
 #include <sstream>
+#include <vector>
+#include <pthread.h>
 
 extern "C" {
 #include <libmemcached/memcached.h>
@@ -51,6 +53,7 @@ extern "C" {
 }
 
 #include "regdata.h"
+#include "eventq.h"
 
 namespace RegData {
 
@@ -97,21 +100,87 @@ namespace RegData {
     uint64_t _cas;
   };
 
+  class AoRCache;
+
   /// @class RegData::MemcachedStore
   ///
   /// A memcached-based implementation of the Store class.
   class MemcachedStore : public Store
   {
   public:
-    MemcachedStore(const std::list<std::string>& servers, int pool_size, bool binary=true);
+    MemcachedStore(const std::list<std::string>& servers,
+                   int pool_size,
+                   bool binary=true,
+                   int cache_entries=0,
+                   int cache_ttl_ms=0,
+                   int io_threads=0,
+                   bool binary_aor=false);
     ~MemcachedStore();
 
     void flush_all();
 
     AoR* get_aor_data(const std::string& aor_id);
+    std::vector<AoR*> get_aor_data_multi(const std::vector<std::string>& aor_ids);
     bool set_aor_data(const std::string& aor_id, AoR* aor_data);
 
+    /// Answered from the cache if possible.  Otherwise, if the store has
+    /// I/O threads, queues the get for them, and they fetch whatever gets
+    /// are queued together.  Without I/O threads, gets the data
+    /// synchronously.
+    bool get_aor_data_async(const std::string& aor_id,
+                            GetCallback* callback,
+                            AoR*& aor_data);
+
+    /// Answered from the cache or the header of the stored AoR, without
+    /// reading the bindings.
+    bool has_active_bindings(const std::string& aor_id);
+
+    /// Serialize an AoR in the format this store writes: binary if the
+    /// store was created with binary_aor set, legacy otherwise.
+    std::string serialize(MemcachedAoR* aor_data) const;
+
+    /// Serialize an AoR in the current binary format.
+    static std::string serialize_aor(MemcachedAoR* aor_data);
+
+    /// Deserialize an AoR directly from the buffer holding it, which may be
+    /// in the binary or legacy format.  Returns NULL if the data is corrupt
+    /// or in a format version we don't understand.
+    static MemcachedAoR* deserialize_aor(const char* data, size_t length);
+    static inline MemcachedAoR* deserialize_aor(const std::string& s)
+    {
+      return deserialize_aor(s.data(), s.length());
+    }
+
+    /// Read the latest expiry time of any binding from the header of an AoR
+    /// in the binary format, without reading the bindings.  Returns -1 if
+    /// the header doesn't record it, for example because the AoR is in the
+    /// legacy format, in which case the caller must deserialize the AoR.
+    static int read_max_expires(const char* data, size_t length);
+
+    /// Serialize and deserialize the legacy format, which was written with
+    /// streams, using host-endian integers and NUL-terminated strings.  The
+    /// legacy format is written by default, since nodes running earlier
+    /// releases can only read the legacy format.
+    static std::string serialize_legacy_aor(MemcachedAoR* aor_data);
+    static MemcachedAoR* deserialize_legacy_aor(const std::string& s);
+
+    /// Maximum number of queued gets an I/O thread fetches at once.
+    static const int IO_BATCH_SIZE = 64;
+
   private:
+    /// A get waiting for an I/O thread.
+    struct PendingGet
+    {
+      std::string aor_id;
+      GetCallback* callback;
+    };
+
+    /// Entry point for the I/O threads.
+    static void* io_thread(void* p);
+
+    /// Helper: fetch a batch of queued gets and report the results.
+    void complete_gets(std::vector<PendingGet>& gets);
+
     /// Helper: to_string method using ostringstream.
     template <class T>
       std::string to_string(T t, ///< datum to convert
@@ -124,12 +193,26 @@ namespace RegData {
       return oss.str();
     }
 
-    static std::string serialize_aor(MemcachedAoR* aor_data);
-    static MemcachedAoR* deserialize_aor(const std::string& s);
+    /// Helper: decode an AoR from a memcached result.
+    MemcachedAoR* decode_result(const std::string& aor_id,
+                                memcached_result_st* result,
+                                uint64_t cached_cas);
 
     /// The memcached pool in use. Owned by this object.
     memcached_pool_st* _pool;
 
+    /// Cache of recently read AoRs, or NULL if caching is disabled.  Owned
+    /// by this object.
+    AoRCache* _cache;
+
+    /// Gets waiting for the I/O threads, and the threads themselves.  The
+    /// queue is NULL if there are no I/O threads.
+    eventq<PendingGet>* _pending;
+    std::vector<pthread_t> _io_threads;
+
+    /// Whether AoRs are written in the binary format rather than the legacy
+    /// one.  Both formats are always read.
+    bool _binary_aor;
   };
 
 } // namespace RegData
@@ -46,7 +46,11 @@ namespace RegData
 {
   RegData::Store* create_memcached_store(const std::list<std::string>& servers,
                                          int connections,
-                                         bool binary=true);
+                                         bool binary=true,
+                                         int cache_entries=0,
+                                         int cache_ttl_ms=0,
+                                         int io_threads=0,
+                                         bool binary_aor=false);
 
   void destroy_memcached_store(RegData::Store* store);
 
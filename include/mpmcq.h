@@ -0,0 +1,494 @@
+/**
+ * @file mpmcq.h Template definition for bounded lock-free multi-producer/multi-consumer queue
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef MPMCQ__
+#define MPMCQ__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <new>
+#include <atomic>
+
+/// Assumed size of a cache line, used to pad shared state so that producers
+/// and consumers don't contend on the same line.
+#define MPMCQ_CACHE_LINE 64
+
+/// @class eventcount
+///
+/// Lets threads park on a condition that is signalled by lock-free code,
+/// without the signaller having to take a lock.  The usual pattern is
+///
+///   uint32_t key = ec.prepare_wait();
+///   if (condition not yet true) { ec.wait(key, timeout); }
+///   ec.cancel_wait(key);
+///
+/// The signaller makes the condition true and then calls notify_one() or
+/// notify_all(), which are close to free if nobody is waiting.
+///
+/// The state is a 32-bit epoch (which is also the futex word) and a count
+/// of waiters.  Each notification bumps the epoch and consumes a waiter,
+/// so repeated notifications while a woken thread is still waking up
+/// don't each cost a system call.
+class eventcount
+{
+public:
+  eventcount() : _state(0) {}
+
+  /// Register interest in the next notification and return a key to pass
+  /// to wait() and cancel_wait().
+  inline uint32_t prepare_wait()
+  {
+    return epoch(_state.fetch_add(ONE_WAITER));
+  }
+
+  /// Withdraw interest registered with prepare_wait().  Must be called
+  /// exactly once for each call to prepare_wait(), after any wait().  If
+  /// there has been a notification since, it has already consumed a waiter
+  /// so there is nothing to do.
+  inline void cancel_wait(uint32_t key)
+  {
+    uint64_t state = _state.load();
+    while ((epoch(state) == key) &&
+           (!_state.compare_exchange_weak(state, state - ONE_WAITER)))
+    {
+      // Retry.
+    }
+  }
+
+  /// Block until notified, or until the timeout (in milliseconds, -1 for
+  /// infinite) expires.  Returns immediately if there has been a
+  /// notification since the key was obtained.
+  inline void wait(uint32_t key, int timeout)
+  {
+    struct timespec ts;
+    struct timespec* tsp = NULL;
+    if (timeout >= 0)
+    {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000;
+      tsp = &ts;
+    }
+    syscall(SYS_futex, futex_word(), FUTEX_WAIT_PRIVATE, (int)key, tsp, NULL, 0);
+  }
+
+  /// Wake a single waiter, if there are any.
+  inline void notify_one()
+  {
+    // The fence orders the caller's update to the condition before the read
+    // of the waiter count, pairing with the read-modify-write in
+    // prepare_wait().  Either the waiter sees the new condition, or we see
+    // the waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t state = _state.load(std::memory_order_relaxed);
+    do
+    {
+      if (waiters(state) == 0)
+      {
+        return;
+      }
+    }
+    while (!_state.compare_exchange_weak(state, next_epoch(state) | ((waiters(state) - 1) << 32)));
+
+    syscall(SYS_futex, futex_word(), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+
+  /// Wake all waiters.
+  inline void notify_all()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t state = _state.load(std::memory_order_relaxed);
+    do
+    {
+      if (waiters(state) == 0)
+      {
+        return;
+      }
+    }
+    while (!_state.compare_exchange_weak(state, next_epoch(state)));
+
+    syscall(SYS_futex, futex_word(), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+
+private:
+  // The epoch is in the low 32 bits and the waiter count in the high 32.
+  static const uint64_t ONE_WAITER = 1ull << 32;
+
+  static inline uint32_t epoch(uint64_t state)
+  {
+    return (uint32_t)state;
+  }
+
+  static inline uint64_t waiters(uint64_t state)
+  {
+    return state >> 32;
+  }
+
+  static inline uint64_t next_epoch(uint64_t state)
+  {
+    return (uint32_t)(epoch(state) + 1);
+  }
+
+  /// Address of the epoch within the state, for use as the futex word.
+  inline int* futex_word()
+  {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return (int*)&_state;
+#else
+    return (int*)&_state + 1;
+#endif
+  }
+
+  std::atomic<uint64_t> _state;
+};
+
+/// @class mpmcq
+///
+/// Bounded lock-free multi-producer/multi-consumer queue, with the same
+/// interface as eventq so that it can be used in its place.  Items are held
+/// in a ring of sequence-numbered cells (Vyukov's algorithm), so push and
+/// pop each cost a single compare-and-swap when uncontended.  Threads only
+/// enter the kernel (via a futex) when they have to block because the queue
+/// is empty or full.
+///
+/// T must be copyable and default constructible.
+template<class T>
+class mpmcq
+{
+public:
+  /// Create a queue.
+  ///
+  /// @param max_queue maximum size of the queue.  This is rounded up to a
+  ///                  power of two.
+  mpmcq(unsigned int max_queue, bool open=true) :
+    _open(open),
+    _terminated(false)
+  {
+    unsigned int capacity = 2;
+    while (capacity < max_queue)
+    {
+      capacity <<= 1;
+    }
+    _mask = capacity - 1;
+
+    void* mem = NULL;
+    if (posix_memalign(&mem, MPMCQ_CACHE_LINE, sizeof(cell) * capacity) != 0)
+    {
+      throw std::bad_alloc(); // LCOV_EXCL_LINE
+    }
+    _cells = (cell*)mem;
+    for (unsigned int ii = 0; ii < capacity; ++ii)
+    {
+      new (&_cells[ii]) cell();
+      _cells[ii].seq.store(ii, std::memory_order_relaxed);
+    }
+
+    _head.store(0, std::memory_order_relaxed);
+    _tail.store(0, std::memory_order_relaxed);
+  }
+
+  ~mpmcq()
+  {
+    for (unsigned int ii = 0; ii <= _mask; ++ii)
+    {
+      _cells[ii].~cell();
+    }
+    free(_cells);
+  }
+
+  /// Open the queue for new inputs.
+  void open()
+  {
+    _open = true;
+  }
+
+  /// Close the queue to new inputs.
+  void close()
+  {
+    _open = false;
+  }
+
+  /// Send a termination signal via the queue.  Any blocked readers or
+  /// writers return false.
+  void terminate()
+  {
+    _terminated = true;
+    _not_empty.notify_all();
+    _not_full.notify_all();
+  }
+
+  /// Indicates whether the queue has been terminated.
+  bool is_terminated()
+  {
+    return _terminated;
+  }
+
+  /// Purges all the events currently in the queue.
+  void purge()
+  {
+    T item;
+    while (try_pop(item))
+    {
+    }
+  }
+
+  /// Returns the capacity of the queue.
+  unsigned int capacity() const
+  {
+    return _mask + 1;
+  }
+
+  /// Returns the number of items in the queue.  This is only a snapshot
+  /// since other threads may be pushing or popping concurrently.
+  unsigned int size() const
+  {
+    size_t tail = _tail.load(std::memory_order_acquire);
+    size_t head = _head.load(std::memory_order_acquire);
+    return (tail > head) ? (unsigned int)(tail - head) : 0;
+  }
+
+  /// Push an item on to the queue.
+  ///
+  /// This may block if the queue is full, and will fail if the queue is
+  /// closed or terminated.
+  bool push(T item)
+  {
+    while (_open && !_terminated)
+    {
+      if (try_push(item))
+      {
+        return true;
+      }
+
+      // The queue is full, so wait for a reader to make space.
+      uint32_t key = _not_full.prepare_wait();
+      if ((size() > _mask) && (_open) && (!_terminated))
+      {
+        _not_full.wait(key, -1);
+      }
+      _not_full.cancel_wait(key);
+    }
+
+    return false;
+  }
+
+  /// Push an item on to the queue.
+  ///
+  /// This will not block, but may discard the event if the queue is full.
+  bool push_noblock(T item)
+  {
+    return (_open) && (!_terminated) && (try_push(item));
+  }
+
+  /// Pop an item from the queue, waiting indefinitely if it is empty.
+  ///
+  /// Returns false (without an item) once the queue has been terminated.
+  bool pop(T& item)
+  {
+    return pop(item, -1);
+  }
+
+  /// Pop an item from the queue, waiting for the specified timeout if the
+  /// queue is empty.
+  ///
+  /// Unlike eventq::pop, this only returns true if an item was popped.
+  ///
+  /// @param timeout Maximum time to wait in milliseconds, or -1 to wait
+  ///                indefinitely.
+  bool pop(T& item, int timeout)
+  {
+    return (pop_batch(&item, 1, timeout) == 1);
+  }
+
+  /// Pop an item from the queue if there is one, without waiting.
+  bool try_pop(T& item)
+  {
+    size_t pos = _head.load(std::memory_order_relaxed);
+    cell* c;
+
+    for (;;)
+    {
+      c = &_cells[pos & _mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+      if (dif == 0)
+      {
+        // This cell is ready to be read, so try to claim it.
+        if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (dif < 0)
+      {
+        // The cell hasn't been written yet, so the queue is empty.
+        return false;
+      }
+      else
+      {
+        // Another reader claimed this cell first, so try again.
+        pos = _head.load(std::memory_order_relaxed);
+      }
+    }
+
+    item = c->data;
+    c->seq.store(pos + _mask + 1, std::memory_order_release);
+    _not_full.notify_one();
+
+    return true;
+  }
+
+  /// Pop up to max_items items from the queue into the supplied array.
+  /// Waits (up to the timeout) for the first item, but not for any others.
+  ///
+  /// Returns the number of items popped, which is zero if the timeout
+  /// expired or the queue has been terminated.
+  ///
+  /// @param timeout Maximum time to wait in milliseconds, or -1 to wait
+  ///                indefinitely.
+  unsigned int pop_batch(T* items, unsigned int max_items, int timeout=-1)
+  {
+    unsigned int count = 0;
+
+    while ((count == 0) && (!_terminated))
+    {
+      while ((count < max_items) && (try_pop(items[count])))
+      {
+        ++count;
+      }
+
+      if ((count == 0) && (timeout != 0))
+      {
+        // The queue is empty, so wait for something to arrive.  Check again
+        // after registering as a waiter so we can't miss a wake-up.
+        uint32_t key = _not_empty.prepare_wait();
+        if ((size() == 0) && (!_terminated))
+        {
+          _not_empty.wait(key, timeout);
+        }
+        _not_empty.cancel_wait(key);
+
+        if (timeout != -1)
+        {
+          // Only wait once if there is a timeout.  This might return early
+          // if woken by another push, but callers must cope with spurious
+          // wake-ups anyway.
+          timeout = 0;
+        }
+      }
+      else if (count == 0)
+      {
+        break;
+      }
+    }
+
+    return count;
+  }
+
+private:
+
+  struct cell
+  {
+    std::atomic<size_t> seq;
+    T data;
+  } __attribute__((aligned(MPMCQ_CACHE_LINE)));
+
+  /// Push an item if there is space, without waiting.
+  bool try_push(const T& item)
+  {
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    cell* c;
+
+    for (;;)
+    {
+      c = &_cells[pos & _mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+      if (dif == 0)
+      {
+        // This cell is free, so try to claim it.
+        if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (dif < 0)
+      {
+        // The cell still holds an item from the previous lap, so the queue
+        // is full.
+        return false;
+      }
+      else
+      {
+        // Another writer claimed this cell first, so try again.
+        pos = _tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    c->data = item;
+    c->seq.store(pos + 1, std::memory_order_release);
+    _not_empty.notify_one();
+
+    return true;
+  }
+
+  // Keep the fields written by writers, by readers and by neither on
+  // separate cache lines.
+  cell* _cells;
+  size_t _mask;
+  volatile bool _open;
+  volatile bool _terminated;
+
+  char _pad0[MPMCQ_CACHE_LINE];
+  std::atomic<size_t> _tail;
+  eventcount _not_empty;
+
+  char _pad1[MPMCQ_CACHE_LINE];
+  std::atomic<size_t> _head;
+  eventcount _not_full;
+
+  char _pad2[MPMCQ_CACHE_LINE];
+};
+
+#endif
@@ -43,9 +43,13 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 
+class Histogram;
+class Counter;
+
 namespace RegData
 {
   /// @class RegData::AoR
@@ -92,7 +96,8 @@ namespace RegData
 
     /// Constructor: the store is initially empty.
     AoR() :
-      _bindings()
+      _bindings(),
+      _expired(0)
     {
     }
 
@@ -128,10 +133,20 @@ namespace RegData
       return _bindings;
     }
 
+    /// The number of bindings removed because they had expired when this
+    /// was last read from or written to the store.
+    inline int expired() const
+    {
+      return _expired;
+    }
+
   private:
     /// Map holding the bindings for a particular AoR indexed by binding ID.
     Bindings _bindings;
 
+    /// The number of bindings the store last expired from this AoR.
+    int _expired;
+
     /// Store code is allowed to manipulate bindings directly.
     friend class Store;
   };
@@ -143,12 +158,42 @@ namespace RegData
   class Store
   {
   public:
+    Store() :
+      _get_latency_histogram(NULL),
+      _set_latency_histogram(NULL),
+      _conflict_counter(NULL)
+    {
+    }
+
     /// Must define a destructor, even though it does nothing, to ensure there
     /// is an entry for it in the vtable.
     virtual ~Store()
     {
     }
 
+    /// Record the round trip time of requests to the underlying storage in
+    /// the specified histogram, which may be NULL.
+    inline void set_latency_histogram(Histogram* histogram)
+    {
+      set_latency_histograms(histogram, histogram);
+    }
+
+    /// Record the round trip times of reads and writes separately.  Either
+    /// histogram may be NULL.
+    inline void set_latency_histograms(Histogram* get_histogram,
+                                       Histogram* set_histogram)
+    {
+      _get_latency_histogram = get_histogram;
+      _set_latency_histogram = set_histogram;
+    }
+
+    /// Count writes rejected because the data changed since it was read in
+    /// the specified counter, which may be NULL.
+    inline void set_conflict_counter(Counter* counter)
+    {
+      _conflict_counter = counter;
+    }
+
     /// Wipe all data from the store.
     virtual void flush_all() = 0;
 
@@ -158,13 +203,56 @@ namespace RegData
     /// by caller and must be freed with delete.
     virtual AoR* get_aor_data(const std::string& aor_id) = 0;
 
+    /// Get the data for several addresses of record at once, creating them
+    /// if necessary.  Returns the AoRs in the same order as the IDs, any of
+    /// which may be NULL in case of error.  The AoRs are owned by the
+    /// caller and must be freed with delete.
+    virtual std::vector<AoR*> get_aor_data_multi(const std::vector<std::string>& aor_ids);
+
+    /// @class RegData::Store::GetCallback
+    ///
+    /// Receives the result of an asynchronous get.
+    class GetCallback
+    {
+    public:
+      virtual ~GetCallback()
+      {
+      }
+
+      /// Called when the get completes, with the data for the address of
+      /// record, or NULL in case of error.  The data is owned by the
+      /// callee.  May be called on one of the store's own threads, so must
+      /// not block or do any SIP processing itself.
+      virtual void get_complete(const std::string& aor_id, AoR* aor_data) = 0;
+    };
+
+    /// Get the data for an address of record without waiting for the store
+    /// to respond.  If the data is available straight away (for example
+    /// because it is cached), returns true with the data in aor_data, and
+    /// the callback is not called.  Otherwise returns false, and the
+    /// callback is called once the data has been read.
+    virtual bool get_aor_data_async(const std::string& aor_id,
+                                    GetCallback* callback,
+                                    AoR*& aor_data);
+
     /// Update the data for a particular address of record.  Writes the data
     /// atomically.  If the underlying data has changed since it was last
     /// read, the update is rejected and this returns false; if the update
     /// succeeds, this returns true.
     virtual bool set_aor_data(const std::string& aor_id, AoR* data) = 0;
 
+    /// Returns true if the address of record has any unexpired bindings.
+    /// Returns false if it has none, or in case of error.  This is cheaper
+    /// than getting the data, as implementations need not read the
+    /// bindings themselves.
+    virtual bool has_active_bindings(const std::string& aor_id);
+
     virtual int expire_bindings(AoR* aor_data, int now);
+
+  protected:
+    Histogram* _get_latency_histogram;
+    Histogram* _set_latency_histogram;
+    Counter* _conflict_counter;
   };
 
 }; // namespace RegData
@@ -48,6 +48,7 @@ extern "C" {
 #include "hssconnection.h"
 #include "analyticslogger.h"
 #include "ifchandler.h"
+#include "bindingexpirer.h"
 
 extern pjsip_module mod_registrar;
 
@@ -55,8 +56,14 @@ extern pj_status_t init_registrar(RegData::Store* registrar_store,
                                   HSSConnection* hss_connection,
                                   AnalyticsLogger* analytics_logger,
                                   IfcHandler* ifchandler_ref,
-                                  int cfg_max_expires);
+                                  int cfg_max_expires,
+                                  BindingExpirer* binding_expirer);
 
 extern void destroy_registrar();
 
+/// Called when an AoR's bindings have been written to the store other than
+/// by a REGISTER, so the binding expirer (if any) can track them.
+extern void registrar_bindings_changed(const std::string& aor,
+                                       RegData::AoR* aor_data);
+
 #endif
@@ -49,4 +49,5 @@ namespace RegistrationUtils {
 void user_initiated_deregistration(IfcHandler *ifchandler, RegData::Store *store, const std::string& served_user, const std::string& binding_id, SAS::TrailId trail);
 void network_initiated_deregistration(IfcHandler *ifchandler, RegData::Store* store, const std::string& served_user, const std::string& binding_id, SAS::TrailId trail);
 void register_with_application_servers(IfcHandler *ifchandler, RegData::Store *store, pjsip_rx_data *received_register, pjsip_tx_data *ok_response, int expires, const std::string& served_user, SAS::TrailId trail);
+void deregister_with_application_servers(IfcHandler *ifchandler, RegData::Store *store, const std::string& served_user, SAS::TrailId trail);
 }
@@ -0,0 +1,104 @@
+/**
+ * @file rxdatapool.h  Recycled pools for passing received messages to worker threads
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef RXDATAPOOL_H__
+#define RXDATAPOOL_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <atomic>
+
+#include "mpmcq.h"
+
+/// @class RxDataPool
+///
+/// Clones received messages so they can be passed to worker threads, as a
+/// cheaper replacement for pjsip_rx_data_clone and
+/// pjsip_rx_data_free_cloned.
+///
+/// - Pools are recycled through a lock-free free list rather than being
+///   created and released through the (locked) caching pool factory for
+///   every message.
+/// - Only the bytes of the message itself are copied, rather than the
+///   transport's entire receive buffer, and the rest of the clone is not
+///   zeroed first.
+///
+/// The parsed message still has to be cloned, since the transport reuses
+/// its receive buffer and pool as soon as the message has been queued.
+class RxDataPool
+{
+public:
+  /// Create a pool of clones.
+  ///
+  /// @param factory  pool factory used to create new pools.
+  /// @param max_free maximum number of pools kept for reuse.
+  RxDataPool(pj_pool_factory* factory, unsigned int max_free);
+  ~RxDataPool();
+
+  /// Create pools and put them on the free list, up to its maximum size.
+  /// The pools' first blocks are allocated by the calling thread, so this
+  /// is called by the threads that will process the clones to keep that
+  /// memory on their NUMA node.
+  void reserve(unsigned int count);
+
+  /// Clone a received message.  The clone must be freed with release().
+  pj_status_t clone(const pjsip_rx_data* src, pjsip_rx_data** p_rdata);
+
+  /// Free a clone returned by clone(), returning its pool to the free list.
+  void release(pjsip_rx_data* rdata);
+
+  /// Returns the number of pools created, and the number currently free.
+  inline unsigned long pools_created() const { return _created.load(); }
+  inline unsigned int pools_free() const { return _free.size(); }
+
+private:
+  /// Initial size of each pool.  This is enough for the rx_data structure
+  /// plus the parsed form of a typical message, so most messages only need
+  /// a single block.
+  static const pj_size_t POOL_SIZE = sizeof(pjsip_rx_data) + 8192;
+  static const pj_size_t POOL_INCREMENT = 4096;
+
+  pj_pool_factory* _factory;
+  mpmcq<pj_pool_t*> _free;
+  std::atomic<unsigned long> _created;
+};
+
+#endif
@@ -40,9 +40,15 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
-#include "eventq.h"
+#include "mpmcq.h"
+#include "spscq.h"
 
 class SAS
 {
@@ -58,6 +64,7 @@ public:
     inline Message(TrailId trail, uint32_t id, uint32_t instance)
     {
       _trail = trail;
+      _timestamp = 0;
       _msg.hdr.id = id;
       _msg.hdr.instance = instance;
       _msg.hdr.static_data_len = 0;
@@ -95,10 +102,28 @@ public:
       return add_var_param(s.length(), (uint8_t*)s.data());
     }
 
+    /// Set the time the message reports, in milliseconds since the epoch,
+    /// if it is for something that happened before the message is sent.
+    /// By default the time the message is encoded is used.
+    inline Message& set_timestamp(uint64_t timestamp_ms)
+    {
+      _timestamp = timestamp_ms;
+      return *this;
+    }
+
     friend class SAS;
 
+  protected:
+    /// Returns the encoded length of the static and variable parameters.
+    size_t params_length() const;
+
+    /// Encodes the static and variable parameters, returning a pointer to
+    /// the byte after them.
+    char* write_params(char* p) const;
+
   private:
     TrailId _trail;
+    uint64_t _timestamp;
     struct
     {
       struct
@@ -125,6 +150,12 @@ public:
     {
     }
 
+    /// Returns the length of the encoded event.
+    size_t encoded_length() const;
+
+    /// Encodes the event into a buffer of encoded_length() bytes.
+    void encode(char* buf, size_t len) const;
+
     std::string to_string() const;
   };
 
@@ -143,15 +174,110 @@ public:
       TrailGroup = 2
     };
 
+    /// Returns the length of the encoded marker.
+    size_t encoded_length() const;
+
+    /// Encodes the marker into a buffer of encoded_length() bytes.
+    void encode(char* buf, size_t len, Scope scope) const;
+
     std::string to_string(Scope scope) const;
   };
 
+  /// An encoded message waiting to be sent to SAS.  The data follows the
+  /// header in the same allocation.
+  struct Buffer
+  {
+    uint32_t len;
+    uint32_t capacity;
+
+    inline char* data() { return (char*)(this + 1); }
+  };
+
+  /// Pool of buffers for encoded messages, so that reporting an event
+  /// doesn't allocate once the pool has warmed up.  Buffers come in two
+  /// sizes - small ones for most events, and ones big enough for the
+  /// largest possible SAS message (the length field is 16 bits).
+  class BufferPool
+  {
+  public:
+    static const size_t SMALL_BUFFER_SIZE = 2048;
+    static const size_t LARGE_BUFFER_SIZE = 65536;
+
+    /// @param max_free maximum number of free buffers kept of each size.
+    BufferPool(unsigned int max_free);
+    ~BufferPool();
+
+    /// Get a buffer with room for at least len bytes, or NULL if len is too
+    /// big for a SAS message.
+    Buffer* get(size_t len);
+
+    /// Return a buffer to the pool.
+    void release(Buffer* buf);
+
+    /// Returns the number of buffers allocated by the pool.
+    inline unsigned long buffers_created() const { return _created.load(); }
+
+  private:
+    mpmcq<Buffer*>& free_list(size_t capacity);
+
+    mpmcq<Buffer*> _small_free;
+    mpmcq<Buffer*> _large_free;
+    std::atomic<unsigned long> _created;
+  };
+
+  /// Controls which trails and events are reported.  By default every
+  /// event on every trail is reported.
+  struct Policy
+  {
+    Policy() : sample_percent(100.0) {}
+
+    /// Percentage of new trails that are traced.  The decision is made once
+    /// when the trail is created.
+    double sample_percent;
+
+    /// Users whose trails are always traced.  A trail is traced from the
+    /// point a marker with an ID in user_markers is reported on it with one
+    /// of these users as its first parameter.
+    std::set<std::string> traced_users;
+    std::set<uint32_t> user_markers;
+
+    /// Maximum number of events with each ID reported per second on trails
+    /// that were sampled.  Forced trails aren't capped.
+    std::map<uint32_t, unsigned int> event_caps;
+  };
+
+  /// Set the policy.  Must be called before any trails are created.
+  static void set_policy(const Policy& policy);
+
+  /// Returns true if events on the trail are reported.  Callers can use this
+  /// to avoid building events that would be thrown away.
+  static bool is_traced(TrailId trail);
+
+  /// Trace all further events on a trail, even if it wasn't sampled.  This
+  /// is used when something has gone wrong on the trail.
+  static void force_trail(TrailId trail);
+
+  /// Returns the number of trails created, and the number of those traced
+  /// (either because they were sampled or they were forced).
+  static unsigned long trails_created();
+  static unsigned long trails_traced();
+
+  /// Returns the number of events not reported because of the event caps.
+  static unsigned long events_capped();
+
   static void init(int system_name_length, const char* system_name, const std::string& sas_address);
   static void term();
   static TrailId new_trail(uint32_t instance);
   static void report_event(const Event& event);
   static void report_marker(const Marker& marker, Marker::Scope scope=Marker::Scope::None);
 
+  /// Returns the number of messages waiting to be sent to SAS.
+  static unsigned int queue_depth();
+
+  /// Returns the total number of messages discarded because a thread's
+  /// queue was full.
+  static unsigned long events_dropped();
+
 private:
   class Connection
   {
@@ -159,18 +285,95 @@ private:
     Connection(const std::string& system_name, const std::string& sas_address);
     ~Connection();
 
-    void send_msg(std::string msg);
+    /// Returns true if messages are currently being sent to SAS, so there
+    /// is no point encoding them otherwise.
+    inline bool connected() const { return _connected.load(std::memory_order_relaxed); }
+
+    /// Get a buffer to encode a message into.
+    inline Buffer* get_buffer(size_t len) { return _buffers.get(len); }
+
+    /// Queue an encoded message to be sent.  The connection takes ownership
+    /// of the buffer.
+    void send_msg(Buffer* buf);
+
+    /// Returns the number of messages queued across all threads.
+    unsigned int queue_depth();
+
+    /// Returns the number of messages dropped because a queue was full.
+    unsigned long dropped();
 
     static void* writer_thread(void* p);
 
   private:
+    /// Maximum number of messages sent in one writev call.
+    static const int MAX_SEND_BATCH = 64;
+
+    /// Maximum number of free buffers of each size kept for reuse.
+    static const unsigned int MAX_FREE_BUFFERS = 1024;
+
+    /// Maximum number of messages queued by a single thread.
+    static const unsigned int RING_SIZE = 2048;
+
+    /// Maximum number of bytes of buffers queued by a single thread.  This
+    /// bounds the memory SAS can use to RING_MAX_BYTES per thread that
+    /// reports events, however far the writer falls behind.
+    static const size_t RING_MAX_BYTES = 4 * 1024 * 1024;
+
+    /// Queue of messages from a single thread.  Only the owning thread
+    /// pushes and only the writer thread pops, so neither side takes a lock
+    /// and threads don't contend with each other.
+    struct Ring
+    {
+      Ring(Connection* c) :
+        connection(c), q(RING_SIZE), pushed_bytes(0), sent_bytes(0), dropped(0), closed(false) {}
+
+      Connection* connection;
+      spscq<Buffer*> q;
+
+      // Buffer capacity queued and sent, written only by the owning thread
+      // and the writer thread respectively.
+      size_t pushed_bytes;
+      std::atomic<size_t> sent_bytes;
+
+      // Messages dropped, written only by the owning thread.
+      std::atomic<unsigned long> dropped;
+
+      // Set when the owning thread exits.  The writer frees the ring once
+      // it is empty.
+      std::atomic<bool> closed;
+    };
+
+    static void ring_closed(void* p);
+
+    Ring* get_ring();
+    void refresh_rings();
+    int collect(Buffer** batch);
+    void wait_for_msgs();
     bool connect_init();
     void writer();
+    bool send_batch(Buffer** batch, int count);
+    void discard_queued();
 
     std::string _system_name;
     std::string _sas_address;
 
-    eventq<std::string> _msg_q;
+    BufferPool _buffers;
+
+    // All the rings, protected by _rings_lock.  The writer works from its
+    // own copy, refreshed when _rings_changed is set.
+    pthread_key_t _ring_key;
+    pthread_mutex_t _rings_lock;
+    std::vector<Ring*> _rings;
+    std::atomic<bool> _rings_changed;
+    unsigned long _closed_rings_dropped;
+
+    std::vector<Ring*> _writer_rings;
+    unsigned int _next_ring;
+
+    // Kicked by producers when they queue a message, and on termination.
+    eventcount _msgs_queued;
+    std::atomic<bool> _connected;
+    std::atomic<bool> _terminated;
 
     pthread_t _writer;
 
@@ -178,17 +381,40 @@ private:
     int _sock;
   };
 
-  static void write_hdr(std::string& s, uint16_t msg_length, uint8_t msg_type);
-  static void write_int8(std::string& s, uint8_t c);
-  static void write_int16(std::string& s, uint16_t v);
-  static void write_int32(std::string& s, uint32_t v);
-  static void write_int64(std::string& s, uint64_t v);
-  static void write_data(std::string& s, size_t length, const char* data);
-  static void write_timestamp(std::string& s);
-  static void write_trail(std::string& s, TrailId trail);
+  /// Set in the IDs of trails that weren't sampled.  Trail IDs are never big
+  /// enough to use this bit otherwise.
+  static const TrailId UNSAMPLED_TRAIL = 1ull << 63;
+
+  /// Limit on the rate of events with one ID.
+  struct EventCap
+  {
+    EventCap(uint32_t id, unsigned int max_per_sec) :
+      id(id), max_per_sec(max_per_sec), second(0), count(0), capped(0) {}
+
+    uint32_t id;
+    unsigned int max_per_sec;
+    std::atomic<uint64_t> second;
+    std::atomic<unsigned int> count;
+    std::atomic<unsigned long> capped;
+  };
+
+  /// Set of unsampled trails that have been forced.
+  class ForcedTrails;
+
+  static bool is_sampled(TrailId trail);
+  static bool check_cap(TrailId trail, uint32_t id);
+  static void check_user_marker(const Marker& marker);
 
   static std::atomic<TrailId> _next_trail_id;
   static Connection* _connection;
+
+  static bool _sample_all;
+  static uint64_t _sample_threshold;
+  static std::set<std::string> _traced_users;
+  static std::set<uint32_t> _user_markers;
+  static std::vector<EventCap*> _event_caps;
+  static ForcedTrails _forced_trails;
+  static std::atomic<unsigned long> _trails_unsampled;
 };
 
 #endif
@@ -0,0 +1,203 @@
+/**
+ * @file shardq.h Template definition for sharded queue with work stealing
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef SHARDQ__
+#define SHARDQ__
+
+#include <vector>
+#include <atomic>
+
+#include "mpmcq.h"
+
+/// @class shardq
+///
+/// A set of queues, one per consumer.  Producers choose a shard by hashing
+/// some key, so that related items are always handled by the same
+/// consumer.  A consumer whose shard is empty steals from the most
+/// backlogged of the other shards, so an uneven spread of keys doesn't
+/// leave some consumers idle while others fall behind.
+template<class T>
+class shardq
+{
+public:
+  /// Create a sharded queue.
+  ///
+  /// @param num_shards      number of shards (normally one per consumer).
+  /// @param max_queue       maximum size of each shard.
+  /// @param steal_threshold minimum depth of another shard before an idle
+  ///                        consumer steals from it.
+  /// @param poll_ms         how often an idle consumer checks for work to
+  ///                        steal.
+  shardq(unsigned int num_shards,
+         unsigned int max_queue,
+         unsigned int steal_threshold=2,
+         int poll_ms=10) :
+    _shards(num_shards),
+    _stolen(num_shards),
+    _steal_threshold(steal_threshold),
+    _poll_ms(poll_ms)
+  {
+    for (unsigned int ii = 0; ii < num_shards; ++ii)
+    {
+      _shards[ii] = new mpmcq<T>(max_queue);
+      _stolen[ii] = 0;
+    }
+  }
+
+  ~shardq()
+  {
+    for (unsigned int ii = 0; ii < _shards.size(); ++ii)
+    {
+      delete _shards[ii];
+    }
+  }
+
+  /// Returns the number of shards.
+  unsigned int num_shards() const
+  {
+    return _shards.size();
+  }
+
+  /// Returns the shard that items with the given hash are pushed to.
+  unsigned int shard(unsigned int hash) const
+  {
+    return hash % _shards.size();
+  }
+
+  /// Send a termination signal to all consumers.
+  void terminate()
+  {
+    for (unsigned int ii = 0; ii < _shards.size(); ++ii)
+    {
+      _shards[ii]->terminate();
+    }
+  }
+
+  /// Indicates whether the queue has been terminated.
+  bool is_terminated()
+  {
+    return _shards[0]->is_terminated();
+  }
+
+  /// Returns the number of items in the given shard.
+  unsigned int size(unsigned int shard) const
+  {
+    return _shards[shard]->size();
+  }
+
+  /// Returns the total number of items in all shards.
+  unsigned int size() const
+  {
+    unsigned int total = 0;
+    for (unsigned int ii = 0; ii < _shards.size(); ++ii)
+    {
+      total += _shards[ii]->size();
+    }
+    return total;
+  }
+
+  /// Returns the number of items taken from the given shard by other
+  /// consumers.
+  unsigned long stolen(unsigned int shard) const
+  {
+    return _stolen[shard].load();
+  }
+
+  /// Push an item on to the shard selected by the hash.  This may block if
+  /// the shard is full.
+  bool push(T item, unsigned int hash)
+  {
+    return _shards[shard(hash)]->push(item);
+  }
+
+  /// Pop an item for the consumer of the given shard, waiting indefinitely
+  /// if there is nothing to do.  Items are taken from the consumer's own
+  /// shard if possible, otherwise stolen from a backlogged shard.
+  ///
+  /// Returns false once the queue has been terminated.
+  bool pop(unsigned int shard, T& item)
+  {
+    mpmcq<T>* own = _shards[shard];
+
+    while (!own->is_terminated())
+    {
+      if ((own->try_pop(item)) ||
+          (steal(shard, item)) ||
+          (own->pop(item, _poll_ms)))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+private:
+  /// Try to take an item from the most backlogged of the other shards.
+  bool steal(unsigned int thief, T& item)
+  {
+    unsigned int victim = thief;
+    unsigned int max_depth = _steal_threshold - 1;
+
+    for (unsigned int ii = 0; ii < _shards.size(); ++ii)
+    {
+      unsigned int depth = _shards[ii]->size();
+      if ((ii != thief) && (depth > max_depth))
+      {
+        victim = ii;
+        max_depth = depth;
+      }
+    }
+
+    if ((victim != thief) && (_shards[victim]->try_pop(item)))
+    {
+      _stolen[victim]++;
+      return true;
+    }
+
+    return false;
+  }
+
+  std::vector<mpmcq<T>*> _shards;
+  std::vector<std::atomic<unsigned long> > _stolen;
+  unsigned int _steal_threshold;
+  int _poll_ms;
+};
+
+#endif
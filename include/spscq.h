@@ -0,0 +1,141 @@
+/**
+ * @file spscq.h Template definition for a single-producer single-consumer ring
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef SPSCQ__
+#define SPSCQ__
+
+#include <atomic>
+
+#include "mpmcq.h"
+
+/// @class spscq
+///
+/// Bounded lock-free ring for passing items from exactly one producer
+/// thread to exactly one consumer thread.  Pushing and popping are each a
+/// plain store and a load of the other side's index, with no read-modify-
+/// write operations, so a producer with its own ring never contends with
+/// other producers.  The queue never blocks - callers that need to wait
+/// pair it with an eventcount.
+///
+/// T must be copyable and default constructible.
+template<class T>
+class spscq
+{
+public:
+  /// Create a ring.
+  ///
+  /// @param max_queue capacity of the ring.  This is rounded up to a power
+  ///                  of two.
+  spscq(unsigned int max_queue)
+  {
+    unsigned int capacity = 2;
+    while (capacity < max_queue)
+    {
+      capacity <<= 1;
+    }
+    _mask = capacity - 1;
+    _items = new T[capacity];
+    _head.store(0, std::memory_order_relaxed);
+    _tail.store(0, std::memory_order_relaxed);
+  }
+
+  ~spscq()
+  {
+    delete[] _items;
+  }
+
+  /// Returns the capacity of the ring.
+  unsigned int capacity() const
+  {
+    return _mask + 1;
+  }
+
+  /// Returns the number of items in the ring.  This is only a snapshot if
+  /// called from a thread other than the producer or consumer.
+  unsigned int size() const
+  {
+    size_t tail = _tail.load(std::memory_order_acquire);
+    size_t head = _head.load(std::memory_order_acquire);
+    return (tail > head) ? (unsigned int)(tail - head) : 0;
+  }
+
+  /// Push an item, returning false if the ring is full.  Must only be
+  /// called by the producer.
+  bool try_push(const T& item)
+  {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) > _mask)
+    {
+      return false;
+    }
+    _items[tail & _mask] = item;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Pop an item, returning false if the ring is empty.  Must only be
+  /// called by the consumer.
+  bool try_pop(T& item)
+  {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    item = _items[head & _mask];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  T* _items;
+  size_t _mask;
+
+  // The indices are written by different threads, so keep them on separate
+  // cache lines.
+  char _pad0[MPMCQ_CACHE_LINE];
+  std::atomic<size_t> _tail;
+
+  char _pad1[MPMCQ_CACHE_LINE];
+  std::atomic<size_t> _head;
+
+  char _pad2[MPMCQ_CACHE_LINE];
+};
+
+#endif
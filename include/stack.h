@@ -108,6 +108,14 @@ inline SAS::TrailId get_trail(const pjsip_transaction* tsx)
   return (SAS::TrailId)tsx->mod_data[stack_data.module_id];
 }
 
+/// How received messages are passed to the worker threads.
+enum RxDispatch
+{
+  RX_DISPATCH_SHARED,   // Single queue shared by all worker threads
+  RX_DISPATCH_CALLID,   // Queue per worker thread, chosen by Call-ID
+  RX_DISPATCH_PRIORITY  // Priority lanes shared by all worker threads
+};
+
 extern void init_pjsip_logging(int log_level,
                                pj_bool_t log_to_file,
                                const std::string& directory);
@@ -121,9 +129,21 @@ extern pj_status_t init_stack(const std::string& system_name,
                               const std::string& sprout_domain,
                               const std::string& alias_hosts,
                               int num_pjsip_threads,
-                              int num_worker_threads);
+                              int num_worker_threads,
+                              bool lockfree_rx_queue,
+                              RxDispatch rx_dispatch,
+                              unsigned long target_latency_us,
+                              unsigned int max_queue_depth,
+                              int retry_after,
+                              const std::string& pjsip_cpus,
+                              const std::string& worker_cpus,
+                              int udp_sockets);
 extern pj_status_t start_stack();
 extern void stop_stack();
+extern bool stack_continue(void (*callback)(void*),
+                           void* context,
+                           const pj_str_t* call_id);
+extern void stack_run_continuations();
 extern void unregister_stack_modules(void);
 extern void destroy_stack();
 extern pj_status_t init_pjsip();
@@ -123,7 +123,7 @@ private:
 };
 
 // This is the data that is attached to the UAS transaction
-class UASTransaction
+class UASTransaction : public RegData::Store::GetCallback
 {
 public:
   ~UASTransaction();
@@ -140,10 +140,15 @@ public:
   void on_client_not_responding(UACTransaction* uac_data);
   void on_tsx_state(pjsip_event* event);
   void cancel_pending_uac_tsx(int st_code, bool dissociate_uac);
+  void handle_cancel();
   pj_status_t handle_final_response();
 
   void register_proxy(CallServices::Terminating* proxy);
 
+  // Called by the registration store, on one of its own threads, with the
+  // bindings to use as targets.
+  void get_complete(const std::string& aor_id, RegData::AoR* aor_data);
+
   pj_status_t send_trying(pjsip_rx_data* rdata);
   pj_status_t send_response(int st_code, const pj_str_t* st_text=NULL);
   bool redirect(std::string, int);
@@ -184,6 +189,8 @@ private:
   void move_to_terminating_chain();
   AsChainLink::Disposition handle_terminating(target** pre_target);
   void handle_outgoing_non_cancel(target* pre_target);
+  void route_to_targets(target_list& targets);
+  static void on_targets_found(void* p);
 
   pj_grp_lock_t*       _lock;      //< Lock to protect this UASTransaction and the underlying PJSIP transaction
   pjsip_transaction*   _tsx;
@@ -204,8 +211,13 @@ private:
   CallServices::Terminating* _proxy;  //< A proxy inserted into the signalling path, which sees all responses.
   bool                 _pending_destroy;
   int                  _context_count;
+  uint_fast64_t        _start_time_us;  //< Creation time, or 0 once the latency has been recorded.
   AsChainLink          _as_chain_link;
   std::list<AsChain*>  _victims;  //< Objects to die along with the transaction.
+  const pj_str_t*      _lookup_call_id;  //< Call-ID of the request, used to continue it once the store returns its targets' bindings.
+  std::string          _lookup_aor;      //< AoR whose bindings the store returned.
+  RegData::AoR*        _lookup_data;     //< Bindings the store returned, or NULL.
+  bool                 _cancelled;       //< A CANCEL has been received for the request.
 };
 
 // This is the data that is attached to the UAC transaction
@@ -284,12 +296,13 @@ void destroy_stateful_proxy();
 pj_status_t proxy_process_edge_routing(pjsip_rx_data *rdata,
                                        pjsip_tx_data *tdata);
 
-void proxy_calculate_targets(pjsip_msg* msg,
+bool proxy_calculate_targets(pjsip_msg* msg,
                              pj_pool_t* pool,
                              const TrustBoundary* trust,
                              target_list& targets,
                              int max_targets,
-                             SAS::TrailId trail);
+                             SAS::TrailId trail,
+                             RegData::Store::GetCallback* callback);
 #endif
 
 #endif
@@ -37,37 +37,81 @@
 #ifndef STATISTICS_H__
 #define STATISTICS_H__
 
+#include <atomic>
 #include <string>
-#include <zmq.h>
 #include <vector>
 
 #include <pthread.h>
 
-#include "eventq.h"
+class LastValueCache;
 
+/// A statistic published through the last value cache.
+///
+/// Values are published by a single background thread shared by all
+/// statistics.  Reporting a change just stores the new value - if the
+/// statistic changes again before the thread gets round to publishing it,
+/// only the latest value is sent.  The thread publishes at most once per
+/// minimum interval, so bursts of changes are coalesced.
+///
+/// The thread keeps a registry of every statistic that exists, and
+/// announces each one to the last value cache when it is created, so there
+/// is no fixed list of statistics to maintain.  A statistic can instead be
+/// a single number that the thread reads periodically and publishes when
+/// it changes, which makes updating it as cheap as an atomic operation.
 class Statistic
 {
 public:
   Statistic(std::string statname);
+
+  /// Constructor for a statistic whose value is the specified number,
+  /// which must outlive the statistic.
+  Statistic(std::string statname, const std::atomic_int_fast64_t* polled_value);
   ~Statistic();
 
+  /// Report the latest value of the statistic.  Safe to be called by
+  /// multiple threads.  Pass a temporary (or use std::move) to avoid
+  /// copying the value.
   void report_change(std::vector<std::string> new_value);
 
-  static int known_stats_count();
-  static std::string *known_stats();
+  /// Set the last value cache that statistics are published to, or NULL to
+  /// stop publishing.  Once this returns nothing is being published to the
+  /// previous cache, so it can be destroyed.
+  static void set_last_value_cache(LastValueCache* lvc);
+
+  /// Set the minimum time between the reporter thread publishing batches
+  /// of changes.  Zero publishes every change as soon as possible.
+  static void set_min_interval(int interval_ms);
 
-  // Thread entry point for reporting thread.
-  static void* reporter_thread(void* p);
+  static const int DEFAULT_MIN_INTERVAL_MS = 100;
 
 private:
-  void reporter();
+  class Reporter;
+  friend class Reporter;
+
+  /// Register with the reporter thread, creating it if necessary.
+  void register_statistic();
 
   std::string _statname;
-  void *_publisher;
-  pthread_t _reporter;
-  eventq<std::vector<std::string> > _stat_q;  // input queue
 
-  static const int MAX_Q_DEPTH = 100;
+  // The latest value not yet published, and whether there is one.  Both are
+  // protected by the reporter's lock.
+  std::vector<std::string> _pending;
+  bool _changed;
+
+  // The number this statistic reports, if it is polled, and the value last
+  // published.
+  const std::atomic_int_fast64_t* _polled_value;
+  int_fast64_t _published_value;
+
+  // The reporter thread, created with the first statistic and destroyed
+  // with the last.
+  static Reporter* _reporter;
+  static int _num_statistics;
+  static std::atomic<int> _min_interval_ms;
+  static pthread_mutex_t _reporter_lock;
+
+  // The last value cache to publish to, protected by _reporter_lock.
+  static LastValueCache* _lvc;
 };
 
 #endif
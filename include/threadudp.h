@@ -0,0 +1,93 @@
+/**
+ * @file threadudp.h  UDP transports read by a single owning thread
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef THREADUDP_H__
+#define THREADUDP_H__
+
+extern "C" {
+#include <pjsip.h>
+}
+
+#include <poll.h>
+#include <vector>
+
+/// A UDP transport whose socket is read by one thread, rather than through
+/// the endpoint's ioqueue (which every PJSIP thread polls).  Several of
+/// these can share a port using SO_REUSEPORT, one or more for each PJSIP
+/// thread, so datagrams the kernel spreads across the sockets are read by
+/// the thread that owns each socket.  Sending is done directly on the
+/// socket by whichever thread is sending.  The structure starts with a
+/// pjsip_transport, so a pointer to it can be used as one.
+struct thread_udp_transport;
+
+/// Open a UDP socket bound to the specified address with SO_REUSEPORT set,
+/// and register a PJSIP transport for it.  PJSIP sends new requests on the
+/// primary transport, so there should be exactly one of these; the others
+/// only send responses to requests they received.  The transport receives
+/// nothing until it is added to the poller of its owning thread.  Shutting
+/// down the transport closes its socket.
+extern pj_status_t thread_udp_transport_create(pjsip_endpoint* endpt,
+                                               const pj_sockaddr_in* addr,
+                                               const pjsip_host_port* published_name,
+                                               pj_bool_t primary,
+                                               thread_udp_transport** p_tp);
+
+/// @class ThreadUdpPoller
+///
+/// Reads the thread UDP transports owned by one thread.
+class ThreadUdpPoller
+{
+public:
+  /// Add a transport for this poller to read.
+  void add(thread_udp_transport* tp);
+
+  /// Indicates whether this poller has any transports to read.
+  inline bool is_empty() const { return _tps.empty(); }
+
+  /// Wait up to the specified time for datagrams on any of the transports,
+  /// and pass any that arrive up to PJSIP.  This must only be called by
+  /// the thread that owns the transports.
+  void poll(int timeout_ms);
+
+private:
+  std::vector<thread_udp_transport*> _tps;
+  std::vector<struct pollfd> _fds;
+};
+
+#endif
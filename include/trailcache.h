@@ -0,0 +1,158 @@
+/**
+ * @file trailcache.h  Cache of SAS trails keyed by Via branch
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef TRAILCACHE_H__
+#define TRAILCACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+#include "sas.h"
+
+/// @class TrailCache
+///
+/// Remembers the SAS trail for recently seen Via branches, so received
+/// responses, ACKs and CANCELs can be correlated to the trail of the
+/// request they relate to without looking up its transaction (which takes
+/// the transaction's group lock).
+///
+/// The cache is a fixed-size, direct-mapped table keyed on a 64-bit hash
+/// of the branch, and is lock-free.  Each slot is guarded by a sequence
+/// number, so a lookup never pairs a branch with another branch's trail.
+/// A newer branch that maps to the same slot evicts the older one, and an
+/// insert is dropped if another thread is updating the slot, so lookups
+/// can miss - callers then start a new trail, as they would for a message
+/// that doesn't correlate to anything.
+class TrailCache
+{
+public:
+  /// Create a cache.
+  ///
+  /// @param size number of slots, rounded up to a power of two.
+  TrailCache(unsigned int size) :
+    _mask(capacity(size) - 1),
+    _slots(_mask + 1)
+  {
+  }
+
+  /// Record the trail for a branch, replacing any entry for it.
+  void insert(const char* branch, size_t len, SAS::TrailId trail)
+  {
+    uint64_t hash = hash_branch(branch, len);
+    Slot& slot = _slots[hash & _mask];
+
+    // Make the sequence number odd while the slot is updated, so readers
+    // discard anything they read meanwhile.  If another thread is already
+    // updating the slot, drop this insert rather than wait.
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    if ((seq & 1) ||
+        (!slot.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)))
+    {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.key.store(hash, std::memory_order_relaxed);
+    slot.trail.store(trail, std::memory_order_relaxed);
+    slot.seq.store(seq + 2, std::memory_order_release);
+  }
+
+  /// Find the trail for a branch, returning 0 if it isn't cached.
+  SAS::TrailId lookup(const char* branch, size_t len) const
+  {
+    uint64_t hash = hash_branch(branch, len);
+    const Slot& slot = _slots[hash & _mask];
+
+    // The key and trail belong together only if the slot wasn't being
+    // updated before or while they were read.
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq & 1)
+    {
+      return 0;
+    }
+    uint64_t key = slot.key.load(std::memory_order_relaxed);
+    SAS::TrailId trail = slot.trail.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if ((key != hash) || (slot.seq.load(std::memory_order_relaxed) != seq))
+    {
+      return 0;
+    }
+    return trail;
+  }
+
+private:
+  struct Slot
+  {
+    Slot() : seq(0), key(0), trail(0) {}
+
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> key;
+    std::atomic<SAS::TrailId> trail;
+  };
+
+  /// Rounds the requested size up to a power of two.
+  static unsigned int capacity(unsigned int size)
+  {
+    unsigned int capacity = 1;
+    while (capacity < size)
+    {
+      capacity <<= 1;
+    }
+    return capacity;
+  }
+
+  /// FNV-1a hash of the branch.  Zero marks an empty slot, so is never
+  /// returned.
+  static uint64_t hash_branch(const char* branch, size_t len)
+  {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t ii = 0; ii < len; ++ii)
+    {
+      hash ^= (unsigned char)branch[ii];
+      hash *= 1099511628211ull;
+    }
+    return (hash != 0) ? hash : 1;
+  }
+
+  unsigned int _mask;
+  std::vector<Slot> _slots;
+};
+
+#endif
@@ -43,6 +43,8 @@
 #include <string>
 #include <curl/curl.h>
 #include "httpconnection.h"
+#include "histogram.h"
+#include "counter.h"
 #include "sas.h"
 
 class XDMConnection
@@ -56,6 +58,10 @@ public:
 
 private:
   HttpConnection* _http;
+
+  /// Round trip times of requests to the XDMS, and the number that failed.
+  StatisticHistogram _latency_histogram;
+  StatisticCounter _error_counter;
 };
 
 #endif
@@ -50,29 +50,34 @@ extern "C" {
 class LastValueCache
 {
 public:
-  LastValueCache(int statcount, std::string *statnames, long poll_timeout_ms = 1000);
-  ~LastValueCache();
-  void* get_internal_publisher(std::string statname);
+  LastValueCache(long poll_timeout_ms = 1000);
+  virtual ~LastValueCache();
+  void* get_internal_publisher();
   void run();
 
+  /// Publish the latest value of a statistic to the cache.  At most one
+  /// thread may publish at a time.
+  virtual void publish(const std::string& statname,
+                       const std::vector<std::string>& value);
+
 private:
-  void clear_cache(void *entry);
-  void replay_cache(void *entry);
+  void clear_cache(const std::string& statname);
+  void replay_cache(const std::string& statname);
 
-  void **_subscriber;
+  void *_subscriber;
   void *_publisher;
-  std::map<void *, std::vector<zmq_msg_t *>> _cache;
+
+  /// Cached messages for each statistic that has been announced, keyed by
+  /// name.
+  std::map<std::string, std::vector<zmq_msg_t *>> _cache;
   pthread_t _cache_thread;
   void *_context;
-  int _statcount;
-  std::string *_statnames;
   const long _poll_timeout_ms;
   volatile bool _terminate;
 
-  /// A bound 0MQ socket per statistic, for use by the internal
-  // publishers. At most one thread may use each socket at
-  // a time.
-  std::map<std::string, void*> _internal_publishers;
+  /// A bound 0MQ socket for use by the internal publisher.  At most one
+  /// thread may use it at a time.
+  void* _internal_publisher;
 
   static void* last_value_cache_entry_func(void *);
 };
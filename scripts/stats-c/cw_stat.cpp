@@ -37,48 +37,25 @@
 // C++ re-implementation of Ruby cw_stat tool.
 // Runs significantly faster - useful on heavily-loaded cacti systems.
 // Usage: cw_stat <hostname> <statname>
+//        cw_stat -w [-i <secs>] [-W <secs>] [-c] <hostname> <statname>...
 // Compile: g++ -o cw_stat cw_stat.cpp -lzmq
 
 #include <string>
 #include <vector>
+#include <map>
+#include <deque>
 #include <string.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include <zmq.h>
 
-// Gets a block of messages from the specified host, for the specified
-// statistic.
+// Receives a block of messages from the specified socket.
 // Return true on success, false on failure.
-bool get_msgs(char* host, char* stat, std::vector<std::string>& msgs)
+bool recv_msgs(void* sck, std::vector<std::string>& msgs)
 {
-  // Create the context.
-  void* ctx = zmq_ctx_new();
-  if (ctx == NULL)
-  {
-    perror("zmq_ctx_new");
-    return false;
-  }
-
-  // Create the socket and connect it to the host.
-  void* sck = zmq_socket(ctx, ZMQ_SUB);
-  if (sck == NULL)
-  {
-    perror("zmq_socket");
-    return false;
-  }
-  std::string ep = std::string("tcp://") + host + ":6666";
-  if (zmq_connect(sck, ep.c_str()) != 0)
-  {
-    perror("zmq_connect");
-    return false;
-  }
-
-  // Subscribe to the specified statistic.
-  if (zmq_setsockopt(sck, ZMQ_SUBSCRIBE, stat, strlen(stat)) != 0)
-  {
-    perror("zmq_setsockopt");
-    return false;
-  }
-
   // Spin round until we've got all the messages in this block.
   int64_t more = 0;
   size_t more_sz = sizeof(more);
@@ -105,6 +82,67 @@ bool get_msgs(char* host, char* stat, std::vector<std::string>& msgs)
   }
   while (more);
 
+  return true;
+}
+
+// Creates a socket connected to the specified host, and subscribes it to
+// the specified statistics.
+// Return the socket on success, NULL on failure.
+void* connect_stats(void* ctx, char* host, char** stats, int num_stats)
+{
+  // Create the socket and connect it to the host.
+  void* sck = zmq_socket(ctx, ZMQ_SUB);
+  if (sck == NULL)
+  {
+    perror("zmq_socket");
+    return NULL;
+  }
+  std::string ep = std::string("tcp://") + host + ":6666";
+  if (zmq_connect(sck, ep.c_str()) != 0)
+  {
+    perror("zmq_connect");
+    return NULL;
+  }
+
+  // Subscribe to the specified statistics.
+  for (int ii = 0; ii < num_stats; ii++)
+  {
+    if (zmq_setsockopt(sck, ZMQ_SUBSCRIBE, stats[ii], strlen(stats[ii])) != 0)
+    {
+      perror("zmq_setsockopt");
+      return NULL;
+    }
+  }
+
+  return sck;
+}
+
+// Gets a block of messages from the specified host, for the specified
+// statistic.
+// Return true on success, false on failure.
+bool get_msgs(char* host, char* stat, std::vector<std::string>& msgs)
+{
+  // Create the context.
+  void* ctx = zmq_ctx_new();
+  if (ctx == NULL)
+  {
+    perror("zmq_ctx_new");
+    return false;
+  }
+
+  // Create the socket, connect it to the host and subscribe to the
+  // statistic.
+  void* sck = connect_stats(ctx, host, &stat, 1);
+  if (sck == NULL)
+  {
+    return false;
+  }
+
+  if (!recv_msgs(sck, msgs))
+  {
+    return false;
+  }
+
   // Close the socket.
   if (zmq_close(sck) != 0)
   {
@@ -184,18 +222,433 @@ void render_latency_us(std::vector<std::string>& msgs)
   }
 }
 
+// A histogram report kept for the sliding window.
+struct HistogramReport
+{
+  uint64_t time_ms;
+  uint64_t n;
+  uint64_t p99;
+};
+
+// A statistic being watched.
+struct WatchedStat
+{
+  WatchedStat() : received(false), update_ms(0), prev_update_ms(0) {}
+
+  // The latest values received, and those at the last render.
+  std::vector<std::string> values;
+  std::vector<std::string> prev_values;
+  bool received;
+
+  // When the latest and previous updates arrived.
+  uint64_t update_ms;
+  uint64_t prev_update_ms;
+
+  // Histogram reports within the sliding window.
+  std::deque<HistogramReport> window;
+};
+
+// Watch mode options.
+static int watch_interval_s = 1;
+static int watch_window_s = 60;
+static bool watch_csv = false;
+
+static uint64_t now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t to_int(const std::string& value)
+{
+  return strtoll(value.c_str(), NULL, 10);
+}
+
+// Histograms report the sample count, percentiles and maximum; accumulators
+// report the mean, variance and water marks.  Both are named for the units
+// of their samples.
+static bool is_histogram(const std::string& name, const std::vector<std::string>& values)
+{
+  return ((values.size() == 6) &&
+          (name.size() > 3) &&
+          (name.compare(name.size() - 3, 3, "_us") == 0));
+}
+
+static bool is_accumulator(const std::string& name, const std::vector<std::string>& values)
+{
+  return ((values.size() == 4) &&
+          (name.size() > 3) &&
+          (name.compare(name.size() - 3, 3, "_us") == 0));
+}
+
+// Store an update to a watched statistic.
+void update_stat(const std::string& name, WatchedStat& stat, std::vector<std::string>& msgs, uint64_t time_ms)
+{
+  // A statistic that hasn't reported a value yet just has the status line.
+  stat.values.assign(msgs.begin() + 2, msgs.end());
+  stat.received = !stat.values.empty();
+  stat.prev_update_ms = stat.update_ms;
+  stat.update_ms = time_ms;
+
+  if (is_histogram(name, stat.values))
+  {
+    HistogramReport report;
+    report.time_ms = time_ms;
+    report.n = to_int(stat.values[0]);
+    report.p99 = to_int(stat.values[3]);
+    stat.window.push_back(report);
+  }
+}
+
+// Work out the sample rate and worst 99th percentile of a histogram over the
+// sliding window.  Each report covers the time since the one before, so the
+// first report in the window only marks where it starts.
+void window_stats(WatchedStat& stat, uint64_t time_ms, double& rate, uint64_t& p99)
+{
+  while ((!stat.window.empty()) &&
+         (stat.window.front().time_ms + watch_window_s * 1000 < time_ms))
+  {
+    stat.window.pop_front();
+  }
+
+  rate = 0;
+  p99 = 0;
+  uint64_t n = 0;
+  for (size_t ii = 0; ii < stat.window.size(); ii++)
+  {
+    if (ii > 0)
+    {
+      n += stat.window[ii].n;
+    }
+    p99 = (stat.window[ii].p99 > p99) ? stat.window[ii].p99 : p99;
+  }
+  if (stat.window.size() > 1)
+  {
+    uint64_t span_ms = stat.window.back().time_ms - stat.window.front().time_ms;
+    rate = (span_ms > 0) ? (double)n * 1000 / span_ms : 0;
+  }
+}
+
+// Work out a rate per second from a change over the specified time.
+static double per_second(int64_t delta, uint64_t elapsed_ms)
+{
+  return (elapsed_ms > 0) ? (double)delta * 1000 / elapsed_ms : 0;
+}
+
+// Render the watched statistics as a table, replacing the previous one.
+// Rates of change are over the time elapsed since the last render.
+void render_table(char* host, std::map<std::string, WatchedStat>& stats, uint64_t time_ms, uint64_t elapsed_ms)
+{
+  char timestamp[32];
+  time_t now = time(NULL);
+  strftime(timestamp, sizeof(timestamp), "%H:%M:%S", localtime(&now));
+
+  printf("\033[H\033[2J");
+  printf("cw_stat %s - every %ds, %ds window - %s\n\n", host, watch_interval_s, watch_window_s, timestamp);
+
+  // Single numbers (counters and gauges), with their change since the last
+  // render.
+  bool header = false;
+  for (std::map<std::string, WatchedStat>::iterator it = stats.begin(); it != stats.end(); ++it)
+  {
+    WatchedStat& stat = it->second;
+    if ((stat.received) && (stat.values.size() == 1))
+    {
+      if (!header)
+      {
+        printf("%-36s %12s %12s %12s\n", "statistic", "value", "delta", "/s");
+        header = true;
+      }
+      int64_t value = to_int(stat.values[0]);
+      int64_t delta = (stat.prev_values.size() == 1) ? value - to_int(stat.prev_values[0]) : 0;
+      printf("%-36s %12lld %12lld %12.1f\n",
+             it->first.c_str(),
+             (long long)value,
+             (long long)delta,
+             per_second(delta, elapsed_ms));
+    }
+  }
+
+  // Histograms, with their rate and worst 99th percentile over the window.
+  header = false;
+  for (std::map<std::string, WatchedStat>::iterator it = stats.begin(); it != stats.end(); ++it)
+  {
+    WatchedStat& stat = it->second;
+    if ((stat.received) && (is_histogram(it->first, stat.values)))
+    {
+      if (!header)
+      {
+        printf("\n%-36s %9s %9s %9s %9s %9s %9s %9s %9s\n",
+               "histogram", "n", "n/s(win)", "p50", "p90", "p99", "p99.9", "max", "p99(win)");
+        header = true;
+      }
+      double rate;
+      uint64_t window_p99;
+      window_stats(stat, time_ms, rate, window_p99);
+      printf("%-36s %9s %9.1f %9s %9s %9s %9s %9s %9llu\n",
+             it->first.c_str(),
+             stat.values[0].c_str(),
+             rate,
+             stat.values[1].c_str(),
+             stat.values[2].c_str(),
+             stat.values[3].c_str(),
+             stat.values[4].c_str(),
+             stat.values[5].c_str(),
+             (unsigned long long)window_p99);
+    }
+  }
+
+  // Accumulators.
+  header = false;
+  for (std::map<std::string, WatchedStat>::iterator it = stats.begin(); it != stats.end(); ++it)
+  {
+    WatchedStat& stat = it->second;
+    if ((stat.received) && (is_accumulator(it->first, stat.values)))
+    {
+      if (!header)
+      {
+        printf("\n%-36s %12s %12s %12s %12s\n", "accumulator", "mean", "variance", "lwm", "hwm");
+        header = true;
+      }
+      printf("%-36s %12s %12s %12s %12s\n",
+             it->first.c_str(),
+             stat.values[0].c_str(),
+             stat.values[1].c_str(),
+             stat.values[2].c_str(),
+             stat.values[3].c_str());
+    }
+  }
+
+  // Anything else, and statistics that haven't reported yet.
+  header = false;
+  for (std::map<std::string, WatchedStat>::iterator it = stats.begin(); it != stats.end(); ++it)
+  {
+    WatchedStat& stat = it->second;
+    if ((!stat.received) ||
+        ((stat.values.size() != 1) &&
+         (!is_histogram(it->first, stat.values)) &&
+         (!is_accumulator(it->first, stat.values))))
+    {
+      if (!header)
+      {
+        printf("\n%-36s %s\n", "other", "values");
+        header = true;
+      }
+      std::string values = (stat.received) ? "" : "(no value yet)";
+      for (size_t ii = 0; ii < stat.values.size(); ii++)
+      {
+        values += ((ii > 0) ? " " : "") + stat.values[ii];
+      }
+      printf("%-36s %s\n", it->first.c_str(), values.c_str());
+    }
+  }
+
+  fflush(stdout);
+}
+
+// Render the watched statistics as CSV rows, one per value.  Single numbers
+// also get their change and rate since the last render, elapsed_ms ago.
+void render_csv(std::map<std::string, WatchedStat>& stats, uint64_t elapsed_ms)
+{
+  time_t now = time(NULL);
+  for (std::map<std::string, WatchedStat>::iterator it = stats.begin(); it != stats.end(); ++it)
+  {
+    WatchedStat& stat = it->second;
+    if (!stat.received)
+    {
+      continue;
+    }
+
+    if (stat.values.size() == 1)
+    {
+      int64_t value = to_int(stat.values[0]);
+      int64_t delta = (stat.prev_values.size() == 1) ? value - to_int(stat.prev_values[0]) : 0;
+      printf("%ld,%s,value,%lld,%lld,%.1f\n",
+             (long)now,
+             it->first.c_str(),
+             (long long)value,
+             (long long)delta,
+             per_second(delta, elapsed_ms));
+    }
+    else
+    {
+      static const char* histogram_fields[] = {"n", "p50", "p90", "p99", "p999", "max"};
+      static const char* accumulator_fields[] = {"mean", "variance", "lwm", "hwm"};
+      for (size_t ii = 0; ii < stat.values.size(); ii++)
+      {
+        std::string field = (is_histogram(it->first, stat.values)) ? histogram_fields[ii] :
+                            (is_accumulator(it->first, stat.values)) ? accumulator_fields[ii] :
+                            std::to_string(ii);
+        printf("%ld,%s,%s,%s,,\n", (long)now, it->first.c_str(), field.c_str(), stat.values[ii].c_str());
+      }
+    }
+  }
+
+  fflush(stdout);
+}
+
+// Subscribes to the specified statistics and renders them every interval
+// until interrupted.
+// Return true on success, false on failure.
+bool watch_stats(char* host, char** statnames, int num_stats)
+{
+  std::map<std::string, WatchedStat> stats;
+  for (int ii = 0; ii < num_stats; ii++)
+  {
+    stats[statnames[ii]] = WatchedStat();
+  }
+
+  void* ctx = zmq_ctx_new();
+  if (ctx == NULL)
+  {
+    perror("zmq_ctx_new");
+    return false;
+  }
+
+  void* sck = connect_stats(ctx, host, statnames, num_stats);
+  if (sck == NULL)
+  {
+    return false;
+  }
+
+  if (watch_csv)
+  {
+    printf("time,statistic,field,value,delta,per_second\n");
+  }
+
+  // Rates are worked out over the time actually elapsed between renders,
+  // which can be longer than the interval if we fall behind.
+  uint64_t last_render_ms = now_ms();
+  uint64_t next_render_ms = last_render_ms + watch_interval_s * 1000;
+  while (true)
+  {
+    uint64_t time_ms = now_ms();
+    if (time_ms >= next_render_ms)
+    {
+      if (watch_csv)
+      {
+        render_csv(stats, time_ms - last_render_ms);
+      }
+      else
+      {
+        render_table(host, stats, time_ms, time_ms - last_render_ms);
+      }
+      last_render_ms = time_ms;
+
+      for (std::map<std::string, WatchedStat>::iterator it = stats.begin(); it != stats.end(); ++it)
+      {
+        it->second.prev_values = it->second.values;
+      }
+      // Skip any renders we've fallen behind on.
+      next_render_ms += watch_interval_s * 1000;
+      if (next_render_ms <= time_ms)
+      {
+        next_render_ms = time_ms + watch_interval_s * 1000;
+      }
+      continue;
+    }
+
+    zmq_pollitem_t item;
+    item.socket = sck;
+    item.fd = 0;
+    item.events = ZMQ_POLLIN;
+    item.revents = 0;
+    if (zmq_poll(&item, 1, next_render_ms - time_ms) < 0)
+    {
+      perror("zmq_poll");
+      return false;
+    }
+
+    if (item.revents & ZMQ_POLLIN)
+    {
+      std::vector<std::string> msgs;
+      if (!recv_msgs(sck, msgs))
+      {
+        return false;
+      }
+
+      // Subscriptions match on prefixes, so ignore statistics we didn't ask
+      // for, and error responses.
+      std::map<std::string, WatchedStat>::iterator it = stats.find(msgs[0]);
+      if ((it != stats.end()) &&
+          (msgs.size() >= 2) &&
+          (msgs[1] == "OK"))
+      {
+        update_stat(it->first, it->second, msgs, now_ms());
+      }
+      else if ((it != stats.end()) && (msgs.size() >= 2))
+      {
+        fprintf(stderr, "Error response \"%s\" for statistic \"%s\"\n", msgs[1].c_str(), msgs[0].c_str());
+      }
+    }
+  }
+
+  return true;
+}
+
+void usage(char* command)
+{
+  fprintf(stderr, "Usage: %s <hostname> <statname>\n", command);
+  fprintf(stderr, "       %s -w [-i <secs>] [-W <secs>] [-c] <hostname> <statname>...\n\n", command);
+  fprintf(stderr, " -w  Watch the statistics, rendering them every interval until interrupted\n"
+                  " -i  Interval between renders, in seconds (default is 1)\n"
+                  " -W  Sliding window for histogram rates and percentiles, in seconds (default is 60)\n"
+                  " -c  Render a CSV stream rather than a table\n");
+}
+
 int main(int argc, char** argv)
 {
+  bool watch = false;
+  int c;
+  while ((c = getopt(argc, argv, "wi:W:c")) != -1)
+  {
+    switch (c)
+    {
+      case 'w':
+        watch = true;
+        break;
+
+      case 'i':
+        watch_interval_s = atoi(optarg);
+        break;
+
+      case 'W':
+        watch_window_s = atoi(optarg);
+        break;
+
+      case 'c':
+        watch_csv = true;
+        break;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (watch)
+  {
+    if ((argc - optind < 2) || (watch_interval_s < 1) || (watch_window_s < 1))
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    return watch_stats(argv[optind], &argv[optind + 1], argc - optind - 1) ? 0 : 2;
+  }
+
   // Check arguments.
-  if (argc != 3)
+  if (argc - optind != 2)
   {
-    fprintf(stderr, "Usage: %s <hostname> <statname>\n", argv[0]);
+    usage(argv[0]);
     return 1;
   }
+  char* host = argv[optind];
+  char* statname = argv[optind + 1];
 
   // Get messages from the server.
   std::vector<std::string> msgs;
-  if (!get_msgs(argv[1], argv[2], msgs))
+  if (!get_msgs(host, statname, msgs))
   {
     return 2;
   }
@@ -34,30 +34,101 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <stdlib.h>
+#include <pthread.h>
+#include <new>
 #include <vector>
 
 #include "accumulator.h"
 
+// Each thread that accumulates into a sharded accumulator is given an index,
+// which picks its shard in every accumulator.
+static pthread_once_t thread_index_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_index_key;
+static std::atomic<uintptr_t> next_thread_index(0);
+
+static void create_thread_index_key()
+{
+  pthread_key_create(&thread_index_key, NULL);
+}
+
+/// Get the index of the calling thread.
+static unsigned int thread_index()
+{
+  pthread_once(&thread_index_once, &create_thread_index_key);
+
+  // Store the index plus one, so that NULL means there isn't one yet.
+  uintptr_t index = (uintptr_t)pthread_getspecific(thread_index_key);
+  if (index == 0)
+  {
+    index = ++next_thread_index;
+    pthread_setspecific(thread_index_key, (void*)index);
+  }
+  return (unsigned int)(index - 1);
+}
+
+/// Constructor.
+Accumulator::Accumulator(uint_fast64_t period_us, unsigned int num_shards) :
+  _target_period_us(period_us),
+  _num_shards((num_shards > 0) ? num_shards : 1)
+{
+  // Allocate the shards on cache line boundaries, so that no two share a
+  // line.
+  void* mem = NULL;
+  if (posix_memalign(&mem, CACHE_LINE, sizeof(Shard) * _num_shards) != 0)
+  {
+    // LCOV_EXCL_START
+    throw std::bad_alloc();
+    // LCOV_EXCL_STOP
+  }
+  _shards = (Shard*)mem;
+  for (unsigned int ii = 0; ii < _num_shards; ++ii)
+  {
+    new (&_shards[ii]) Shard();
+  }
+
+  reset();
+}
+
+/// Destructor.
+Accumulator::~Accumulator()
+{
+  for (unsigned int ii = 0; ii < _num_shards; ++ii)
+  {
+    _shards[ii].~Shard();
+  }
+  free(_shards);
+}
+
+/// Get the shard for the calling thread.
+Accumulator::Shard& Accumulator::thread_shard()
+{
+  return (_num_shards == 1) ? _shards[0] : _shards[thread_index() % _num_shards];
+}
+
 /// Accumulate a sample into our results.
 void Accumulator::accumulate(unsigned long sample)
 {
-  // Update the basic counters and samples.
-  _current._n++;
-  _current._sigma += sample;
-  _current._sigma_squared += sample * sample;
+  Shard& shard = thread_shard();
+
+  // Update the basic counters and samples.  Ordering is left to the refresh,
+  // as with the reads of these values.
+  shard._n.fetch_add(1, std::memory_order_relaxed);
+  shard._sigma.fetch_add(sample, std::memory_order_relaxed);
+  shard._sigma_squared.fetch_add(sample * sample, std::memory_order_relaxed);
 
   // Update the low- and high-water marks.  In each case, we get the current
   // value, decide whether a change is required and then atomically swap it
   // if so, repeating if it was changed in the meantime.
-  uint_fast64_t lwm = _current._lwm.load();
+  uint_fast64_t lwm = shard._lwm.load(std::memory_order_relaxed);
   while ((sample < lwm) &&
-	 (!_current._lwm.compare_exchange_weak(lwm, sample)))
+         (!shard._lwm.compare_exchange_weak(lwm, sample)))
   {
     // Do nothing.
   }
-  uint_fast64_t hwm = _current._hwm.load();
+  uint_fast64_t hwm = shard._hwm.load(std::memory_order_relaxed);
   while ((sample > hwm) &&
-	 (!_current._hwm.compare_exchange_weak(hwm, sample)))
+         (!shard._hwm.compare_exchange_weak(hwm, sample)))
   {
     // Do nothing.
   }
@@ -72,14 +143,14 @@ void Accumulator::refresh(bool force)
 {
   // Get the timestamp from the start of the current period, and the timestamp
   // now.
-  uint_fast64_t timestamp_us = _current._timestamp_us.load();
+  uint_fast64_t timestamp_us = _timestamp_us.load();
   uint_fast64_t timestamp_us_now = get_timestamp_us();
 
   // If we're forced, or this period is already long enough, read the new
   // values and make the refreshed() callback.
   if ((force ||
        (timestamp_us_now >= timestamp_us + _target_period_us)) &&
-      (_current._timestamp_us.compare_exchange_weak(timestamp_us, timestamp_us_now)))
+      (_timestamp_us.compare_exchange_weak(timestamp_us, timestamp_us_now)))
   {
     read(timestamp_us_now - timestamp_us);
     refreshed();
@@ -90,13 +161,16 @@ void Accumulator::refresh(bool force)
 void Accumulator::reset()
 {
   // Get the timestamp now.
-  _current._timestamp_us.store(get_timestamp_us());
+  _timestamp_us.store(get_timestamp_us());
   // Reset everything else to 0.
-  _current._n.store(0);
-  _current._sigma.store(0);
-  _current._sigma_squared.store(0);
-  _current._lwm.store(MAX_UINT_FAST64);
-  _current._hwm.store(0);
+  for (unsigned int ii = 0; ii < _num_shards; ++ii)
+  {
+    _shards[ii]._n.store(0);
+    _shards[ii]._sigma.store(0);
+    _shards[ii]._sigma_squared.store(0);
+    _shards[ii]._lwm.store(MAX_UINT_FAST64);
+    _shards[ii]._hwm.store(0);
+  }
   _last._n = 0;
   _last._mean = 0;
   _last._variance = 0;
@@ -108,10 +182,24 @@ void Accumulator::reset()
 /// them as the last set of statistics.
 void Accumulator::read(uint_fast64_t period_us)
 {
-  // Read the basic statistics, and replace them with 0.
-  uint_fast64_t n = _current._n.exchange(0);
-  uint_fast64_t sigma = _current._sigma.exchange(0);
-  uint_fast64_t sigma_squared = _current._sigma_squared.exchange(0);
+  // Read the basic statistics from each shard and merge them, replacing
+  // them with 0 (or the starting values for the water marks).
+  uint_fast64_t n = 0;
+  uint_fast64_t sigma = 0;
+  uint_fast64_t sigma_squared = 0;
+  uint_fast64_t lwm = MAX_UINT_FAST64;
+  uint_fast64_t hwm = 0;
+  for (unsigned int ii = 0; ii < _num_shards; ++ii)
+  {
+    Shard& shard = _shards[ii];
+    n += shard._n.exchange(0);
+    sigma += shard._sigma.exchange(0);
+    sigma_squared += shard._sigma_squared.exchange(0);
+    uint_fast64_t shard_lwm = shard._lwm.exchange(MAX_UINT_FAST64);
+    lwm = (shard_lwm < lwm) ? shard_lwm : lwm;
+    uint_fast64_t shard_hwm = shard._hwm.exchange(0);
+    hwm = (shard_hwm > hwm) ? shard_hwm : hwm;
+  }
   // Scale n by the period.
   _last._n = n * period_us / _target_period_us;
   // Calculate the mean in the obvious way (avoiding division by 0.
@@ -119,11 +207,9 @@ void Accumulator::read(uint_fast64_t period_us)
   _last._mean = mean;
   // Calculate variance as mean of squares minus square of mean.
   _last._variance = (n > 0) ? ((sigma_squared / n) - (mean * mean)) : 0;
-  // Read low- and high-water marks, fixing low-water mark to 0 if there were
-  // no samples in the period.
-  uint_fast64_t lwm = _current._lwm.exchange(0);
+  // Fix the low-water mark to 0 if there were no samples in the period.
   _last._lwm = (n > 0) ? lwm : 0;
-  _last._hwm = _current._hwm.exchange(MAX_UINT_FAST64);
+  _last._hwm = hwm;
 }
 
 /// Callback whenever the accumulated statistics are refreshed.  Passes
@@ -137,5 +223,5 @@ void StatisticAccumulator::refreshed()
   values.push_back(std::to_string(get_variance()));
   values.push_back(std::to_string(get_lwm()));
   values.push_back(std::to_string(get_hwm()));
-  _statistic.report_change(values);
+  _statistic.report_change(std::move(values));
 }
@@ -0,0 +1,180 @@
+/**
+ * @file admission_control.cpp Overload control for received SIP requests
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <vector>
+#include <string>
+
+#include "log.h"
+#include "admission_control.h"
+
+AdmissionControl::AdmissionControl(unsigned long target_latency_us,
+                                   unsigned int max_queue_depth,
+                                   int retry_after) :
+  _target_latency_us(target_latency_us),
+  _max_queue_depth(max_queue_depth),
+  _retry_after(retry_after),
+  _smoothed_delay_us(0),
+  _reject_permille(0),
+  _request_count(0),
+  _period_samples(0),
+  _queue_depth(0),
+  _period_start_us(get_timestamp_us()),
+  _statistic("admission_control")
+{
+  LOG_STATUS("Admission control target latency %luus, maximum queue depth %u",
+             _target_latency_us, _max_queue_depth);
+  report();
+}
+
+
+AdmissionControl::~AdmissionControl()
+{
+}
+
+
+/// Record the time a message spent on the receive queue.
+void AdmissionControl::record_queue_delay(unsigned long delay_us)
+{
+  // Update the moving average with a weight of 1/16 for the new sample.
+  // Concurrent updates may occasionally lose a sample, which doesn't matter
+  // for a smoothed value.
+  unsigned long smoothed = _smoothed_delay_us.load();
+  _smoothed_delay_us.store(smoothed - (smoothed >> 4) + (delay_us >> 4));
+  _period_samples++;
+
+  maybe_adjust();
+}
+
+
+/// If this period is over, adjust the rejection rate.  This is called both
+/// when messages are dequeued and when requests arrive, so that we recover
+/// even if we are rejecting everything and the queue has emptied.
+void AdmissionControl::maybe_adjust()
+{
+  // Only one thread wins the exchange and does the work.
+  uint_fast64_t period_start_us = _period_start_us.load();
+  uint_fast64_t now_us = get_timestamp_us();
+  if ((now_us >= period_start_us + ADJUST_PERIOD_US) &&
+      (_period_start_us.compare_exchange_strong(period_start_us, now_us)))
+  {
+    adjust();
+  }
+}
+
+
+/// Decide whether to admit a new out-of-dialog request.
+bool AdmissionControl::admit_request(unsigned int queue_depth)
+{
+  _queue_depth.store(queue_depth);
+  maybe_adjust();
+
+  if ((_max_queue_depth != 0) && (queue_depth >= _max_queue_depth))
+  {
+    LOG_DEBUG("Rejecting request - queue depth %u", queue_depth);
+    return false;
+  }
+
+  unsigned int reject_permille = _reject_permille.load();
+  if (reject_permille > 0)
+  {
+    // Multiplying by a number coprime to 1000 spreads the rejections
+    // through each run of 1000 requests rather than bunching them.
+    unsigned int slot = (_request_count++ * 613) % 1000;
+    if (slot < reject_permille)
+    {
+      LOG_DEBUG("Rejecting request - smoothed queueing delay %luus",
+                _smoothed_delay_us.load());
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+/// Recalculate the rejection rate.  Back off quickly while the target is
+/// exceeded and recover gradually, so we don't oscillate between admitting
+/// a burst and rejecting everything.
+void AdmissionControl::adjust()
+{
+  unsigned int old_reject = _reject_permille.load();
+  unsigned int new_reject;
+
+  if ((_period_samples.exchange(0) == 0) && (_queue_depth.load() == 0))
+  {
+    // Nothing has been dequeued this period and the queue is empty, so
+    // there's no queueing delay.  (If the queue isn't empty, the workers
+    // are stuck, so leave the delay as it was.)
+    _smoothed_delay_us.store(0);
+  }
+
+  if ((_target_latency_us != 0) &&
+      (_smoothed_delay_us.load() > _target_latency_us))
+  {
+    new_reject = old_reject + REJECT_STEP_PERMILLE + (1000 - old_reject) / 8;
+    new_reject = (new_reject > 1000) ? 1000 : new_reject;
+  }
+  else
+  {
+    new_reject = old_reject - old_reject / 8;
+    new_reject = (new_reject < REJECT_STEP_PERMILLE) ? 0 : new_reject;
+  }
+
+  if (new_reject != old_reject)
+  {
+    _reject_permille.store(new_reject);
+
+    if ((old_reject == 0) || (new_reject == 0))
+    {
+      LOG_STATUS("Admission control %s - smoothed queueing delay %luus",
+                 (new_reject > 0) ? "throttling" : "no longer throttling",
+                 _smoothed_delay_us.load());
+    }
+
+    report();
+  }
+}
+
+
+/// Report the throttle state, rejection rate and smoothed queueing delay.
+void AdmissionControl::report()
+{
+  std::vector<std::string> values;
+  values.push_back(std::to_string(is_throttled() ? 1 : 0));
+  values.push_back(std::to_string(get_reject_permille()));
+  values.push_back(std::to_string(get_smoothed_delay_us()));
+  _statistic.report_change(std::move(values));
+}
@@ -0,0 +1,303 @@
+/**
+ * @file aorcache.cpp Cache of AoRs read from the memcached store
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <time.h>
+
+#include <functional>
+
+#include "aorcache.h"
+#include "log.h"
+
+namespace RegData {
+
+AoRCache::AoRCache(int max_entries, int ttl_ms, int num_shards) :
+  _ttl_ms(ttl_ms),
+  _max_shard_entries(0),
+  _num_shards((num_shards > 0) ? num_shards : 1),
+  _shards(NULL),
+  _hit_counter("store_cache_hits"),
+  _validated_counter("store_cache_validated"),
+  _miss_counter("store_cache_misses"),
+  _stale_counter("store_cache_stale"),
+  _size_gauge("store_cache_size")
+{
+  // Don't have more shards than entries, so each shard can hold at least
+  // one entry and the total never exceeds the size asked for.
+  if (_num_shards > max_entries)
+  {
+    _num_shards = (max_entries > 0) ? max_entries : 1;
+  }
+  _max_shard_entries = (max_entries > 0) ? max_entries / _num_shards : 1;
+
+  _shards = new Shard[_num_shards];
+  for (int ii = 0; ii < _num_shards; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+  }
+
+  LOG_STATUS("Caching up to %d AoRs for %dms in %d shards",
+             _max_shard_entries * _num_shards, _ttl_ms, _num_shards);
+}
+
+AoRCache::~AoRCache()
+{
+  clear();
+  for (int ii = 0; ii < _num_shards; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+  delete[] _shards;
+}
+
+MemcachedAoR* AoRCache::get(const std::string& aor_id, uint64_t& cas)
+{
+  AoRPtr cached;
+  cas = 0;
+
+  Shard* s = shard(aor_id);
+  pthread_mutex_lock(&s->lock);
+
+  std::unordered_map<std::string, LRUList::iterator>::iterator i = s->map.find(aor_id);
+  if (i != s->map.end())
+  {
+    LRUList::iterator entry = i->second;
+    if (now_ms() - entry->cached_ms < (uint64_t)_ttl_ms)
+    {
+      // Recent enough to use without checking.  Move it to the front of
+      // the LRU list.
+      s->lru.splice(s->lru.begin(), s->lru, entry);
+      cached = entry->aor_data;
+    }
+    else
+    {
+      cas = entry->cas;
+    }
+  }
+
+  pthread_mutex_unlock(&s->lock);
+
+  // Copy the AoR now the lock is released.
+  MemcachedAoR* aor_data = NULL;
+  if (cached)
+  {
+    aor_data = new MemcachedAoR(*cached);
+    _hit_counter.increment();
+  }
+
+  return aor_data;
+}
+
+bool AoRCache::get_max_expires(const std::string& aor_id, int& max_expires)
+{
+  bool found = false;
+
+  Shard* s = shard(aor_id);
+  pthread_mutex_lock(&s->lock);
+
+  std::unordered_map<std::string, LRUList::iterator>::iterator i = s->map.find(aor_id);
+  if ((i != s->map.end()) &&
+      (now_ms() - i->second->cached_ms < (uint64_t)_ttl_ms))
+  {
+    s->lru.splice(s->lru.begin(), s->lru, i->second);
+    max_expires = i->second->max_expires;
+    found = true;
+  }
+
+  pthread_mutex_unlock(&s->lock);
+
+  if (found)
+  {
+    _hit_counter.increment();
+  }
+
+  return found;
+}
+
+MemcachedAoR* AoRCache::validate(const std::string& aor_id, uint64_t cas)
+{
+  AoRPtr cached;
+  AoRPtr removed;
+
+  Shard* s = shard(aor_id);
+  pthread_mutex_lock(&s->lock);
+
+  std::unordered_map<std::string, LRUList::iterator>::iterator i = s->map.find(aor_id);
+  if (i != s->map.end())
+  {
+    LRUList::iterator entry = i->second;
+    if (entry->cas == cas)
+    {
+      // Nothing has changed since we cached it.
+      entry->cached_ms = now_ms();
+      s->lru.splice(s->lru.begin(), s->lru, entry);
+      cached = entry->aor_data;
+    }
+    else
+    {
+      // Another node has updated it since.
+      removed = remove(s, entry);
+    }
+  }
+
+  pthread_mutex_unlock(&s->lock);
+
+  // Copy the AoR now the lock is released.  A stale AoR is freed when
+  // removed goes out of scope.
+  MemcachedAoR* aor_data = NULL;
+  if (cached)
+  {
+    aor_data = new MemcachedAoR(*cached);
+    _validated_counter.increment();
+  }
+
+  if (removed)
+  {
+    _stale_counter.increment();
+  }
+
+  return aor_data;
+}
+
+void AoRCache::put(const std::string& aor_id, MemcachedAoR* aor_data)
+{
+  // Copy the AoR before taking the lock, and free any entries this
+  // replaces or evicts after releasing it.
+  Entry new_entry;
+  new_entry.aor_id = aor_id;
+  new_entry.aor_data.reset(new MemcachedAoR(*aor_data));
+  new_entry.cas = aor_data->get_cas();
+  new_entry.max_expires = 0;
+  new_entry.cached_ms = now_ms();
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    if (i->second->_expires > new_entry.max_expires)
+    {
+      new_entry.max_expires = i->second->_expires;
+    }
+  }
+
+  std::vector<AoRPtr> removed;
+
+  Shard* s = shard(aor_id);
+  pthread_mutex_lock(&s->lock);
+
+  std::unordered_map<std::string, LRUList::iterator>::iterator i = s->map.find(aor_id);
+  if (i != s->map.end())
+  {
+    removed.push_back(remove(s, i->second));
+  }
+
+  // Make room by evicting the least recently used entries.
+  while ((int)s->lru.size() >= _max_shard_entries)
+  {
+    removed.push_back(remove(s, --s->lru.end()));
+  }
+
+  s->lru.push_front(new_entry);
+  s->map[aor_id] = s->lru.begin();
+  _size_gauge.increment();
+
+  pthread_mutex_unlock(&s->lock);
+
+  _miss_counter.increment();
+}
+
+void AoRCache::invalidate(const std::string& aor_id, uint64_t stale_cas)
+{
+  bool stale = false;
+  AoRPtr removed;
+
+  Shard* s = shard(aor_id);
+  pthread_mutex_lock(&s->lock);
+
+  std::unordered_map<std::string, LRUList::iterator>::iterator i = s->map.find(aor_id);
+  if (i != s->map.end())
+  {
+    stale = ((stale_cas != 0) && (i->second->cas == stale_cas));
+    removed = remove(s, i->second);
+  }
+
+  pthread_mutex_unlock(&s->lock);
+
+  if (stale)
+  {
+    _stale_counter.increment();
+  }
+}
+
+void AoRCache::clear()
+{
+  for (int ii = 0; ii < _num_shards; ++ii)
+  {
+    Shard* s = &_shards[ii];
+    pthread_mutex_lock(&s->lock);
+    while (!s->lru.empty())
+    {
+      remove(s, s->lru.begin());
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+AoRCache::Shard* AoRCache::shard(const std::string& aor_id)
+{
+  return &_shards[std::hash<std::string>()(aor_id) % _num_shards];
+}
+
+/// Remove an entry from a shard, returning its AoR so the caller can free
+/// it once the lock is released.  Must be called with the shard locked.
+AoRCache::AoRPtr AoRCache::remove(Shard* s, LRUList::iterator entry)
+{
+  AoRPtr aor_data = entry->aor_data;
+  s->map.erase(entry->aor_id);
+  s->lru.erase(entry);
+  _size_gauge.decrement();
+  return aor_data;
+}
+
+uint64_t AoRCache::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+} // namespace RegData
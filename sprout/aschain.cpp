@@ -289,7 +289,8 @@ AsChainLink::on_initial_request(CallServices* call_services,
 }
 
 
-AsChainTable::AsChainTable()
+AsChainTable::AsChainTable() :
+  _size_gauge("as_chain_table_size")
 {
   pthread_mutex_init(&_lock, NULL);
 }
@@ -315,6 +316,7 @@ void AsChainTable::register_(AsChain* as_chain, std::vector<std::string>& tokens
     tokens.push_back(token);
     _t2c_map[token] = AsChainLink(as_chain, i + 1);
   }
+  _size_gauge.set(_t2c_map.size());
 
   pthread_mutex_unlock(&_lock);
 }
@@ -330,6 +332,7 @@ void AsChainTable::unregister(std::vector<std::string>& tokens)
   {
     _t2c_map.erase(*it);
   }
+  _size_gauge.set(_t2c_map.size());
 
   pthread_mutex_unlock(&_lock);
 }
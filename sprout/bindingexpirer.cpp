@@ -0,0 +1,195 @@
+/**
+ * @file bindingexpirer.cpp Service that expires registration bindings
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "bindingexpirer.h"
+#include "registration_utils.h"
+#include "pjutils.h"
+#include "sas.h"
+#include "log.h"
+
+BindingExpirer::BindingExpirer(RegData::Store* store,
+                               IfcHandler* ifchandler,
+                               pj_pool_t* pool) :
+  _store(store),
+  _ifchandler(ifchandler),
+  _pool(pool),
+  _wheel(time(NULL)),
+  _thread(NULL),
+  _terminated(false),
+  _tracked_gauge("registrar_tracked_aors"),
+  _expired_counter("registrar_expired_aors")
+{
+}
+
+BindingExpirer::~BindingExpirer()
+{
+  stop();
+}
+
+void BindingExpirer::init()
+{
+  pj_status_t status = pj_thread_create(_pool, "expirer",
+                                        &expiry_thread,
+                                        (void*)this, 0, 0, &_thread);
+  if (status != PJ_SUCCESS)
+  {
+    LOG_ERROR("Error creating binding expiry thread, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+  }
+}
+
+void BindingExpirer::update(const std::string& aor,
+                            RegData::AoR* aor_data)
+{
+  if (aor_data->bindings().empty())
+  {
+    _wheel.cancel(aor);
+  }
+  else
+  {
+    int first_expires = aor_data->bindings().begin()->second->_expires;
+    for (RegData::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+         i != aor_data->bindings().end();
+         ++i)
+    {
+      first_expires = std::min(first_expires, i->second->_expires);
+    }
+    _wheel.schedule(aor, first_expires);
+  }
+}
+
+void BindingExpirer::expire(int now)
+{
+  std::vector<std::string> aors;
+  _wheel.pop_expired(now, aors);
+
+  if (!aors.empty())
+  {
+    LOG_DEBUG("Expiring bindings for %d AoRs", (int)aors.size());
+  }
+
+  // Read the AoRs from the store in batches.
+  for (size_t ii = 0; ii < aors.size(); ii += BATCH_SIZE)
+  {
+    std::vector<std::string> batch(aors.begin() + ii,
+                                   aors.begin() + std::min(ii + BATCH_SIZE, aors.size()));
+    std::vector<RegData::AoR*> aor_data = _store->get_aor_data_multi(batch);
+    for (size_t jj = 0; jj < batch.size(); ++jj)
+    {
+      expire_aor(batch[jj], aor_data[jj], now);
+    }
+  }
+
+  _tracked_gauge.set(_wheel.size());
+}
+
+/// Remove an AoR's expired bindings from the store.  The store has already
+/// dropped them from the copy it read, so write that back if it dropped any
+/// and it still has some left, retrying if the AoR has changed since it was
+/// read.  If it has none, the AoR expires from the store by itself, and if
+/// nothing was dropped (because the bindings have been refreshed) there is
+/// nothing to write.  Takes ownership of the AoR data.
+void BindingExpirer::expire_aor(const std::string& aor,
+                                RegData::AoR* aor_data,
+                                int now)
+{
+  while ((aor_data != NULL) &&
+         (aor_data->expired() > 0) &&
+         (!aor_data->bindings().empty()) &&
+         (!_store->set_aor_data(aor, aor_data)))
+  {
+    delete aor_data;
+    aor_data = _store->get_aor_data(aor);
+  }
+
+  if (aor_data == NULL)
+  {
+    // We can't get to the store, so try again later.
+    LOG_ERROR("Failed to get AoR %s from store to expire bindings", aor.c_str());
+    _wheel.schedule(aor, now + RETRY_INTERVAL);
+    return;
+  }
+
+  if (aor_data->bindings().empty())
+  {
+    // The last binding has expired, so deregister from the application
+    // servers, as for a network-initiated deregistration.
+    LOG_INFO("All bindings for %s have expired", aor.c_str());
+    SAS::TrailId trail = SAS::new_trail(1u);
+    RegistrationUtils::deregister_with_application_servers(_ifchandler, _store, aor, trail);
+    _expired_counter.increment();
+  }
+  else
+  {
+    // Track the next binding to expire.
+    update(aor, aor_data);
+  }
+
+  delete aor_data;
+}
+
+void BindingExpirer::stop()
+{
+  if (_thread)
+  {
+    // Set the terminated flag to signal the expiry thread to exit.
+    _terminated = true;
+
+    // Wait for the expiry thread to exit.
+    pj_thread_join(_thread);
+    _thread = NULL;
+  }
+}
+
+int BindingExpirer::expiry_thread(void* p)
+{
+  BindingExpirer* expirer = (BindingExpirer*)p;
+  while (!expirer->_terminated)
+  {
+    sleep(1);
+    expirer->expire(time(NULL));
+  }
+  return 0;
+}
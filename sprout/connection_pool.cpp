@@ -428,7 +428,7 @@ void ConnectionPool::report_sprout_counts()
     reported_value.push_back(host);
     reported_value.push_back(connection_count);
   }
-  _statistic.report_change(reported_value);
+  _statistic.report_change(std::move(reported_value));
 }
 
 
@@ -0,0 +1,325 @@
+/**
+ * @file cpuaffinity.cpp Placement of threads on CPUs and NUMA nodes
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "log.h"
+#include "cpuaffinity.h"
+
+// Memory policy from linux/mempolicy.h, not exposed by glibc.
+static const int MPOL_PREFERRED_MODE = 1;
+
+std::string CpuAffinity::_sysfs_root = "/sys/devices/system";
+
+CpuAffinity::CpuAffinity() :
+  _slots()
+{
+}
+
+
+bool CpuAffinity::parse(const std::string& spec)
+{
+  _slots.clear();
+
+  if (spec.empty())
+  {
+    return true;
+  }
+
+  std::vector<int> values;
+
+  if (spec.compare(0, 5, "node:") == 0)
+  {
+    // One slot per NUMA node, containing all the CPUs on the node.
+    if (!parse_list(spec.substr(5), values))
+    {
+      return false;
+    }
+
+    for (size_t ii = 0; ii < values.size(); ++ii)
+    {
+      Slot slot;
+      slot.node = values[ii];
+      if (!node_cpus(slot.node, slot.cpus))
+      {
+        LOG_ERROR("NUMA node %d does not exist", slot.node);
+        _slots.clear();
+        return false;
+      }
+      _slots.push_back(slot);
+    }
+  }
+  else
+  {
+    // One slot per CPU.
+    if (!parse_list(spec, values))
+    {
+      return false;
+    }
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (size_t ii = 0; ii < values.size(); ++ii)
+    {
+      if (values[ii] >= num_cpus)
+      {
+        LOG_ERROR("CPU %d does not exist, only %ld CPUs configured",
+                  values[ii], num_cpus);
+        _slots.clear();
+        return false;
+      }
+      Slot slot;
+      slot.cpus.push_back(values[ii]);
+      slot.node = cpu_node(values[ii]);
+      _slots.push_back(slot);
+    }
+  }
+
+  return true;
+}
+
+
+int CpuAffinity::node(unsigned int index) const
+{
+  return (_slots.empty()) ? -1 : _slots[index % _slots.size()].node;
+}
+
+
+int CpuAffinity::max_node() const
+{
+  int max_node = -1;
+  for (size_t ii = 0; ii < _slots.size(); ++ii)
+  {
+    max_node = (_slots[ii].node > max_node) ? _slots[ii].node : max_node;
+  }
+  return max_node;
+}
+
+
+bool CpuAffinity::bind(unsigned int index) const
+{
+  if (_slots.empty())
+  {
+    return true;
+  }
+
+  const Slot& slot = _slots[index % _slots.size()];
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  for (size_t ii = 0; ii < slot.cpus.size(); ++ii)
+  {
+    CPU_SET(slot.cpus[ii], &cpuset);
+  }
+
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+  if (rc != 0)
+  {
+    LOG_ERROR("Failed to bind thread to CPUs %s: %s",
+              format_list(slot.cpus).c_str(), strerror(rc));
+    return false;
+  }
+
+  if (slot.node >= 0)
+  {
+    // Prefer the thread's own node for the pages it touches first, which
+    // includes the pools it creates.  This isn't fatal if it fails (for
+    // example on a kernel without NUMA support) since the first-touch
+    // policy usually has the same effect once the thread is bound.
+    const unsigned int bits_per_word = sizeof(unsigned long) * 8;
+    std::vector<unsigned long> nodemask(slot.node / bits_per_word + 1, 0);
+    nodemask[slot.node / bits_per_word] = 1ul << (slot.node % bits_per_word);
+    if (syscall(SYS_set_mempolicy,
+                MPOL_PREFERRED_MODE,
+                nodemask.data(),
+                nodemask.size() * bits_per_word + 1) != 0)
+    {
+      LOG_WARNING("Failed to set memory policy for NUMA node %d: %s",
+                  slot.node, strerror(errno));
+    }
+  }
+
+  return true;
+}
+
+
+std::string CpuAffinity::describe(unsigned int index) const
+{
+  if (_slots.empty())
+  {
+    return "any CPU";
+  }
+
+  const Slot& slot = _slots[index % _slots.size()];
+  std::string desc = ((slot.cpus.size() == 1) ? "CPU " : "CPUs ") +
+                     format_list(slot.cpus);
+  if (slot.node >= 0)
+  {
+    desc += " (node " + std::to_string(slot.node) + ")";
+  }
+  return desc;
+}
+
+
+bool CpuAffinity::parse_list(const std::string& list, std::vector<int>& values)
+{
+  values.clear();
+
+  if ((list.empty()) || (list[list.size() - 1] == ','))
+  {
+    LOG_ERROR("Invalid CPU or node list %s", list.c_str());
+    return false;
+  }
+
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+  {
+    char* end;
+    long first = strtol(item.c_str(), &end, 10);
+    long last = first;
+
+    if ((end == item.c_str()) || (first < 0))
+    {
+      LOG_ERROR("Invalid CPU or node list %s", list.c_str());
+      return false;
+    }
+
+    if (*end == '-')
+    {
+      const char* start = end + 1;
+      last = strtol(start, &end, 10);
+      if ((end == start) || (last < first))
+      {
+        LOG_ERROR("Invalid range in CPU or node list %s", list.c_str());
+        return false;
+      }
+    }
+
+    if (*end != '\0')
+    {
+      LOG_ERROR("Invalid CPU or node list %s", list.c_str());
+      return false;
+    }
+
+    for (long value = first; value <= last; ++value)
+    {
+      values.push_back((int)value);
+    }
+  }
+
+  return true;
+}
+
+
+std::string CpuAffinity::format_list(const std::vector<int>& values)
+{
+  std::string list;
+  size_t ii = 0;
+  while (ii < values.size())
+  {
+    // Find the end of this run of consecutive values.
+    size_t jj = ii;
+    while ((jj + 1 < values.size()) && (values[jj + 1] == values[jj] + 1))
+    {
+      ++jj;
+    }
+
+    if (!list.empty())
+    {
+      list += ",";
+    }
+    list += std::to_string(values[ii]);
+    if (jj > ii)
+    {
+      list += "-" + std::to_string(values[jj]);
+    }
+    ii = jj + 1;
+  }
+  return list;
+}
+
+
+int CpuAffinity::cpu_node(int cpu)
+{
+  // Each CPU's sysfs directory contains a nodeN link to its node.
+  std::string path = _sysfs_root + "/cpu/cpu" + std::to_string(cpu);
+  int node = -1;
+
+  DIR* dir = opendir(path.c_str());
+  if (dir != NULL)
+  {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if ((strncmp(entry->d_name, "node", 4) == 0) &&
+          (isdigit(entry->d_name[4])))
+      {
+        node = atoi(entry->d_name + 4);
+        break;
+      }
+    }
+    closedir(dir);
+  }
+
+  return node;
+}
+
+
+bool CpuAffinity::node_cpus(int node, std::vector<int>& cpus)
+{
+  std::ifstream file((_sysfs_root + "/node/node" + std::to_string(node) +
+                      "/cpulist").c_str());
+  std::string list;
+  if (!std::getline(file, list))
+  {
+    return false;
+  }
+  return parse_list(list, cpus);
+}
@@ -232,8 +232,10 @@ void DNSResolver::ares_callback(int status,
   }
   else
   {
-    // Log that we've failed.
+    // Log that we've failed, tracing the rest of the trail even if it
+    // wasn't sampled.
     LOG_WARNING("DNS ENUM query failed for host %s: %s", _domain.c_str(), ares_strerror(status));
+    SAS::force_trail(_trail);
     SAS::Event event(_trail, SASEvent::RX_ENUM_ERR, 1u);
     event.add_static_param(status);
     event.add_var_param(_domain);
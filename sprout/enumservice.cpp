@@ -48,6 +48,7 @@
 #include "utils.h"
 #include "log.h"
 #include "sasevent.h"
+#include "histogram.h"
 
 
 const boost::regex EnumService::CHARS_TO_STRIP_FROM_UAS = boost::regex("([^0-9+]|(?<=.)[^0-9])");
@@ -283,6 +284,9 @@ std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::T
     return std::string();
   }
 
+  // Time the whole lookup, including any follow-on queries.
+  Histogram::Timer timer(_latency_histogram);
+
   // Log starting ENUM processing.
   SAS::Event event(trail, SASEvent::ENUM_START, 1u);
   event.add_var_param(user);
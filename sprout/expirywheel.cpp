@@ -0,0 +1,228 @@
+/**
+ * @file expirywheel.cpp Hierarchical timing wheel of expiry times
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <algorithm>
+
+#include "expirywheel.h"
+
+ExpiryWheel::ExpiryWheel(int now) :
+  _now(now),
+  _level0_size(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ExpiryWheel::~ExpiryWheel()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void ExpiryWheel::schedule(const std::string& key, int expires)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, Slot::iterator>::iterator i = _index.find(key);
+  if (i != _index.end())
+  {
+    // Already tracked, so move the entry to the slot for its new time.
+    Slot::iterator entry = i->second;
+    entry->expires = expires;
+    place(slot(entry->level, entry->slot), entry);
+  }
+  else
+  {
+    Slot new_entry;
+    Entry e = {key, expires, DUE, 0};
+    new_entry.push_back(e);
+    Slot::iterator entry = new_entry.begin();
+    place(new_entry, entry);
+    _index.insert(std::make_pair(key, entry));
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void ExpiryWheel::cancel(const std::string& key)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, Slot::iterator>::iterator i = _index.find(key);
+  if (i != _index.end())
+  {
+    Slot::iterator entry = i->second;
+    if (entry->level == 0)
+    {
+      --_level0_size;
+    }
+    slot(entry->level, entry->slot).erase(entry);
+    _index.erase(i);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void ExpiryWheel::pop_expired(int now, std::vector<std::string>& expired)
+{
+  pthread_mutex_lock(&_lock);
+
+  // Turn the wheel a second at a time.  Each turn of a level moves the
+  // next slot of the level above down.
+  while (_now < now)
+  {
+    if (_level0_size == 0)
+    {
+      // Nothing is due before the end of this turn of the first level, so
+      // skip straight there.
+      _now = std::min(_now | ((1 << LEVEL0_BITS) - 1), now);
+      if (_now == now)
+      {
+        break;
+      }
+    }
+
+    ++_now;
+    int index = _now & ((1 << LEVEL0_BITS) - 1);
+    for (int level = 1; (index == 0) && (level < LEVELS); ++level)
+    {
+      index = (_now >> (LEVEL0_BITS + (level - 1) * LEVELN_BITS)) &
+              ((1 << LEVELN_BITS) - 1);
+      cascade(level);
+    }
+
+    // Everything in this second's slot is now due.
+    Slot& current = _level0[_now & ((1 << LEVEL0_BITS) - 1)];
+    for (Slot::iterator i = current.begin(); i != current.end(); ++i)
+    {
+      i->level = DUE;
+      --_level0_size;
+    }
+    _due.splice(_due.end(), current);
+  }
+
+  for (Slot::iterator i = _due.begin(); i != _due.end(); ++i)
+  {
+    expired.push_back(i->key);
+    _index.erase(i->key);
+  }
+  _due.clear();
+
+  pthread_mutex_unlock(&_lock);
+}
+
+size_t ExpiryWheel::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _index.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+/// Move an entry from its current slot to the right slot for its expiry
+/// time.  Must be called with the lock held.
+void ExpiryWheel::place(Slot& from, Slot::iterator entry)
+{
+  int delta = entry->expires - _now;
+
+  if (entry->level == 0)
+  {
+    --_level0_size;
+  }
+
+  if (delta <= 0)
+  {
+    entry->level = DUE;
+    entry->slot = 0;
+  }
+  else if (delta < (1 << LEVEL0_BITS))
+  {
+    entry->level = 0;
+    entry->slot = entry->expires & ((1 << LEVEL0_BITS) - 1);
+  }
+  else
+  {
+    // Find the lowest level whose range covers the expiry time.  Anything
+    // beyond the top level's range goes in its furthest slot, and is
+    // placed again when that slot is cascaded.
+    int expires = entry->expires;
+    int level = 1;
+    while ((level < LEVELS - 1) &&
+           (delta >= (1 << (LEVEL0_BITS + level * LEVELN_BITS))))
+    {
+      ++level;
+    }
+    int range = 1 << (LEVEL0_BITS + level * LEVELN_BITS);
+    if (delta >= range)
+    {
+      expires = _now + range - 1;
+    }
+    entry->level = level;
+    entry->slot = (expires >> (LEVEL0_BITS + (level - 1) * LEVELN_BITS)) &
+                  ((1 << LEVELN_BITS) - 1);
+  }
+
+  if (entry->level == 0)
+  {
+    ++_level0_size;
+  }
+
+  Slot& to = slot(entry->level, entry->slot);
+  to.splice(to.end(), from, entry);
+}
+
+/// Move the entries in the current slot of a level down to the levels
+/// below.  Must be called with the lock held.
+void ExpiryWheel::cascade(int level)
+{
+  int index = (_now >> (LEVEL0_BITS + (level - 1) * LEVELN_BITS)) &
+              ((1 << LEVELN_BITS) - 1);
+
+  Slot cascading;
+  cascading.splice(cascading.end(), _levels[level - 1][index]);
+  while (!cascading.empty())
+  {
+    place(cascading, cascading.begin());
+  }
+}
+
+ExpiryWheel::Slot& ExpiryWheel::slot(int level, int slot)
+{
+  return (level == DUE) ? _due :
+         (level == 0) ? _level0[slot] :
+                        _levels[level - 1][slot];
+}
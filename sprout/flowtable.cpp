@@ -215,7 +215,7 @@ void FlowTable::report_flow_count()
   LOG_DEBUG("Reporting current flow count: %d", _tp2flow_map.size());
   std::vector<std::string> message;
   message.push_back(std::to_string(_tp2flow_map.size()));
-  _statistic.report_change(message);
+  _statistic.report_change(std::move(message));
 }
 
 
@@ -0,0 +1,196 @@
+/**
+ * @file histogram.cpp Log-bucketed histogram of samples, reporting percentiles
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include "histogram.h"
+
+Histogram::Histogram(uint_fast64_t period_us) :
+  _target_period_us(period_us)
+{
+  reset();
+}
+
+/// Accumulate a sample into our results.
+void Histogram::accumulate(unsigned long sample)
+{
+  _current._buckets[bucket_index(sample)]++;
+
+  // Update the maximum, repeating if it was changed in the meantime.
+  uint_fast64_t max = _current._max.load();
+  while ((sample > max) &&
+         (!_current._max.compare_exchange_weak(max, sample)))
+  {
+    // Do nothing.
+  }
+
+  // Refresh the statistics, if required.
+  refresh();
+}
+
+/// Refresh our calculations - called at the end of each period, or
+/// optionally at other times to get an up-to-date result.
+void Histogram::refresh(bool force)
+{
+  uint_fast64_t timestamp_us = _current._timestamp_us.load();
+  uint_fast64_t timestamp_us_now = get_timestamp_us();
+
+  // If we're forced, or this period is already long enough, read the new
+  // values and make the refreshed() callback.
+  if ((force ||
+       (timestamp_us_now >= timestamp_us + _target_period_us)) &&
+      (_current._timestamp_us.compare_exchange_weak(timestamp_us, timestamp_us_now)))
+  {
+    read(timestamp_us_now - timestamp_us);
+    refreshed();
+  }
+}
+
+/// Reset the histogram.
+void Histogram::reset()
+{
+  _current._timestamp_us.store(get_timestamp_us());
+  _current._max.store(0);
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _current._buckets[ii].store(0);
+  }
+  _last._n = 0;
+  _last._p50 = 0;
+  _last._p90 = 0;
+  _last._p99 = 0;
+  _last._p999 = 0;
+  _last._max = 0;
+}
+
+/// Get the index of the bucket holding the specified value.  Values below
+/// 2^SUB_BUCKET_BITS have a bucket each.  Above that, the top
+/// SUB_BUCKET_BITS bits of the value select the bucket within the range
+/// for its power of two.
+unsigned int Histogram::bucket_index(uint_fast64_t value)
+{
+  if (value >= ((uint_fast64_t)1 << MAX_VALUE_BITS))
+  {
+    return NUM_BUCKETS - 1;
+  }
+
+  if (value < (SUB_BUCKET_HALF << 1))
+  {
+    return value;
+  }
+
+  unsigned int msb = 63 - __builtin_clzll(value);
+  unsigned int shift = msb - SUB_BUCKET_BITS + 1;
+  return (shift * SUB_BUCKET_HALF) + (value >> shift);
+}
+
+/// Get the highest value held in the specified bucket.
+uint_fast64_t Histogram::bucket_max(unsigned int index)
+{
+  if (index < (SUB_BUCKET_HALF << 1))
+  {
+    return index;
+  }
+
+  unsigned int shift = (index / SUB_BUCKET_HALF) - 1;
+  uint_fast64_t top = index - (shift * SUB_BUCKET_HALF);
+  return ((top + 1) << shift) - 1;
+}
+
+/// Find the value at the specified percentile (in hundredths of a
+/// percent), as the highest value in the bucket holding that sample.
+uint_fast64_t Histogram::percentile(const uint_fast64_t* counts,
+                                    uint_fast64_t n,
+                                    unsigned int centipercent)
+{
+  // Work out the rank of the sample at this percentile, rounding up.
+  uint_fast64_t rank = (n * centipercent + 9999) / 10000;
+  rank = (rank > 0) ? rank : 1;
+
+  uint_fast64_t seen = 0;
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    seen += counts[ii];
+    if (seen >= rank)
+    {
+      return bucket_max(ii);
+    }
+  }
+
+  return 0;
+}
+
+/// Read the accumulated samples, calculate their percentiles and report
+/// them as the last set of statistics.
+void Histogram::read(uint_fast64_t period_us)
+{
+  // Read the buckets, replacing them with 0, and count the samples.
+  uint_fast64_t counts[NUM_BUCKETS];
+  uint_fast64_t n = 0;
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    counts[ii] = _current._buckets[ii].exchange(0);
+    n += counts[ii];
+  }
+  uint_fast64_t max = _current._max.exchange(0);
+
+  // Scale n by the period, as Accumulator does.
+  _last._n = n * period_us / _target_period_us;
+
+  if (n > 0)
+  {
+    // The top bucket holds the maximum, so the bucket's upper bound
+    // overestimates it.  Use the tracked maximum to cap the percentiles.
+    uint_fast64_t p50 = percentile(counts, n, 5000);
+    uint_fast64_t p90 = percentile(counts, n, 9000);
+    uint_fast64_t p99 = percentile(counts, n, 9900);
+    uint_fast64_t p999 = percentile(counts, n, 9990);
+    _last._p50 = (p50 < max) ? p50 : max;
+    _last._p90 = (p90 < max) ? p90 : max;
+    _last._p99 = (p99 < max) ? p99 : max;
+    _last._p999 = (p999 < max) ? p999 : max;
+    _last._max = max;
+  }
+  else
+  {
+    _last._p50 = 0;
+    _last._p90 = 0;
+    _last._p99 = 0;
+    _last._p999 = 0;
+    _last._max = 0;
+  }
+}
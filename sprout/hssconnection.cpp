@@ -52,7 +52,9 @@ HSSConnection::HSSConnection(const std::string& server) :
   _http(new HttpConnection(server,
                            false,
                            SASEvent::TX_HSS_BASE,
-                           "connected_homesteads"))
+                           "connected_homesteads")),
+  _latency_histogram("hss_latency_us"),
+  _error_counter("hss_errors")
 {
 }
 
@@ -117,7 +119,17 @@ bool HSSConnection::get_user_ifc(const std::string& public_user_identity,
 {
   std::string path = "/filtercriteria/" +
                      Utils::url_escape(public_user_identity);
-  return _http->get(path, xml_data, "", trail);
+  bool got_data;
+  {
+    Histogram::Timer timer(&_latency_histogram);
+    got_data = _http->get(path, xml_data, "", trail);
+  }
+
+  if (!got_data)
+  {
+    _error_counter.increment();
+  }
+  return got_data;
 }
 
 /// Retrieve a JSON object from a path on the server. Caller is responsible for deleting.
@@ -125,8 +137,19 @@ Json::Value* HSSConnection::get_object(const std::string& path, SAS::TrailId tra
 {
   std::string json_data;
   Json::Value* root = NULL;
+  bool got_data;
 
-  if (_http->get(path, json_data, "", trail))
+  {
+    // Time the round trip to the HSS, but not the parsing.
+    Histogram::Timer timer(&_latency_histogram);
+    got_data = _http->get(path, json_data, "", trail);
+  }
+
+  if (!got_data)
+  {
+    _error_counter.increment();
+  }
+  else
   {
     root = new Json::Value;
     Json::Reader reader;
@@ -187,7 +187,7 @@ void PoolEntry::setRemoteIp(std::string value)  //< Remote IP, or "" if no conne
   pthread_mutex_unlock(&_parent->_lock);
 
   // Actually report outside the mutex to avoid any risk of deadlock.
-  _parent->_statistic.report_change(new_value);
+  _parent->_statistic.report_change(std::move(new_value));
 }
 
 /// cURL helper - write data into string.
@@ -358,8 +358,10 @@ bool HttpConnection::get(const std::string& path,       //< Absolute path to req
     }
     else
     {
-      // Report the error to SAS
+      // Report the error to SAS, tracing the rest of the trail even if it
+      // wasn't sampled.
       LOG_ERROR("HTTP error response : GET %s : %s", url.c_str(), curl_easy_strerror(rc));
+      SAS::force_trail(trail);
       SAS::Event http_err_event(trail, _sasEventBase + SASEvent::HTTP_ERR, 1u);
       http_err_event.add_static_param(rc);
       http_err_event.add_var_param(url);
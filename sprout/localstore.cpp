@@ -50,12 +50,14 @@
 #include <fstream>
 #include <iomanip>
 #include <algorithm>
+#include <functional>
 
 #include <time.h>
 #include <stdint.h>
 
 #include "localstorefactory.h"
 #include "localstore.h"
+#include "counter.h"
 
 namespace RegData {
 
@@ -72,40 +74,81 @@ namespace RegData {
   }
 
 
-  LocalStore::LocalStore() :
-    _db()
+  LocalStore::LocalStore(int num_shards) :
+    _num_shards((num_shards > 0) ? num_shards : 1),
+    _shards(NULL)
   {
+    _shards = new Shard[_num_shards];
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      pthread_mutex_init(&_shards[ii].lock, NULL);
+      _shards[ii].next_cas = 1;
+      _shards[ii].purge_bucket = 0;
+    }
   }
 
 
   LocalStore::~LocalStore()
   {
     flush_all();
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      pthread_mutex_destroy(&_shards[ii].lock);
+    }
+    delete[] _shards;
   }
 
 
   void LocalStore::flush_all()
   {
-    _db.clear();
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      // Swap the AoRs out under the lock, and free them after releasing it.
+      std::unordered_map<std::string, Record> db;
+      pthread_mutex_lock(&_shards[ii].lock);
+      _shards[ii].db.swap(db);
+      pthread_mutex_unlock(&_shards[ii].lock);
+    }
   }
 
 
   AoR* LocalStore::get_aor_data(const std::string& aor_id)
   {
-    LocalAoR* aor_data = new LocalAoR;
-    std::map<std::string, LocalAoR>::iterator i = _db.find(aor_id);
-    if (i != _db.end())
+    std::shared_ptr<LocalAoR> stored;
+    std::shared_ptr<LocalAoR> expired;
+    int now = time(NULL);
+
+    Shard* s = shard(aor_id);
+    pthread_mutex_lock(&s->lock);
+
+    std::unordered_map<std::string, Record>::iterator i = s->db.find(aor_id);
+    if (i != s->db.end())
     {
-      // AoR is already in database, so expire the bindings then copy
-      // the data.
-      expire_bindings(&i->second, time(NULL));
-      *aor_data = i->second;
+      if (i->second.max_expires > now)
+      {
+        // AoR is in the database.  Stored AoRs are never modified, so just
+        // take a reference to it and copy it after releasing the lock.
+        stored = i->second.aor_data;
+      }
+      else
+      {
+        // All the bindings have expired, so the AoR no longer exists.
+        expired.swap(i->second.aor_data);
+        s->db.erase(i);
+      }
     }
-    else
+
+    pthread_mutex_unlock(&s->lock);
+
+    // Copy the AoR and expire the bindings on our copy, outside the lock.
+    // If the AoR isn't in the database, it is returned empty with a CAS of
+    // zero, and is only added when it is written.
+    LocalAoR* aor_data = new LocalAoR;
+    if (stored)
     {
-      // AoR is not already in the database, so insert it.
-      _db.insert(std::make_pair(aor_id, *aor_data));
+      *aor_data = *stored;
     }
+    expire_bindings(aor_data, now);
 
     return (AoR*)aor_data;
   }
@@ -117,22 +160,172 @@ namespace RegData {
     LocalAoR* aor_data = (LocalAoR*)(data);
     if (aor_data != NULL)
     {
-      std::map<std::string, LocalAoR>::iterator i = _db.find(aor_id);
+      // Expire any old bindings before writing.  If there are none left,
+      // the AoR is removed rather than stored.
+      int now = time(NULL);
+      int max_expires = expire_bindings(aor_data, now);
+
+      // Copy the AoR before taking the lock.  Nothing else can see the copy
+      // until it is stored, so its CAS can be filled in under the lock.
+      // Any AoRs this replaces or purges are freed after the lock is
+      // released.
+      std::shared_ptr<LocalAoR> stored;
+      if (max_expires > now)
+      {
+        stored.reset(new LocalAoR(*aor_data));
+      }
+      std::vector<std::shared_ptr<LocalAoR> > purged;
+
+      Shard* s = shard(aor_id);
+      pthread_mutex_lock(&s->lock);
+
+      std::unordered_map<std::string, Record>::iterator i = s->db.find(aor_id);
+      if ((i != s->db.end()) && (i->second.max_expires <= now))
+      {
+        // The stored AoR has expired, so treat it as absent.
+        purged.push_back(i->second.aor_data);
+        s->db.erase(i);
+        i = s->db.end();
+      }
+
+      if (aor_data->get_cas() == 0)
+      {
+        // New record, so add it, unless someone else got there first.
+        rc = (i == s->db.end());
+      }
+      else
+      {
+        // Update to an existing record, so check it hasn't changed since
+        // it was read.
+        rc = ((i != s->db.end()) &&
+              (i->second.aor_data->get_cas() == aor_data->get_cas()));
+      }
 
-      if (i != _db.end())
+      if (rc)
       {
-        if (aor_data->get_cas() == i->second.get_cas())
+        aor_data->set_cas(s->next_cas++);
+        if (stored)
+        {
+          stored->set_cas(aor_data->get_cas());
+          Record& record = s->db[aor_id];
+          record.aor_data.swap(stored);
+          record.max_expires = max_expires;
+        }
+        else if (i != s->db.end())
         {
-          // CAS is unchanged, so increment the CAS and update the data.
-          aor_data->set_cas(aor_data->get_cas() + 1);
-          i->second = *aor_data;
-          rc = true;
+          purged.push_back(i->second.aor_data);
+          s->db.erase(i);
         }
       }
+
+      purge(s, now, PURGE_BUCKETS, purged);
+
+      pthread_mutex_unlock(&s->lock);
+
+      if ((!rc) && (_conflict_counter != NULL))
+      {
+        // The data has changed since it was read.
+        _conflict_counter->increment();
+      }
     }
 
     return rc;
   }
 
+
+  bool LocalStore::has_active_bindings(const std::string& aor_id)
+  {
+    // The latest expiry time of the AoR's bindings is stored alongside it,
+    // so there's no need to look at the bindings.
+    bool active = false;
+    int now = time(NULL);
+
+    Shard* s = shard(aor_id);
+    pthread_mutex_lock(&s->lock);
+
+    std::unordered_map<std::string, Record>::const_iterator i = s->db.find(aor_id);
+    if (i != s->db.end())
+    {
+      active = (i->second.max_expires > now);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return active;
+  }
+
+
+  void LocalStore::purge()
+  {
+    int now = time(NULL);
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      std::vector<std::shared_ptr<LocalAoR> > purged;
+      pthread_mutex_lock(&_shards[ii].lock);
+      purge(&_shards[ii], now, _shards[ii].db.bucket_count(), purged);
+      pthread_mutex_unlock(&_shards[ii].lock);
+    }
+  }
+
+
+  int LocalStore::size()
+  {
+    int size = 0;
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      pthread_mutex_lock(&_shards[ii].lock);
+      size += _shards[ii].db.size();
+      pthread_mutex_unlock(&_shards[ii].lock);
+    }
+    return size;
+  }
+
+
+  LocalStore::Shard* LocalStore::shard(const std::string& aor_id)
+  {
+    return &_shards[std::hash<std::string>()(aor_id) % _num_shards];
+  }
+
+
+  /// Remove the AoRs whose bindings have all expired from the next few hash
+  /// buckets of a shard, carrying on from where the last call left off.
+  /// The AoRs removed are added to purged, so the caller can free them
+  /// after releasing the lock.  Must be called with the shard locked.
+  void LocalStore::purge(Shard* s,
+                         int now,
+                         size_t num_buckets,
+                         std::vector<std::shared_ptr<LocalAoR> >& purged)
+  {
+    size_t bucket_count = s->db.bucket_count();
+    for (size_t ii = 0; (ii < num_buckets) && (ii < bucket_count); ++ii)
+    {
+      // The number of buckets changes as the table grows, so this may skip
+      // or repeat some buckets, but they are all checked eventually.
+      size_t bucket = s->purge_bucket++ % bucket_count;
+
+      // Erasing invalidates the iterator, so start again after each erase.
+      // Buckets rarely hold more than a couple of AoRs.
+      bool erased;
+      do
+      {
+        erased = false;
+        for (std::unordered_map<std::string, Record>::local_iterator j = s->db.begin(bucket);
+             j != s->db.end(bucket);
+             ++j)
+        {
+          if (j->second.max_expires <= now)
+          {
+            purged.push_back(j->second.aor_data);
+            std::string aor_id = j->first;
+            s->db.erase(aor_id);
+            erased = true;
+            break;
+          }
+        }
+      }
+      while (erased);
+    }
+  }
+
 } // namespace RegData
 
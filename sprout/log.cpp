@@ -51,7 +51,7 @@
 namespace Log
 {
   static Logger *logger = new Logger();
-  static int loggingLevel = 4;
+  int loggingLevel = 4;
 };
 
 void
@@ -57,28 +57,135 @@
 
 #include "logger.h"
 
+#include <string.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Maximum number of iovecs passed to each writev call by the flusher thread.
+static const int IOV_BATCH = 256;
+
+// How often the flusher thread drains the rings, in milliseconds.
+static const long FLUSH_INTERVAL_MS = 10;
+
+// Size of the buffer used to format a timestamp.
+static const int TIMESTAMP_SIZE = 32;
+
+/// Ring buffer of log lines written by a single thread and read by the
+/// flusher thread.  Each line is stored as a header followed by the text,
+/// padded to a multiple of 8 bytes, and never wraps around the end of the
+/// buffer - if it doesn't fit, a padding record fills the rest of the
+/// buffer and the line starts again at the beginning.
+struct Logger::Ring
+{
+  struct Header
+  {
+    uint32_t len;
+    uint32_t flags;
+    struct timespec ts;
+  };
+
+  static const uint32_t PADDING = 0xffffffff;
+
+  Ring(unsigned int size) :
+    capacity(size),
+    buf(new char[size]),
+    head(0),
+    tail(0),
+    closed(false)
+  {
+  }
+
+  ~Ring()
+  {
+    delete[] buf;
+  }
+
+  static inline size_t record_size(size_t len)
+  {
+    return (sizeof(Header) + len + 7) & ~(size_t)7;
+  }
+
+  inline Header* header(size_t pos)
+  {
+    return (Header*)(buf + (pos % capacity));
+  }
+
+  /// Add a line to the ring, returning false if there is no room.  Only
+  /// called by the thread that owns the ring.
+  bool push(const struct timespec& ts, int flags, const char* data, size_t len)
+  {
+    size_t need = record_size(len);
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t contiguous = capacity - (h % capacity);
+    size_t skip = (contiguous < need) ? contiguous : 0;
+
+    if (skip + need > capacity - (h - t))
+    {
+      return false;
+    }
+
+    if (skip != 0)
+    {
+      header(h)->len = PADDING;
+      h += skip;
+    }
+
+    Header* hdr = header(h);
+    hdr->len = len;
+    hdr->flags = flags;
+    hdr->ts = ts;
+    memcpy(hdr + 1, data, len);
+    head.store(h + need, std::memory_order_release);
+
+    return true;
+  }
+
+  const size_t capacity;
+  char* const buf;
+  std::atomic<size_t> head;
+  std::atomic<size_t> tail;
+  std::atomic<bool> closed;
+};
+
+
 Logger::Logger() :
   _flags(ADD_TIMESTAMPS),
   _last_hour(0),
   _rotate(false),
-  _fd(stdout)
+  _fd(stdout),
+  _async(false),
+  _ring_size(DEFAULT_RING_SIZE),
+  _rings(),
+  _flusher_stop(false),
+  _dropped(0),
+  _reported_dropped(0)
 {
   pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_flusher_cond, NULL);
 };
 
 Logger::Logger(const std::string& directory, const std::string& filename) :
   _flags(ADD_TIMESTAMPS),
   _last_hour(0),
   _rotate(true),
-  _fd(NULL)
+  _fd(NULL),
+  _async(false),
+  _ring_size(DEFAULT_RING_SIZE),
+  _rings(),
+  _flusher_stop(false),
+  _dropped(0),
+  _reported_dropped(0)
 {
   pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_flusher_cond, NULL);
   _prefix = directory + "/" + filename;
 }
 
 
 Logger::~Logger()
 {
+  stop_async();
 }
 
 
@@ -104,15 +211,57 @@ void Logger::write(const char* data)
   // Writes logger output to a series of hourly files.
   struct timespec ts;
   gettime(&ts);
-  struct tm* dt = gmtime(&ts.tv_sec);
+
+  if (_async)
+  {
+    // Leave the line for the flusher thread to write.
+    Ring* ring = get_ring();
+    if (!ring->push(ts, _flags, data, strlen(data)))
+    {
+      _dropped++;
+    }
+    return;
+  }
+
+  struct tm dt;
+  gmtime_r(&ts.tv_sec, &dt);
 
   // Take the lock before we operate on member variables.
   pthread_mutex_lock(&_lock);
 
-  // Convert the date/time into a rough number of hours since some base date.
-  // This doesn't have to be exact, but it does have to be monotonically
-  // increasing, so assume every year is a leap year.
-  int hour = dt->tm_year * 366 * 24 + dt->tm_yday * 24 + dt->tm_hour;
+  rotate(&dt);
+
+  if (_flags & ADD_TIMESTAMPS)
+  {
+    char timestamp[TIMESTAMP_SIZE];
+    format_timestamp(timestamp, sizeof(timestamp), &ts, &dt);
+    fputs(timestamp, _fd);
+  }
+
+  // Write the log to the current file.
+  fputs(data, _fd);
+
+  if (_flags & FLUSH_ON_WRITE)
+  {
+    fflush(_fd);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+/// Convert the date/time into a rough number of hours since some base date.
+/// This doesn't have to be exact, but it does have to be monotonically
+/// increasing, so assume every year is a leap year.
+static inline int hours(const struct tm* dt)
+{
+  return dt->tm_year * 366 * 24 + dt->tm_yday * 24 + dt->tm_hour;
+}
+
+/// Switch to a new log file if this is the first log or the hour has
+/// changed.  Must be called with the lock held.
+void Logger::rotate(const struct tm* dt)
+{
+  int hour = hours(dt);
   if (_rotate && ((hour > _last_hour) || (_fd == NULL)))
   {
     // Time to switch to a new log file.
@@ -130,25 +279,24 @@ void Logger::write(const char* data)
     _fd = fopen(fname, "a");
     _last_hour = hour;
   }
+}
 
-  if (_flags & ADD_TIMESTAMPS)
+/// Format the timestamp at the start of each line into a buffer of the
+/// specified size, returning its length (truncated to fit if necessary).
+int Logger::format_timestamp(char* buf, size_t size, const struct timespec* ts, const struct tm* dt)
+{
+  int len = snprintf(buf, size, "%2.2d-%2.2d-%4.4d %2.2d:%2.2d:%2.2d.%3.3ld ",
+                     dt->tm_mday, (dt->tm_mon+1), (dt->tm_year + 1900),
+                     dt->tm_hour, dt->tm_min, dt->tm_sec, (ts->tv_nsec / 1000000));
+  if (len < 0)
   {
-    char timestamp[100];
-    sprintf(timestamp, "%2.2d-%2.2d-%4.4d %2.2d:%2.2d:%2.2d.%3.3ld ",
-            dt->tm_mday, (dt->tm_mon+1), (dt->tm_year + 1900),
-            dt->tm_hour, dt->tm_min, dt->tm_sec, (ts.tv_nsec / 1000000));
-    fputs(timestamp, _fd);
+    len = 0;
   }
-
-  // Write the log to the current file.
-  fputs(data, _fd);
-
-  if (_flags & FLUSH_ON_WRITE)
+  else if ((size_t)len >= size)
   {
-    fflush(_fd);
+    len = size - 1;
   }
-
-  pthread_mutex_unlock(&_lock);
+  return len;
 }
 
 // LCOV_EXCL_START Only used in exceptional signal handlers - not hit in UT
@@ -162,6 +310,17 @@ void Logger::write(const char* data)
 // function is not thread-safe.
 void Logger::backtrace(const char *data)
 {
+  if (_async)
+  {
+    // Write out the lines still in the rings first, since the process is
+    // about to abort and they would otherwise be lost.  This can't take the
+    // lock, and doesn't free the rings of exited threads.
+    for (std::vector<Ring*>::iterator it = _rings.begin(); it != _rings.end(); ++it)
+    {
+      drain(*it);
+    }
+  }
+
   // If the file exists, dump a header and then the backtrace.
   if (_fd != NULL)
   {
@@ -206,5 +365,251 @@ void Logger::backtrace(const char *data)
 
 void Logger::flush()
 {
-  fflush(_fd);
+  if (_async)
+  {
+    // Write out everything the flusher thread hasn't got to yet.
+    pthread_mutex_lock(&_lock);
+    drain_all();
+    pthread_mutex_unlock(&_lock);
+  }
+  else
+  {
+    fflush(_fd);
+  }
+}
+
+
+void Logger::start_async(unsigned int ring_size)
+{
+  if (_async)
+  {
+    return;
+  }
+
+  // Anything already buffered by the FILE must go out before the flusher
+  // thread starts writing directly to the file descriptor.
+  if (_fd != NULL)
+  {
+    fflush(_fd);
+  }
+
+  _ring_size = ring_size & ~7u;
+  _flusher_stop = false;
+  pthread_key_create(&_ring_key, release_ring);
+  _async = true;
+  pthread_create(&_flusher, NULL, flusher_thread, this);
+}
+
+
+void Logger::stop_async()
+{
+  if (!_async)
+  {
+    return;
+  }
+
+  // The flusher thread drains the rings one last time before exiting.
+  pthread_mutex_lock(&_lock);
+  _flusher_stop = true;
+  pthread_cond_signal(&_flusher_cond);
+  pthread_mutex_unlock(&_lock);
+  pthread_join(_flusher, NULL);
+
+  _async = false;
+  pthread_key_delete(_ring_key);
+  for (size_t ii = 0; ii < _rings.size(); ++ii)
+  {
+    delete _rings[ii];
+  }
+  _rings.clear();
+}
+
+
+/// Returns the calling thread's ring, creating it on first use.
+Logger::Ring* Logger::get_ring()
+{
+  Ring* ring = (Ring*)pthread_getspecific(_ring_key);
+  if (ring == NULL)
+  {
+    ring = new Ring(_ring_size);
+    pthread_mutex_lock(&_lock);
+    _rings.push_back(ring);
+    pthread_mutex_unlock(&_lock);
+    pthread_setspecific(_ring_key, ring);
+  }
+  return ring;
+}
+
+
+/// Called when a thread with a ring exits.  The flusher thread frees the
+/// ring once it has been drained.
+void Logger::release_ring(void* ring)
+{
+  ((Ring*)ring)->closed.store(true, std::memory_order_release);
+}
+
+
+void* Logger::flusher_thread(void* p)
+{
+  ((Logger*)p)->flusher();
+  return NULL;
+}
+
+
+void Logger::flusher()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_flusher_stop)
+  {
+    drain_all();
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_nsec -= 1000000000L;
+      deadline.tv_sec += 1;
+    }
+    pthread_cond_timedwait(&_flusher_cond, &_lock, &deadline);
+  }
+
+  drain_all();
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+/// Write an array of iovecs in full, coping with partial writes.
+static void write_iov(int fd, struct iovec* iov, int iovcnt)
+{
+  while (iovcnt > 0)
+  {
+    ssize_t written = writev(fd, iov, iovcnt);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break; // LCOV_EXCL_LINE
+    }
+
+    while ((iovcnt > 0) && ((size_t)written >= iov->iov_len))
+    {
+      written -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+
+/// Write out the lines in a ring, in batches of up to IOV_BATCH iovecs per
+/// writev call.  Must be called with the lock held.
+bool Logger::drain(Ring* ring)
+{
+  struct iovec iov[IOV_BATCH];
+  char timestamps[IOV_BATCH / 2][TIMESTAMP_SIZE];
+  size_t tail = ring->tail.load(std::memory_order_relaxed);
+  size_t head = ring->head.load(std::memory_order_acquire);
+  bool drained = (tail != head);
+
+  while (tail != head)
+  {
+    int iovcnt = 0;
+    int lines = 0;
+    size_t pos = tail;
+
+    while ((pos != head) && (iovcnt + 2 <= IOV_BATCH))
+    {
+      Ring::Header* hdr = ring->header(pos);
+      if (hdr->len == Ring::PADDING)
+      {
+        pos += ring->capacity - (pos % ring->capacity);
+        continue;
+      }
+
+      struct tm dt;
+      gmtime_r(&hdr->ts.tv_sec, &dt);
+      if ((_rotate) && ((hours(&dt) > _last_hour) || (_fd == NULL)))
+      {
+        // This line goes in a new file, so write out what we have so far
+        // before switching.
+        if (iovcnt > 0)
+        {
+          break;
+        }
+        rotate(&dt);
+      }
+
+      if (hdr->flags & ADD_TIMESTAMPS)
+      {
+        iov[iovcnt].iov_base = timestamps[lines];
+        iov[iovcnt].iov_len = format_timestamp(timestamps[lines], TIMESTAMP_SIZE, &hdr->ts, &dt);
+        ++iovcnt;
+      }
+      iov[iovcnt].iov_base = hdr + 1;
+      iov[iovcnt].iov_len = hdr->len;
+      ++iovcnt;
+      ++lines;
+      pos += Ring::record_size(hdr->len);
+    }
+
+    if ((iovcnt > 0) && (_fd != NULL))
+    {
+      write_iov(fileno(_fd), iov, iovcnt);
+    }
+
+    tail = pos;
+    ring->tail.store(tail, std::memory_order_release);
+  }
+
+  return drained;
+}
+
+
+/// Drain all the rings, free those whose threads have exited, and report
+/// any lines that were dropped.  Must be called with the lock held.
+void Logger::drain_all()
+{
+  for (std::vector<Ring*>::iterator it = _rings.begin(); it != _rings.end(); )
+  {
+    Ring* ring = *it;
+    bool closed = ring->closed.load(std::memory_order_acquire);
+    drain(ring);
+    if (closed)
+    {
+      delete ring;
+      it = _rings.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+
+  unsigned long dropped = _dropped.load();
+  if ((dropped != _reported_dropped) && (_fd != NULL))
+  {
+    struct timespec ts;
+    gettime(&ts);
+    struct tm dt;
+    gmtime_r(&ts.tv_sec, &dt);
+    char line[TIMESTAMP_SIZE + 100];
+    int len = format_timestamp(line, sizeof(line), &ts, &dt);
+    len += snprintf(line + len, sizeof(line) - len,
+                    "Warning logger.cpp: %lu log lines dropped, %lu in total\n",
+                    dropped - _reported_dropped, dropped);
+    struct iovec iov = {line, (size_t)len};
+    write_iov(fileno(_fd), &iov, 1);
+    _reported_dropped = dropped;
+  }
 }
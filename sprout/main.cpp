@@ -77,6 +77,11 @@ extern "C" {
 #include "pjutils.h"
 #include "log.h"
 #include "zmq_lvc.h"
+#include "histogram.h"
+#include "counter.h"
+#include "statistic.h"
+#include "sas.h"
+#include "sasevent.h"
 
 struct options
 {
@@ -98,18 +103,34 @@ struct options
   std::string            auth_realm;
   std::string            auth_config;
   std::string            sas_server;
+  SAS::Policy            sas_policy;
   std::string            hss_server;
   std::string            xdm_server;
   std::string            store_servers;
+  int                    store_cache_entries;
+  int                    store_cache_ttl_ms;
+  int                    store_io_threads;
+  pj_bool_t              store_binary_aor;
   std::string            enum_server;
   std::string            enum_suffix;
   std::string            enum_file;
   pj_bool_t              analytics_enabled;
   std::string            analytics_directory;
   int                    reg_max_expires;
+  pj_bool_t              expire_bindings;
   int                    pjsip_threads;
   int                    worker_threads;
+  pj_bool_t              lockfree_rx_queue;
+  RxDispatch             rx_dispatch;
+  int                    target_latency_us;
+  int                    max_queue_depth;
+  int                    retry_after;
+  std::string            pjsip_cpus;
+  std::string            worker_cpus;
+  int                    udp_sockets;
+  int                    stats_interval_ms;
   pj_bool_t              log_to_file;
+  pj_bool_t              log_async;
   std::string            log_directory;
   int                    log_level;
   pj_bool_t              interactive;
@@ -117,6 +138,30 @@ struct options
 };
 
 
+// Long options that have no single-character equivalent.
+enum OptionTypes
+{
+  OPT_RX_QUEUE = 256 + 1,
+  OPT_TARGET_LATENCY,
+  OPT_MAX_QUEUE_DEPTH,
+  OPT_RETRY_AFTER,
+  OPT_RX_DISPATCH,
+  OPT_PJSIP_CPUS,
+  OPT_WORKER_CPUS,
+  OPT_UDP_SOCKETS,
+  OPT_LOG_ASYNC,
+  OPT_SAS_SAMPLE,
+  OPT_SAS_TRACE_USERS,
+  OPT_SAS_EVENT_CAPS,
+  OPT_STATS_INTERVAL,
+  OPT_STORE_CACHE,
+  OPT_STORE_CACHE_TTL,
+  OPT_EXPIRE_BINDINGS,
+  OPT_STORE_IO_THREADS,
+  OPT_STORE_BINARY_AOR
+};
+
+
 static pj_bool_t quit_flag = PJ_FALSE;
 
 static void usage(void)
@@ -144,8 +189,31 @@ static void usage(void)
        " -M, --memstore <servers>   Use memcached store on comma-separated list of\n"
        "                            servers for registration state\n"
        "                            (otherwise uses local store)\n"
+       "     --memstore-cache N     Cache up to N AoRs read from the memcached store\n"
+       "                            (default: 0, caching disabled)\n"
+       "     --memstore-cache-ttl N Time (in milliseconds) to use cached AoRs before\n"
+       "                            checking the memcached store for changes\n"
+       "                            (default: 1000)\n"
+       "     --memstore-io-threads N\n"
+       "                            Read from the memcached store on N threads of\n"
+       "                            its own, so worker threads don't wait for it\n"
+       "                            (default: 0, worker threads read the store)\n"
+       "     --memstore-binary-aor  Write registration state to the memcached store\n"
+       "                            in the binary format.  Only set this once every\n"
+       "                            node in the deployment can read the binary\n"
+       "                            format (default: legacy format)\n"
        " -S, --sas <ipv4>           Use specified host as software assurance\n"
        "                            server.  Otherwise uses localhost\n"
+       "     --sas-sample <percent> Percentage of new trails reported to SAS.  Trails\n"
+       "                            that hit an error are always reported from that\n"
+       "                            point on (default: 100)\n"
+       "     --sas-trace-users <users>\n"
+       "                            Comma-separated list of users (the user part of\n"
+       "                            the calling or called URI) whose trails are\n"
+       "                            always reported to SAS\n"
+       "     --sas-event-caps <id>:<N>[,<id>:<N>...]\n"
+       "                            Report at most N events per second with each\n"
+       "                            SAS event ID on sampled trails\n"
        " -H, --hss <server>         Name/IP address of HSS server\n"
        " -X, --xdms <server>        Name/IP address of XDM server\n"
        " -E, --enum <server>        Name/IP address of ENUM server (default: 127.0.0.1)\n"
@@ -153,12 +221,49 @@ static void usage(void)
        " -f, --enum-file <file>     JSON ENUM config file (disables DNS-based ENUM lookup)\n"
        " -r, --reg-max-expires <expiry>\n"
        "                            The maximum allowed registration period (in seconds)\n"
+       "     --expire-bindings      Remove registration bindings from the store as soon\n"
+       "                            as they expire, and deregister users whose last\n"
+       "                            binding expires from their application servers\n"
        " -p, --pjsip_threads N      Number of PJSIP threads (default: 1)\n"
        " -w, --worker_threads N     Number of worker threads (default: 1)\n"
+       "     --rx-queue <type>      Queue used to pass received messages to worker\n"
+       "                            threads, either eventq (default) or lockfree\n"
+       "     --rx-dispatch <mode>   How received messages are shared between worker\n"
+       "                            threads, either shared (default), callid to\n"
+       "                            keep each Call-ID on the same worker thread, or\n"
+       "                            priority to process responses and in-dialog\n"
+       "                            requests ahead of new requests\n"
+       "     --target-latency-us N  Target time (in microseconds) for received messages\n"
+       "                            to wait for a worker thread.  New requests are\n"
+       "                            rejected with 503 while this is exceeded\n"
+       "                            (default: 0, no target)\n"
+       "     --max-queue-depth N    Reject new requests with 503 while N or more\n"
+       "                            messages are waiting for a worker thread\n"
+       "                            (default: 0, no limit)\n"
+       "     --retry-after N        Retry-After value (in seconds) on 503 responses\n"
+       "                            when overloaded (default: 5)\n"
+       "     --pjsip-cpus <cpus>    Bind PJSIP threads to CPUs, specified either as a\n"
+       "                            list of CPUs (for example 0-3,8), one CPU per\n"
+       "                            thread, or as node:<list> to bind each thread to\n"
+       "                            all the CPUs on one NUMA node (default: unbound)\n"
+       "     --worker-cpus <cpus>   Bind worker threads to CPUs, specified in the same\n"
+       "                            way as --pjsip-cpus (default: unbound)\n"
+       "     --udp-sockets N        Number of UDP sockets to open on each listening\n"
+       "                            port, sharing the port with SO_REUSEPORT so the\n"
+       "                            kernel spreads load across them.  Each socket is\n"
+       "                            read by one PJSIP thread.  0 opens one per PJSIP\n"
+       "                            thread (default: 1)\n"
+       "     --stats-interval N     Minimum time (in milliseconds) between publishing\n"
+       "                            changes to statistics.  Changes made in between\n"
+       "                            are coalesced (default: 100)\n"
        " -a, --analytics <directory>\n"
        "                            Generate analytics logs in specified directory\n"
        " -F, --log-file <directory>\n"
        "                            Log to file in specified directory\n"
+       "     --log-async            Write the log file from a background thread, so\n"
+       "                            logging never blocks.  Lines are dropped (and\n"
+       "                            counted) if a thread logs faster than they can\n"
+       "                            be written\n"
        " -L, --log-level N          Set log level to N (default: 4)\n"
        " -d, --daemon               Run as daemon\n"
        " -i, --interactive          Run in foreground with interactive menu\n"
@@ -182,17 +287,35 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
     { "auth",              required_argument, 0, 'A'},
     { "realm",             required_argument, 0, 'R'},
     { "memstore",          required_argument, 0, 'M'},
+    { "memstore-cache",    required_argument, 0, OPT_STORE_CACHE},
+    { "memstore-cache-ttl", required_argument, 0, OPT_STORE_CACHE_TTL},
+    { "memstore-io-threads", required_argument, 0, OPT_STORE_IO_THREADS},
+    { "memstore-binary-aor", no_argument,       0, OPT_STORE_BINARY_AOR},
     { "sas",               required_argument, 0, 'S'},
+    { "sas-sample",        required_argument, 0, OPT_SAS_SAMPLE},
+    { "sas-trace-users",   required_argument, 0, OPT_SAS_TRACE_USERS},
+    { "sas-event-caps",    required_argument, 0, OPT_SAS_EVENT_CAPS},
     { "hss",               required_argument, 0, 'H'},
     { "xdms",              required_argument, 0, 'X'},
     { "enum",              required_argument, 0, 'E'},
     { "enum-suffix",       required_argument, 0, 'x'},
     { "enum-file",         required_argument, 0, 'f'},
     { "reg-max-expires",   required_argument, 0, 'r'},
+    { "expire-bindings",   no_argument,       0, OPT_EXPIRE_BINDINGS},
     { "pjsip-threads",     required_argument, 0, 'p'},
     { "worker-threads",    required_argument, 0, 'w'},
+    { "rx-queue",          required_argument, 0, OPT_RX_QUEUE},
+    { "rx-dispatch",       required_argument, 0, OPT_RX_DISPATCH},
+    { "target-latency-us", required_argument, 0, OPT_TARGET_LATENCY},
+    { "max-queue-depth",   required_argument, 0, OPT_MAX_QUEUE_DEPTH},
+    { "retry-after",       required_argument, 0, OPT_RETRY_AFTER},
+    { "pjsip-cpus",        required_argument, 0, OPT_PJSIP_CPUS},
+    { "worker-cpus",       required_argument, 0, OPT_WORKER_CPUS},
+    { "udp-sockets",       required_argument, 0, OPT_UDP_SOCKETS},
+    { "stats-interval",    required_argument, 0, OPT_STATS_INTERVAL},
     { "analytics",         required_argument, 0, 'a'},
     { "log-file",          required_argument, 0, 'F'},
+    { "log-async",         no_argument,       0, OPT_LOG_ASYNC},
     { "log-level",         required_argument, 0, 'L'},
     { "daemon",            no_argument,       0, 'd'},
     { "interactive",       no_argument,       0, 'i'},
@@ -289,11 +412,66 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
       fprintf(stdout, "Using memcached store on servers %s\n", pj_optarg);
       break;
 
+    case OPT_STORE_CACHE:
+      options->store_cache_entries = atoi(pj_optarg);
+      fprintf(stdout, "Cache up to %d AoRs from memcached store\n", options->store_cache_entries);
+      break;
+
+    case OPT_STORE_CACHE_TTL:
+      options->store_cache_ttl_ms = atoi(pj_optarg);
+      fprintf(stdout, "Memcached store cache TTL set to %dms\n", options->store_cache_ttl_ms);
+      break;
+
+    case OPT_STORE_IO_THREADS:
+      options->store_io_threads = atoi(pj_optarg);
+      fprintf(stdout, "Use %d threads to read from memcached store\n", options->store_io_threads);
+      break;
+
+    case OPT_STORE_BINARY_AOR:
+      options->store_binary_aor = PJ_TRUE;
+      fprintf(stdout, "Write binary format AoRs to memcached store\n");
+      break;
+
     case 'S':
       options->sas_server = std::string(pj_optarg);
       fprintf(stdout, "SAS set to %s\n", pj_optarg);
       break;
 
+    case OPT_SAS_SAMPLE:
+      options->sas_policy.sample_percent = atof(pj_optarg);
+      fprintf(stdout, "Report %g%% of trails to SAS\n", options->sas_policy.sample_percent);
+      break;
+
+    case OPT_SAS_TRACE_USERS:
+      {
+        std::vector<std::string> users;
+        Utils::split_string(std::string(pj_optarg), ',', users, 0, true);
+        options->sas_policy.traced_users.insert(users.begin(), users.end());
+        fprintf(stdout, "Always report trails for users %s to SAS\n", pj_optarg);
+      }
+      break;
+
+    case OPT_SAS_EVENT_CAPS:
+      {
+        std::vector<std::string> caps;
+        Utils::split_string(std::string(pj_optarg), ',', caps, 0, true);
+        for (std::vector<std::string>::iterator i = caps.begin();
+             i != caps.end();
+             ++i)
+        {
+          char* end;
+          unsigned long id = strtoul(i->c_str(), &end, 0);
+          if ((*end != ':') || (end == i->c_str()) || (*(end + 1) == '\0'))
+          {
+            fprintf(stdout, "Invalid SAS event cap %s, must be <id>:<N>\n", i->c_str());
+            return -1;
+          }
+          options->sas_policy.event_caps[(uint32_t)id] = atoi(end + 1);
+        }
+        fprintf(stdout, "SAS event caps set to %s\n", pj_optarg);
+      }
+      break;
+
     case 'H':
       options->hss_server = std::string(pj_optarg);
       fprintf(stdout, "HSS server set to %s\n", pj_optarg);
@@ -338,6 +516,11 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
       }
       break;
 
+    case OPT_EXPIRE_BINDINGS:
+      options->expire_bindings = PJ_TRUE;
+      fprintf(stdout, "Expire registration bindings proactively\n");
+      break;
+
     case 'p':
       options->pjsip_threads = atoi(pj_optarg);
       fprintf(stdout, "Use %d PJSIP threads\n", options->pjsip_threads);
@@ -348,6 +531,79 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
       fprintf(stdout, "Use %d worker threads\n", options->worker_threads);
       break;
 
+    case OPT_RX_QUEUE:
+      if (strcmp(pj_optarg, "lockfree") == 0)
+      {
+        options->lockfree_rx_queue = PJ_TRUE;
+      }
+      else if (strcmp(pj_optarg, "eventq") == 0)
+      {
+        options->lockfree_rx_queue = PJ_FALSE;
+      }
+      else
+      {
+        fprintf(stdout, "Unknown receive queue type %s, must be eventq or lockfree\n", pj_optarg);
+        return -1;
+      }
+      fprintf(stdout, "Receive queue type set to %s\n", pj_optarg);
+      break;
+
+    case OPT_RX_DISPATCH:
+      if (strcmp(pj_optarg, "callid") == 0)
+      {
+        options->rx_dispatch = RX_DISPATCH_CALLID;
+      }
+      else if (strcmp(pj_optarg, "priority") == 0)
+      {
+        options->rx_dispatch = RX_DISPATCH_PRIORITY;
+      }
+      else if (strcmp(pj_optarg, "shared") == 0)
+      {
+        options->rx_dispatch = RX_DISPATCH_SHARED;
+      }
+      else
+      {
+        fprintf(stdout, "Unknown receive dispatch mode %s, must be shared, callid or priority\n", pj_optarg);
+        return -1;
+      }
+      fprintf(stdout, "Receive dispatch mode set to %s\n", pj_optarg);
+      break;
+
+    case OPT_TARGET_LATENCY:
+      options->target_latency_us = atoi(pj_optarg);
+      fprintf(stdout, "Target queueing latency set to %dus\n", options->target_latency_us);
+      break;
+
+    case OPT_MAX_QUEUE_DEPTH:
+      options->max_queue_depth = atoi(pj_optarg);
+      fprintf(stdout, "Maximum receive queue depth set to %d\n", options->max_queue_depth);
+      break;
+
+    case OPT_RETRY_AFTER:
+      options->retry_after = atoi(pj_optarg);
+      fprintf(stdout, "Retry-After on overload set to %ds\n", options->retry_after);
+      break;
+
+    case OPT_PJSIP_CPUS:
+      options->pjsip_cpus = std::string(pj_optarg);
+      fprintf(stdout, "PJSIP thread CPUs set to %s\n", pj_optarg);
+      break;
+
+    case OPT_WORKER_CPUS:
+      options->worker_cpus = std::string(pj_optarg);
+      fprintf(stdout, "Worker thread CPUs set to %s\n", pj_optarg);
+      break;
+
+    case OPT_UDP_SOCKETS:
+      options->udp_sockets = atoi(pj_optarg);
+      fprintf(stdout, "Use %d UDP sockets per port\n", options->udp_sockets);
+      break;
+
+    case OPT_STATS_INTERVAL:
+      options->stats_interval_ms = atoi(pj_optarg);
+      fprintf(stdout, "Minimum statistics interval set to %dms\n", options->stats_interval_ms);
+      break;
+
     case 'a':
       options->analytics_enabled = PJ_TRUE;
       options->analytics_directory = std::string(pj_optarg);
@@ -365,6 +621,11 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
       fprintf(stdout, "Log directory set to %s\n", pj_optarg);
       break;
 
+    case OPT_LOG_ASYNC:
+      options->log_async = PJ_TRUE;
+      fprintf(stdout, "Asynchronous logging enabled\n");
+      break;
+
     case 'd':
       options->daemon = PJ_TRUE;
       break;
@@ -462,7 +723,9 @@ int main(int argc, char *argv[])
   CallServices* call_services = NULL;
   IfcHandler* ifc_handler = NULL;
   AnalyticsLogger* analytics_logger = NULL;
+  Logger* file_logger = NULL;
   EnumService* enum_service = NULL;
+  Histogram* enum_latency_histogram = NULL;
   BgcfService* bgcf_service = NULL;
 
   // Set up our exception signal handler for asserts and segfaults.
@@ -483,6 +746,10 @@ int main(int argc, char *argv[])
   // opt.auth_realm = "";
   // opt.auth_config = "";
   // opt.store_servers = "";
+  opt.store_cache_entries = 0;
+  opt.store_cache_ttl_ms = 1000;
+  opt.store_io_threads = 0;
+  opt.store_binary_aor = PJ_FALSE;
   opt.sas_server = "127.0.0.1";
   // opt.hss_server = "";
   // opt.xdm_server = "";
@@ -490,11 +757,20 @@ int main(int argc, char *argv[])
   opt.enum_suffix = ".e164.arpa";
   // opt.enum_file = "";
   opt.reg_max_expires = 300;
+  opt.expire_bindings = PJ_FALSE;
   opt.pjsip_threads = 1;
   opt.worker_threads = 1;
+  opt.lockfree_rx_queue = PJ_FALSE;
+  opt.rx_dispatch = RX_DISPATCH_SHARED;
+  opt.target_latency_us = 0;
+  opt.max_queue_depth = 0;
+  opt.retry_after = 5;
+  opt.udp_sockets = 1;
+  opt.stats_interval_ms = Statistic::DEFAULT_MIN_INTERVAL_MS;
   opt.analytics_enabled = PJ_FALSE;
   // opt.analytics_directory = "";
   opt.log_to_file = PJ_FALSE;
+  opt.log_async = PJ_FALSE;
   // opt.log_directory = "";
   opt.log_level = 0;
   opt.daemon = PJ_FALSE;
@@ -575,7 +851,12 @@ int main(int argc, char *argv[])
     if (slash_ptr != NULL) {
       prog_name = slash_ptr + 1;
     }
-    Log::setLogger(new Logger(opt.log_directory, prog_name));
+    file_logger = new Logger(opt.log_directory, prog_name);
+    if (opt.log_async)
+    {
+      file_logger->start_async();
+    }
+    Log::setLogger(file_logger);
   }
 
   if (opt.analytics_enabled)
@@ -583,6 +864,13 @@ int main(int argc, char *argv[])
     analytics_logger = new AnalyticsLogger(opt.analytics_directory);
   }
 
+  Statistic::set_min_interval(opt.stats_interval_ms);
+
+  // The SAS policy must be in place before the stack creates any trails.
+  opt.sas_policy.user_markers.insert(SASMarker::CALLING_DN);
+  opt.sas_policy.user_markers.insert(SASMarker::CALLED_DN);
+  SAS::set_policy(opt.sas_policy);
+
   // Initialize the PJSIP stack and associated subsystems.
   status = init_stack(opt.system_name,
                       opt.sas_server,
@@ -593,7 +881,15 @@ int main(int argc, char *argv[])
                       opt.sprout_domain,
                       opt.alias_hosts,
                       opt.pjsip_threads,
-                      opt.worker_threads);
+                      opt.worker_threads,
+                      opt.lockfree_rx_queue,
+                      opt.rx_dispatch,
+                      opt.target_latency_us,
+                      opt.max_queue_depth,
+                      opt.retry_after,
+                      opt.pjsip_cpus,
+                      opt.worker_cpus,
+                      opt.udp_sockets);
 
   if (status != PJ_SUCCESS)
   {
@@ -608,7 +904,13 @@ int main(int argc, char *argv[])
     LOG_STATUS("Using memcached compatible store with ASCII protocol");
     std::list<std::string> servers;
     Utils::split_string(opt.store_servers, ',', servers, 0, true);
-    registrar_store = RegData::create_memcached_store(servers, 100, false);
+    registrar_store = RegData::create_memcached_store(servers,
+                                                      100,
+                                                      false,
+                                                      opt.store_cache_entries,
+                                                      opt.store_cache_ttl_ms,
+                                                      opt.store_io_threads,
+                                                      opt.store_binary_aor);
   }
   else
   {
@@ -623,6 +925,15 @@ int main(int argc, char *argv[])
     exit(0);
   }
 
+  // Track the round trip times of requests to the registration store, and
+  // how often writes conflict with another update.
+  Histogram* store_get_latency_histogram = new StatisticHistogram("store_get_latency_us");
+  Histogram* store_set_latency_histogram = new StatisticHistogram("store_set_latency_us");
+  Counter* store_conflict_counter = new StatisticCounter("store_conflicts");
+  registrar_store->set_latency_histograms(store_get_latency_histogram,
+                                          store_set_latency_histogram);
+  registrar_store->set_conflict_counter(store_conflict_counter);
+
   if (opt.hss_server != "")
   {
     // Create a connection to the HSS.
@@ -665,6 +976,8 @@ int main(int argc, char *argv[])
     {
       enum_service = new DNSEnumService(opt.enum_server, opt.enum_suffix);
     }
+    enum_latency_histogram = new StatisticHistogram("enum_latency_us");
+    enum_service->set_latency_histogram(enum_latency_histogram);
     bgcf_service = new BgcfService();
   }
 
@@ -691,13 +1004,23 @@ int main(int argc, char *argv[])
 
   // An edge proxy doesn't handle registrations, it passes them through.
   pj_bool_t registrar_enabled = !opt.edge_proxy;
+  BindingExpirer* binding_expirer = NULL;
   if (registrar_enabled)
   {
+    if (opt.expire_bindings)
+    {
+      binding_expirer = new BindingExpirer(registrar_store,
+                                           ifc_handler,
+                                           stack_data.pool);
+      binding_expirer->init();
+    }
+
     status = init_registrar(registrar_store,
                             hss_connection,
                             analytics_logger,
                             ifc_handler,
-                            opt.reg_max_expires);
+                            opt.reg_max_expires,
+                            binding_expirer);
     if (status != PJ_SUCCESS)
     {
       LOG_ERROR("Error initializing registrar, %s",
@@ -765,6 +1088,13 @@ int main(int argc, char *argv[])
     }
   }
 
+  // Stop expiring bindings before the stack, since deregistering an expired
+  // user from its application servers sends requests through the stack.
+  if (binding_expirer != NULL)
+  {
+    binding_expirer->stop();
+  }
+
   stop_stack();
   // We must unregister stack modules here because this terminates the
   // transaction layer, which can otherwise generate work for other modules
@@ -773,6 +1103,7 @@ int main(int argc, char *argv[])
   if (registrar_enabled)
   {
     destroy_registrar();
+    delete binding_expirer;
   }
   if (websockets_enabled)
   {
@@ -791,6 +1122,7 @@ int main(int argc, char *argv[])
   delete hss_connection;
   delete xdm_connection;
   delete enum_service;
+  delete enum_latency_histogram;
   delete bgcf_service;
 
   if (opt.store_servers != "")
@@ -802,6 +1134,16 @@ int main(int argc, char *argv[])
     RegData::destroy_local_store(registrar_store);
   }
 
+  delete store_get_latency_histogram;
+  delete store_set_latency_histogram;
+  delete store_conflict_counter;
+
+  if (file_logger != NULL)
+  {
+    // Write out anything still queued for the log file.
+    file_logger->stop_async();
+  }
+
   return 0;
 }
 
@@ -50,8 +50,13 @@
 #include <iomanip>
 #include <algorithm>
 #include <time.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "memcachedstorefactory.h"
+#include "aorcache.h"
+#include "histogram.h"
+#include "counter.h"
 #include "log.h"
 
 namespace RegData {
@@ -66,10 +71,20 @@ RegData::Store* create_memcached_store(const std::list<std::string>& servers,
                                        int connections,
                                        ///< size of pool (used as init and
                                        /// max)
-                                       bool binary)
+                                       bool binary,
                                        ///< use binary protocol?
+                                       int cache_entries,
+                                       ///< AoRs to cache, 0 to disable
+                                       int cache_ttl_ms,
+                                       ///< time to use cached AoRs without
+                                       /// checking memcached
+                                       int io_threads,
+                                       ///< threads to service asynchronous
+                                       /// gets, 0 to get synchronously
+                                       bool binary_aor)
+                                       ///< write AoRs in the binary format?
 {
-  return new MemcachedStore(servers, connections, binary);
+  return new MemcachedStore(servers, connections, binary, cache_entries, cache_ttl_ms, io_threads, binary_aor);
 }
 
 /// Destroy a store object which used the memcached implementation.
@@ -87,8 +102,21 @@ MemcachedStore::MemcachedStore(const std::list<std::string>& servers,
                                ///< list of servers to be used
                                int pool_size,
                                ///< size of pool (used as init and max)
-                               bool binary)
+                               bool binary,
                                ///< use binary protocol?
+                               int cache_entries,
+                               ///< AoRs to cache, 0 to disable
+                               int cache_ttl_ms,
+                               ///< time to use cached AoRs without
+                               /// checking memcached
+                               int io_threads,
+                               ///< threads to service asynchronous gets,
+                               /// 0 to get synchronously
+                               bool binary_aor) :
+                               ///< write AoRs in the binary format?  Only
+                               /// set once every node can read it.
+  _pending(NULL),
+  _binary_aor(binary_aor)
 {
   // Create the options string to connect to the servers.
   std::string options;
@@ -114,10 +142,57 @@ MemcachedStore::MemcachedStore(const std::list<std::string>& servers,
     LOG_ERROR("Failed to connected to memcached store: %s", options.c_str());
     // LCOV_EXCL_STOP
   }
+
+  _cache = (cache_entries > 0) ? new AoRCache(cache_entries, cache_ttl_ms) : NULL;
+
+  if (io_threads > 0)
+  {
+    // Start the threads that service asynchronous gets.  Each has its own
+    // connection while it fetches, so there must be enough connections in
+    // the pool for them as well as the synchronous callers.
+    _pending = new eventq<PendingGet>();
+    for (int ii = 0; ii < io_threads; ++ii)
+    {
+      pthread_t thread;
+      int rc = pthread_create(&thread, NULL, &io_thread, (void*)this);
+      if (rc != 0)
+      {
+        // LCOV_EXCL_START
+        LOG_ERROR("Failed to create memcached I/O thread, %s", strerror(rc));
+        break;
+        // LCOV_EXCL_STOP
+      }
+      _io_threads.push_back(thread);
+    }
+  }
 }
 
 MemcachedStore::~MemcachedStore()
 {
+  if (_pending != NULL)
+  {
+    // Stop the I/O threads, then fail any gets they didn't get to.
+    _pending->terminate();
+    for (size_t ii = 0; ii < _io_threads.size(); ++ii)
+    {
+      pthread_join(_io_threads[ii], NULL);
+    }
+
+    while (true)
+    {
+      PendingGet get;
+      get.callback = NULL;
+      _pending->pop(get, 0);
+      if (get.callback == NULL)
+      {
+        break;
+      }
+      get.callback->get_complete(get.aor_id, NULL);
+    }
+    delete _pending;
+  }
+
+  delete _cache;
   memcached_pool_destroy(_pool);
 }
 
@@ -139,6 +214,11 @@ void MemcachedStore::flush_all()
     rc = memcached_flush(st, 0);
     memcached_pool_release(_pool, st);
   }
+
+  if (_cache != NULL)
+  {
+    _cache->clear();
+  }
 }
 
 // LCOV_EXCL_START - need real memcached to test
@@ -150,6 +230,19 @@ AoR* MemcachedStore::get_aor_data(const std::string& aor_id)
 {
   memcached_return_t rc;
   MemcachedAoR* aor_data = NULL;
+  uint64_t cached_cas = 0;
+
+  if (_cache != NULL)
+  {
+    // Use the cached copy if it's recent enough.
+    aor_data = _cache->get(aor_id, cached_cas);
+    if (aor_data != NULL)
+    {
+      int now = time(NULL);
+      expire_bindings(aor_data, now);
+      return (AoR*)aor_data;
+    }
+  }
 
   // Try to get a connection
   struct timespec wait_time;
@@ -162,20 +255,25 @@ AoR* MemcachedStore::get_aor_data(const std::string& aor_id)
     // Got one: use it.
     const char* key_ptr = aor_id.data();
     const size_t key_len = aor_id.length();
-    rc = memcached_mget(st, &key_ptr, &key_len, 1);
-    if (memcached_success(rc))
+    memcached_return_t fetch_rc = MEMCACHED_FAILURE;
+    memcached_result_st result;
     {
-      memcached_result_st result;
-      memcached_result_create(st, &result);
-      memcached_fetch_result(st, &result, &rc);
-
+      // Time the round trip to the server, but not the deserialization.
+      Histogram::Timer timer(_get_latency_histogram);
+      rc = memcached_mget(st, &key_ptr, &key_len, 1);
       if (memcached_success(rc))
       {
-        aor_data = deserialize_aor(std::string(memcached_result_value(&result), memcached_result_length(&result)));
-        aor_data->set_cas(memcached_result_cas(&result));
+        memcached_result_create(st, &result);
+        memcached_fetch_result(st, &result, &fetch_rc);
+      }
+    }
+
+    if (memcached_success(rc))
+    {
+      if (memcached_success(fetch_rc))
+      {
+        aor_data = decode_result(aor_id, &result, cached_cas);
         memcached_result_free(&result);
-        int now = time(NULL);
-        expire_bindings(aor_data, now);
       }
       else
       {
@@ -200,6 +298,265 @@ AoR* MemcachedStore::get_aor_data(const std::string& aor_id)
   return (AoR*)aor_data;
 }
 
+/// Retrieve the AoR data for several SIP URIs, with a single multi-get for
+/// all those not in the cache, decoding each AoR as its result arrives.
+/// Returns the AoRs in the same order as the URIs.  An entry is NULL if
+/// that AoR couldn't be read, for example because we can't get a
+/// connection.
+std::vector<AoR*> MemcachedStore::get_aor_data_multi(const std::vector<std::string>& aor_ids)
+                                                     ///< the SIP URIs
+{
+  memcached_return_t rc = MEMCACHED_SUCCESS;
+  std::vector<AoR*> aors(aor_ids.size(), (AoR*)NULL);
+
+  // Find where the first request for each AoR is, and which AoRs we need
+  // to fetch from memcached, along with the CAS of any older copy in the
+  // cache.
+  std::map<std::string, size_t> first;
+  std::map<std::string, uint64_t> pending;
+  std::vector<const char*> keys;
+  std::vector<size_t> key_lengths;
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    if (first.insert(std::make_pair(aor_ids[ii], ii)).second)
+    {
+      MemcachedAoR* aor_data = NULL;
+      uint64_t cached_cas = 0;
+      if (_cache != NULL)
+      {
+        aor_data = _cache->get(aor_ids[ii], cached_cas);
+      }
+
+      if (aor_data != NULL)
+      {
+        int now = time(NULL);
+        expire_bindings(aor_data, now);
+        aors[ii] = (AoR*)aor_data;
+      }
+      else
+      {
+        pending[aor_ids[ii]] = cached_cas;
+        keys.push_back(aor_ids[ii].data());
+        key_lengths.push_back(aor_ids[ii].length());
+      }
+    }
+  }
+
+  if (!keys.empty())
+  {
+    // Try to get a connection
+    struct timespec wait_time;
+    wait_time.tv_sec = 0;
+    wait_time.tv_nsec = 100 * 1000 * 1000;
+    memcached_st* st = memcached_pool_fetch(_pool, &wait_time, &rc);
+
+    if (st != NULL)
+    {
+      // Time the whole batch as a single round trip.  This includes
+      // decoding, as the results are decoded as they arrive.
+      Histogram::Timer timer(_get_latency_histogram);
+      rc = memcached_mget(st, &keys[0], &key_lengths[0], keys.size());
+      if (memcached_success(rc))
+      {
+        memcached_return_t fetch_rc;
+        memcached_result_st result;
+        memcached_result_create(st, &result);
+        while (memcached_fetch_result(st, &result, &fetch_rc) != NULL)
+        {
+          std::string aor_id(memcached_result_key_value(&result),
+                             memcached_result_key_length(&result));
+          std::map<std::string, uint64_t>::iterator i = pending.find(aor_id);
+          if (i != pending.end())
+          {
+            aors[first[aor_id]] = (AoR*)decode_result(aor_id, &result, i->second);
+            pending.erase(i);
+          }
+        }
+        memcached_result_free(&result);
+
+        if ((fetch_rc != MEMCACHED_END) && (!memcached_success(fetch_rc)))
+        {
+          LOG_ERROR("memcached_fetch_result failed, rc = %d (%s)",
+                    fetch_rc,
+                    memcached_strerror(st, fetch_rc));
+        }
+        else
+        {
+          // Any AoRs not returned don't exist yet, so create them.
+          for (std::map<std::string, uint64_t>::const_iterator i = pending.begin();
+               i != pending.end();
+               ++i)
+          {
+            aors[first[i->first]] = (AoR*)new MemcachedAoR();
+          }
+        }
+      }
+      else
+      {
+        LOG_ERROR("memcached_mget command failed, rc = %d (%s)",
+                  rc,
+                  memcached_strerror(st, rc));
+      }
+      memcached_pool_release(_pool, st);
+    }
+    else
+    {
+      LOG_ERROR("Failed to get memcached_st for get_aor_data_multi, %d", rc);
+    }
+  }
+
+  // Give any repeated requests for the same AoR their own copy.
+  for (size_t ii = 0; ii < aor_ids.size(); ++ii)
+  {
+    size_t jj = first[aor_ids[ii]];
+    if ((jj != ii) && (aors[jj] != NULL))
+    {
+      aors[ii] = (AoR*)new MemcachedAoR(*(MemcachedAoR*)aors[jj]);
+    }
+  }
+
+  return aors;
+}
+
+/// Decode an AoR from a memcached result, or use the cached copy if it has
+/// the same CAS, and expire any old bindings.  Returns NULL if the result
+/// can't be decoded.
+MemcachedAoR* MemcachedStore::decode_result(const std::string& aor_id,
+                                            memcached_result_st* result,
+                                            uint64_t cached_cas)
+{
+  MemcachedAoR* aor_data = NULL;
+  uint64_t cas = memcached_result_cas(result);
+
+  if (cached_cas != 0)
+  {
+    // We have an older copy cached, which we can use if the data hasn't
+    // changed since.
+    aor_data = _cache->validate(aor_id, cas);
+  }
+
+  if (aor_data == NULL)
+  {
+    // Decode straight from the result buffer.
+    aor_data = deserialize_aor(memcached_result_value(result),
+                               memcached_result_length(result));
+    if (aor_data != NULL)
+    {
+      aor_data->set_cas(cas);
+      if (_cache != NULL)
+      {
+        _cache->put(aor_id, aor_data);
+      }
+    }
+  }
+
+  if (aor_data != NULL)
+  {
+    int now = time(NULL);
+    expire_bindings(aor_data, now);
+  }
+
+  return aor_data;
+}
+
+/// Get the data for an address of record without waiting for memcached.
+/// Returns true with the data if it is in the cache and fresh enough to
+/// use.  Otherwise queues the get for the I/O threads and returns false,
+/// and the callback is called from an I/O thread with the result.
+bool MemcachedStore::get_aor_data_async(const std::string& aor_id,
+                                        ///< the SIP URI
+                                        GetCallback* callback,
+                                        ///< called with the result if it
+                                        /// isn't available straight away
+                                        AoR*& aor_data)
+                                        ///< the result, if available
+                                        /// straight away
+{
+  if (_pending == NULL)
+  {
+    // No I/O threads, so just get the data now.
+    aor_data = get_aor_data(aor_id);
+    return true;
+  }
+
+  if (_cache != NULL)
+  {
+    uint64_t cached_cas;
+    MemcachedAoR* cached = _cache->get(aor_id, cached_cas);
+    if (cached != NULL)
+    {
+      int now = time(NULL);
+      expire_bindings(cached, now);
+      aor_data = (AoR*)cached;
+      return true;
+    }
+  }
+
+  PendingGet get;
+  get.aor_id = aor_id;
+  get.callback = callback;
+  _pending->push(get);
+  return false;
+}
+
+/// Service the asynchronous gets.  Each thread waits for a get, then takes
+/// any others that have been queued meanwhile (up to a batch), and fetches
+/// them with a single multi-get, so many gets share each round trip.
+void* MemcachedStore::io_thread(void* p)
+{
+  MemcachedStore* store = (MemcachedStore*)p;
+  std::vector<PendingGet> gets;
+  PendingGet get;
+
+  bool running = true;
+  while (running)
+  {
+    get.callback = NULL;
+    running = store->_pending->pop(get);
+    if (get.callback == NULL)
+    {
+      continue;
+    }
+    gets.push_back(get);
+
+    while ((int)gets.size() < IO_BATCH_SIZE)
+    {
+      // Take another get if there is one waiting, without blocking.
+      get.callback = NULL;
+      store->_pending->pop(get, 0);
+      if (get.callback == NULL)
+      {
+        break;
+      }
+      gets.push_back(get);
+    }
+
+    store->complete_gets(gets);
+    gets.clear();
+  }
+
+  return NULL;
+}
+
+/// Fetch a batch of queued gets, and pass each result to its callback.
+void MemcachedStore::complete_gets(std::vector<PendingGet>& gets)
+{
+  std::vector<std::string> aor_ids;
+  aor_ids.reserve(gets.size());
+  for (size_t ii = 0; ii < gets.size(); ++ii)
+  {
+    aor_ids.push_back(gets[ii].aor_id);
+  }
+
+  std::vector<AoR*> aors = get_aor_data_multi(aor_ids);
+  LOG_DEBUG("Completed %d asynchronous gets", (int)gets.size());
+
+  for (size_t ii = 0; ii < gets.size(); ++ii)
+  {
+    gets[ii].callback->get_complete(gets[ii].aor_id, aors[ii]);
+  }
+}
+
 /// Update the data for a particular address of record.  Writes the data
 /// atomically.  If the underlying data has changed since it was last
 /// read, the update is rejected and this returns false; if the update
@@ -230,20 +587,50 @@ bool MemcachedStore::set_aor_data(const std::string& aor_id,
     // may cause concurrency problems because memcached does not support
     // cas on delete operations.  In this case we do a memcached_cas with
     // an effectively immediate expiry time.
+    //
+    // The latest expiry time of the bindings also goes in the item's flags,
+    // whichever format the AoR is written in, so has_active_bindings can
+    // answer without decoding it.  Readers that don't know about this
+    // ignore the flags.
     int now = time(NULL);
     int max_expires = expire_bindings(aor_data, now);
-    std::string value = serialize_aor(aor_data);
-    if (aor_data->get_cas() == 0)
+    uint32_t flags = (uint32_t)max_expires;
+    std::string value = serialize(aor_data);
+    {
+      // Time the round trip to the server.
+      Histogram::Timer timer(_set_latency_histogram);
+      if (aor_data->get_cas() == 0)
+      {
+        // New record, so attempt to add.  This will fail if someone else
+        // gets there first.
+        rc = memcached_add(st, aor_id.data(), aor_id.length(), value.data(), value.length(), max_expires, flags);
+      }
+      else
+      {
+        // This is an update to an existing record, so use memcached_cas
+        // to make sure it is atomic.
+        rc = memcached_cas(st, aor_id.data(), aor_id.length(), value.data(), value.length(), max_expires, flags, aor_data->get_cas());
+      }
+    }
+
+    if (((rc == MEMCACHED_DATA_EXISTS) || (rc == MEMCACHED_NOTSTORED)) &&
+        (_conflict_counter != NULL))
     {
-      // New record, so attempt to add.  This will fail if someone else
-      // gets there first.
-      rc = memcached_add(st, aor_id.data(), aor_id.length(), value.data(), value.length(), max_expires, 0);
+      // Someone else updated the record since we read it, so the caller
+      // will have to read it again and retry.
+      _conflict_counter->increment();
     }
-    else
+
+    if (_cache != NULL)
     {
-      // This is an update to an existing record, so use memcached_cas
-      // to make sure it is atomic.
-      rc = memcached_cas(st, aor_id.data(), aor_id.length(), value.data(), value.length(), max_expires, 0, aor_data->get_cas());
+      // The cached copy is now out of date whether or not the write
+      // succeeded.  If it failed because someone else updated the record,
+      // the caller may have been working from the cached copy, so the
+      // cache checks whether that was stale.
+      _cache->invalidate(aor_id,
+                         ((rc == MEMCACHED_DATA_EXISTS) ||
+                          (rc == MEMCACHED_NOTSTORED)) ?
+                           aor_data->get_cas() : 0);
     }
 
     if (!memcached_success(rc))
@@ -265,10 +652,448 @@ bool MemcachedStore::set_aor_data(const std::string& aor_id,
   return memcached_success(rc);
 }
 
+/// Find out whether an AoR has any unexpired bindings.  The item's flags
+/// (or failing that the header of a binary format AoR) record the latest
+/// expiry time of its bindings, so this only has to decode the bindings if
+/// the AoR was written before either of those was added.  Returns false if
+/// we can't get a connection.
+bool MemcachedStore::has_active_bindings(const std::string& aor_id)
+                                         ///< the SIP URI
+{
+  memcached_return_t rc;
+  int now = time(NULL);
+  int max_expires = -1;
+
+  if ((_cache != NULL) && (_cache->get_max_expires(aor_id, max_expires)))
+  {
+    return (max_expires > now);
+  }
+
+  // Try to get a connection
+  struct timespec wait_time;
+  wait_time.tv_sec = 0;
+  wait_time.tv_nsec = 100 * 1000 * 1000;
+  memcached_st* st = memcached_pool_fetch(_pool, &wait_time, &rc);
+
+  if (st != NULL)
+  {
+    const char* key_ptr = aor_id.data();
+    const size_t key_len = aor_id.length();
+    memcached_return_t fetch_rc = MEMCACHED_FAILURE;
+    memcached_result_st result;
+    {
+      Histogram::Timer timer(_get_latency_histogram);
+      rc = memcached_mget(st, &key_ptr, &key_len, 1);
+      if (memcached_success(rc))
+      {
+        memcached_result_create(st, &result);
+        memcached_fetch_result(st, &result, &fetch_rc);
+      }
+    }
+
+    if (memcached_success(rc))
+    {
+      if (memcached_success(fetch_rc))
+      {
+        const char* value = memcached_result_value(&result);
+        size_t length = memcached_result_length(&result);
+        uint32_t flags = memcached_result_flags(&result);
+        max_expires = (flags != 0) ? (int)flags : read_max_expires(value, length);
+        if (max_expires < 0)
+        {
+          // The header doesn't say, so we have to look at the bindings.
+          MemcachedAoR* aor_data = deserialize_aor(value, length);
+          if (aor_data != NULL)
+          {
+            // This returns now if there are no unexpired bindings.
+            max_expires = expire_bindings(aor_data, now);
+            delete aor_data;
+          }
+        }
+        memcached_result_free(&result);
+      }
+    }
+    else
+    {
+      LOG_ERROR("memcached_mget command failed, rc = %d (%s)",
+                rc,
+                memcached_strerror(st, rc));
+    }
+    memcached_pool_release(_pool, st);
+  }
+  else
+  {
+    LOG_ERROR("Failed to get memcached_st for has_active_bindings, %d", rc);
+  }
+
+  return (max_expires > now);
+}
+
 // LCOV_EXCL_STOP
 
+// The binary AoR format is
+//
+//   magic      2 bytes, 0xFF 0xAC
+//   version    1 byte
+//   header     varint length, then that many bytes of header fields, each
+//              a varint tag followed by a varint value
+//   bindings   varint count, then for each binding
+//                id, uri, cid          strings
+//                cseq, expires, priority
+//                                      signed varints
+//                params                varint count, then name and value
+//                                      strings for each
+//                path headers          varint count, then strings
+//
+// Strings are a varint length followed by the bytes, and varints are
+// little-endian base 128, with signed values zigzag-encoded first.
+//
+// The header fields are
+//
+//   1          max expires, the latest expiry time of any of the bindings,
+//              so readers can tell whether the AoR has any unexpired
+//              bindings without reading them
+//
+// Readers skip any header fields they don't understand, so fields can be
+// added to the header without changing the version.  The version only
+// changes for incompatible changes.
+//
+// Values in the legacy format start with a host-endian binding count, which
+// would have to be implausibly large to begin with the magic bytes.
+static const unsigned char AOR_MAGIC_0 = 0xFF;
+static const unsigned char AOR_MAGIC_1 = 0xAC;
+static const unsigned char AOR_VERSION = 1;
+static const uint64_t AOR_HEADER_MAX_EXPIRES = 1;
+
+static inline void encode_varint(std::string& s, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    s.push_back((char)((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  s.push_back((char)value);
+}
+
+static inline void encode_int(std::string& s, int value)
+{
+  int64_t v = value;
+  encode_varint(s, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static inline void encode_string(std::string& s, const std::string& value)
+{
+  encode_varint(s, value.length());
+  s.append(value);
+}
+
+/// Reads values in the binary AoR format directly from a buffer.  Reading
+/// past the end of the buffer, or a varint that's too long, marks the
+/// reader as failed, after which every read returns zero or empty.
+class AoRReader
+{
+public:
+  AoRReader(const char* data, size_t length) :
+    _p((const unsigned char*)data),
+    _end((const unsigned char*)data + length),
+    _ok(true)
+  {
+  }
+
+  inline bool ok() const { return _ok; }
+  inline size_t remaining() const { return _end - _p; }
+  inline const char* data() const { return (const char*)_p; }
+
+  inline uint64_t varint()
+  {
+    uint64_t value = 0;
+    for (int shift = 0; (_ok) && (shift < 64); shift += 7)
+    {
+      if (_p == _end)
+      {
+        break;
+      }
+      unsigned char byte = *_p++;
+      value |= (uint64_t)(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0)
+      {
+        return value;
+      }
+    }
+    _ok = false;
+    return 0;
+  }
+
+  inline int integer()
+  {
+    uint64_t v = varint();
+    return (int)(int64_t)((v >> 1) ^ (~(v & 1) + 1));
+  }
+
+  /// Read a count of items, each of which takes at least one byte, so a
+  /// corrupt count can't make the caller allocate vast numbers of them.
+  inline uint64_t count()
+  {
+    uint64_t value = varint();
+    if (value > remaining())
+    {
+      _ok = false;
+      value = 0;
+    }
+    return value;
+  }
+
+  inline void string(std::string& value)
+  {
+    uint64_t length = varint();
+    if ((_ok) && (length <= remaining()))
+    {
+      value.assign((const char*)_p, length);
+      _p += length;
+    }
+    else
+    {
+      _ok = false;
+      value.clear();
+    }
+  }
+
+  inline void skip(uint64_t length)
+  {
+    if ((_ok) && (length <= remaining()))
+    {
+      _p += length;
+    }
+    else
+    {
+      _ok = false;
+    }
+  }
+
+  inline unsigned char byte()
+  {
+    if ((_ok) && (_p != _end))
+    {
+      return *_p++;
+    }
+    _ok = false;
+    return 0;
+  }
+
+private:
+  const unsigned char* _p;
+  const unsigned char* const _end;
+  bool _ok;
+};
+
+/// Returns true if the data is in the binary format rather than the legacy
+/// format.
+static inline bool is_binary_aor(const char* data, size_t length)
+{
+  return ((length >= 3) &&
+          ((unsigned char)data[0] == AOR_MAGIC_0) &&
+          ((unsigned char)data[1] == AOR_MAGIC_1));
+}
+
+/// Reads the version and header of an AoR in the binary format, leaving the
+/// reader at the bindings.  Returns false if the version is one we can't
+/// read.  Fields not in the header are left unchanged.
+static bool read_header(AoRReader& reader, int& max_expires)
+{
+  unsigned char version = reader.byte();
+  if (version != AOR_VERSION)
+  {
+    LOG_DEBUG("Can't read AoR in format version %d", version);
+    return false;
+  }
+
+  uint64_t header_length = reader.varint();
+  if ((!reader.ok()) || (header_length > reader.remaining()))
+  {
+    return false;
+  }
+
+  AoRReader header(reader.data(), header_length);
+  reader.skip(header_length);
+  while ((header.ok()) && (header.remaining() > 0))
+  {
+    uint64_t tag = header.varint();
+    uint64_t value = header.varint();
+    if ((tag == AOR_HEADER_MAX_EXPIRES) && (header.ok()))
+    {
+      max_expires = (int)value;
+    }
+  }
+
+  return header.ok();
+}
+
+/// Serialize the contents of an AoR in the format this store writes.  The
+/// legacy format is the default so that, during an upgrade, nodes still
+/// running an earlier release can read what this one writes.
+std::string MemcachedStore::serialize(MemcachedAoR* aor_data) const
+{
+  return _binary_aor ? serialize_aor(aor_data) : serialize_legacy_aor(aor_data);
+}
+
 /// Serialize the contents of an AoR.
 std::string MemcachedStore::serialize_aor(MemcachedAoR* aor_data)
+{
+  // Work out roughly how big the result will be so we only allocate once.
+  // The fixed size covers the magic, version, header, counts and integers
+  // with room to spare, and each string gets a few bytes for its length.
+  // Also find the latest expiry time for the header.
+  size_t size = 24;
+  int max_expires = 0;
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    AoR::Binding* b = i->second;
+    if (b->_expires > max_expires)
+    {
+      max_expires = b->_expires;
+    }
+    size += 32 + i->first.length() + b->_uri.length() + b->_cid.length();
+    for (std::list<std::pair<std::string, std::string> >::const_iterator j = b->_params.begin();
+         j != b->_params.end();
+         ++j)
+    {
+      size += 6 + j->first.length() + j->second.length();
+    }
+    for (std::list<std::string>::const_iterator j = b->_path_headers.begin();
+         j != b->_path_headers.end();
+         ++j)
+    {
+      size += 3 + j->length();
+    }
+  }
+
+  std::string s;
+  s.reserve(size);
+  s.push_back((char)AOR_MAGIC_0);
+  s.push_back((char)AOR_MAGIC_1);
+  s.push_back((char)AOR_VERSION);
+
+  std::string header;
+  encode_varint(header, AOR_HEADER_MAX_EXPIRES);
+  encode_varint(header, max_expires);
+  encode_string(s, header);
+
+  encode_varint(s, aor_data->bindings().size());
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    AoR::Binding* b = i->second;
+    encode_string(s, i->first);
+    encode_string(s, b->_uri);
+    encode_string(s, b->_cid);
+    encode_int(s, b->_cseq);
+    encode_int(s, b->_expires);
+    encode_int(s, b->_priority);
+
+    encode_varint(s, b->_params.size());
+    for (std::list<std::pair<std::string, std::string> >::const_iterator j = b->_params.begin();
+         j != b->_params.end();
+         ++j)
+    {
+      encode_string(s, j->first);
+      encode_string(s, j->second);
+    }
+
+    encode_varint(s, b->_path_headers.size());
+    for (std::list<std::string>::const_iterator j = b->_path_headers.begin();
+         j != b->_path_headers.end();
+         ++j)
+    {
+      encode_string(s, *j);
+    }
+  }
+
+  return s;
+}
+
+/// Deserialize the contents of an AoR.
+MemcachedAoR* MemcachedStore::deserialize_aor(const char* data, size_t length)
+{
+  if (!is_binary_aor(data, length))
+  {
+    // Written before the binary format existed.
+    LOG_DEBUG("Reading AoR in legacy format");
+    return deserialize_legacy_aor(std::string(data, length));
+  }
+
+  // We don't need anything from the header, as the bindings hold all the
+  // information it summarises.
+  AoRReader reader(data + 2, length - 2);
+  int max_expires;
+  if (!read_header(reader, max_expires))
+  {
+    LOG_ERROR("Failed to read AoR - unknown format version or corrupt header");
+    return NULL;
+  }
+
+  MemcachedAoR* aor_data = new MemcachedAoR();
+  uint64_t num_bindings = reader.count();
+  LOG_DEBUG("There are %d bindings", (int)num_bindings);
+  std::string binding_id;
+  for (uint64_t ii = 0; (reader.ok()) && (ii < num_bindings); ++ii)
+  {
+    reader.string(binding_id);
+    AoR::Binding* b = aor_data->get_binding(binding_id);
+    reader.string(b->_uri);
+    reader.string(b->_cid);
+    b->_cseq = reader.integer();
+    b->_expires = reader.integer();
+    b->_priority = reader.integer();
+
+    b->_params.resize(reader.count());
+    for (std::list<std::pair<std::string, std::string> >::iterator j = b->_params.begin();
+         j != b->_params.end();
+         ++j)
+    {
+      reader.string(j->first);
+      reader.string(j->second);
+    }
+
+    b->_path_headers.resize(reader.count());
+    for (std::list<std::string>::iterator j = b->_path_headers.begin();
+         j != b->_path_headers.end();
+         ++j)
+    {
+      reader.string(*j);
+    }
+  }
+
+  if (!reader.ok())
+  {
+    LOG_ERROR("Failed to read AoR - data is truncated or corrupt");
+    delete aor_data;
+    aor_data = NULL;
+  }
+
+  return aor_data;
+}
+
+/// Read the latest expiry time of any binding from the header of an AoR,
+/// without reading the bindings.
+int MemcachedStore::read_max_expires(const char* data, size_t length)
+{
+  int max_expires = -1;
+  if (is_binary_aor(data, length))
+  {
+    AoRReader reader(data + 2, length - 2);
+    if (!read_header(reader, max_expires))
+    {
+      max_expires = -1;
+    }
+  }
+  return max_expires;
+}
+
+/// Serialize the contents of an AoR in the legacy format.
+std::string MemcachedStore::serialize_legacy_aor(MemcachedAoR* aor_data)
 {
   std::ostringstream oss(std::ostringstream::out|std::ostringstream::binary);
 
@@ -308,8 +1133,8 @@ std::string MemcachedStore::serialize_aor(MemcachedAoR* aor_data)
   return oss.str();
 }
 
-/// Deserialize the contents of an AoR
-MemcachedAoR* MemcachedStore::deserialize_aor(const std::string& s)
+/// Deserialize the contents of an AoR in the legacy format.
+MemcachedAoR* MemcachedStore::deserialize_legacy_aor(const std::string& s)
 {
   std::istringstream iss(s, std::istringstream::in|std::istringstream::binary);
 
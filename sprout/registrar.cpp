@@ -49,6 +49,7 @@ extern "C" {
 #include <list>
 #include <queue>
 #include <string>
+#include <atomic>
 
 #include "utils.h"
 #include "sasevent.h"
@@ -74,6 +75,8 @@ static AnalyticsLogger* analytics;
 
 static int max_expires;
 
+static BindingExpirer* expirer;
+
 //
 // mod_registrar is the module to receive SIP REGISTER requests.  This
 // must get invoked before the proxy UA module.
@@ -206,10 +209,109 @@ std::string get_binding_id(pjsip_contact_hdr *contact)
 // }
 
 
+static void complete_register_request(pjsip_rx_data* rdata,
+                                      const std::string& aor,
+                                      Json::Value* uris,
+                                      SAS::TrailId trail,
+                                      RegData::AoR* aor_data);
+
+
+/// @class RegisterContinuation
+///
+/// Holds a REGISTER request while the registrar waits for the store to
+/// return the current bindings for its AoR, then completes the request on
+/// a worker thread.  It waits for both the bindings and a clone of the
+/// request, since the store may return the bindings before the worker
+/// thread that received the request has finished cloning it.
+class RegisterContinuation : public RegData::Store::GetCallback
+{
+public:
+  RegisterContinuation(const std::string& aor,
+                       Json::Value* uris,
+                       SAS::TrailId trail) :
+    _rdata(NULL),
+    _aor(aor),
+    _uris(uris),
+    _trail(trail),
+    _aor_data(NULL),
+    _waiting(2)
+  {
+  }
+
+  virtual ~RegisterContinuation()
+  {
+    if (_rdata != NULL)
+    {
+      pjsip_rx_data_free_cloned(_rdata);
+    }
+  }
+
+  /// Called with the clone of the request, or NULL if it couldn't be
+  /// cloned (in which case the request has already been rejected).
+  void request_ready(pjsip_rx_data* rdata)
+  {
+    _rdata = rdata;
+    resume_if_ready();
+  }
+
+  /// Called by the store, on one of its own threads, with the bindings.
+  void get_complete(const std::string& aor_id, RegData::AoR* aor_data)
+  {
+    _aor_data = aor_data;
+    resume_if_ready();
+  }
+
+private:
+  void resume_if_ready()
+  {
+    if (--_waiting == 0)
+    {
+      const pj_str_t* call_id = (_rdata != NULL) ? &_rdata->msg_info.cid->id : NULL;
+      if (!stack_continue(&resume, (void*)this, call_id))
+      {
+        // LCOV_EXCL_START - only happens when shutting down
+        delete _aor_data;
+        delete _uris;
+        delete this;
+        // LCOV_EXCL_STOP
+      }
+    }
+  }
+
+  /// Runs on a worker thread to complete the request.
+  static void resume(void* p)
+  {
+    RegisterContinuation* continuation = (RegisterContinuation*)p;
+    if (continuation->_rdata != NULL)
+    {
+      complete_register_request(continuation->_rdata,
+                                continuation->_aor,
+                                continuation->_uris,
+                                continuation->_trail,
+                                continuation->_aor_data);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      delete continuation->_aor_data;
+      delete continuation->_uris;
+      // LCOV_EXCL_STOP
+    }
+    delete continuation;
+  }
+
+  pjsip_rx_data* _rdata;
+  std::string _aor;
+  Json::Value* _uris;
+  SAS::TrailId _trail;
+  RegData::AoR* _aor_data;
+  std::atomic<int> _waiting;
+};
+
+
 void process_register_request(pjsip_rx_data* rdata)
 {
   pj_status_t status;
-  int st_code = PJSIP_SC_OK;
 
   // Get the URI from the To header and check it is a SIP or SIPS URI.
   pjsip_uri* uri = (pjsip_uri*)pjsip_uri_get_uri(rdata->msg_info.to->uri);
@@ -235,11 +337,6 @@ void process_register_request(pjsip_rx_data* rdata)
   std::string public_id = PJUtils::aor_from_uri((pjsip_sip_uri*)uri);
   LOG_DEBUG("Process REGISTER for public ID %s", public_id.c_str());
 
-  // Get the call identifier and the cseq number from the respective headers.
-  std::string cid = PJUtils::pj_str_to_string((const pj_str_t*)&rdata->msg_info.cid->id);;
-  int cseq = rdata->msg_info.cseq->cseq;
-  pjsip_msg *msg = rdata->msg_info.msg;
-
   // Add SAS markers to the trail attached to the message so the trail
   // becomes searchable.
   SAS::TrailId trail = get_trail(rdata);
@@ -281,6 +378,60 @@ void process_register_request(pjsip_rx_data* rdata)
   std::string aor = uris->get((Json::ArrayIndex)0, Json::Value::null).asString();
   LOG_DEBUG("REGISTER for public ID %s uses AOR %s", public_id.c_str(), aor.c_str());
 
+  // Start reading the current bindings for the AoR.  If the store can't
+  // return them straight away, hold on to the request and let this worker
+  // thread get on with something else until they arrive.
+  RegisterContinuation* continuation = new RegisterContinuation(aor, uris, trail);
+  RegData::AoR* aor_data = NULL;
+  if (store->get_aor_data_async(aor, continuation, aor_data))
+  {
+    delete continuation;
+    complete_register_request(rdata, aor, uris, trail, aor_data);
+  }
+  else
+  {
+    LOG_DEBUG("Waiting for AoR data for %s", aor.c_str());
+    pjsip_rx_data* clone_rdata = NULL;
+    status = pjsip_rx_data_clone(rdata, 0, &clone_rdata);
+    if (status == PJ_SUCCESS)
+    {
+      set_trail(clone_rdata, trail);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Failed to clone REGISTER request (%s)",
+                PJUtils::pj_status_to_string(status).c_str());
+      PJUtils::respond_stateless(stack_data.endpt,
+                                 rdata,
+                                 PJSIP_SC_INTERNAL_SERVER_ERROR,
+                                 NULL,
+                                 NULL,
+                                 NULL);
+      // LCOV_EXCL_STOP
+    }
+    continuation->request_ready(clone_rdata);
+  }
+}
+
+
+/// Update the bindings for a REGISTER request once the current bindings
+/// have been read from the store, and send the response.  Takes ownership
+/// of the AoR data.
+static void complete_register_request(pjsip_rx_data* rdata,
+                                      const std::string& aor,
+                                      Json::Value* uris,
+                                      SAS::TrailId trail,
+                                      RegData::AoR* aor_data)
+{
+  pj_status_t status;
+  int st_code = PJSIP_SC_OK;
+
+  // Get the call identifier and the cseq number from the respective headers.
+  std::string cid = PJUtils::pj_str_to_string((const pj_str_t*)&rdata->msg_info.cid->id);;
+  int cseq = rdata->msg_info.cseq->cseq;
+  pjsip_msg *msg = rdata->msg_info.msg;
+
   // Find the expire headers in the message.
   pjsip_expires_hdr* expires = (pjsip_expires_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_EXPIRES, NULL);
 
@@ -290,18 +441,19 @@ void process_register_request(pjsip_rx_data* rdata)
 
   // The registration service uses optimistic locking to avoid concurrent
   // updates to the same AoR conflicting.  This means we have to loop
-  // reading, updating and writing the AoR until the write is successful.
-  RegData::AoR* aor_data = NULL;
+  // updating and writing the AoR, reading it again after any conflict,
+  // until the write is successful.
+  bool first = true;
   do
   {
-    if (aor_data != NULL)
+    if (!first)
     {
-      delete aor_data; // LCOV_EXCL_LINE - Single-threaded tests mean we'll
-                       //                  always pass CAS.
+      // LCOV_EXCL_START - Single-threaded tests mean we'll always pass CAS.
+      delete aor_data;
+      aor_data = store->get_aor_data(aor);
+      // LCOV_EXCL_STOP
     }
-
-    // Find the current bindings for the AoR.
-    aor_data = store->get_aor_data(aor);
+    first = false;
     LOG_DEBUG("Retrieved AoR data %p", aor_data);
 
     if (aor_data == NULL)
@@ -419,6 +571,12 @@ void process_register_request(pjsip_rx_data* rdata)
   {
     // Log the bindings.
     log_bindings(aor, aor_data);
+
+    if (expirer != NULL)
+    {
+      // Track when the bindings expire.
+      expirer->update(aor, aor_data);
+    }
   }
 
   // Build and send the reply.
@@ -621,7 +779,8 @@ pj_status_t init_registrar(RegData::Store* registrar_store,
                            HSSConnection* hss_connection,
                            AnalyticsLogger* analytics_logger,
                            IfcHandler* ifchandler_ref,
-                           int cfg_max_expires)
+                           int cfg_max_expires,
+                           BindingExpirer* binding_expirer)
 {
   pj_status_t status;
 
@@ -630,6 +789,7 @@ pj_status_t init_registrar(RegData::Store* registrar_store,
   analytics = analytics_logger;
   ifchandler = ifchandler_ref;
   max_expires = cfg_max_expires;
+  expirer = binding_expirer;
 
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_registrar);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
@@ -641,5 +801,16 @@ pj_status_t init_registrar(RegData::Store* registrar_store,
 void destroy_registrar()
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_registrar);
+  expirer = NULL;
+}
+
+
+void registrar_bindings_changed(const std::string& aor,
+                                RegData::AoR* aor_data)
+{
+  if (expirer != NULL)
+  {
+    expirer->update(aor, aor_data);
+  }
 }
 
@@ -63,12 +63,10 @@ void send_register_to_as(pjsip_rx_data* received_register,
     const std::string&,
     SAS::TrailId);
 
-void deregister_with_application_servers(IfcHandler*, RegData::Store* store, const std::string&, SAS::TrailId trail);
-
-void deregister_with_application_servers(IfcHandler *ifchandler,
-                                         RegData::Store* store,
-                                         const std::string& served_user,
-                                         SAS::TrailId trail)
+void RegistrationUtils::deregister_with_application_servers(IfcHandler *ifchandler,
+                                                            RegData::Store* store,
+                                                            const std::string& served_user,
+                                                            SAS::TrailId trail)
 {
   RegistrationUtils::register_with_application_servers(ifchandler, store, NULL, NULL, 0, served_user, trail);
 }
@@ -288,6 +286,11 @@ static void expire_bindings(RegData::Store *store, const std::string& aor, const
     }
 
     bool ok = store->set_aor_data(aor, aor_data);
+    if (ok)
+    {
+      // Stop the registrar expiring the removed bindings again.
+      registrar_bindings_changed(aor, aor_data);
+    }
     delete aor_data;
     if (ok)
     {
@@ -302,6 +305,6 @@ void RegistrationUtils::network_initiated_deregistration(IfcHandler *ifchandler,
 
   // Note that 3GPP TS 24.229 V12.0.0 (2013-03) 5.4.1.7 doesn't specify that any binding information
   // should be passed on the REGISTER message, so we don't need the binding ID.
-  deregister_with_application_servers(ifchandler, store, served_user, trail);
+  RegistrationUtils::deregister_with_application_servers(ifchandler, store, served_user, trail);
   notify_application_servers();
 };
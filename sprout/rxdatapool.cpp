@@ -0,0 +1,228 @@
+/**
+ * @file rxdatapool.cpp  Recycled pools for passing received messages to worker threads
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include "rxdatapool.h"
+
+RxDataPool::RxDataPool(pj_pool_factory* factory, unsigned int max_free) :
+  _factory(factory),
+  _free(max_free),
+  _created(0)
+{
+}
+
+
+RxDataPool::~RxDataPool()
+{
+  pj_pool_t* pool;
+  while (_free.try_pop(pool))
+  {
+    pj_pool_release(pool);
+  }
+}
+
+
+/// Create pools for the free list in advance.
+void RxDataPool::reserve(unsigned int count)
+{
+  for (unsigned int ii = 0; ii < count; ++ii)
+  {
+    pj_pool_t* pool = pj_pool_create(_factory, "rxd%p", POOL_SIZE, POOL_INCREMENT, NULL);
+    if (pool == NULL)
+    {
+      return; // LCOV_EXCL_LINE
+    }
+    _created++;
+
+    if (!_free.push_noblock(pool))
+    {
+      pj_pool_release(pool);
+      return;
+    }
+  }
+}
+
+
+/// Clone a received message.  This does the same as pjsip_rx_data_clone,
+/// but using a recycled pool and copying as little as possible.
+pj_status_t RxDataPool::clone(const pjsip_rx_data* src, pjsip_rx_data** p_rdata)
+{
+  pj_pool_t* pool;
+  if (!_free.try_pop(pool))
+  {
+    pool = pj_pool_create(_factory, "rxd%p", POOL_SIZE, POOL_INCREMENT, NULL);
+    if (pool == NULL)
+    {
+      return PJ_ENOMEM; // LCOV_EXCL_LINE
+    }
+    _created++;
+  }
+
+  // Don't zero the whole structure - most of it is the receive buffer, of
+  // which only the message itself is needed.
+  pjsip_rx_data* dst = (pjsip_rx_data*)pj_pool_alloc(pool, sizeof(pjsip_rx_data));
+
+  pj_bzero(&dst->tp_info, sizeof(dst->tp_info));
+  dst->tp_info.pool = pool;
+  dst->tp_info.transport = src->tp_info.transport;
+
+  dst->pkt_info.timestamp = src->pkt_info.timestamp;
+  dst->pkt_info.len = src->msg_info.len;
+  pj_memcpy(dst->pkt_info.packet, src->msg_info.msg_buf, src->msg_info.len);
+  dst->pkt_info.packet[src->msg_info.len] = '\0';
+  dst->pkt_info.zero = 0;
+  dst->pkt_info.src_addr = src->pkt_info.src_addr;
+  dst->pkt_info.src_addr_len = src->pkt_info.src_addr_len;
+  pj_memcpy(dst->pkt_info.src_name, src->pkt_info.src_name, sizeof(src->pkt_info.src_name));
+  dst->pkt_info.src_port = src->pkt_info.src_port;
+
+  pj_bzero(&dst->msg_info, sizeof(dst->msg_info));
+  pj_list_init(&dst->msg_info.parse_err);
+  dst->msg_info.msg_buf = dst->pkt_info.packet;
+  dst->msg_info.len = src->msg_info.len;
+  dst->msg_info.msg = pjsip_msg_clone(pool, src->msg_info.msg);
+
+  // Fill in the shortcuts to the headers of the cloned message.  As in
+  // pjsip_rx_data_clone, these point to the first header of each type.
+  for (pjsip_hdr* hdr = dst->msg_info.msg->hdr.next;
+       hdr != &dst->msg_info.msg->hdr;
+       hdr = hdr->next)
+  {
+    switch (hdr->type)
+    {
+    case PJSIP_H_CALL_ID:
+      dst->msg_info.cid = (pjsip_cid_hdr*)hdr;
+      break;
+
+    case PJSIP_H_FROM:
+      dst->msg_info.from = (pjsip_from_hdr*)hdr;
+      break;
+
+    case PJSIP_H_TO:
+      dst->msg_info.to = (pjsip_to_hdr*)hdr;
+      break;
+
+    case PJSIP_H_VIA:
+      if (dst->msg_info.via == NULL)
+      {
+        dst->msg_info.via = (pjsip_via_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_CSEQ:
+      dst->msg_info.cseq = (pjsip_cseq_hdr*)hdr;
+      break;
+
+    case PJSIP_H_MAX_FORWARDS:
+      dst->msg_info.max_fwd = (pjsip_max_fwd_hdr*)hdr;
+      break;
+
+    case PJSIP_H_ROUTE:
+      if (dst->msg_info.route == NULL)
+      {
+        dst->msg_info.route = (pjsip_route_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_RECORD_ROUTE:
+      if (dst->msg_info.record_route == NULL)
+      {
+        dst->msg_info.record_route = (pjsip_rr_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_CONTENT_TYPE:
+      dst->msg_info.ctype = (pjsip_ctype_hdr*)hdr;
+      break;
+
+    case PJSIP_H_CONTENT_LENGTH:
+      dst->msg_info.clen = (pjsip_clen_hdr*)hdr;
+      break;
+
+    case PJSIP_H_REQUIRE:
+      if (dst->msg_info.require == NULL)
+      {
+        dst->msg_info.require = (pjsip_require_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_SUPPORTED:
+      if (dst->msg_info.supported == NULL)
+      {
+        dst->msg_info.supported = (pjsip_supported_hdr*)hdr;
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  // Copy the module data, which includes the SAS trail.
+  pj_memcpy(dst->endpt_info.mod_data,
+            src->endpt_info.mod_data,
+            sizeof(src->endpt_info.mod_data));
+
+  // Hold a reference to the transport for as long as the clone exists.
+  pjsip_transport_add_ref(dst->tp_info.transport);
+
+  *p_rdata = dst;
+  return PJ_SUCCESS;
+}
+
+
+/// Free a clone, and keep its pool for reuse if there is room on the free
+/// list.
+void RxDataPool::release(pjsip_rx_data* rdata)
+{
+  pj_pool_t* pool = rdata->tp_info.pool;
+  pjsip_transport_dec_ref(rdata->tp_info.transport);
+
+  // Resetting the pool frees all but its first block, so a pool that grew
+  // to hold an unusually large message doesn't hold on to the memory.
+  pj_pool_reset(pool);
+  if (!_free.push_noblock(pool))
+  {
+    pj_pool_release(pool);
+  }
+}
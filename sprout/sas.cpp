@@ -38,6 +38,9 @@
 #include <time.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+
+#include <unordered_set>
 
 #include "log.h"
 #include "sas.h"
@@ -57,9 +60,183 @@ const int MARKER_HDR_SIZE = COMMON_HDR_SIZE + sizeof(uint64_t) + sizeof(uint32_t
 const int SAS_PORT = 6761;
 
 
+// Helpers for encoding messages.  Each writes a field at p and returns a
+// pointer to the byte after it.
+static inline char* write_int8(char* p, uint8_t c)
+{
+  *p = (char)c;
+  return p + sizeof(uint8_t);
+}
+
+
+static inline char* write_int16(char* p, uint16_t v)
+{
+  uint16_t v_nw = htons(v);
+  memcpy(p, &v_nw, sizeof(uint16_t));
+  return p + sizeof(uint16_t);
+}
+
+
+static inline char* write_int32(char* p, uint32_t v)
+{
+  uint32_t v_nw = htonl(v);
+  memcpy(p, &v_nw, sizeof(uint32_t));
+  return p + sizeof(uint32_t);
+}
+
+
+static inline char* write_int64(char* p, uint64_t v)
+{
+  p = write_int32(p, v >> 32);
+  return write_int32(p, v & 0xffffffff);
+}
+
+
+static inline char* write_data(char* p, size_t len, const char* data)
+{
+  memcpy(p, data, len);
+  return p + len;
+}
+
+
+/// Writes the timestamp, which is the current time unless one is given.
+static inline char* write_timestamp(char* p, unsigned long long timestamp)
+{
+  if (timestamp == 0)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timestamp = ts.tv_sec;
+    timestamp = timestamp * 1000 + (ts.tv_nsec / 1000000);
+  }
+  return write_int64(p, timestamp);
+}
+
+
+static inline char* write_hdr(char* p,
+                              uint16_t msg_length,
+                              uint8_t msg_type,
+                              unsigned long long timestamp = 0)
+{
+  p = write_int16(p, msg_length);
+  p = write_int8(p, 1);             // Version = 1
+  p = write_int8(p, msg_type);
+  return write_timestamp(p, timestamp);
+}
+
+
+/// Unsampled trails that have been forced.  The set is split into shards
+/// to keep lock contention down, and each shard holds two generations of
+/// trails so it can be bounded without tracking when each trail ends - when
+/// the current generation fills up it replaces the previous one.
+class SAS::ForcedTrails
+{
+public:
+  ForcedTrails() : _forced(0)
+  {
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      pthread_mutex_init(&_shards[ii].lock, NULL);
+    }
+  }
+
+  ~ForcedTrails()
+  {
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      pthread_mutex_destroy(&_shards[ii].lock);
+    }
+  }
+
+  /// Add a trail, returning true if it wasn't already there.
+  bool insert(TrailId trail)
+  {
+    Shard& shard = _shards[trail % NUM_SHARDS];
+    pthread_mutex_lock(&shard.lock);
+    bool inserted = ((shard.previous.count(trail) == 0) &&
+                     (shard.current.insert(trail).second));
+    if (shard.current.size() >= MAX_GENERATION_SIZE)
+    {
+      shard.previous.swap(shard.current);
+      shard.current.clear();
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    if (inserted)
+    {
+      _forced++;
+    }
+    return inserted;
+  }
+
+  bool contains(TrailId trail)
+  {
+    if (_forced.load(std::memory_order_relaxed) == 0)
+    {
+      // Nothing has ever been forced, so no need to look.
+      return false;
+    }
+
+    Shard& shard = _shards[trail % NUM_SHARDS];
+    pthread_mutex_lock(&shard.lock);
+    bool found = ((shard.current.count(trail) != 0) ||
+                  (shard.previous.count(trail) != 0));
+    pthread_mutex_unlock(&shard.lock);
+    return found;
+  }
+
+  /// Returns the number of trails that have been forced.
+  unsigned long forced() const { return _forced.load(); }
+
+private:
+  static const int NUM_SHARDS = 16;
+  static const size_t MAX_GENERATION_SIZE = 4096;
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    std::unordered_set<TrailId> current;
+    std::unordered_set<TrailId> previous;
+  };
+
+  Shard _shards[NUM_SHARDS];
+  std::atomic<unsigned long> _forced;
+};
+
+
 std::atomic<SAS::TrailId> SAS::_next_trail_id(1);
 SAS::Connection* SAS::_connection = NULL;
 
+bool SAS::_sample_all = true;
+uint64_t SAS::_sample_threshold = 0;
+std::set<std::string> SAS::_traced_users;
+std::set<uint32_t> SAS::_user_markers;
+std::vector<SAS::EventCap*> SAS::_event_caps;
+SAS::ForcedTrails SAS::_forced_trails;
+std::atomic<unsigned long> SAS::_trails_unsampled(0);
+
+
+void SAS::set_policy(const Policy& policy)
+{
+  _sample_all = (policy.sample_percent >= 100.0);
+  _sample_threshold = (policy.sample_percent <= 0.0) ? 0 :
+                      (uint64_t)(policy.sample_percent / 100.0 * 18446744073709551615.0);
+  _traced_users = policy.traced_users;
+  _user_markers = policy.user_markers;
+
+  for (size_t ii = 0; ii < _event_caps.size(); ++ii)
+  {
+    delete _event_caps[ii];
+  }
+  _event_caps.clear();
+  for (std::map<uint32_t, unsigned int>::const_iterator i = policy.event_caps.begin();
+       i != policy.event_caps.end();
+       ++i)
+  {
+    _event_caps.push_back(new EventCap(i->first, i->second));
+  }
+}
+
 
 void SAS::init(int system_name_length, const char* system_name, const std::string& sas_address)
 {
@@ -81,10 +258,21 @@ void SAS::term()
 SAS::Connection::Connection(const std::string& system_name, const std::string& sas_address) :
   _system_name(system_name),
   _sas_address(sas_address),
-  _msg_q(0, false),
+  _buffers(MAX_FREE_BUFFERS),
+  _rings(),
+  _rings_changed(false),
+  _closed_rings_dropped(0),
+  _writer_rings(),
+  _next_ring(0),
+  _msgs_queued(),
+  _connected(false),
+  _terminated(false),
   _writer(0),
   _sock(0)
 {
+  pthread_key_create(&_ring_key, &ring_closed);
+  pthread_mutex_init(&_rings_lock, NULL);
+
   // Spawn a thread to open and write to the SAS connection.
   int rc = pthread_create(&_writer, NULL, &writer_thread, this);
 
@@ -99,19 +287,28 @@ SAS::Connection::Connection(const std::string& system_name, const std::string& s
 
 SAS::Connection::~Connection()
 {
-  // Close off the queue.
-  _msg_q.close();
-
   if (_writer != 0)
   {
     // Signal the writer thread to disconnect the socket and end.
-    _msg_q.terminate();
+    _terminated = true;
+    _msgs_queued.notify_all();
 
     // Wait for the writer thread to exit.
     pthread_join(_writer, NULL);
 
     _writer = 0;
   }
+
+  // Free the rings.  Threads still running no longer have a destructor
+  // called for the key once it is deleted.
+  pthread_key_delete(_ring_key);
+  discard_queued();
+  for (size_t ii = 0; ii < _rings.size(); ++ii)
+  {
+    delete _rings[ii];
+  }
+  _rings.clear();
+  pthread_mutex_destroy(&_rings_lock);
 }
 
 
@@ -124,66 +321,253 @@ void* SAS::Connection::writer_thread(void* p)
 
 void SAS::Connection::writer()
 {
-  while (true)
+  while (!_terminated)
   {
     int reconnect_timeout = 10000;  // If connect fails, retry every 10 seconds.
 
     if (connect_init())
     {
-      // Open the queue for input
-      _msg_q.open();
-
-      // Now can start dequeuing and sending data.
-      std::string msg;
-      while (_msg_q.pop(msg))
+      // Let threads start queuing messages.
+      _connected = true;
+
+      // Now can start dequeuing and sending data.  Each time the writer
+      // wakes up it sends everything that has been queued since, up to
+      // MAX_SEND_BATCH messages per system call.
+      Buffer* batch[MAX_SEND_BATCH];
+      while (!_terminated)
       {
-        int len = msg.length();
-        char* buf = (char*)msg.data();
-        while (len > 0)
+        int count = collect(batch);
+        if (count == 0)
         {
-          int nsent = ::send(_sock, buf, len, 0);
-          if (nsent > 0)
-          {
-            len -= nsent;
-            buf += nsent;
-          }
-          else if ((nsent < 0) && (errno != EINTR))
-          {
-            LOG_ERROR("SAS connection to %s:%d failed: %d %s", _sas_address.c_str(), SAS_PORT, errno, ::strerror(errno));
-            ::close(_sock);
-            break;
-          }
+          wait_for_msgs();
+        }
+        else if (!send_batch(batch, count))
+        {
+          break;
         }
       }
 
-      // Close the input queue and purge it.
-      _msg_q.close();
-      _msg_q.purge();
+      // Stop threads queuing messages and purge anything already queued.
+      _connected = false;
+      discard_queued();
 
       // Terminate the socket.
       ::close(_sock);
 
-      if (_msg_q.is_terminated())
+      // Try reconnecting after 1 second after a failure.
+      reconnect_timeout = 1000;
+    }
+
+    // Wait for the specified timeout before trying to reconnect.  We wait
+    // on the eventcount so we get a kick if the term function is called.
+    LOG_DEBUG("Waiting to reconnect to SAS - timeout = %d", reconnect_timeout);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t deadline_ms = now.tv_sec * 1000ull + now.tv_nsec / 1000000 + reconnect_timeout;
+    while (!_terminated)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      uint64_t now_ms = now.tv_sec * 1000ull + now.tv_nsec / 1000000;
+      if (now_ms >= deadline_ms)
       {
-        // Received a termination signal on the queue, so exit.
         break;
       }
 
-      // Try reconnecting after 1 second after a failure.
-      reconnect_timeout = 1000;
+      uint32_t key = _msgs_queued.prepare_wait();
+      if (!_terminated)
+      {
+        _msgs_queued.wait(key, (int)(deadline_ms - now_ms));
+      }
+      _msgs_queued.cancel_wait(key);
     }
+  }
+}
 
-    // Wait on the input queue for the specified timeout before trying to
-    // reconnect.  We wait on the queue so we get a kick if the term function
-    // is called.
-    std::string msg;
-    LOG_DEBUG("Waiting to reconnect to SAS - timeout = %d", reconnect_timeout);
-    if (!_msg_q.pop(msg, reconnect_timeout))
+
+/// Block until a thread queues a message or the connection is terminated.
+void SAS::Connection::wait_for_msgs()
+{
+  // Check the rings again after registering as a waiter, in case a message
+  // was queued in between.
+  uint32_t key = _msgs_queued.prepare_wait();
+  bool empty = true;
+  refresh_rings();
+  for (size_t ii = 0; ii < _writer_rings.size(); ++ii)
+  {
+    if (_writer_rings[ii]->q.size() > 0)
     {
-      // Received a termination signal on the queue, so exit.
+      empty = false;
       break;
     }
   }
+  if ((empty) && (!_terminated))
+  {
+    _msgs_queued.wait(key, -1);
+  }
+  _msgs_queued.cancel_wait(key);
+}
+
+
+/// Take up to MAX_SEND_BATCH messages off the rings, starting from a
+/// different ring each time so that a busy thread can't starve the others.
+/// Returns the number of messages taken.
+int SAS::Connection::collect(Buffer** batch)
+{
+  refresh_rings();
+
+  int count = 0;
+  size_t num_rings = _writer_rings.size();
+  for (size_t ii = 0; (ii < num_rings) && (count < MAX_SEND_BATCH); ++ii)
+  {
+    Ring* ring = _writer_rings[(_next_ring + ii) % num_rings];
+    size_t sent_bytes = ring->sent_bytes.load(std::memory_order_relaxed);
+    while ((count < MAX_SEND_BATCH) && (ring->q.try_pop(batch[count])))
+    {
+      sent_bytes += batch[count]->capacity;
+      ++count;
+    }
+    ring->sent_bytes.store(sent_bytes, std::memory_order_release);
+  }
+
+  if (num_rings > 0)
+  {
+    _next_ring = (_next_ring + 1) % num_rings;
+  }
+
+  return count;
+}
+
+
+/// Bring the writer's copy of the ring list up to date, freeing the rings
+/// of threads that have exited once they have been drained.
+void SAS::Connection::refresh_rings()
+{
+  if (_rings_changed.exchange(false))
+  {
+    pthread_mutex_lock(&_rings_lock);
+
+    std::vector<Ring*>::iterator it = _rings.begin();
+    while (it != _rings.end())
+    {
+      Ring* ring = *it;
+      if ((ring->closed.load()) && (ring->q.size() == 0))
+      {
+        _closed_rings_dropped += ring->dropped.load();
+        delete ring;
+        it = _rings.erase(it);
+      }
+      else
+      {
+        if (ring->closed.load())
+        {
+          // Still has messages to send, so check again next time.
+          _rings_changed = true;
+        }
+        ++it;
+      }
+    }
+    _writer_rings = _rings;
+
+    pthread_mutex_unlock(&_rings_lock);
+  }
+}
+
+
+/// Called when a thread that has queued messages exits.
+void SAS::Connection::ring_closed(void* p)
+{
+  Ring* ring = (Ring*)p;
+  ring->closed = true;
+  ring->connection->_rings_changed = true;
+}
+
+
+/// Get the calling thread's ring, creating it if this is the first message
+/// the thread has sent.
+SAS::Connection::Ring* SAS::Connection::get_ring()
+{
+  Ring* ring = (Ring*)pthread_getspecific(_ring_key);
+  if (ring == NULL)
+  {
+    ring = new Ring(this);
+    pthread_setspecific(_ring_key, ring);
+
+    pthread_mutex_lock(&_rings_lock);
+    _rings.push_back(ring);
+    pthread_mutex_unlock(&_rings_lock);
+    _rings_changed = true;
+  }
+  return ring;
+}
+
+
+/// Send a batch of messages with as few writev calls as possible, then
+/// return the buffers to the pool.  Returns false if the connection failed.
+bool SAS::Connection::send_batch(Buffer** batch, int count)
+{
+  struct iovec iov[MAX_SEND_BATCH];
+  for (int ii = 0; ii < count; ++ii)
+  {
+    iov[ii].iov_base = batch[ii]->data();
+    iov[ii].iov_len = batch[ii]->len;
+  }
+
+  bool ok = true;
+  struct iovec* next = iov;
+  int remaining = count;
+  while (remaining > 0)
+  {
+    ssize_t nsent = ::writev(_sock, next, remaining);
+    if (nsent > 0)
+    {
+      // Skip past the iovecs that have been sent completely, and adjust
+      // the first one that has only been partly sent.
+      while ((remaining > 0) && ((size_t)nsent >= next->iov_len))
+      {
+        nsent -= next->iov_len;
+        ++next;
+        --remaining;
+      }
+      if (remaining > 0)
+      {
+        next->iov_base = (char*)next->iov_base + nsent;
+        next->iov_len -= nsent;
+      }
+    }
+    else if ((nsent < 0) && (errno != EINTR))
+    {
+      LOG_ERROR("SAS connection to %s:%d failed: %d %s", _sas_address.c_str(), SAS_PORT, errno, ::strerror(errno));
+      ok = false;
+      break;
+    }
+  }
+
+  for (int ii = 0; ii < count; ++ii)
+  {
+    _buffers.release(batch[ii]);
+  }
+
+  return ok;
+}
+
+
+/// Throw away any messages still on the rings.
+void SAS::Connection::discard_queued()
+{
+  pthread_mutex_lock(&_rings_lock);
+  for (size_t ii = 0; ii < _rings.size(); ++ii)
+  {
+    Ring* ring = _rings[ii];
+    size_t sent_bytes = ring->sent_bytes.load(std::memory_order_relaxed);
+    Buffer* buf;
+    while (ring->q.try_pop(buf))
+    {
+      sent_bytes += buf->capacity;
+      _buffers.release(buf);
+    }
+    ring->sent_bytes.store(sent_bytes, std::memory_order_release);
+  }
+  pthread_mutex_unlock(&_rings_lock);
 }
 
 
@@ -217,17 +601,17 @@ bool SAS::Connection::connect_init()
   LOG_DEBUG("Connected SAS socket to %s:%d", _sas_address.c_str(), SAS_PORT);
 
   // Send an init message to SAS.
-  std::string init;
   std::string version("v0.1");
   int init_len = INIT_HDR_SIZE + sizeof(uint8_t) + _system_name.length() + sizeof(uint32_t) + sizeof(uint8_t) + version.length();
-  init.reserve(init_len);
-  write_hdr(init, init_len, SAS_MSG_INIT);
-  write_int8(init, (uint8_t)_system_name.length());
-  write_data(init, _system_name.length(), _system_name.data());
+  std::string init(init_len, '\0');
+  char* p = &init[0];
+  p = write_hdr(p, init_len, SAS_MSG_INIT);
+  p = write_int8(p, (uint8_t)_system_name.length());
+  p = write_data(p, _system_name.length(), _system_name.data());
   int endianness = 1;
-  init.append((char*)&endianness, sizeof(int));     // Endianness must be written in machine order.
-  write_int8(init, version.length());
-  write_data(init, version.length(), version.data());
+  p = write_data(p, sizeof(int), (char*)&endianness);    // Endianness must be written in machine order.
+  p = write_int8(p, version.length());
+  p = write_data(p, version.length(), version.data());
 
   LOG_DEBUG("Sending SAS INIT message");
 
@@ -244,159 +628,380 @@ bool SAS::Connection::connect_init()
 }
 
 
-void SAS::Connection::send_msg(std::string msg)
+void SAS::Connection::send_msg(Buffer* buf)
+{
+  if (!connected())
+  {
+    // Not connected, so nowhere to send it.
+    _buffers.release(buf);
+    return;
+  }
+
+  Ring* ring = get_ring();
+  size_t queued_bytes = ring->pushed_bytes -
+                        ring->sent_bytes.load(std::memory_order_acquire);
+
+  if ((queued_bytes + buf->capacity > RING_MAX_BYTES) ||
+      (!ring->q.try_push(buf)))
+  {
+    // The writer isn't keeping up with this thread, so drop the message
+    // rather than block.  Only this thread writes the count.
+    ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+    _buffers.release(buf);
+    return;
+  }
+
+  ring->pushed_bytes += buf->capacity;
+  _msgs_queued.notify_one();
+}
+
+
+unsigned int SAS::Connection::queue_depth()
 {
-  _msg_q.push_noblock(msg);
+  unsigned int depth = 0;
+  pthread_mutex_lock(&_rings_lock);
+  for (size_t ii = 0; ii < _rings.size(); ++ii)
+  {
+    depth += _rings[ii]->q.size();
+  }
+  pthread_mutex_unlock(&_rings_lock);
+  return depth;
+}
+
+
+unsigned long SAS::Connection::dropped()
+{
+  pthread_mutex_lock(&_rings_lock);
+  unsigned long dropped = _closed_rings_dropped;
+  for (size_t ii = 0; ii < _rings.size(); ++ii)
+  {
+    dropped += _rings[ii]->dropped.load(std::memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&_rings_lock);
+  return dropped;
 }
 
 
 SAS::TrailId SAS::new_trail(uint32_t instance)
 {
   TrailId trail = _next_trail_id++;
+  if (!is_sampled(trail))
+  {
+    trail |= UNSAMPLED_TRAIL;
+    _trails_unsampled++;
+  }
   return trail;
 }
 
 
-void SAS::report_event(const Event& event)
+/// Decides whether a new trail is sampled.  This hashes the trail ID rather
+/// than using a random number, so it needs no shared state.
+bool SAS::is_sampled(TrailId trail)
 {
-  if (_connection)
+  if (_sample_all)
   {
-    _connection->send_msg(event.to_string());
+    return true;
   }
+
+  uint64_t hash = trail;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+  hash = hash ^ (hash >> 31);
+  return (hash < _sample_threshold);
 }
 
 
-void SAS::report_marker(const Marker& marker, Marker::Scope scope)
+bool SAS::is_traced(TrailId trail)
 {
-  if (_connection)
+  return (((trail & UNSAMPLED_TRAIL) == 0) ||
+          (_forced_trails.contains(trail)));
+}
+
+
+void SAS::force_trail(TrailId trail)
+{
+  if ((trail & UNSAMPLED_TRAIL) != 0)
   {
-    _connection->send_msg(marker.to_string(scope));
+    _forced_trails.insert(trail);
   }
 }
 
 
-void SAS::write_hdr(std::string& s, uint16_t msg_length, uint8_t msg_type)
+unsigned long SAS::trails_created()
 {
-  SAS::write_int16(s, msg_length);
-  SAS::write_int8(s, 1);             // Version = 1
-  SAS::write_int8(s, msg_type);
-  SAS::write_timestamp(s);
+  return _next_trail_id.load() - 1;
 }
 
 
-void SAS::write_int8(std::string& s, uint8_t c)
+unsigned long SAS::trails_traced()
 {
-  s.append((char*)&c, sizeof(uint8_t));
+  return trails_created() - _trails_unsampled.load() + _forced_trails.forced();
 }
 
 
-void SAS::write_int16(std::string& s, uint16_t v)
+unsigned long SAS::events_capped()
 {
-  uint16_t v_nw = htons(v);
-  s.append((char*)&v_nw, sizeof(uint16_t));
+  unsigned long capped = 0;
+  for (size_t ii = 0; ii < _event_caps.size(); ++ii)
+  {
+    capped += _event_caps[ii]->capped.load();
+  }
+  return capped;
 }
 
 
-void SAS::write_int32(std::string& s, uint32_t v)
+/// Returns true if an event should be reported without exceeding its cap.
+/// Each cap counts events in one second windows, which is cheap and
+/// accurate enough to protect the SAS link.
+bool SAS::check_cap(TrailId trail, uint32_t id)
 {
-  uint32_t v_nw = htonl(v);
-  s.append((char*)&v_nw, sizeof(uint32_t));
+  if ((_event_caps.empty()) || ((trail & UNSAMPLED_TRAIL) != 0))
+  {
+    // No caps, or the trail has been forced so isn't subject to them.
+    return true;
+  }
+
+  for (size_t ii = 0; ii < _event_caps.size(); ++ii)
+  {
+    EventCap* cap = _event_caps[ii];
+    if (cap->id == id)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+      uint64_t second = ts.tv_sec;
+      uint64_t current = cap->second.load(std::memory_order_relaxed);
+      if ((current != second) &&
+          (cap->second.compare_exchange_strong(current, second)))
+      {
+        // First event in a new window.
+        cap->count.store(0, std::memory_order_relaxed);
+      }
+
+      if (cap->count.fetch_add(1, std::memory_order_relaxed) >= cap->max_per_sec)
+      {
+        cap->capped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+  }
+
+  return true;
 }
 
 
-void SAS::write_int64(std::string& s, uint64_t v)
+/// Forces the trail if the marker identifies one of the traced users.
+void SAS::check_user_marker(const Marker& marker)
 {
-  uint32_t vh_nw = htonl(v >> 32);
-  uint32_t vl_nw = htonl(v & 0xffffffff);
-  s.append((char*)&vh_nw, sizeof(uint32_t));
-  s.append((char*)&vl_nw, sizeof(uint32_t));
+  if ((!_traced_users.empty()) &&
+      ((marker._trail & UNSAMPLED_TRAIL) != 0) &&
+      (marker._msg.hdr.num_var_data > 0) &&
+      (_user_markers.count(marker._msg.hdr.id) != 0))
+  {
+    std::string user((char*)marker._msg.var_data[0].ptr,
+                     marker._msg.var_data[0].len);
+    if (_traced_users.count(user) != 0)
+    {
+      force_trail(marker._trail);
+    }
+  }
 }
 
 
-void SAS::write_data(std::string& s, size_t len, const char* data)
+void SAS::report_event(const Event& event)
 {
-  s.append(data, len);
+  // Check the policy before doing any encoding work.
+  if ((_connection) &&
+      (_connection->connected()) &&
+      (is_traced(event._trail)) &&
+      (check_cap(event._trail, event._msg.hdr.id)))
+  {
+    size_t len = event.encoded_length();
+    Buffer* buf = _connection->get_buffer(len);
+    if (buf != NULL)
+    {
+      event.encode(buf->data(), len);
+      buf->len = len;
+      _connection->send_msg(buf);
+    }
+  }
 }
 
 
-void SAS::write_timestamp(std::string& s)
+void SAS::report_marker(const Marker& marker, Marker::Scope scope)
 {
-  unsigned long long timestamp;
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
-  timestamp = ts.tv_sec;
-  timestamp = timestamp * 1000 + (ts.tv_nsec / 1000000);
-  write_int64(s, timestamp);
+  check_user_marker(marker);
+
+  if ((_connection) &&
+      (_connection->connected()) &&
+      (is_traced(marker._trail)))
+  {
+    size_t len = marker.encoded_length();
+    Buffer* buf = _connection->get_buffer(len);
+    if (buf != NULL)
+    {
+      marker.encode(buf->data(), len, scope);
+      buf->len = len;
+      _connection->send_msg(buf);
+    }
+  }
 }
 
 
-void SAS::write_trail(std::string& s, TrailId trail)
+unsigned int SAS::queue_depth()
 {
-  write_int64(s, trail);
+  return (_connection) ? _connection->queue_depth() : 0;
 }
 
 
-std::string SAS::Event::to_string() const
+unsigned long SAS::events_dropped()
 {
-  std::string s;
-  int msg_length = EVENT_HDR_SIZE + _msg.hdr.static_data_len;
-  for (uint32_t ii = 0; ii < _msg.hdr.num_var_data; ++ii)
-  {
-    msg_length += sizeof(uint16_t) + _msg.var_data[ii].len;
-  }
-  s.reserve(msg_length);
+  return (_connection) ? _connection->dropped() : 0;
+}
+
 
-  SAS::write_hdr(s, msg_length, SAS_MSG_EVENT);
-  write_trail(s, _trail);
-  write_int32(s, _msg.hdr.id);
-  write_int32(s, _msg.hdr.instance);
-  write_int16(s, _msg.hdr.static_data_len);
-  for (uint32_t ii = 0; ii < _msg.hdr.static_data_len / 4; ++ii)
+const SAS::TrailId SAS::UNSAMPLED_TRAIL;
+const size_t SAS::Connection::RING_MAX_BYTES;
+const size_t SAS::BufferPool::SMALL_BUFFER_SIZE;
+const size_t SAS::BufferPool::LARGE_BUFFER_SIZE;
+
+SAS::BufferPool::BufferPool(unsigned int max_free) :
+  _small_free(max_free),
+  _large_free(max_free),
+  _created(0)
+{
+}
+
+
+SAS::BufferPool::~BufferPool()
+{
+  Buffer* buf;
+  while (_small_free.try_pop(buf))
   {
-    // Static parameters are written in native byte order, not network order.
-    write_data(s, sizeof(uint32_t), (char *)&_msg.static_data[ii]);
+    delete[] (char*)buf;
   }
-  for (uint32_t ii = 0; ii < _msg.hdr.num_var_data; ++ii)
+  while (_large_free.try_pop(buf))
   {
-    write_int16(s, _msg.var_data[ii].len);
-    write_data(s, _msg.var_data[ii].len, (char *)_msg.var_data[ii].ptr);
+    delete[] (char*)buf;
   }
+}
 
-  return s;
+
+mpmcq<SAS::Buffer*>& SAS::BufferPool::free_list(size_t capacity)
+{
+  return (capacity <= SMALL_BUFFER_SIZE) ? _small_free : _large_free;
 }
 
 
-std::string SAS::Marker::to_string(Marker::Scope scope) const
+SAS::Buffer* SAS::BufferPool::get(size_t len)
 {
-  std::string s;
+  if (len >= LARGE_BUFFER_SIZE)
+  {
+    // Too big to report, as the length field is only 16 bits.
+    LOG_WARNING("Discarding SAS message of %d bytes", (int)len);
+    return NULL;
+  }
 
-  int msg_length = MARKER_HDR_SIZE + _msg.hdr.static_data_len;
-  for (uint32_t ii = 0; ii < _msg.hdr.num_var_data; ++ii)
+  size_t capacity = (len <= SMALL_BUFFER_SIZE) ? SMALL_BUFFER_SIZE : LARGE_BUFFER_SIZE;
+  Buffer* buf;
+  if (!free_list(capacity).try_pop(buf))
+  {
+    buf = (Buffer*)new char[sizeof(Buffer) + capacity];
+    buf->capacity = capacity;
+    _created++;
+  }
+  buf->len = 0;
+  return buf;
+}
+
+
+void SAS::BufferPool::release(Buffer* buf)
+{
+  if (!free_list(buf->capacity).push_noblock(buf))
   {
-    msg_length += sizeof(uint16_t) + _msg.var_data[ii].len;
+    // Already have enough free buffers of this size.
+    delete[] (char*)buf;
   }
-  s.reserve(msg_length);
+}
+
 
-  write_hdr(s, msg_length, SAS_MSG_MARKER);
-  write_trail(s, _trail);
-  write_int32(s, _msg.hdr.id);
-  write_int32(s, _msg.hdr.instance);
-  write_int8(s, (uint8_t)(scope != Scope::None));
-  write_int8(s, (uint8_t)scope);
-  write_int16(s, _msg.hdr.static_data_len);
-  for (uint32_t ii = 0; ii < _msg.hdr.static_data_len / 4; ++ii)
+size_t SAS::Message::params_length() const
+{
+  size_t len = sizeof(uint16_t) + _msg.hdr.static_data_len;
+  for (uint32_t ii = 0; ii < _msg.hdr.num_var_data; ++ii)
   {
-    // Static parameters are written in native byte order, not network order.
-    write_data(s, sizeof(uint32_t), (char *)&_msg.static_data[ii]);
+    len += sizeof(uint16_t) + _msg.var_data[ii].len;
   }
+  return len;
+}
+
+
+char* SAS::Message::write_params(char* p) const
+{
+  p = write_int16(p, _msg.hdr.static_data_len);
+
+  // Static parameters are written in native byte order, not network order.
+  p = write_data(p, _msg.hdr.static_data_len, (char*)_msg.static_data);
+
   for (uint32_t ii = 0; ii < _msg.hdr.num_var_data; ++ii)
   {
-    write_int16(s, _msg.var_data[ii].len);
-    write_data(s, _msg.var_data[ii].len, (char *)_msg.var_data[ii].ptr);
+    p = write_int16(p, _msg.var_data[ii].len);
+    p = write_data(p, _msg.var_data[ii].len, (char*)_msg.var_data[ii].ptr);
   }
+  return p;
+}
+
+
+size_t SAS::Event::encoded_length() const
+{
+  // The header size includes the static data length field.
+  return EVENT_HDR_SIZE - sizeof(uint16_t) + params_length();
+}
 
+
+void SAS::Event::encode(char* buf, size_t len) const
+{
+  char* p = write_hdr(buf, len, SAS_MSG_EVENT, _timestamp);
+  p = write_int64(p, _trail);
+  p = write_int32(p, _msg.hdr.id);
+  p = write_int32(p, _msg.hdr.instance);
+  write_params(p);
+}
+
+
+std::string SAS::Event::to_string() const
+{
+  size_t len = encoded_length();
+  std::string s(len, '\0');
+  encode(&s[0], len);
   return s;
 }
 
 
+size_t SAS::Marker::encoded_length() const
+{
+  // The header size includes the static data length field.
+  return MARKER_HDR_SIZE - sizeof(uint16_t) + params_length();
+}
+
+
+void SAS::Marker::encode(char* buf, size_t len, Marker::Scope scope) const
+{
+  char* p = write_hdr(buf, len, SAS_MSG_MARKER, _timestamp);
+  p = write_int64(p, _trail);
+  p = write_int32(p, _msg.hdr.id);
+  p = write_int32(p, _msg.hdr.instance);
+  p = write_int8(p, (uint8_t)(scope != Scope::None));
+  p = write_int8(p, (uint8_t)scope);
+  write_params(p);
+}
+
 
+std::string SAS::Marker::to_string(Marker::Scope scope) const
+{
+  size_t len = encoded_length();
+  std::string s(len, '\0');
+  encode(&s[0], len, scope);
+  return s;
+}
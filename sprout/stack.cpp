@@ -53,9 +53,13 @@ extern "C" {
 #include <list>
 #include <queue>
 #include <string>
+#include <atomic>
 
 #include "constants.h"
 #include "eventq.h"
+#include "mpmcq.h"
+#include "shardq.h"
+#include "laneq.h"
 #include "pjutils.h"
 #include "log.h"
 #include "sas.h"
@@ -66,6 +70,12 @@ extern "C" {
 #include "statistic.h"
 #include "custom_headers.h"
 #include "accumulator.h"
+#include "histogram.h"
+#include "admission_control.h"
+#include "rxdatapool.h"
+#include "cpuaffinity.h"
+#include "threadudp.h"
+#include "trailcache.h"
 
 struct stack_data_struct stack_data;
 
@@ -74,22 +84,159 @@ static std::vector<pj_thread_t*> worker_threads;
 static volatile pj_bool_t quit_flag;
 
 
-// Queue for incoming messages.
+// Queue for incoming messages.  By default this is an eventq, but a
+// lock-free ring can be selected at startup instead, in which case
+// rx_msg_ring is non-NULL and used in place of rx_msg_q.  Alternatively
+// messages can be sharded across the worker threads by Call-ID, or split
+// into priority lanes, in which case rx_msg_shards or rx_msg_lanes
+// respectively is non-NULL and used instead.  The same queue also carries
+// work that is continuing after waiting for something else (such as the
+// registration store), in which case callback is set instead of rdata.
 struct rx_msg_qe
 {
   pjsip_rx_data* rdata;    // received message
   struct timespec rx_time; // time at which it was received
+  unsigned int lane;       // priority lane, if using priority lanes
+  RxDataPool* pool;        // pool the message was cloned with
+  void (*callback)(void*); // work to continue, if not a received message
+  void* context;           // parameter to pass to callback
 };
 eventq<struct rx_msg_qe> rx_msg_q;
+static mpmcq<struct rx_msg_qe>* rx_msg_ring = NULL;
+static shardq<struct rx_msg_qe>* rx_msg_shards = NULL;
+static laneq<struct rx_msg_qe>* rx_msg_lanes = NULL;
+
+// Set once the worker threads are stopping, after which work can no longer
+// be continued on them.  stack_continue counts itself in continuing while
+// it checks the flag and queues the work, so stop_stack can wait for any
+// work already let through to be queued before it terminates the queues.
+static std::atomic<bool> workers_stopped(false);
+static std::atomic<int> continuing(0);
+
+// Capacity of the lock-free receive ring.  PJSIP threads block when the
+// ring is full.
+static const unsigned int RX_MSG_RING_SIZE = 65536;
+
+// Maximum number of messages a worker thread takes off the lock-free ring
+// at once.  This is kept small because workers can block for a long time
+// on HSS or store requests, and any messages they hold are stuck until
+// they finish.
+static const unsigned int RX_MSG_BATCH_SIZE = 4;
+
+// Capacity of each worker thread's shard when sharding by Call-ID.
+static const unsigned int RX_MSG_SHARD_SIZE = 16384;
+
+// Priority lanes, in priority order.  Messages that let existing
+// transactions and dialogs make progress come first, since delaying them
+// causes retransmissions.  New INVITEs (and other new requests) come next,
+// followed by REGISTER, OPTIONS and SUBSCRIBE, which are the requests most
+// likely to arrive in large bursts (for example after a network outage).
+enum RxLane
+{
+  RX_LANE_IN_PROGRESS = 0,
+  RX_LANE_NEW_CALL,
+  RX_LANE_BACKGROUND,
+  RX_LANE_COUNT
+};
 
+// Share of the worker threads' time given to each lane while they are all
+// backlogged, and the capacity of each lane.
+static const unsigned int RX_LANE_WEIGHTS[RX_LANE_COUNT] = {8, 3, 1};
+static const unsigned int RX_MSG_LANE_SIZE = 16384;
+
+// Minimum interval between reports of the shard and lane depths.
+static const uint64_t QUEUE_STATS_INTERVAL_US = 1000000;
+
+// Number of shards in the latency accumulators, which are updated by every
+// worker thread for every message.  Threads beyond this share shards.
+static const unsigned int LATENCY_ACCUMULATOR_SHARDS = 64;
+static std::atomic<uint64_t> queue_stats_time(0);
+static Statistic* shard_depth_stat = NULL;
+static Statistic* shard_stolen_stat = NULL;
+static Statistic* lane_depth_stat = NULL;
+static Statistic* sas_depth_stat = NULL;
+static Statistic* sas_dropped_stat = NULL;
+static Statistic* sas_sampling_stat = NULL;
+static Statistic* sas_capped_stat = NULL;
+static Accumulator* lane_latency_accumulators[RX_LANE_COUNT];
+
+
+// Maximum number of pools kept for cloning received messages.  Beyond
+// this, pools are released once the message has been processed.
+static const unsigned int RX_DATA_POOL_FREE = 1024;
+
+// Number of pools each worker thread creates up front for its node.
+static const unsigned int RX_DATA_POOL_RESERVE = 64;
+
+// Pools used to clone received messages, one per NUMA node that worker
+// threads are bound to (or just one if they aren't bound).  Each worker
+// thread fills its node's free list when it starts, so the pools' memory
+// is allocated on the node that processes the clones, and pools go back
+// to the list they came from.
+//
+// When messages are sharded by Call-ID, the transport thread knows which
+// worker will process a message and uses the pool for that worker's node.
+// Otherwise any worker may take it, so each PJSIP thread records in
+// thread-local data the pool for its own node if there are workers there,
+// or for the first worker's node if not.
+static std::vector<RxDataPool*> rx_data_pools;
+static pthread_key_t rx_data_pool_key;
+
+// Where to place the PJSIP and worker threads.
+static CpuAffinity pjsip_affinity;
+static CpuAffinity worker_affinity;
+
+// Number of UDP sockets opened on each listening port.  If this is more
+// than one, the sockets share the port using SO_REUSEPORT and the kernel
+// spreads incoming datagrams across them.  Each socket is owned by one
+// PJSIP thread, which reads it directly rather than through the endpoint's
+// ioqueue, so the load the kernel spreads reaches the threads.
+static unsigned int udp_sockets_per_port = 1;
+
+// The UDP sockets owned by each PJSIP thread.
+static std::vector<ThreadUdpPoller> pjsip_thread_udp;
+
+// Maximum time a PJSIP thread that owns UDP sockets waits on them before
+// handling the endpoint's timers and TCP connections.
+static const int UDP_POLL_MS = 1;
+
+// Number of concurrent reads PJSIP keeps outstanding on each UDP socket.
+static const unsigned int UDP_ASYNC_CNT = 50;
+
+// SAS trails of recent requests, keyed by the top Via branch.  Requests we
+// send are added so that their responses can be correlated, and requests we
+// receive are added so that ACKs and CANCELs for them can be.
+static const unsigned int TRAIL_CACHE_SIZE = 65536;
+static TrailCache trail_cache(TRAIL_CACHE_SIZE);
 
 static Accumulator* latency_accumulator;
 
+/// Returns the pool for cloning received messages to be processed on the
+/// given NUMA node.
+static RxDataPool* rx_data_pool(int node)
+{
+  return ((node >= 0) && (node < (int)rx_data_pools.size())) ?
+           rx_data_pools[node] : rx_data_pools[0];
+}
+
+// Distributions of the time transport threads spend on each received
+// message, the time messages spend on the receive queue and the time workers
+// spend processing them.
+static Histogram* transport_histogram;
+static Histogram* queue_wait_histogram;
+static Histogram* processing_histogram;
+static AdmissionControl* admission_control = NULL;
+
+// Retry-After value, in seconds, on 503 responses to requests rejected
+// because we are overloaded.
+static int overload_retry_after = 5;
+
 
 // We register a single module to handle scheduling plus local and
 // SAS logging.
 static pj_bool_t on_rx_msg(pjsip_rx_data* rdata);
 static pj_status_t on_tx_msg(pjsip_tx_data* tdata);
+static void sas_log_rx_msg(pjsip_rx_data* rdata);
 
 static pjsip_module mod_stack =
 {
@@ -108,19 +255,120 @@ static pjsip_module mod_stack =
   NULL,                               /* on_tsx_state()       */
 };
 
+/// Report the depth of each worker thread's shard and how many messages
+/// have been stolen from it by other worker threads, or the depth of each
+/// priority lane, along with the state of SAS reporting - the depth of the
+/// SAS queues, how many SAS messages have been dropped or capped and the
+/// effective sampling rate.  This is rate limited so can be called after
+/// every message.
+static void report_queue_stats()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+  uint64_t last_us = queue_stats_time.load();
+
+  if ((now_us >= last_us + QUEUE_STATS_INTERVAL_US) &&
+      (queue_stats_time.compare_exchange_strong(last_us, now_us)))
+  {
+    if (rx_msg_shards != NULL)
+    {
+      std::vector<std::string> depths;
+      std::vector<std::string> stolen;
+      for (unsigned int ii = 0; ii < rx_msg_shards->num_shards(); ++ii)
+      {
+        depths.push_back(std::to_string(rx_msg_shards->size(ii)));
+        stolen.push_back(std::to_string(rx_msg_shards->stolen(ii)));
+      }
+      shard_depth_stat->report_change(std::move(depths));
+      shard_stolen_stat->report_change(std::move(stolen));
+    }
+
+    if (rx_msg_lanes != NULL)
+    {
+      std::vector<std::string> depths;
+      for (unsigned int ii = 0; ii < rx_msg_lanes->num_lanes(); ++ii)
+      {
+        depths.push_back(std::to_string(rx_msg_lanes->size(ii)));
+      }
+      lane_depth_stat->report_change(std::move(depths));
+    }
+
+    std::vector<std::string> sas_depth;
+    sas_depth.push_back(std::to_string(SAS::queue_depth()));
+    sas_depth_stat->report_change(std::move(sas_depth));
+
+    std::vector<std::string> sas_dropped;
+    sas_dropped.push_back(std::to_string(SAS::events_dropped()));
+    sas_dropped_stat->report_change(std::move(sas_dropped));
+
+    // The sampling rate is the percentage of trails created since the last
+    // report that are being traced.
+    static unsigned long last_trails_created = 0;
+    static unsigned long last_trails_traced = 0;
+    unsigned long trails_created = SAS::trails_created();
+    unsigned long trails_traced = SAS::trails_traced();
+    if (trails_created > last_trails_created)
+    {
+      std::vector<std::string> sampling;
+      sampling.push_back(std::to_string((trails_traced - last_trails_traced) * 100 /
+                                        (trails_created - last_trails_created)));
+      sas_sampling_stat->report_change(std::move(sampling));
+    }
+    last_trails_created = trails_created;
+    last_trails_traced = trails_traced;
+
+    std::vector<std::string> sas_capped;
+    sas_capped.push_back(std::to_string(SAS::events_capped()));
+    sas_capped_stat->report_change(std::move(sas_capped));
+  }
+}
+
+
 /// PJSIP threads are donated to PJSIP to handle receiving at transport level
 /// and timers.
 static int pjsip_thread(void *p)
 {
   pj_time_val delay = {0, 10};
+  unsigned int index = (unsigned int)(intptr_t)p;
+
+  pjsip_affinity.bind(index);
 
-  PJ_UNUSED_ARG(p);
+  // Use the pool for this thread's node if there are worker threads on it.
+  int node = pjsip_affinity.node(index);
+  bool worker_on_node = false;
+  for (size_t ii = 0; ii < worker_threads.size(); ++ii)
+  {
+    worker_on_node = worker_on_node || (worker_affinity.node(ii) == node);
+  }
+  if (!worker_on_node)
+  {
+    node = worker_affinity.node(0);
+  }
+  pthread_setspecific(rx_data_pool_key, rx_data_pool(node));
 
   LOG_DEBUG("PJSIP thread started");
 
+  ThreadUdpPoller& udp = pjsip_thread_udp[index];
+  pj_time_val no_delay = {0, 0};
+
   while (!quit_flag)
   {
-    pjsip_endpt_handle_events(stack_data.endpt, &delay);
+    if (udp.is_empty())
+    {
+      pjsip_endpt_handle_events(stack_data.endpt, &delay);
+    }
+    else
+    {
+      // Wait on this thread's own UDP sockets, then deal with anything
+      // that is ready on the endpoint's ioqueue or timers.
+      udp.poll(UDP_POLL_MS);
+      pjsip_endpt_handle_events(stack_data.endpt, &no_delay);
+    }
+
+    // Make sure the queue statistics are reported even when the worker
+    // threads are idle.
+    report_queue_stats();
   }
 
   LOG_DEBUG("PJSIP thread ended");
@@ -129,7 +377,79 @@ static int pjsip_thread(void *p)
 }
 
 
-/// Worker threads handle most SIP message processing.
+/// Process a single message taken off the receive queue, and free it.
+static void process_rx_msg(struct rx_msg_qe& qe,
+                           pjsip_process_rdata_param* rp)
+{
+  if (qe.callback != NULL)
+  {
+    // This is work continuing rather than a received message.
+    qe.callback(qe.context);
+    return;
+  }
+
+  pjsip_rx_data* rdata = qe.rdata;
+  if (rdata)
+  {
+    LOG_DEBUG("Worker thread dequeue message %p", rdata);
+
+    struct timespec dequeue_time;
+    bool have_dequeue_time = (clock_gettime(CLOCK_MONOTONIC, &dequeue_time) == 0);
+    if (have_dequeue_time)
+    {
+      // Record how long the message spent on the queue.
+      long delay_us = (dequeue_time.tv_nsec - qe.rx_time.tv_nsec) / 1000L +
+                      (dequeue_time.tv_sec - qe.rx_time.tv_sec) * 1000000L;
+      delay_us = (delay_us > 0) ? delay_us : 0;
+      queue_wait_histogram->accumulate(delay_us);
+
+      if (admission_control != NULL)
+      {
+        admission_control->record_queue_delay(delay_us);
+      }
+
+      if (rx_msg_lanes != NULL)
+      {
+        lane_latency_accumulators[qe.lane]->accumulate(delay_us);
+        lane_latency_accumulators[qe.lane]->refresh();
+      }
+    }
+
+    // Log the message to SAS here rather than on the transport thread.
+    // The event carries the time the message was received.
+    sas_log_rx_msg(rdata);
+
+    pjsip_endpt_process_rx_data(stack_data.endpt, rdata, rp, NULL);
+    LOG_DEBUG("Worker thread completed processing message %p", rdata);
+    qe.pool->release(rdata);
+
+    struct timespec done_time;
+    if (clock_gettime(CLOCK_MONOTONIC, &done_time) == 0)
+    {
+      long latency_us = (done_time.tv_nsec - qe.rx_time.tv_nsec) / 1000L +
+                        (done_time.tv_sec - qe.rx_time.tv_sec) * 1000000L;
+      LOG_DEBUG("Request latency = %ldus", latency_us);
+      latency_accumulator->accumulate(latency_us);
+      latency_accumulator->refresh();
+
+      if (have_dequeue_time)
+      {
+        long processing_us = (done_time.tv_nsec - dequeue_time.tv_nsec) / 1000L +
+                             (done_time.tv_sec - dequeue_time.tv_sec) * 1000000L;
+        processing_histogram->accumulate((processing_us > 0) ? processing_us : 0);
+      }
+    }
+    else
+    {
+      LOG_ERROR("Failed to get done timestamp: %s", strerror(errno));
+    }
+  }
+}
+
+
+/// Worker threads handle most SIP message processing.  The parameter is
+/// the index of the worker thread, which is also its shard if messages are
+/// sharded by Call-ID.
 static int worker_thread(void* p)
 {
   // Set up data to always process incoming messages at the first PJSIP
@@ -139,35 +459,62 @@ static int worker_thread(void* p)
   rp.start_mod = &mod_stack;
   rp.idx_after_start = 1;
 
+  worker_affinity.bind((unsigned int)(intptr_t)p);
+
+  // Create pools for cloning the messages this thread will process, now
+  // that it is running on its own node.
+  rx_data_pool(worker_affinity.node((unsigned int)(intptr_t)p))->reserve(RX_DATA_POOL_RESERVE);
+
   LOG_DEBUG("Worker thread started");
 
-  struct rx_msg_qe qe = {0};
+  if (rx_msg_shards != NULL)
+  {
+    // Take messages from this thread's shard, or steal them from other
+    // threads' shards if they are backlogged.
+    unsigned int shard = (unsigned int)(intptr_t)p;
+    struct rx_msg_qe qe = {0};
 
-  while (rx_msg_q.pop(qe))
+    while (rx_msg_shards->pop(shard, qe))
+    {
+      process_rx_msg(qe, &rp);
+      report_queue_stats();
+    }
+  }
+  else if (rx_msg_lanes != NULL)
   {
-    pjsip_rx_data* rdata = qe.rdata;
-    if (rdata)
+    // Take messages from the priority lanes.
+    struct rx_msg_qe qe = {0};
+    unsigned int lane;
+
+    while (rx_msg_lanes->pop(qe, lane))
     {
-      LOG_DEBUG("Worker thread dequeue message %p", rdata);
-      pjsip_endpt_process_rx_data(stack_data.endpt, rdata, &rp, NULL);
-      LOG_DEBUG("Worker thread completed processing message %p", rdata);
-      pjsip_rx_data_free_cloned(rdata);
+      process_rx_msg(qe, &rp);
+      report_queue_stats();
+    }
+  }
+  else if (rx_msg_ring != NULL)
+  {
+    // Using the lock-free ring, so take messages off in small batches.
+    struct rx_msg_qe batch[RX_MSG_BATCH_SIZE];
+    unsigned int count;
 
-      struct timespec done_time;
-      if (clock_gettime(CLOCK_MONOTONIC, &done_time) == 0)
-      {
-        long latency_us = (done_time.tv_nsec - qe.rx_time.tv_nsec) / 1000L +
-                          (done_time.tv_sec - qe.rx_time.tv_sec) * 1000000L;
-        LOG_DEBUG("Request latency = %ldus", latency_us);
-        latency_accumulator->accumulate(latency_us);
-        latency_accumulator->refresh();
-      }
-      else
+    while ((count = rx_msg_ring->pop_batch(batch, RX_MSG_BATCH_SIZE)) > 0)
+    {
+      for (unsigned int ii = 0; ii < count; ++ii)
       {
-        LOG_ERROR("Failed to get done timestamp: %s", strerror(errno));
+        process_rx_msg(batch[ii], &rp);
       }
     }
   }
+  else
+  {
+    struct rx_msg_qe qe = {0};
+
+    while (rx_msg_q.pop(qe))
+    {
+      process_rx_msg(qe, &rp);
+    }
+  }
 
   LOG_DEBUG("Worker thread ended");
 
@@ -210,56 +557,26 @@ static void local_log_tx_msg(pjsip_tx_data* tdata)
 static void sas_log_rx_msg(pjsip_rx_data* rdata)
 {
   SAS::TrailId trail = 0;
+  const pj_str_t* branch = (rdata->msg_info.via != NULL) ?
+                             &rdata->msg_info.via->branch_param : NULL;
 
-  if (rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG)
-  {
-    // Message is a response, so try to correlate to an existing UAC
-    // transaction using the top-most Via header.
-    pj_str_t key;
-    pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_ROLE_UAC,
-                         &rdata->msg_info.cseq->method, rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_TRUE);
-    if (tsx)
-    {
-      // Found the UAC transaction, so get the trail if there is one.
-      trail = get_trail(tsx);
-
-      // Unlock tsx because it is locked in find_tsx()
-      pj_grp_lock_release(tsx->grp_lock);
-    }
-  }
-  else if (rdata->msg_info.msg->line.req.method.id == PJSIP_ACK_METHOD)
+  if ((branch != NULL) && (branch->slen > 0))
   {
-    // Message is an ACK, so try to correlate it to the existing UAS
-    // transaction using the top-most Via header.
-    pj_str_t key;
-    pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
-                         &rdata->msg_info.cseq->method, rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_TRUE);
-    if (tsx)
+    if ((rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG) ||
+        (rdata->msg_info.msg->line.req.method.id == PJSIP_ACK_METHOD) ||
+        (rdata->msg_info.msg->line.req.method.id == PJSIP_CANCEL_METHOD))
     {
-      // Found the UAS transaction, so get the trail if there is one.
-      trail = get_trail(tsx);
-
-      // Unlock tsx because it is locked in find_tsx()
-      pj_grp_lock_release(tsx->grp_lock);
+      // Responses share the branch of the request we sent, and ACKs and
+      // CANCELs the branch of the INVITE they relate to, so try to
+      // correlate them to that request's trail.
+      trail = trail_cache.lookup(branch->ptr, branch->slen);
     }
-  }
-  else if (rdata->msg_info.msg->line.req.method.id == PJSIP_CANCEL_METHOD)
-  {
-    // Message is a CANCEL request chasing an INVITE, so we want to try to
-    // correlate it to the INVITE trail for the purposes of SAS tracing.
-    pj_str_t key;
-    pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
-                         pjsip_get_invite_method(), rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_TRUE);
-    if (tsx)
+    else if (trail_cache.lookup(branch->ptr, branch->slen) == 0)
     {
-      // Found the INVITE UAS transaction, so get the trail if there is one.
-      trail = get_trail(tsx);
-
-      // Unlock tsx because it is locked in find_tsx()
-      pj_grp_lock_release(tsx->grp_lock);
+      // A new request, so start a new trail and remember it for any ACK or
+      // CANCEL.  Retransmissions don't replace the original trail.
+      trail = SAS::new_trail(1u);
+      trail_cache.insert(branch->ptr, branch->slen, trail);
     }
   }
 
@@ -273,8 +590,18 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
   // Store the trail in the message as it gets passed up the stack.
   set_trail(rdata, trail);
 
-  // Log the message event.
+  if ((rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG) &&
+      (rdata->msg_info.msg->line.status.code >= PJSIP_SC_INTERNAL_SERVER_ERROR))
+  {
+    // Server errors are always traced, even if the trail wasn't sampled.
+    SAS::force_trail(trail);
+  }
+
+  // Log the message event, with the time it was received rather than the
+  // time it was taken off the receive queue.
   SAS::Event event(trail, SASEvent::RX_SIP_MSG, 1u);
+  event.set_timestamp(rdata->pkt_info.timestamp.sec * 1000ull +
+                      rdata->pkt_info.timestamp.msec);
   event.add_static_param(pjsip_transport_get_type_from_flag(rdata->tp_info.transport->flag));
   event.add_static_param(rdata->pkt_info.src_port);
   event.add_var_param(rdata->pkt_info.src_name);
@@ -290,6 +617,28 @@ static void sas_log_tx_msg(pjsip_tx_data *tdata)
 
   if (trail != 0)
   {
+    if ((tdata->msg->type == PJSIP_REQUEST_MSG) &&
+        (tdata->msg->line.req.method.id != PJSIP_ACK_METHOD))
+    {
+      // Remember the trail so the responses can be correlated to it.
+      pjsip_via_hdr* via = (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg,
+                                                               PJSIP_H_VIA,
+                                                               NULL);
+      if ((via != NULL) && (via->branch_param.slen > 0))
+      {
+        trail_cache.insert(via->branch_param.ptr,
+                           via->branch_param.slen,
+                           trail);
+      }
+    }
+
+    if ((tdata->msg->type == PJSIP_RESPONSE_MSG) &&
+        (tdata->msg->line.status.code >= PJSIP_SC_INTERNAL_SERVER_ERROR))
+    {
+      // Server errors are always traced, even if the trail wasn't sampled.
+      SAS::force_trail(trail);
+    }
+
     // Log the message event.
     SAS::Event event(trail, SASEvent::TX_SIP_MSG, 1u);
     event.add_static_param(pjsip_transport_get_type_from_flag(tdata->tp_info.transport->flag));
@@ -307,6 +656,115 @@ static void sas_log_tx_msg(pjsip_tx_data *tdata)
 }
 
 
+/// Returns the number of messages waiting for a worker thread.
+static unsigned int rx_msg_q_depth()
+{
+  return (rx_msg_shards != NULL) ? rx_msg_shards->size() :
+         (rx_msg_lanes != NULL) ? rx_msg_lanes->size() :
+         (rx_msg_ring != NULL) ? rx_msg_ring->size() : rx_msg_q.size();
+}
+
+
+/// Returns true if the message is a request that starts a new dialog or
+/// transaction, and so is subject to admission control.  Responses, ACKs,
+/// CANCELs and in-dialog requests are always admitted, since rejecting them
+/// would waste the work already done on calls in progress.
+static bool is_new_request(pjsip_rx_data* rdata)
+{
+  if (rdata->msg_info.msg->type != PJSIP_REQUEST_MSG)
+  {
+    return false;
+  }
+
+  pjsip_method_e method = rdata->msg_info.msg->line.req.method.id;
+  if ((method == PJSIP_ACK_METHOD) || (method == PJSIP_CANCEL_METHOD))
+  {
+    return false;
+  }
+
+  return ((rdata->msg_info.to == NULL) ||
+          (rdata->msg_info.to->tag.slen == 0));
+}
+
+
+/// Returns true if the request is a retransmission of one that already has
+/// a transaction.  Retransmissions of initial requests have no To tag so
+/// look like new requests, but rejecting them would fail a transaction
+/// that is already in progress.  This takes the transaction layer lock, so
+/// is only done for requests we are about to reject.
+static bool is_retransmission(pjsip_rx_data* rdata)
+{
+  pj_str_t key;
+  pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_ROLE_UAS,
+                       &rdata->msg_info.cseq->method, rdata);
+  return (pjsip_tsx_layer_find_tsx(&key, PJ_FALSE) != NULL);
+}
+
+
+/// Rejects a request because we are overloaded.  This is done statelessly,
+/// so costs us as little as possible.
+static void reject_overload(pjsip_rx_data* rdata)
+{
+  pjsip_hdr hdr_list;
+  pj_list_init(&hdr_list);
+  pjsip_retry_after_hdr* retry_after =
+    pjsip_retry_after_hdr_create(rdata->tp_info.pool, overload_retry_after);
+  pj_list_push_back(&hdr_list, retry_after);
+
+  PJUtils::respond_stateless(stack_data.endpt,
+                             rdata,
+                             PJSIP_SC_SERVICE_UNAVAILABLE,
+                             NULL,
+                             &hdr_list,
+                             NULL);
+}
+
+
+/// Returns the priority lane for a message.
+static RxLane rx_lane(pjsip_rx_data* rdata)
+{
+  if (!is_new_request(rdata))
+  {
+    return RX_LANE_IN_PROGRESS;
+  }
+
+  pjsip_method_e method = rdata->msg_info.msg->line.req.method.id;
+  if ((method == PJSIP_REGISTER_METHOD) ||
+      (method == PJSIP_OPTIONS_METHOD) ||
+      (pj_strcmp2(&rdata->msg_info.msg->line.req.method.name,
+                  "SUBSCRIBE") == 0))
+  {
+    return RX_LANE_BACKGROUND;
+  }
+
+  return RX_LANE_NEW_CALL;
+}
+
+
+/// Returns a hash of the message's Call-ID, used to pick a worker thread
+/// when sharding by Call-ID.
+static unsigned int call_id_hash(pjsip_rx_data* rdata)
+{
+  return (rdata->msg_info.cid != NULL) ?
+           pj_hash_calc(0,
+                        rdata->msg_info.cid->id.ptr,
+                        rdata->msg_info.cid->id.slen) : 0;
+}
+
+
+/// Record how long a transport thread spent on a received message.
+static void record_transport_time(const struct timespec& rx_time)
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+  {
+    long transport_us = (now.tv_nsec - rx_time.tv_nsec) / 1000L +
+                        (now.tv_sec - rx_time.tv_sec) * 1000000L;
+    transport_histogram->accumulate((transport_us > 0) ? transport_us : 0);
+  }
+}
+
+
 static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
 {
   // Before we start, get a timestamp.  This will track the time from
@@ -318,13 +776,42 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
     return PJ_TRUE;
   }
 
-  // Do logging.
+  // Do logging.  SAS logging is left to the worker thread unless the
+  // message is rejected here.
   local_log_rx_msg(rdata);
-  sas_log_rx_msg(rdata);
 
-  // Clone the message and queue it to a scheduler thread.
+  // Reject new requests before cloning them if the worker threads aren't
+  // keeping up.  New requests start a new trail, so logging them to SAS is
+  // cheap.
+  if ((admission_control != NULL) &&
+      (is_new_request(rdata)) &&
+      (!admission_control->admit_request(rx_msg_q_depth())) &&
+      (!is_retransmission(rdata)))
+  {
+    sas_log_rx_msg(rdata);
+    reject_overload(rdata);
+    record_transport_time(qe.rx_time);
+    return PJ_TRUE;
+  }
+
+  // Clone the message and queue it to a scheduler thread, using the pool
+  // for the NUMA node it will be processed on.
+  unsigned int hash = 0;
+  if (rx_msg_shards != NULL)
+  {
+    hash = call_id_hash(rdata);
+    qe.pool = rx_data_pool(worker_affinity.node(rx_msg_shards->shard(hash)));
+  }
+  else
+  {
+    qe.pool = (RxDataPool*)pthread_getspecific(rx_data_pool_key);
+    if (qe.pool == NULL)
+    {
+      qe.pool = rx_data_pools[0];
+    }
+  }
   pjsip_rx_data* clone_rdata;
-  pj_status_t status = pjsip_rx_data_clone(rdata, 0, &clone_rdata);
+  pj_status_t status = qe.pool->clone(rdata, &clone_rdata);
 
   if (status != PJ_SUCCESS)
   {
@@ -333,24 +820,118 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
     return PJ_TRUE;
   }
 
-  // Make sure the trail identifier is passed across.
-  set_trail(clone_rdata, get_trail(rdata));
-
-  // @TODO - need to think about back-pressure mechanisms.  For example,
-  // should we have a maximum depth of queue and drop messages after that?
-  // May be better to hold on to the message until the queue has space - this
-  // will force back pressure on the particular TCP connection.  Or should we
-  // have a queue per transport and round-robin them?
-
   LOG_DEBUG("Queuing cloned received message %p for worker threads", clone_rdata);
   qe.rdata = clone_rdata;
-  rx_msg_q.push(qe);
+  qe.callback = NULL;
+  if (rx_msg_shards != NULL)
+  {
+    // Keep all messages for a dialog on the same worker thread, so they
+    // don't contend for the same transaction and dialog locks.
+    rx_msg_shards->push(qe, hash);
+  }
+  else if (rx_msg_lanes != NULL)
+  {
+    // Only block the transport thread if the in-progress lane is full.
+    // Blocking on a lower lane would hold up in-progress messages behind
+    // new requests, so new requests are rejected instead (unless they are
+    // retransmissions, which are just dropped).
+    qe.lane = rx_lane(rdata);
+    if (qe.lane == RX_LANE_IN_PROGRESS)
+    {
+      rx_msg_lanes->push(qe, qe.lane);
+    }
+    else if (!rx_msg_lanes->push_noblock(qe, qe.lane))
+    {
+      LOG_DEBUG("Priority lane %d full, rejecting message %p",
+                qe.lane, clone_rdata);
+      qe.pool->release(clone_rdata);
+      if (!is_retransmission(rdata))
+      {
+        sas_log_rx_msg(rdata);
+        reject_overload(rdata);
+      }
+    }
+  }
+  else if (rx_msg_ring != NULL)
+  {
+    rx_msg_ring->push(qe);
+  }
+  else
+  {
+    rx_msg_q.push(qe);
+  }
+
+  record_transport_time(qe.rx_time);
 
   // return TRUE to flag that we have absorbed the incoming message.
   return PJ_TRUE;
 }
 
 
+/// Queue work to continue on a worker thread, for example once a response
+/// arrives from the registration store.  The work goes on the same shard as
+/// messages with the given Call-ID (if any), and in the highest priority
+/// lane as it is for a request already in progress.
+bool stack_continue(void (*callback)(void*),
+                    void* context,
+                    const pj_str_t* call_id)
+{
+  continuing++;
+  if (workers_stopped)
+  {
+    continuing--;
+    LOG_WARNING("Dropping work to continue as the worker threads have stopped");
+    return false;
+  }
+
+  struct rx_msg_qe qe = {0};
+  clock_gettime(CLOCK_MONOTONIC, &qe.rx_time);
+  qe.callback = callback;
+  qe.context = context;
+
+  bool queued;
+  if (rx_msg_shards != NULL)
+  {
+    queued = rx_msg_shards->push(qe, (call_id != NULL) ?
+                                       pj_hash_calc(0, call_id->ptr, call_id->slen) : 0);
+  }
+  else if (rx_msg_lanes != NULL)
+  {
+    qe.lane = RX_LANE_IN_PROGRESS;
+    queued = rx_msg_lanes->push(qe, qe.lane);
+  }
+  else if (rx_msg_ring != NULL)
+  {
+    queued = rx_msg_ring->push(qe);
+  }
+  else
+  {
+    queued = rx_msg_q.push(qe);
+  }
+
+  continuing--;
+  return queued;
+}
+
+
+/// Run any work queued by stack_continue on the calling thread.  This is for
+/// UTs, which don't start the worker threads, so only takes work off the
+/// default queue.
+void stack_run_continuations()
+{
+  struct rx_msg_qe qe = {0};
+  while (rx_msg_q.size() > 0)
+  {
+    qe.callback = NULL;
+    rx_msg_q.pop(qe, 0);
+    if (qe.callback != NULL)
+    {
+      qe.callback(qe.context);
+    }
+  }
+}
+
+
 static pj_status_t on_tx_msg(pjsip_tx_data* tdata)
 {
   // Do logging.
@@ -404,17 +985,46 @@ pj_status_t create_listener_transports(int port, pjsip_tpfactory** tcp_factory)
   published_name.host = stack_data.local_host;
   published_name.port = port;
 
-  status = pjsip_udp_transport_start(stack_data.endpt,
-                                     &addr,
-                                     &published_name,
-                                     50,
-                                     NULL);
-  if (status != PJ_SUCCESS)
+  if (udp_sockets_per_port <= 1)
   {
-    LOG_ERROR("Failed to start UDP transport for port %d (%s)", port, PJUtils::pj_status_to_string(status).c_str());
-    return status;
+    status = pjsip_udp_transport_start(stack_data.endpt,
+                                       &addr,
+                                       &published_name,
+                                       UDP_ASYNC_CNT,
+                                       NULL);
+    if (status != PJ_SUCCESS)
+    {
+      LOG_ERROR("Failed to start UDP transport for port %d (%s)", port, PJUtils::pj_status_to_string(status).c_str());
+      return status;
+    }
+  }
+  else
+  {
+    // Open several sockets sharing the port, and give them to the PJSIP
+    // threads round-robin.  Responses go out on the socket the request
+    // arrived on, and new requests on the first socket.
+    for (unsigned int ii = 0; ii < udp_sockets_per_port; ++ii)
+    {
+      thread_udp_transport* tp;
+      status = thread_udp_transport_create(stack_data.endpt,
+                                           &addr,
+                                           &published_name,
+                                           (ii == 0) ? PJ_TRUE : PJ_FALSE,
+                                           &tp);
+      if (status != PJ_SUCCESS)
+      {
+        LOG_ERROR("Failed to start UDP transport %d for port %d (%s)", ii, port, PJUtils::pj_status_to_string(status).c_str());
+        return status;
+      }
+      pjsip_thread_udp[ii % pjsip_thread_udp.size()].add(tp);
+    }
+    LOG_STATUS("Opened %d UDP sockets on port %d, each read by one of %d PJSIP threads",
+               udp_sockets_per_port, port, (int)pjsip_thread_udp.size());
   }
 
+  // There is a single TCP listener per port.  PJSIP's TCP listener gives
+  // no way to set SO_REUSEPORT before it binds, and accepted connections
+  // are registered on the endpoint's ioqueue, which all PJSIP threads poll.
   status = pjsip_tcp_transport_start2(stack_data.endpt,
                                       &addr,
                                       &published_name,
@@ -481,7 +1091,15 @@ pj_status_t init_stack(const std::string& system_name,
                        const std::string& sprout_cluster_domain,
                        const std::string& alias_hosts,
                        int num_pjsip_threads,
-                       int num_worker_threads)
+                       int num_worker_threads,
+                       bool lockfree_rx_queue,
+                       RxDispatch rx_dispatch,
+                       unsigned long target_latency_us,
+                       unsigned int max_queue_depth,
+                       int retry_after,
+                       const std::string& pjsip_cpus,
+                       const std::string& worker_cpus,
+                       int udp_sockets)
 {
   pj_status_t status;
   pj_sockaddr pri_addr;
@@ -493,6 +1111,52 @@ pj_status_t init_stack(const std::string& system_name,
   // start_stack is called.
   pjsip_threads.resize(num_pjsip_threads);
   worker_threads.resize(num_worker_threads);
+  pjsip_thread_udp.resize(num_pjsip_threads);
+
+  // Work out how many UDP sockets to open on each port - zero means one
+  // for each PJSIP thread.
+  udp_sockets_per_port = (udp_sockets > 0) ? udp_sockets : num_pjsip_threads;
+
+  // Work out where to run the threads, and log the layout.
+  if ((!pjsip_affinity.parse(pjsip_cpus)) ||
+      (!worker_affinity.parse(worker_cpus)))
+  {
+    return PJ_EINVAL;
+  }
+
+  for (int ii = 0; ii < num_pjsip_threads; ++ii)
+  {
+    LOG_STATUS("PJSIP thread %d runs on %s",
+               ii, pjsip_affinity.describe(ii).c_str());
+  }
+
+  for (int ii = 0; ii < num_worker_threads; ++ii)
+  {
+    LOG_STATUS("Worker thread %d runs on %s",
+               ii, worker_affinity.describe(ii).c_str());
+  }
+
+  // Create the sharded queues or lock-free receive ring if requested.
+  // Otherwise messages are passed to the worker threads through rx_msg_q.
+  if (rx_dispatch == RX_DISPATCH_CALLID)
+  {
+    LOG_STATUS("Sharding received messages across worker threads by Call-ID");
+    rx_msg_shards = new shardq<struct rx_msg_qe>(num_worker_threads,
+                                                 RX_MSG_SHARD_SIZE);
+  }
+  else if (rx_dispatch == RX_DISPATCH_PRIORITY)
+  {
+    LOG_STATUS("Using priority lanes for received messages, weights %d:%d:%d",
+               RX_LANE_WEIGHTS[0], RX_LANE_WEIGHTS[1], RX_LANE_WEIGHTS[2]);
+    std::vector<unsigned int> weights(RX_LANE_WEIGHTS,
+                                      RX_LANE_WEIGHTS + RX_LANE_COUNT);
+    rx_msg_lanes = new laneq<struct rx_msg_qe>(weights, RX_MSG_LANE_SIZE);
+  }
+  else if (lockfree_rx_queue)
+  {
+    LOG_STATUS("Using lock-free receive queue, capacity %d", RX_MSG_RING_SIZE);
+    rx_msg_ring = new mpmcq<struct rx_msg_qe>(RX_MSG_RING_SIZE);
+  }
 
   // Get ports and host names specified on options.  If local host was not
   // specified, use the host name returned by pj_gethostname.
@@ -519,6 +1183,17 @@ pj_status_t init_stack(const std::string& system_name,
   // Initialise PJSIP and all the associated resources.
   status = init_pjsip();
 
+  // Create the pools used to clone received messages for the worker
+  // threads.
+  int num_rx_data_pools = (worker_affinity.max_node() >= 0) ?
+                                    worker_affinity.max_node() + 1 : 1;
+  for (int ii = 0; ii < num_rx_data_pools; ++ii)
+  {
+    rx_data_pools.push_back(new RxDataPool(&stack_data.cp.factory,
+                                           RX_DATA_POOL_FREE));
+  }
+  pthread_key_create(&rx_data_pool_key, NULL);
+
   // Register the stack module.
   pjsip_endpt_register_module(stack_data.endpt, &mod_stack);
   stack_data.module_id = mod_stack.id;
@@ -599,10 +1274,53 @@ pj_status_t init_stack(const std::string& system_name,
                stack_data.name[i].ptr);
   }
 
-  stack_data.stats_aggregator = new LastValueCache(Statistic::known_stats_count(),
-                                                   Statistic::known_stats());
+  stack_data.stats_aggregator = new LastValueCache();
+  Statistic::set_last_value_cache(stack_data.stats_aggregator);
+
+  latency_accumulator = new StatisticAccumulator("latency_us",
+                                                 Accumulator::DEFAULT_PERIOD_US,
+                                                 LATENCY_ACCUMULATOR_SHARDS);
+  transport_histogram = new StatisticHistogram("transport_us");
+  queue_wait_histogram = new StatisticHistogram("queue_wait_us");
+  processing_histogram = new StatisticHistogram("processing_us");
+  sas_depth_stat = new Statistic("sas_queue_depth");
+  sas_dropped_stat = new Statistic("sas_events_dropped");
+  sas_sampling_stat = new Statistic("sas_sampling_percent");
+  sas_capped_stat = new Statistic("sas_events_capped");
+
+  if (rx_msg_shards != NULL)
+  {
+    shard_depth_stat = new Statistic("worker_queue_depths");
+    shard_stolen_stat = new Statistic("worker_queue_stolen");
+  }
 
-  latency_accumulator = new StatisticAccumulator("latency_us");
+  if (rx_msg_lanes != NULL)
+  {
+    lane_depth_stat = new Statistic("rx_lane_depths");
+    lane_latency_accumulators[RX_LANE_IN_PROGRESS] =
+      new StatisticAccumulator("rx_lane_in_progress_latency_us",
+                               Accumulator::DEFAULT_PERIOD_US,
+                               LATENCY_ACCUMULATOR_SHARDS);
+    lane_latency_accumulators[RX_LANE_NEW_CALL] =
+      new StatisticAccumulator("rx_lane_new_call_latency_us",
+                               Accumulator::DEFAULT_PERIOD_US,
+                               LATENCY_ACCUMULATOR_SHARDS);
+    lane_latency_accumulators[RX_LANE_BACKGROUND] =
+      new StatisticAccumulator("rx_lane_background_latency_us",
+                               Accumulator::DEFAULT_PERIOD_US,
+                               LATENCY_ACCUMULATOR_SHARDS);
+  }
+
+  overload_retry_after = retry_after;
+
+  // Enable admission control if a target queueing latency or a maximum
+  // queue depth was specified.  It is off by default.
+  if ((target_latency_us != 0) || (max_queue_depth != 0))
+  {
+    admission_control = new AdmissionControl(target_latency_us,
+                                             max_queue_depth,
+                                             retry_after);
+  }
 
   return status;
 }
@@ -613,6 +1331,7 @@ pj_status_t start_stack()
   pj_status_t status = PJ_SUCCESS;
 
   quit_flag = PJ_FALSE;
+  workers_stopped = false;
 
   // Create worker threads first as they take work from the PJSIP threads so
   // need to be ready.
@@ -620,7 +1339,7 @@ pj_status_t start_stack()
   {
     pj_thread_t* thread;
     status = pj_thread_create(stack_data.pool, "worker", &worker_thread,
-                              NULL, 0, 0, &thread);
+                              (void*)ii, 0, 0, &thread);
     if (status != PJ_SUCCESS)
     {
       LOG_ERROR("Error creating worker thread, %s",
@@ -635,7 +1354,7 @@ pj_status_t start_stack()
   {
     pj_thread_t* thread;
     status = pj_thread_create(stack_data.pool, "pjsip", &pjsip_thread,
-                              NULL, 0, 0, &thread);
+                              (void*)ii, 0, 0, &thread);
     if (status != PJ_SUCCESS)
     {
       LOG_ERROR("Error creating PJSIP thread, %s",
@@ -667,9 +1386,34 @@ void stop_stack()
     pj_thread_join(*i);
   }
 
+  // Stop work being continued on the worker threads, for example by the
+  // registration store's threads, and wait for any that is already being
+  // queued.  Otherwise it could be queued after the workers have gone, or
+  // block forever on a full queue.
+  workers_stopped = true;
+  while (continuing > 0)
+  {
+    pj_thread_sleep(1);
+  }
+
   // Now it is safe to signal the worker threads to exit via the queue and to
   // wait for them to terminate.
-  rx_msg_q.terminate();
+  if (rx_msg_shards != NULL)
+  {
+    rx_msg_shards->terminate();
+  }
+  else if (rx_msg_lanes != NULL)
+  {
+    rx_msg_lanes->terminate();
+  }
+  else if (rx_msg_ring != NULL)
+  {
+    rx_msg_ring->terminate();
+  }
+  else
+  {
+    rx_msg_q.terminate();
+  }
   for (std::vector<pj_thread_t*>::iterator i = worker_threads.begin();
        i != worker_threads.end();
        ++i)
@@ -703,9 +1447,60 @@ void destroy_stack(void)
   // Tear down the stack.
   delete latency_accumulator;
   latency_accumulator = NULL;
+  delete transport_histogram;
+  transport_histogram = NULL;
+  delete queue_wait_histogram;
+  queue_wait_histogram = NULL;
+  delete processing_histogram;
+  processing_histogram = NULL;
+  delete sas_depth_stat;
+  sas_depth_stat = NULL;
+  delete sas_dropped_stat;
+  sas_dropped_stat = NULL;
+  delete sas_sampling_stat;
+  sas_sampling_stat = NULL;
+  delete sas_capped_stat;
+  sas_capped_stat = NULL;
+  delete admission_control;
+  admission_control = NULL;
+  // Stop publishing statistics before the last value cache goes away.
+  // Some statistics outlive the stack, so the reporter thread is still
+  // running.
+  Statistic::set_last_value_cache(NULL);
   delete stack_data.stats_aggregator;
+  stack_data.stats_aggregator = NULL;
+  delete rx_msg_ring;
+  rx_msg_ring = NULL;
+  delete rx_msg_shards;
+  rx_msg_shards = NULL;
+  delete shard_depth_stat;
+  shard_depth_stat = NULL;
+  delete shard_stolen_stat;
+  shard_stolen_stat = NULL;
+  if (rx_msg_lanes != NULL)
+  {
+    delete lane_depth_stat;
+    lane_depth_stat = NULL;
+    for (int ii = 0; ii < RX_LANE_COUNT; ++ii)
+    {
+      delete lane_latency_accumulators[ii];
+      lane_latency_accumulators[ii] = NULL;
+    }
+    delete rx_msg_lanes;
+    rx_msg_lanes = NULL;
+  }
   pjsip_threads.clear();
   worker_threads.clear();
+  pjsip_thread_udp.clear();
+
+  // Release the pools used for cloning received messages before PJSIP's
+  // pool factory goes away.
+  for (size_t ii = 0; ii < rx_data_pools.size(); ++ii)
+  {
+    delete rx_data_pools[ii];
+  }
+  rx_data_pools.clear();
+  pthread_key_delete(rx_data_pool_key);
 
   SAS::term();
 
@@ -78,6 +78,10 @@
 /// * add headers
 /// * UASTransaction::init_uac_transactions
 ///
+/// If finding targets means waiting for the registration store, the worker
+/// thread moves on, and UASTransaction::on_targets_found picks up from
+/// there (on a worker thread) once the store returns the bindings.
+///
 /// UASTransaction::init_uac_transactions takes a list of targets and
 /// does:
 /// * create transaction
@@ -126,6 +130,8 @@ extern "C" {
 #include "aschain.h"
 #include "registration_utils.h"
 #include "custom_headers.h"
+#include "histogram.h"
+#include "counter.h"
 
 static RegData::Store* store;
 
@@ -144,6 +150,13 @@ static FlowTable* flow_table;
 static AsChainTable* as_chain_table;
 static HSSConnection* hss;
 
+// Time from creating a UAS transaction to sending its final response.
+static Histogram* transaction_latency = NULL;
+
+// Numbers of UAS and UAC transactions in progress.
+static Gauge* uas_transactions = NULL;
+static Gauge* uac_transactions = NULL;
+
 static bool ibcf = false;
 
 PJUtils::host_list_t trusted_hosts(&PJUtils::compare_pj_sockaddr);
@@ -586,7 +599,7 @@ void process_cancel_request(pjsip_rx_data* rdata)
   // we receive final response from the UAC INVITE transaction.
   LOG_DEBUG("%s - Cancel for UAS transaction", invite_uas->obj_name);
   UASTransaction *uas_data = UASTransaction::get_from_tsx(invite_uas);
-  uas_data->cancel_pending_uac_tsx(0, false);
+  uas_data->handle_cancel();
 
   // Unlock UAS tsx because it is locked in find_tsx()
   pj_grp_lock_release(invite_uas->grp_lock);
@@ -1240,16 +1253,113 @@ static pj_status_t proxy_process_routing(pjsip_tx_data *tdata)
 ///@{
 // IN-TRANSACTION PROCESSING
 
-/// Calculate a list of targets for the message.
+/// Add targets for the bindings of an AoR read from the registration store.
+static void add_targets_from_bindings(const std::string& aor,
+                                      RegData::AoR* aor_data,
+                                      pj_pool_t* pool,
+                                      target_list& targets,
+                                      int max_targets)
+{
+  // Pick up to max_targets bindings to attempt to contact.  Since
+  // some of these may be stale, and we don't want stale bindings to
+  // push live bindings out, we sort by expiry time and pick those
+  // with the most distant expiry times.  See bug 45.
+  std::list<RegData::AoR::Bindings::value_type> target_bindings;
+  if (aor_data != NULL)
+  {
+    const RegData::AoR::Bindings& bindings = aor_data->bindings();
+    if ((int)bindings.size() <= max_targets)
+    {
+      for (RegData::AoR::Bindings::const_iterator i = bindings.begin();
+           i != bindings.end();
+           ++i)
+      {
+        target_bindings.push_back(*i);
+      }
+    }
+    else
+    {
+      std::multimap<int, RegData::AoR::Bindings::value_type> ordered;
+      for (RegData::AoR::Bindings::const_iterator i = bindings.begin();
+           i != bindings.end();
+           ++i)
+      {
+        std::pair<int, RegData::AoR::Bindings::value_type> p = std::make_pair(i->second->_expires, *i);
+        ordered.insert(p);
+      }
+
+      int num_contacts = 0;
+      for (std::multimap<int, RegData::AoR::Bindings::value_type>::const_reverse_iterator i = ordered.rbegin();
+           num_contacts < max_targets;
+           ++i)
+      {
+        target_bindings.push_back(i->second);
+        num_contacts++;
+      }
+    }
+  }
+
+  for (std::list<RegData::AoR::Bindings::value_type>::const_iterator i = target_bindings.begin();
+       i != target_bindings.end();
+       ++i)
+  {
+    RegData::AoR::Binding* binding = i->second;
+    LOG_DEBUG("Target = %s", binding->_uri.c_str());
+    bool useable_contact = true;
+    target target;
+    target.from_store = PJ_TRUE;
+    target.aor = aor;
+    target.binding_id = i->first;
+    target.uri = PJUtils::uri_from_string(binding->_uri, pool);
+    if (target.uri == NULL)
+    {
+      LOG_WARNING("Ignoring badly formed contact URI %s for target %s",
+                  binding->_uri.c_str(), aor.c_str());
+      useable_contact = false;
+    }
+    else
+    {
+      for (std::list<std::string>::const_iterator j = binding->_path_headers.begin();
+           j != binding->_path_headers.end();
+           ++j)
+      {
+        pjsip_uri* path = PJUtils::uri_from_string(*j, pool);
+        if (path != NULL)
+        {
+          target.paths.push_back(path);
+        }
+        else
+        {
+          LOG_WARNING("Ignoring contact %s for target %s because of badly formed path header %s",
+                      binding->_uri.c_str(), aor.c_str(), (*j).c_str());
+          useable_contact = false;
+          break;
+        }
+      }
+    }
+
+    if (useable_contact)
+    {
+      targets.push_back(target);
+    }
+  }
+}
+
+/// Calculate a list of targets for the message.  If a callback is supplied
+/// and the targets depend on bindings the registration store can't return
+/// straight away, returns false without any targets, and the store passes
+/// the bindings to the callback once it has read them.  Otherwise returns
+/// true.
 #ifndef UNIT_TEST
 static
 #endif
-void proxy_calculate_targets(pjsip_msg* msg,
+bool proxy_calculate_targets(pjsip_msg* msg,
                              pj_pool_t* pool,
                              const TrustBoundary* trust,
                              target_list& targets,
                              int max_targets,
-                             SAS::TrailId trail)
+                             SAS::TrailId trail,
+                             RegData::Store::GetCallback* callback)
 {
   // RFC 3261 Section 16.5 Determining Request Targets
 
@@ -1264,7 +1374,7 @@ void proxy_calculate_targets(pjsip_msg* msg,
     target target;
     target.uri = (pjsip_uri*)req_uri;
     targets.push_back(target);
-    return;
+    return true;
   }
 
   // If the domain of the Request-URI indicates a domain this element is
@@ -1309,7 +1419,7 @@ void proxy_calculate_targets(pjsip_msg* msg,
     }
 
     targets.push_back(target);
-    return;
+    return true;
   }
 
   if (edge_proxy)
@@ -1359,7 +1469,7 @@ void proxy_calculate_targets(pjsip_msg* msg,
     target.transport = upstream_conn_pool->get_connection();
 
     targets.push_back(target);
-    return;
+    return true;
   }
 
   // If the target set for the request has not been predetermined as
@@ -1380,96 +1490,28 @@ void proxy_calculate_targets(pjsip_msg* msg,
 
       // Look up the target in the registration data store.
       LOG_INFO("Look up targets in registration store: %s", aor.c_str());
-      RegData::AoR* aor_data = store->get_aor_data(aor);
-
-      // Pick up to max_targets bindings to attempt to contact.  Since
-      // some of these may be stale, and we don't want stale bindings to
-      // push live bindings out, we sort by expiry time and pick those
-      // with the most distant expiry times.  See bug 45.
-      std::list<RegData::AoR::Bindings::value_type> target_bindings;
-      if (aor_data != NULL)
+      RegData::AoR* aor_data = NULL;
+      if (callback != NULL)
       {
-        const RegData::AoR::Bindings& bindings = aor_data->bindings();
-        if ((int)bindings.size() <= max_targets)
+        if (!store->get_aor_data_async(aor, callback, aor_data))
         {
-          for (RegData::AoR::Bindings::const_iterator i = bindings.begin();
-               i != bindings.end();
-               ++i)
-          {
-            target_bindings.push_back(*i);
-          }
-        }
-        else
-        {
-          std::multimap<int, RegData::AoR::Bindings::value_type> ordered;
-          for (RegData::AoR::Bindings::const_iterator i = bindings.begin();
-               i != bindings.end();
-               ++i)
-          {
-            std::pair<int, RegData::AoR::Bindings::value_type> p = std::make_pair(i->second->_expires, *i);
-            ordered.insert(p);
-          }
-
-          int num_contacts = 0;
-          for (std::multimap<int, RegData::AoR::Bindings::value_type>::const_reverse_iterator i = ordered.rbegin();
-               num_contacts < max_targets;
-               ++i)
-          {
-            target_bindings.push_back(i->second);
-            num_contacts++;
-          }
+          // The store will pass the bindings to the callback.
+          delete uris;
+          return false;
         }
       }
-
-      for (std::list<RegData::AoR::Bindings::value_type>::const_iterator i = target_bindings.begin();
-           i != target_bindings.end();
-           ++i)
+      else
       {
-        RegData::AoR::Binding* binding = i->second;
-        LOG_DEBUG("Target = %s", binding->_uri.c_str());
-        bool useable_contact = true;
-        target target;
-        target.from_store = PJ_TRUE;
-        target.aor = aor;
-        target.binding_id = i->first;
-        target.uri = PJUtils::uri_from_string(binding->_uri, pool);
-        if (target.uri == NULL)
-        {
-          LOG_WARNING("Ignoring badly formed contact URI %s for target %s",
-                      binding->_uri.c_str(), aor.c_str());
-          useable_contact = false;
-        }
-        else
-        {
-          for (std::list<std::string>::const_iterator j = binding->_path_headers.begin();
-               j != binding->_path_headers.end();
-               ++j)
-          {
-            pjsip_uri* path = PJUtils::uri_from_string(*j, pool);
-            if (path != NULL)
-            {
-              target.paths.push_back(path);
-            }
-            else
-            {
-              LOG_WARNING("Ignoring contact %s for target %s because of badly formed path header %s",
-                          binding->_uri.c_str(), aor.c_str(), (*j).c_str());
-              useable_contact = false;
-              break;
-            }
-          }
-        }
-
-        if (useable_contact)
-        {
-          targets.push_back(target);
-        }
+        aor_data = store->get_aor_data(aor);
       }
 
+      add_targets_from_bindings(aor, aor_data, pool, targets, max_targets);
       delete aor_data;
     }
     delete uris;
   }
+
+  return true;
 }
 
 
@@ -1615,8 +1657,13 @@ UASTransaction::UASTransaction(pjsip_transaction* tsx,
   _proxy(NULL),
   _pending_destroy(false),
   _context_count(0),
+  _start_time_us(Histogram::get_timestamp_us()),
   _as_chain_link(),
-  _victims()
+  _victims(),
+  _lookup_call_id(NULL),
+  _lookup_aor(),
+  _lookup_data(NULL),
+  _cancelled(false)
 {
   for (int ii = 0; ii < MAX_FORKING; ++ii)
   {
@@ -1643,6 +1690,11 @@ UASTransaction::UASTransaction(pjsip_transaction* tsx,
   log_on_tsx_start(rdata);
 
   _tsx->mod_data[mod_tu.id] = this;
+
+  if (uas_transactions != NULL)
+  {
+    uas_transactions->increment();
+  }
 }
 
 /// UASTransaction destructor.  On entry, the group lock must be held.  On
@@ -1653,6 +1705,11 @@ UASTransaction::~UASTransaction()
 
   pj_assert(_context_count == 0);
 
+  if (uas_transactions != NULL)
+  {
+    uas_transactions->decrement();
+  }
+
   if (_tsx != NULL)
   {
     _tsx->mod_data[mod_tu.id] = NULL;
@@ -2025,10 +2082,87 @@ void UASTransaction::handle_outgoing_non_cancel(target* target)
   }
   else
   {
-    // Find targets.
-    proxy_calculate_targets(_req->msg, _req->pool, _trust, targets, MAX_FORKING, trail());
+    // Find targets.  If the registration store can't return the bindings
+    // straight away, wait for them without holding up this thread.
+    pjsip_cid_hdr* cid = PJSIP_MSG_CID_HDR(_req->msg);
+    _lookup_call_id = (cid != NULL) ? &cid->id : NULL;
+    if (!proxy_calculate_targets(_req->msg, _req->pool, _trust, targets, MAX_FORKING, trail(), this))
+    {
+      // Stay in context while waiting, so the transaction isn't destroyed
+      // before the bindings arrive.  The lock is released as normal.
+      LOG_DEBUG("Waiting for bindings from registration store");
+      _context_count++;
+      return;
+    }
   }
 
+  route_to_targets(targets);
+}
+
+// Called by the registration store, on one of its own threads, once it has
+// read the bindings for the request's target.  Passes them back to a worker
+// thread to continue routing the request.
+void UASTransaction::get_complete(const std::string& aor_id,
+                                  RegData::AoR* aor_data)
+{
+  _lookup_aor = aor_id;
+  _lookup_data = aor_data;
+  if (!stack_continue(&on_targets_found, (void*)this, _lookup_call_id))
+  {
+    // LCOV_EXCL_START - only happens when shutting down
+    // on_targets_found won't run, so drop the context held while waiting
+    // for the bindings here instead.
+    pj_grp_lock_acquire(_lock);
+    delete _lookup_data;
+    _lookup_data = NULL;
+    exit_context();
+    // LCOV_EXCL_STOP
+  }
+}
+
+// Continues routing a request on a worker thread once the registration store
+// has returned the bindings for its target.
+void UASTransaction::on_targets_found(void* p)
+{
+  UASTransaction* uas_data = (UASTransaction*)p;
+
+  // We're already in the transaction's context, so just take the lock.
+  pj_grp_lock_acquire(uas_data->_lock);
+
+  if ((uas_data->_tsx == NULL) ||
+      (uas_data->_tsx->state >= PJSIP_TSX_STATE_COMPLETED))
+  {
+    // The request completed while we were waiting for the store.
+    LOG_DEBUG("Request completed while waiting for bindings");
+  }
+  else if (uas_data->_cancelled)
+  {
+    // A CANCEL arrived while we were waiting for the store.  There were no
+    // UAC transactions for it to cancel, so reject the request here rather
+    // than forking it.
+    LOG_DEBUG("Request cancelled while waiting for bindings");
+    uas_data->send_response(PJSIP_SC_REQUEST_TERMINATED);
+  }
+  else
+  {
+    target_list targets;
+    add_targets_from_bindings(uas_data->_lookup_aor,
+                              uas_data->_lookup_data,
+                              uas_data->_req->pool,
+                              targets,
+                              MAX_FORKING);
+    uas_data->route_to_targets(targets);
+  }
+
+  delete uas_data->_lookup_data;
+  uas_data->_lookup_data = NULL;
+
+  uas_data->exit_context();
+}
+
+// Forward the request to the targets, or reject it if there aren't any.
+void UASTransaction::route_to_targets(target_list& targets)
+{
   if (targets.size() == 0)
   {
     // No targets found, so reject with a 404 error - reuse the best_rsp
@@ -2301,6 +2435,17 @@ void UASTransaction::on_tsx_state(pjsip_event* event)
 {
   enter_context();
 
+  if ((transaction_latency != NULL) &&
+      (_start_time_us != 0) &&
+      ((_tsx->state == PJSIP_TSX_STATE_COMPLETED) ||
+       (_tsx->state == PJSIP_TSX_STATE_TERMINATED)))
+  {
+    // The final response has been sent (INVITE transactions that succeed
+    // go straight to terminated), so record how long the transaction took.
+    transaction_latency->accumulate(Histogram::get_timestamp_us() - _start_time_us);
+    _start_time_us = 0;
+  }
+
   if (_tsx->state == PJSIP_TSX_STATE_COMPLETED)
   {
     // UAS transaction has completed, so do any transaction completion
@@ -2675,6 +2820,16 @@ pj_status_t UASTransaction::init_uac_transactions(target_list& targets)
   return status;
 }
 
+// Handles a CANCEL for this transaction by cancelling the pending UAC
+// transactions.  If we're still waiting for the registration store to return
+// the targets there aren't any yet, so on_targets_found checks for the
+// CANCEL instead.
+void UASTransaction::handle_cancel()
+{
+  _cancelled = true;
+  cancel_pending_uac_tsx(0, false);
+}
+
 // Cancels all pending UAC transactions associated with this UAS transaction.
 void UASTransaction::cancel_pending_uac_tsx(int st_code, bool dissociate_uac)
 {
@@ -2866,6 +3021,11 @@ UACTransaction::UACTransaction(UASTransaction* uas_data,
 
   // Initialise the liveness timer.
   pj_timer_entry_init(&_liveness_timer, 0, (void*)this, &liveness_timer_callback);
+
+  if (uac_transactions != NULL)
+  {
+    uac_transactions->increment();
+  }
 }
 
 /// UACTransaction destructor.  On entry, the group lock must be held.  On
@@ -2874,6 +3034,11 @@ UACTransaction::~UACTransaction()
 {
   pj_assert(_context_count == 0);
 
+  if (uac_transactions != NULL)
+  {
+    uac_transactions->decrement();
+  }
+
   if (_tsx != NULL)
   {
     _tsx->mod_data[mod_tu.id] = NULL;
@@ -3325,6 +3490,10 @@ pj_status_t init_stateful_proxy(RegData::Store* registrar_store,
   bgcf_service = bgcfService;
   hss = hss_connection;
 
+  transaction_latency = new StatisticHistogram("transaction_latency_us");
+  uas_transactions = new StatisticGauge("uas_transactions");
+  uac_transactions = new StatisticGauge("uac_transactions");
+
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_stateful_proxy);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
@@ -3353,6 +3522,10 @@ void destroy_stateful_proxy()
 
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_stateful_proxy);
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_tu);
+
+  delete transaction_latency; transaction_latency = NULL;
+  delete uas_transactions; uas_transactions = NULL;
+  delete uac_transactions; uac_transactions = NULL;
 }
 
 
@@ -3486,10 +3659,7 @@ bool is_user_registered(std::string served_user)
   if (store)
   {
     std::string aor = served_user;
-    RegData::AoR* aor_data = store->get_aor_data(aor);
-    is_registered = (aor_data != NULL) &&
-      (aor_data->bindings().size() != 0u);
-    delete aor_data; aor_data = NULL;
+    is_registered = store->has_active_bindings(aor);
     LOG_DEBUG("User %s is %sregistered", aor.c_str(), is_registered ? "" : "un");
   }
 
@@ -35,115 +35,394 @@
  */
 
 #include "statistic.h"
-#include "stack.h"
 #include "zmq_lvc.h"
 #include "log.h"
 
+#include <time.h>
+#include <errno.h>
 #include <string>
+#include <utility>
 
-Statistic::Statistic(std::string statname) :
-  _statname(statname),
-  _stat_q(MAX_Q_DEPTH)
+/// The thread that publishes all statistics.
+class Statistic::Reporter
 {
-  LOG_DEBUG("Creating %s statistic reporter", _statname.c_str());
+public:
+  Reporter(LastValueCache* lvc) :
+    _statistics(),
+    _changed(),
+    _lvc(lvc),
+    _publishing(false),
+    _terminated(false),
+    _thread(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+    pthread_cond_init(&_published_cond, NULL);
 
-  // Spawn a thread to handle the statistic reporting
-  int rc = pthread_create(&_reporter, NULL, &reporter_thread, (void*)this);
+    int rc = pthread_create(&_thread, NULL, &reporter_thread, (void*)this);
+    if (rc < 0)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Error creating statistics reporter thread");
+      _thread = 0;
+      // LCOV_EXCL_STOP
+    }
+  }
 
-  if (rc < 0)
+  ~Reporter()
   {
-    // LCOV_EXCL_START
-    LOG_ERROR("Error creating statistic thread for %s", _statname.c_str());
-    // LCOV_EXCL_STOP
+    if (_thread != 0)
+    {
+      pthread_mutex_lock(&_lock);
+      _terminated = true;
+      pthread_cond_signal(&_cond);
+      pthread_mutex_unlock(&_lock);
+
+      pthread_join(_thread, NULL);
+    }
+
+    pthread_cond_destroy(&_published_cond);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
   }
-}
 
+  /// Change the last value cache statistics are published to.  Every
+  /// statistic is announced to a new cache.  This doesn't return until any
+  /// publishing to the old cache has finished, so the old cache can be
+  /// destroyed as soon as it returns.
+  void set_lvc(LastValueCache* lvc)
+  {
+    pthread_mutex_lock(&_lock);
+    _lvc = lvc;
+    if (lvc != NULL)
+    {
+      for (std::vector<Statistic*>::iterator i = _statistics.begin();
+           i != _statistics.end();
+           ++i)
+      {
+        queue(*i);
+      }
+    }
+    while (_publishing)
+    {
+      pthread_cond_wait(&_published_cond, &_lock);
+    }
+    pthread_mutex_unlock(&_lock);
+  }
 
-Statistic::~Statistic()
-{
-  // Signal the reporting thread.
-  _stat_q.terminate();
+  /// Add a statistic to the registry, and queue it to be announced to the
+  /// last value cache.
+  void add(Statistic* stat)
+  {
+    pthread_mutex_lock(&_lock);
+    _statistics.push_back(stat);
+    queue(stat);
+    pthread_mutex_unlock(&_lock);
+  }
 
-  // Wait for the reporting thread to exit.
-  pthread_join(_reporter, NULL);
-}
+  /// Store a new value for a statistic, and queue the statistic to be
+  /// published if it isn't already queued.  The value is swapped in, so
+  /// new_value is left holding the value it replaced.
+  void report(Statistic* stat, std::vector<std::string>& new_value)
+  {
+    pthread_mutex_lock(&_lock);
+    stat->_pending.swap(new_value);
+    queue(stat);
+    pthread_mutex_unlock(&_lock);
+  }
 
+  /// Remove a statistic that is being destroyed from the registry, and stop
+  /// publishing it.
+  void remove(Statistic* stat)
+  {
+    pthread_mutex_lock(&_lock);
+    if (stat->_changed)
+    {
+      erase(_changed, stat);
+      stat->_changed = false;
+    }
+    erase(_statistics, stat);
+    pthread_mutex_unlock(&_lock);
+  }
 
-/// Report the latest value of a statistic. Safe to be called by
-/// multiple threads, no lock required.
-void Statistic::report_change(std::vector<std::string> new_value)
-{
-  if (!_stat_q.push_noblock(new_value))
+  static void* reporter_thread(void* p)
   {
-    // LCOV_EXCL_START
-    LOG_DEBUG("Statistic %s queue overflowed", _statname.c_str());
-    // LCOV_EXCL_STOP
+    ((Reporter*)p)->run();
+    return NULL;
   }
-}
 
+private:
+  typedef std::pair<std::string, std::vector<std::string> > Update;
 
-void Statistic::reporter()
-{
-  LOG_DEBUG("Initializing inproc://%s statistic reporter", _statname.c_str());
+  /// Interval at which polled statistics are checked for changes.
+  static const int POLL_INTERVAL_MS = 1000;
 
-  _publisher = stack_data.stats_aggregator->get_internal_publisher(_statname);
+  void run()
+  {
+    LOG_DEBUG("Statistics reporter started");
+
+    std::vector<Update> updates;
 
-  std::vector<std::string> new_value;
+    pthread_mutex_lock(&_lock);
+    while (true)
+    {
+      check_for_changes();
+      while ((_changed.empty()) && (!_terminated))
+      {
+        // Wait for a change to be reported, or until it's time to check the
+        // polled statistics again.
+        struct timespec attime;
+        get_deadline(POLL_INTERVAL_MS, attime);
+        pthread_cond_timedwait(&_cond, &_lock, &attime);
+        check_for_changes();
+      }
+
+      if (_terminated)
+      {
+        break;
+      }
+
+      // Take the latest values.  The names are copied so the statistics
+      // can be destroyed while we publish without holding the lock.
+      for (std::vector<Statistic*>::iterator i = _changed.begin();
+           i != _changed.end();
+           ++i)
+      {
+        Statistic* stat = *i;
+        updates.push_back(Update(stat->_statname, std::vector<std::string>()));
+        if (stat->_polled_value != NULL)
+        {
+          stat->_published_value = stat->_polled_value->load();
+          updates.back().second.push_back(std::to_string(stat->_published_value));
+        }
+        else
+        {
+          updates.back().second.swap(stat->_pending);
+        }
+        stat->_changed = false;
+      }
+      _changed.clear();
+      LastValueCache* lvc = _lvc;
+      int min_interval_ms = _min_interval_ms;
+      _publishing = true;
+      pthread_mutex_unlock(&_lock);
 
-  while (_stat_q.pop(new_value))
+      for (std::vector<Update>::iterator i = updates.begin();
+           i != updates.end();
+           ++i)
+      {
+        publish(lvc, i->first, i->second);
+      }
+      updates.clear();
+
+      pthread_mutex_lock(&_lock);
+      _publishing = false;
+      pthread_cond_broadcast(&_published_cond);
+
+      if (min_interval_ms > 0)
+      {
+        // Let further changes accumulate until the interval is up.
+        wait_for_interval(min_interval_ms);
+      }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    LOG_DEBUG("Statistics reporter ended");
+  }
+
+  /// Queue a statistic (with the lock held) to be published, if it isn't
+  /// queued already.
+  void queue(Statistic* stat)
   {
-    LOG_DEBUG("Send new value for statistic %s, size %d", _statname.c_str(), new_value.size());
-    std::string status = "OK";
+    if (!stat->_changed)
+    {
+      stat->_changed = true;
+      _changed.push_back(stat);
+      if (_changed.size() == 1)
+      {
+        pthread_cond_signal(&_cond);
+      }
+    }
+  }
 
-    // If there's no message, just send the envelope and status line.
-    if (new_value.empty())
+  /// Queue (with the lock held) any polled statistics whose values have
+  /// changed.
+  void check_for_changes()
+  {
+    for (std::vector<Statistic*>::iterator i = _statistics.begin();
+         i != _statistics.end();
+         ++i)
     {
-      zmq_send(_publisher, _statname.c_str(), _statname.length(), ZMQ_SNDMORE);
-      zmq_send(_publisher, status.c_str(), status.length(), 0);
+      Statistic* stat = *i;
+      if ((stat->_polled_value != NULL) &&
+          (stat->_polled_value->load(std::memory_order_relaxed) != stat->_published_value))
+      {
+        queue(stat);
+      }
     }
-    else
+  }
+
+  /// Remove a statistic from a list.
+  static void erase(std::vector<Statistic*>& stats, Statistic* stat)
+  {
+    for (std::vector<Statistic*>::iterator i = stats.begin();
+         i != stats.end();
+         ++i)
     {
-      // Otherwise send the envelope, status line, and body, remembering to set SNDMORE on all
-      // but the last section.
-      zmq_send(_publisher, _statname.c_str(), _statname.length(), ZMQ_SNDMORE);
-      zmq_send(_publisher, status.c_str(), status.length(), ZMQ_SNDMORE);
-      std::vector<std::string>::iterator it;
-      for (it = new_value.begin(); it + 1 != new_value.end(); ++it)
+      if (*i == stat)
       {
-        zmq_send(_publisher, it->c_str(), it->length(), ZMQ_SNDMORE);
+        stats.erase(i);
+        break;
       }
-      zmq_send(_publisher, it->c_str(), it->length(), 0);
     }
   }
-}
 
+  /// Get the time the specified interval from now, for a timed wait.
+  static void get_deadline(int interval_ms, struct timespec& attime)
+  {
+    clock_gettime(CLOCK_REALTIME, &attime);
+    attime.tv_sec += interval_ms / 1000;
+    attime.tv_nsec += (interval_ms % 1000) * 1000000;
+    if (attime.tv_nsec >= 1000000000)
+    {
+      attime.tv_nsec -= 1000000000;
+      attime.tv_sec += 1;
+    }
+  }
+
+  /// Wait (with the lock held) for the specified time, or until terminated.
+  void wait_for_interval(int interval_ms)
+  {
+    struct timespec attime;
+    get_deadline(interval_ms, attime);
+
+    while (!_terminated)
+    {
+      if (pthread_cond_timedwait(&_cond, &_lock, &attime) == ETIMEDOUT)
+      {
+        break;
+      }
+    }
+  }
+
+  /// Send a value to the last value cache.
+  void publish(LastValueCache* lvc,
+               const std::string& statname,
+               const std::vector<std::string>& value)
+  {
+    if (lvc == NULL)
+    {
+      // LCOV_EXCL_START
+      return;
+      // LCOV_EXCL_STOP
+    }
+
+    lvc->publish(statname, value);
+  }
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+
+  // All statistics that exist.
+  std::vector<Statistic*> _statistics;
+
+  // Statistics with a value waiting to be published.
+  std::vector<Statistic*> _changed;
 
-static std::string known_statnames[] = {
-  "client_count",
-  "connected_homers",
-  "connected_homesteads",
-  "connected_sprouts",
-  "latency_us"
+  // The last value cache statistics are being published to, and whether
+  // the thread is publishing to it without the lock held.  Changing the
+  // cache waits on _published_cond until publishing has finished.
+  LastValueCache* _lvc;
+  bool _publishing;
+  pthread_cond_t _published_cond;
+
+  bool _terminated;
+  pthread_t _thread;
 };
 
 
+Statistic::Reporter* Statistic::_reporter = NULL;
+int Statistic::_num_statistics = 0;
+std::atomic<int> Statistic::_min_interval_ms(Statistic::DEFAULT_MIN_INTERVAL_MS);
+pthread_mutex_t Statistic::_reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+LastValueCache* Statistic::_lvc = NULL;
+
 
-int Statistic::known_stats_count()
+Statistic::Statistic(std::string statname) :
+  _statname(statname),
+  _pending(),
+  _changed(false),
+  _polled_value(NULL),
+  _published_value(0)
 {
-  return (sizeof(known_statnames) / sizeof(std::string));
+  LOG_DEBUG("Creating %s statistic", _statname.c_str());
+  register_statistic();
 }
 
 
-std::string *Statistic::known_stats()
+Statistic::Statistic(std::string statname,
+                     const std::atomic_int_fast64_t* polled_value) :
+  _statname(statname),
+  _pending(),
+  _changed(false),
+  _polled_value(polled_value),
+  _published_value(0)
 {
-  return known_statnames;
+  LOG_DEBUG("Creating polled %s statistic", _statname.c_str());
+  register_statistic();
 }
 
 
-void* Statistic::reporter_thread(void* p)
+Statistic::~Statistic()
 {
-  ((Statistic*)p)->reporter();
-  return NULL;
+  _reporter->remove(this);
+
+  // Stop the reporter thread if this was the last statistic.
+  pthread_mutex_lock(&_reporter_lock);
+  if (--_num_statistics == 0)
+  {
+    delete _reporter;
+    _reporter = NULL;
+  }
+  pthread_mutex_unlock(&_reporter_lock);
 }
 
 
+void Statistic::register_statistic()
+{
+  // Start the reporter thread if this is the first statistic.
+  pthread_mutex_lock(&_reporter_lock);
+  if (_num_statistics++ == 0)
+  {
+    _reporter = new Reporter(_lvc);
+  }
+  pthread_mutex_unlock(&_reporter_lock);
+
+  _reporter->add(this);
+}
+
+
+/// Report the latest value of a statistic.  This just stores the value for
+/// the reporter thread to publish.
+void Statistic::report_change(std::vector<std::string> new_value)
+{
+  _reporter->report(this, new_value);
+}
+
+
+void Statistic::set_last_value_cache(LastValueCache* lvc)
+{
+  pthread_mutex_lock(&_reporter_lock);
+  _lvc = lvc;
+  if (_reporter != NULL)
+  {
+    _reporter->set_lvc(lvc);
+  }
+  pthread_mutex_unlock(&_reporter_lock);
+}
+
+
+void Statistic::set_min_interval(int interval_ms)
+{
+  _min_interval_ms = interval_ms;
+}
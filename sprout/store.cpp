@@ -58,7 +58,9 @@
 
 namespace RegData {
 
-  AoR::AoR(const AoR& other)
+  AoR::AoR(const AoR& other) :
+    _bindings(),
+    _expired(other._expired)
   {
     for (Bindings::const_iterator i = other._bindings.begin();
          i != other._bindings.end();
@@ -75,6 +77,7 @@ namespace RegData {
     if (this != &other)
     {
       clear();
+      _expired = other._expired;
 
       for (Bindings::const_iterator i = other._bindings.begin();
            i != other._bindings.end();
@@ -131,8 +134,45 @@ namespace RegData {
     }
   }
 
-  /// Expire any old bindings, and report the latest outstanding expiry time,
-  /// or now if none.
+  /// Get the data for several addresses of record.  By default, gets each
+  /// in turn, but implementations may be able to fetch them together.
+  std::vector<AoR*> Store::get_aor_data_multi(const std::vector<std::string>& aor_ids)
+  {
+    std::vector<AoR*> aors;
+    aors.reserve(aor_ids.size());
+    for (std::vector<std::string>::const_iterator i = aor_ids.begin();
+         i != aor_ids.end();
+         ++i)
+    {
+      aors.push_back(get_aor_data(*i));
+    }
+    return aors;
+  }
+
+  /// Get the data for an address of record without waiting for the store.
+  /// By default, gets the data synchronously, so the callback is never
+  /// called.
+  bool Store::get_aor_data_async(const std::string& aor_id,
+                                 GetCallback* callback,
+                                 AoR*& aor_data)
+  {
+    aor_data = get_aor_data(aor_id);
+    return true;
+  }
+
+  /// Returns true if the address of record has any unexpired bindings.  By
+  /// default, gets the data and looks at the bindings, but implementations
+  /// may be able to do better.
+  bool Store::has_active_bindings(const std::string& aor_id)
+  {
+    AoR* aor_data = get_aor_data(aor_id);
+    bool active = (aor_data != NULL) && (aor_data->bindings().size() != 0u);
+    delete aor_data;
+    return active;
+  }
+
+  /// Expire any old bindings, recording how many were removed on the AoR,
+  /// and report the latest outstanding expiry time, or now if none.
   int Store::expire_bindings(AoR* aor_data,
                              ///< the data to examine
                              int now)
@@ -140,6 +180,7 @@ namespace RegData {
                              /// the epoch.
   {
     int max_expires = now;
+    aor_data->_expired = 0;
     for (AoR::Bindings::iterator i = aor_data->_bindings.begin();
          i != aor_data->_bindings.end();
       )
@@ -150,6 +191,7 @@ namespace RegData {
         // The binding has expired, so remove it.
         delete i->second;
         aor_data->_bindings.erase(i++);
+        ++aor_data->_expired;
       }
       else
       {
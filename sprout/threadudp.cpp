@@ -0,0 +1,357 @@
+/**
+ * @file threadudp.cpp  UDP transports read by a single owning thread
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "pjutils.h"
+#include "threadudp.h"
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+/// Maximum number of datagrams read from one socket each time it is polled,
+/// so a busy socket can't hold up the thread's other sockets and timers.
+static const unsigned int READ_BATCH_SIZE = 16;
+
+/// Used to give each transport other than the primary one a key of its own.
+static pj_uint32_t next_key_id = 1;
+
+/* Struct thread_udp_transport "inherits" struct pjsip_transport */
+struct thread_udp_transport
+{
+  pjsip_transport base;
+  pj_sock_t sock;
+  pjsip_rx_data rdata;
+};
+
+static pj_status_t thread_udp_send_msg(pjsip_transport* transport,
+                                       pjsip_tx_data* tdata,
+                                       const pj_sockaddr_t* rem_addr,
+                                       int addr_len,
+                                       void* token,
+                                       pjsip_transport_callback callback);
+static pj_status_t thread_udp_shutdown(pjsip_transport* transport);
+static pj_status_t thread_udp_destroy(pjsip_transport* transport);
+
+
+pj_status_t thread_udp_transport_create(pjsip_endpoint* endpt,
+                                        const pj_sockaddr_in* addr,
+                                        const pjsip_host_port* published_name,
+                                        pj_bool_t primary,
+                                        thread_udp_transport** p_tp)
+{
+  pj_status_t status;
+  pj_sock_t sock;
+  int on = 1;
+
+  status = pj_sock_socket(pj_AF_INET(), pj_SOCK_DGRAM(), 0, &sock);
+  if (status != PJ_SUCCESS)
+  {
+    return status;
+  }
+
+  status = pj_sock_setsockopt(sock, pj_SOL_SOCKET(), SO_REUSEPORT, &on, sizeof(on));
+  if (status == PJ_SUCCESS)
+  {
+    status = pj_sock_bind(sock, addr, sizeof(*addr));
+  }
+  if (status != PJ_SUCCESS)
+  {
+    pj_sock_close(sock);
+    return status;
+  }
+
+  pj_pool_t* pool = pjsip_endpt_create_pool(endpt,
+                                            "tudp%p",
+                                            PJSIP_POOL_LEN_TRANSPORT,
+                                            PJSIP_POOL_INC_TRANSPORT);
+  if (pool == NULL)
+  {
+    pj_sock_close(sock);
+    return PJ_ENOMEM;
+  }
+
+  thread_udp_transport* tp = PJ_POOL_ZALLOC_T(pool, thread_udp_transport);
+  tp->base.pool = pool;
+  tp->sock = sock;
+  pj_memcpy(tp->base.obj_name, pool->obj_name, PJ_MAX_OBJ_NAME);
+
+  status = pj_atomic_create(pool, 0, &tp->base.ref_cnt);
+  if (status == PJ_SUCCESS)
+  {
+    status = pj_lock_create_recursive_mutex(pool, pool->obj_name, &tp->base.lock);
+  }
+  if (status != PJ_SUCCESS)
+  {
+    thread_udp_destroy(&tp->base);
+    return status;
+  }
+
+  // The pool used to parse received messages is reset after each one.
+  tp->rdata.tp_info.pool = pjsip_endpt_create_pool(endpt,
+                                                   "rtd%p",
+                                                   PJSIP_POOL_RDATA_LEN,
+                                                   PJSIP_POOL_RDATA_INC);
+  if (tp->rdata.tp_info.pool == NULL)
+  {
+    thread_udp_destroy(&tp->base);
+    return PJ_ENOMEM;
+  }
+
+  // Fill in the transport as PJSIP's own UDP transport does.  The primary
+  // transport's key has the remote address zero (except the family), as
+  // for any connectionless transport, so it is the one PJSIP looks up to
+  // send new requests.  The transport manager only keeps one transport per
+  // key, so the others each get a made-up remote address, which PJSIP
+  // never looks up but which lets it keep track of them all.
+  tp->base.type_name = "UDP";
+  tp->base.key.type = PJSIP_TRANSPORT_UDP;
+  tp->base.key.rem_addr.addr.sa_family = (pj_uint16_t)pj_AF_INET();
+  if (!primary)
+  {
+    tp->base.key.rem_addr.ipv4.sin_addr.s_addr = pj_htonl(next_key_id++);
+  }
+  tp->base.flag = pjsip_transport_get_flag_from_type(PJSIP_TRANSPORT_UDP);
+  tp->base.info = (char*)pj_pool_alloc(pool, 80);
+  pj_ansi_snprintf(tp->base.info, 80, "udp %.*s:%d (thread)",
+                   (int)published_name->host.slen,
+                   published_name->host.ptr,
+                   published_name->port);
+  tp->base.addr_len = sizeof(pj_sockaddr_in);
+  pj_memcpy(&tp->base.local_addr, addr, sizeof(pj_sockaddr_in));
+  pj_strdup(pool, &tp->base.local_name.host, &published_name->host);
+  tp->base.local_name.port = published_name->port;
+  tp->base.dir = PJSIP_TP_DIR_NONE;
+  tp->base.endpt = endpt;
+  tp->base.send_msg = &thread_udp_send_msg;
+  tp->base.do_shutdown = &thread_udp_shutdown;
+  tp->base.destroy = &thread_udp_destroy;
+
+  // This is a permanent transport, so hold a reference to stop the
+  // transport manager destroying it when it has no users.
+  pj_atomic_inc(tp->base.ref_cnt);
+
+  tp->base.tpmgr = pjsip_endpt_get_tpmgr(endpt);
+  status = pjsip_transport_register(tp->base.tpmgr, &tp->base);
+  if (status != PJ_SUCCESS)
+  {
+    thread_udp_destroy(&tp->base);
+    return status;
+  }
+
+  *p_tp = tp;
+  return PJ_SUCCESS;
+}
+
+
+/// Send a message directly on the socket.  The socket is blocking, so this
+/// completes (or fails) synchronously.
+static pj_status_t thread_udp_send_msg(pjsip_transport* transport,
+                                       pjsip_tx_data* tdata,
+                                       const pj_sockaddr_t* rem_addr,
+                                       int addr_len,
+                                       void* token,
+                                       pjsip_transport_callback callback)
+{
+  thread_udp_transport* tp = (thread_udp_transport*)transport;
+  pj_sock_t sock = tp->sock;
+  if (sock == PJ_INVALID_SOCKET)
+  {
+    return PJSIP_ETPNOTAVAIL;
+  }
+  pj_ssize_t size = tdata->buf.cur - tdata->buf.start;
+  return pj_sock_sendto(sock, tdata->buf.start, &size, 0, rem_addr, addr_len);
+}
+
+
+/// Close the socket, so the port stops receiving on it.  The owning thread's
+/// poller skips the transport from then on.  The rest of the transport is
+/// freed when it is destroyed.
+static pj_status_t thread_udp_shutdown(pjsip_transport* transport)
+{
+  thread_udp_transport* tp = (thread_udp_transport*)transport;
+
+  pj_lock_acquire(tp->base.lock);
+  if (tp->sock != PJ_INVALID_SOCKET)
+  {
+    pj_sock_close(tp->sock);
+    tp->sock = PJ_INVALID_SOCKET;
+  }
+  pj_lock_release(tp->base.lock);
+
+  return PJ_SUCCESS;
+}
+
+
+static pj_status_t thread_udp_destroy(pjsip_transport* transport)
+{
+  thread_udp_transport* tp = (thread_udp_transport*)transport;
+
+  if (tp->sock != PJ_INVALID_SOCKET)
+  {
+    pj_sock_close(tp->sock);
+    tp->sock = PJ_INVALID_SOCKET;
+  }
+
+  if (tp->rdata.tp_info.pool != NULL)
+  {
+    pj_pool_release(tp->rdata.tp_info.pool);
+    tp->rdata.tp_info.pool = NULL;
+  }
+
+  if (tp->base.lock != NULL)
+  {
+    pj_lock_destroy(tp->base.lock);
+    tp->base.lock = NULL;
+  }
+
+  if (tp->base.ref_cnt != NULL)
+  {
+    pj_atomic_destroy(tp->base.ref_cnt);
+    tp->base.ref_cnt = NULL;
+  }
+
+  pj_pool_release(tp->base.pool);
+  return PJ_SUCCESS;
+}
+
+
+/// Read the datagrams waiting on a transport's socket, up to a batch, and
+/// pass each one up to PJSIP.
+static void thread_udp_read(thread_udp_transport* tp)
+{
+  pjsip_rx_data* rdata = &tp->rdata;
+  pj_pool_t* pool = rdata->tp_info.pool;
+
+  for (unsigned int ii = 0; ii < READ_BATCH_SIZE; ++ii)
+  {
+    pj_ssize_t size = sizeof(rdata->pkt_info.packet);
+    rdata->pkt_info.src_addr_len = sizeof(rdata->pkt_info.src_addr);
+    pj_status_t status = pj_sock_recvfrom(tp->sock,
+                                          rdata->pkt_info.packet,
+                                          &size,
+                                          MSG_DONTWAIT,
+                                          &rdata->pkt_info.src_addr,
+                                          &rdata->pkt_info.src_addr_len);
+    if (status != PJ_SUCCESS)
+    {
+      if (status != PJ_STATUS_FROM_OS(EAGAIN))
+      {
+        LOG_WARNING("Failed to read from UDP socket (%s)",
+                    PJUtils::pj_status_to_string(status).c_str());
+      }
+      break;
+    }
+
+    if (size <= 0)
+    {
+      continue;
+    }
+
+    // Reset everything left over from the last message.
+    pj_bzero(&rdata->tp_info, sizeof(rdata->tp_info));
+    rdata->tp_info.pool = pool;
+    rdata->tp_info.transport = &tp->base;
+    rdata->tp_info.tp_data = tp;
+    rdata->tp_info.op_key.rdata = rdata;
+    pj_bzero(&rdata->msg_info, sizeof(rdata->msg_info));
+    pj_bzero(&rdata->endpt_info, sizeof(rdata->endpt_info));
+
+    rdata->pkt_info.len = size;
+    rdata->pkt_info.zero = 0;
+    pj_gettimeofday(&rdata->pkt_info.timestamp);
+    pj_sockaddr_print(&rdata->pkt_info.src_addr,
+                      rdata->pkt_info.src_name,
+                      sizeof(rdata->pkt_info.src_name),
+                      0);
+    rdata->pkt_info.src_port = pj_sockaddr_get_port(&rdata->pkt_info.src_addr);
+
+    // Datagrams carry whole messages, so anything the transport manager
+    // doesn't consume is garbage and is discarded.
+    pjsip_tpmgr_receive_packet(tp->base.tpmgr, rdata);
+
+    pj_pool_reset(pool);
+  }
+}
+
+
+void ThreadUdpPoller::add(thread_udp_transport* tp)
+{
+  struct pollfd fd;
+  fd.fd = (int)tp->sock;
+  fd.events = POLLIN;
+  fd.revents = 0;
+  _tps.push_back(tp);
+  _fds.push_back(fd);
+}
+
+
+void ThreadUdpPoller::poll(int timeout_ms)
+{
+  // Pick up any sockets closed by shutting down their transports.  poll
+  // ignores negative descriptors.
+  for (size_t ii = 0; ii < _fds.size(); ++ii)
+  {
+    _fds[ii].fd = (int)_tps[ii]->sock;
+    _fds[ii].revents = 0;
+  }
+
+  int rc = ::poll(_fds.data(), _fds.size(), timeout_ms);
+  if (rc <= 0)
+  {
+    return;
+  }
+
+  for (size_t ii = 0; ii < _fds.size(); ++ii)
+  {
+    if ((_fds[ii].fd >= 0) && (_fds[ii].revents & POLLIN))
+    {
+      thread_udp_read(_tps[ii]);
+    }
+  }
+}
@@ -38,6 +38,7 @@
 ///----------------------------------------------------------------------------
 
 #include <string>
+#include <pthread.h>
 #include "gtest/gtest.h"
 
 #include "basetest.hpp"
@@ -60,6 +61,33 @@ class AccumulatorTest : public BaseTest
   }
 };
 
+/// Fixture for ShardedAccumulatorTest.
+class ShardedAccumulatorTest : public BaseTest
+{
+  static const int NUM_THREADS = 4;
+  Accumulator _accumulator;
+
+  ShardedAccumulatorTest() :
+    _accumulator(999999999999, 3) // fewer shards than threads, so some share
+  {
+  }
+
+  virtual ~ShardedAccumulatorTest()
+  {
+  }
+
+  /// Accumulate the samples 1000 to 2000 on the calling thread.
+  static void* accumulate_samples(void* p)
+  {
+    Accumulator* accumulator = (Accumulator*)p;
+    for (int ii = 1000; ii <= 2000; ii++)
+    {
+      accumulator->accumulate(ii);
+    }
+    return NULL;
+  }
+};
+
 /// Fixture for StatisticAccumulatorTest.
 class StatisticAccumulatorTest : public BaseTest
 {
@@ -114,6 +142,42 @@ TEST_F(AccumulatorTest, MultipleSamples)
   EXPECT_EQ(_accumulator.get_hwm(), (uint_fast64_t)2000);
 }
 
+TEST_F(AccumulatorTest, MultiplePeriods)
+{
+  _accumulator.accumulate((uint_fast64_t)1234);
+  _accumulator.refresh(true);
+  _accumulator.accumulate((uint_fast64_t)2345);
+  _accumulator.accumulate((uint_fast64_t)3456);
+  _accumulator.refresh(true);
+  EXPECT_EQ(_accumulator.get_mean(), (uint_fast64_t)2900);
+  EXPECT_EQ(_accumulator.get_lwm(), (uint_fast64_t)2345);
+  EXPECT_EQ(_accumulator.get_hwm(), (uint_fast64_t)3456);
+}
+
+TEST_F(ShardedAccumulatorTest, MultipleThreads)
+{
+  pthread_t threads[NUM_THREADS];
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_create(&threads[ii], NULL, accumulate_samples, &_accumulator);
+  }
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+  _accumulator.refresh(true);
+  EXPECT_EQ(_accumulator.get_mean(), (uint_fast64_t)1500);
+  EXPECT_EQ(_accumulator.get_variance(), (uint_fast64_t)83500);
+  EXPECT_EQ(_accumulator.get_lwm(), (uint_fast64_t)1000);
+  EXPECT_EQ(_accumulator.get_hwm(), (uint_fast64_t)2000);
+
+  // All the shards are cleared by the refresh.
+  _accumulator.refresh(true);
+  EXPECT_EQ(_accumulator.get_mean(), (uint_fast64_t)0);
+  EXPECT_EQ(_accumulator.get_lwm(), (uint_fast64_t)0);
+  EXPECT_EQ(_accumulator.get_hwm(), (uint_fast64_t)0);
+}
+
 TEST_F(StatisticAccumulatorTest, BasicTest)
 {
   _accumulator.accumulate(1234);
@@ -0,0 +1,186 @@
+/**
+ * @file admission_control_test.cpp UT for admission control.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "admission_control.h"
+
+using namespace std;
+
+/// Fixture for AdmissionControlTest.
+class AdmissionControlTest : public BaseTest
+{
+  AdmissionControl _ac;
+
+  AdmissionControlTest() :
+    _ac(10000, 100, 5) // 10ms target, 100 message queue limit, Retry-After 5s
+  {
+  }
+
+  virtual ~AdmissionControlTest()
+  {
+  }
+
+  /// Count how many of the next 1000 requests are admitted.
+  int count_admitted(unsigned int queue_depth)
+  {
+    int admitted = 0;
+    for (int ii = 0; ii < 1000; ++ii)
+    {
+      if (_ac.admit_request(queue_depth))
+      {
+        ++admitted;
+      }
+    }
+    return admitted;
+  }
+
+  /// Record enough samples of the given delay for the average to converge.
+  void record_delays(unsigned long delay_us)
+  {
+    for (int ii = 0; ii < 200; ++ii)
+    {
+      _ac.record_queue_delay(delay_us);
+    }
+  }
+};
+
+TEST_F(AdmissionControlTest, NotThrottled)
+{
+  EXPECT_FALSE(_ac.is_throttled());
+  EXPECT_EQ(5, _ac.get_retry_after());
+  record_delays(1000);
+  _ac.adjust();
+  EXPECT_FALSE(_ac.is_throttled());
+  EXPECT_EQ(1000, count_admitted(10));
+}
+
+TEST_F(AdmissionControlTest, QueueDepthLimit)
+{
+  EXPECT_TRUE(_ac.admit_request(99));
+  EXPECT_FALSE(_ac.admit_request(100));
+  EXPECT_FALSE(_ac.admit_request(1000));
+}
+
+TEST_F(AdmissionControlTest, NoQueueDepthLimit)
+{
+  AdmissionControl ac(10000, 0, 5);
+  EXPECT_TRUE(ac.admit_request(1000000));
+}
+
+TEST_F(AdmissionControlTest, NoTargetLatency)
+{
+  // With no target latency only the queue depth limit applies.
+  AdmissionControl ac(0, 100, 5);
+  for (int ii = 0; ii < 200; ++ii)
+  {
+    ac.record_queue_delay(1000000);
+  }
+  ac.adjust();
+  EXPECT_FALSE(ac.is_throttled());
+  EXPECT_TRUE(ac.admit_request(99));
+  EXPECT_FALSE(ac.admit_request(100));
+}
+
+TEST_F(AdmissionControlTest, ThrottleAndRecover)
+{
+  // Exceed the target latency, and check that the rejection rate ramps up
+  // as the target continues to be exceeded.
+  record_delays(50000);
+  EXPECT_GT(_ac.get_smoothed_delay_us(), 10000u);
+  _ac.adjust();
+  EXPECT_TRUE(_ac.is_throttled());
+  unsigned int reject1 = _ac.get_reject_permille();
+  EXPECT_EQ(1000 - (int)reject1, count_admitted(10));
+
+  record_delays(50000);
+  _ac.adjust();
+  unsigned int reject2 = _ac.get_reject_permille();
+  EXPECT_GT(reject2, reject1);
+
+  // Keep exceeding the target until everything is rejected.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    record_delays(50000);
+    _ac.adjust();
+  }
+  EXPECT_EQ(1000u, _ac.get_reject_permille());
+  EXPECT_EQ(0, count_admitted(10));
+
+  // Now drop below the target and check that we recover gradually.
+  record_delays(100);
+  _ac.adjust();
+  EXPECT_TRUE(_ac.is_throttled());
+  EXPECT_LT(_ac.get_reject_permille(), 1000u);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    record_delays(100);
+    _ac.adjust();
+  }
+  EXPECT_FALSE(_ac.is_throttled());
+  EXPECT_EQ(1000, count_admitted(10));
+}
+
+TEST_F(AdmissionControlTest, RecoverWhenIdle)
+{
+  // Throttle everything.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    record_delays(50000);
+    _ac.adjust();
+  }
+  EXPECT_EQ(1000u, _ac.get_reject_permille());
+
+  // If nothing is dequeued but the queue isn't empty, the workers are
+  // stuck, so stay throttled.
+  _ac.admit_request(10);
+  _ac.adjust();
+  EXPECT_GT(_ac.get_smoothed_delay_us(), 10000u);
+
+  // Once the queue is empty, there's no queueing delay so we recover.
+  _ac.admit_request(0);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    _ac.adjust();
+  }
+  EXPECT_EQ(0u, _ac.get_smoothed_delay_us());
+  EXPECT_FALSE(_ac.is_throttled());
+}
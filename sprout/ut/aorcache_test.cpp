@@ -0,0 +1,265 @@
+/**
+ * @file aorcache_test.cpp UT for the cache of AoRs read from the memcached store
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "aorcache.h"
+
+using namespace std;
+using namespace RegData;
+
+/// Fixture for AoRCacheTest.
+class AoRCacheTest : public BaseTest
+{
+  AoRCacheTest()
+  {
+  }
+
+  virtual ~AoRCacheTest()
+  {
+  }
+
+  /// Build an AoR with a single binding with the specified CSeq.
+  static MemcachedAoR* build_aor(int cseq, uint64_t cas)
+  {
+    MemcachedAoR* aor_data = new MemcachedAoR();
+    AoR::Binding* b = aor_data->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1");
+    b->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cseq = cseq;
+    b->_expires = time(NULL) + 300;
+    aor_data->set_cas(cas);
+    return aor_data;
+  }
+
+  /// Check the AoR is the one built by build_aor, then delete it.
+  static void expect_aor(MemcachedAoR* aor_data, int cseq, uint64_t cas)
+  {
+    ASSERT_TRUE(aor_data != NULL);
+    EXPECT_EQ(cas, aor_data->get_cas());
+    ASSERT_EQ(1u, aor_data->bindings().size());
+    EXPECT_EQ(cseq, aor_data->bindings().begin()->second->_cseq);
+    delete aor_data;
+  }
+};
+
+TEST_F(AoRCacheTest, HitAndMiss)
+{
+  AoRCache cache(100, 60000);
+  uint64_t cas = 1;
+
+  // Nothing cached yet.
+  EXPECT_EQ(NULL, cache.get("sip:6505550001@homedomain", cas));
+  EXPECT_EQ(0u, cas);
+
+  MemcachedAoR* aor_data = build_aor(1, 17);
+  cache.put("sip:6505550001@homedomain", aor_data);
+  EXPECT_EQ(1, cache.size());
+
+  // The cache holds its own copy, so changing or deleting the original
+  // doesn't affect it, and each get returns a new copy.
+  aor_data->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1")->_cseq = 2;
+  delete aor_data;
+  expect_aor(cache.get("sip:6505550001@homedomain", cas), 1, 17);
+  expect_aor(cache.get("sip:6505550001@homedomain", cas), 1, 17);
+  EXPECT_EQ(0u, cas);
+  EXPECT_EQ(NULL, cache.get("sip:6505550002@homedomain", cas));
+
+  EXPECT_EQ(2, cache._hit_counter.get());
+  EXPECT_EQ(1, cache._miss_counter.get());
+
+  // The latest expiry time can be found without copying the AoR.
+  int max_expires = 0;
+  EXPECT_TRUE(cache.get_max_expires("sip:6505550001@homedomain", max_expires));
+  EXPECT_LT(time(NULL), max_expires);
+  EXPECT_FALSE(cache.get_max_expires("sip:6505550002@homedomain", max_expires));
+  EXPECT_EQ(3, cache._hit_counter.get());
+
+  // Replace it with a newer version.
+  aor_data = build_aor(3, 18);
+  cache.put("sip:6505550001@homedomain", aor_data);
+  delete aor_data;
+  EXPECT_EQ(1, cache.size());
+  expect_aor(cache.get("sip:6505550001@homedomain", cas), 3, 18);
+
+  cache.clear();
+  EXPECT_EQ(0, cache.size());
+  EXPECT_EQ(NULL, cache.get("sip:6505550001@homedomain", cas));
+}
+
+TEST_F(AoRCacheTest, Validate)
+{
+  // With no TTL, every AoR must be checked against memcached.
+  AoRCache cache(100, 0);
+  uint64_t cas;
+
+  MemcachedAoR* aor_data = build_aor(1, 17);
+  cache.put("sip:6505550001@homedomain", aor_data);
+  delete aor_data;
+
+  EXPECT_EQ(NULL, cache.get("sip:6505550001@homedomain", cas));
+  EXPECT_EQ(17u, cas);
+
+  // The CAS in memcached hasn't changed, so the cached copy is good.
+  expect_aor(cache.validate("sip:6505550001@homedomain", 17), 1, 17);
+  EXPECT_EQ(1, cache._validated_counter.get());
+
+  // Now it has, so the cached copy is thrown away.
+  EXPECT_EQ(NULL, cache.validate("sip:6505550001@homedomain", 19));
+  EXPECT_EQ(1, cache._stale_counter.get());
+  EXPECT_EQ(0, cache.size());
+
+  // Nothing to validate.
+  EXPECT_EQ(NULL, cache.validate("sip:6505550001@homedomain", 19));
+  EXPECT_EQ(1, cache._validated_counter.get());
+  EXPECT_EQ(1, cache._stale_counter.get());
+}
+
+TEST_F(AoRCacheTest, TTL)
+{
+  AoRCache cache(100, 20);
+  uint64_t cas;
+
+  MemcachedAoR* aor_data = build_aor(1, 17);
+  cache.put("sip:6505550001@homedomain", aor_data);
+  delete aor_data;
+  expect_aor(cache.get("sip:6505550001@homedomain", cas), 1, 17);
+
+  // Once the TTL has passed the AoR must be validated again, which
+  // restarts the TTL.
+  usleep(30000);
+  int max_expires;
+  EXPECT_FALSE(cache.get_max_expires("sip:6505550001@homedomain", max_expires));
+  EXPECT_EQ(NULL, cache.get("sip:6505550001@homedomain", cas));
+  EXPECT_EQ(17u, cas);
+  expect_aor(cache.validate("sip:6505550001@homedomain", 17), 1, 17);
+  expect_aor(cache.get("sip:6505550001@homedomain", cas), 1, 17);
+}
+
+TEST_F(AoRCacheTest, Invalidate)
+{
+  AoRCache cache(100, 60000);
+  uint64_t cas;
+
+  MemcachedAoR* aor_data = build_aor(1, 17);
+  cache.put("sip:6505550001@homedomain", aor_data);
+  cache.put("sip:6505550002@homedomain", aor_data);
+  delete aor_data;
+  EXPECT_EQ(2, cache.size());
+
+  // A successful write removes the cached copy without counting it stale.
+  cache.invalidate("sip:6505550001@homedomain");
+  EXPECT_EQ(NULL, cache.get("sip:6505550001@homedomain", cas));
+  EXPECT_EQ(0u, cas);
+  EXPECT_EQ(0, cache._stale_counter.get());
+
+  // A write that conflicted with a different version of the AoR to the
+  // one cached doesn't count either.
+  cache.invalidate("sip:6505550002@homedomain", 16);
+  EXPECT_EQ(0, cache._stale_counter.get());
+  EXPECT_EQ(0, cache.size());
+
+  // A write based on the cached copy that conflicted means the cached copy
+  // was stale.
+  aor_data = build_aor(1, 17);
+  cache.put("sip:6505550002@homedomain", aor_data);
+  delete aor_data;
+  cache.invalidate("sip:6505550002@homedomain", 17);
+  EXPECT_EQ(1, cache._stale_counter.get());
+
+  // Invalidating something that isn't cached does nothing.
+  cache.invalidate("sip:6505550003@homedomain", 17);
+  EXPECT_EQ(1, cache._stale_counter.get());
+  EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(AoRCacheTest, LRU)
+{
+  // A single shard, so the eviction order is predictable.
+  AoRCache cache(3, 60000, 1);
+  uint64_t cas;
+
+  for (int ii = 1; ii <= 3; ++ii)
+  {
+    MemcachedAoR* aor_data = build_aor(ii, ii);
+    cache.put("sip:650555000" + std::to_string(ii) + "@homedomain", aor_data);
+    delete aor_data;
+  }
+  EXPECT_EQ(3, cache.size());
+
+  // Use the first AoR, so the second is now the least recently used, and
+  // is evicted to make room for a fourth.
+  expect_aor(cache.get("sip:6505550001@homedomain", cas), 1, 1);
+  MemcachedAoR* aor_data = build_aor(4, 4);
+  cache.put("sip:6505550004@homedomain", aor_data);
+  delete aor_data;
+  EXPECT_EQ(3, cache.size());
+
+  EXPECT_EQ(NULL, cache.get("sip:6505550002@homedomain", cas));
+  expect_aor(cache.get("sip:6505550001@homedomain", cas), 1, 1);
+  expect_aor(cache.get("sip:6505550003@homedomain", cas), 3, 3);
+  expect_aor(cache.get("sip:6505550004@homedomain", cas), 4, 4);
+}
+
+TEST_F(AoRCacheTest, Sharding)
+{
+  // The cache never has more shards than entries, so never holds more
+  // entries than asked for.
+  AoRCache small_cache(2, 60000, 16);
+  EXPECT_EQ(2, small_cache._num_shards);
+  EXPECT_EQ(1, small_cache._max_shard_entries);
+
+  AoRCache empty_cache(0, 60000, 0);
+  EXPECT_EQ(1, empty_cache._num_shards);
+  EXPECT_EQ(1, empty_cache._max_shard_entries);
+
+  // Fill a sharded cache and check it stays within its size.
+  AoRCache cache(64, 60000);
+  EXPECT_EQ((int)AoRCache::DEFAULT_SHARDS, cache._num_shards);
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    MemcachedAoR* aor_data = build_aor(ii, ii + 1);
+    cache.put("sip:" + std::to_string(6505550000 + ii) + "@homedomain", aor_data);
+    delete aor_data;
+  }
+  EXPECT_LE(cache.size(), 64);
+  EXPECT_GT(cache.size(), 0);
+}
@@ -51,13 +51,13 @@ using namespace std;
 
 BaseTest::BaseTest()
 {
-  stack_data.stats_aggregator = new LastValueCache(Statistic::known_stats_count(),
-                                                   Statistic::known_stats(),
-                                                   10);  // Short period to reduce shutdown delays.
+  stack_data.stats_aggregator = new LastValueCache(10);  // Short period to reduce shutdown delays.
+  Statistic::set_last_value_cache(stack_data.stats_aggregator);
 }
 
 BaseTest::~BaseTest()
 {
+  Statistic::set_last_value_cache(NULL);
   delete stack_data.stats_aggregator;
   stack_data.stats_aggregator = NULL;
 }
@@ -0,0 +1,124 @@
+/**
+ * @file counter_test.cpp UT for Counter and Gauge classes.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "counter.h"
+
+using namespace std;
+
+/// Fixture for CounterTest.
+class CounterTest : public BaseTest
+{
+  static const int NUM_THREADS = 4;
+
+  CounterTest()
+  {
+  }
+
+  virtual ~CounterTest()
+  {
+  }
+
+  /// Count 1000 events on the calling thread.
+  static void* count_events(void* p)
+  {
+    Counter* counter = (Counter*)p;
+    for (int ii = 0; ii < 1000; ii++)
+    {
+      counter->increment();
+    }
+    return NULL;
+  }
+};
+
+TEST_F(CounterTest, Counter)
+{
+  Counter counter;
+  EXPECT_EQ(counter.get(), 0);
+  counter.increment();
+  counter.increment(5);
+  EXPECT_EQ(counter.get(), 6);
+}
+
+TEST_F(CounterTest, MultipleThreads)
+{
+  Counter counter;
+  pthread_t threads[NUM_THREADS];
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_create(&threads[ii], NULL, count_events, &counter);
+  }
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+  EXPECT_EQ(counter.get(), NUM_THREADS * 1000);
+}
+
+TEST_F(CounterTest, Gauge)
+{
+  Gauge gauge;
+  EXPECT_EQ(gauge.get(), 0);
+  gauge.increment();
+  gauge.increment();
+  gauge.decrement();
+  EXPECT_EQ(gauge.get(), 1);
+  gauge.set(42);
+  EXPECT_EQ(gauge.get(), 42);
+}
+
+TEST_F(CounterTest, StatisticCounter)
+{
+  StatisticCounter counter("store_conflicts");
+  counter.increment();
+  EXPECT_EQ(counter.get(), 1);
+  // No easy way to read statistics back.
+}
+
+TEST_F(CounterTest, StatisticGauge)
+{
+  StatisticGauge gauge("uas_transactions");
+  gauge.increment();
+  EXPECT_EQ(gauge.get(), 1);
+  // No easy way to read statistics back.
+}
@@ -0,0 +1,200 @@
+/**
+ * @file cpuaffinity_test.cpp UT for thread CPU placement.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <fstream>
+#include "gtest/gtest.h"
+
+#include "cpuaffinity.h"
+
+using namespace std;
+
+/// Fixture for CpuAffinityTest.
+class CpuAffinityTest : public ::testing::Test
+{
+  CpuAffinityTest()
+  {
+    _saved_sysfs_root = CpuAffinity::_sysfs_root;
+  }
+
+  virtual ~CpuAffinityTest()
+  {
+    CpuAffinity::_sysfs_root = _saved_sysfs_root;
+    if (!_fake_root.empty())
+    {
+      EXPECT_EQ(0, system(("rm -rf " + _fake_root).c_str()));
+    }
+  }
+
+  /// Build a fake sysfs tree with two nodes, each with two CPUs.
+  void fake_sysfs()
+  {
+    char dir[] = "/tmp/cpuaffinity_testXXXXXX";
+    std::string root = mkdtemp(dir);
+    mkdir((root + "/node").c_str(), 0755);
+    mkdir((root + "/cpu").c_str(), 0755);
+    for (int node = 0; node < 2; ++node)
+    {
+      std::string node_dir = root + "/node/node" + std::to_string(node);
+      mkdir(node_dir.c_str(), 0755);
+      std::ofstream((node_dir + "/cpulist").c_str()) <<
+        (node * 2) << "-" << (node * 2 + 1) << std::endl;
+      for (int cpu = node * 2; cpu < node * 2 + 2; ++cpu)
+      {
+        std::string cpu_dir = root + "/cpu/cpu" + std::to_string(cpu);
+        mkdir(cpu_dir.c_str(), 0755);
+        mkdir((cpu_dir + "/node" + std::to_string(node)).c_str(), 0755);
+      }
+    }
+    CpuAffinity::_sysfs_root = root;
+    _fake_root = root;
+  }
+
+  std::string _saved_sysfs_root;
+  std::string _fake_root;
+};
+
+
+TEST_F(CpuAffinityTest, ParseList)
+{
+  std::vector<int> values;
+
+  EXPECT_TRUE(CpuAffinity::parse_list("3", values));
+  EXPECT_EQ("3", CpuAffinity::format_list(values));
+
+  EXPECT_TRUE(CpuAffinity::parse_list("0-3,8,10-11", values));
+  ASSERT_EQ(7u, values.size());
+  EXPECT_EQ(0, values[0]);
+  EXPECT_EQ(3, values[3]);
+  EXPECT_EQ(8, values[4]);
+  EXPECT_EQ(11, values[6]);
+  EXPECT_EQ("0-3,8,10-11", CpuAffinity::format_list(values));
+
+  EXPECT_FALSE(CpuAffinity::parse_list("", values));
+  EXPECT_FALSE(CpuAffinity::parse_list("a", values));
+  EXPECT_FALSE(CpuAffinity::parse_list("1,", values));
+  EXPECT_FALSE(CpuAffinity::parse_list("3-1", values));
+  EXPECT_FALSE(CpuAffinity::parse_list("1-", values));
+  EXPECT_FALSE(CpuAffinity::parse_list("1x", values));
+  EXPECT_FALSE(CpuAffinity::parse_list("-1", values));
+}
+
+
+TEST_F(CpuAffinityTest, Unset)
+{
+  CpuAffinity affinity;
+  EXPECT_TRUE(affinity.parse(""));
+  EXPECT_FALSE(affinity.is_set());
+  EXPECT_EQ(-1, affinity.node(0));
+  EXPECT_EQ(-1, affinity.max_node());
+  EXPECT_EQ("any CPU", affinity.describe(0));
+  EXPECT_TRUE(affinity.bind(0));
+}
+
+
+TEST_F(CpuAffinityTest, Cpus)
+{
+  fake_sysfs();
+  CpuAffinity affinity;
+
+  EXPECT_FALSE(affinity.parse("100000"));
+  EXPECT_FALSE(affinity.is_set());
+
+  EXPECT_TRUE(affinity.parse("0"));
+  EXPECT_TRUE(affinity.is_set());
+  EXPECT_EQ("CPU 0 (node 0)", affinity.describe(0));
+  EXPECT_EQ("CPU 0 (node 0)", affinity.describe(5));
+  EXPECT_EQ(0, affinity.max_node());
+
+  // Bind this thread to CPU 0, and check it took effect.
+  cpu_set_t saved;
+  sched_getaffinity(0, sizeof(saved), &saved);
+  EXPECT_TRUE(affinity.bind(3));
+  cpu_set_t cpuset;
+  sched_getaffinity(0, sizeof(cpuset), &cpuset);
+  EXPECT_EQ(1, CPU_COUNT(&cpuset));
+  EXPECT_TRUE(CPU_ISSET(0, &cpuset));
+  sched_setaffinity(0, sizeof(saved), &saved);
+}
+
+
+TEST_F(CpuAffinityTest, RoundRobin)
+{
+  fake_sysfs();
+  CpuAffinity affinity;
+
+  // Pretend there are four CPUs even if this machine has fewer - we don't
+  // bind here.
+  affinity._slots.clear();
+  for (int cpu = 0; cpu < 4; ++cpu)
+  {
+    CpuAffinity::Slot slot;
+    slot.cpus.push_back(cpu);
+    slot.node = CpuAffinity::cpu_node(cpu);
+    affinity._slots.push_back(slot);
+  }
+
+  EXPECT_EQ(0, affinity.node(0));
+  EXPECT_EQ(0, affinity.node(1));
+  EXPECT_EQ(1, affinity.node(2));
+  EXPECT_EQ(1, affinity.node(3));
+  EXPECT_EQ(0, affinity.node(4));
+  EXPECT_EQ("CPU 3 (node 1)", affinity.describe(3));
+  EXPECT_EQ(1, affinity.max_node());
+}
+
+
+TEST_F(CpuAffinityTest, Nodes)
+{
+  fake_sysfs();
+  CpuAffinity affinity;
+
+  EXPECT_FALSE(affinity.parse("node:2"));
+  EXPECT_FALSE(affinity.parse("node:"));
+
+  EXPECT_TRUE(affinity.parse("node:0,1"));
+  EXPECT_EQ("CPUs 0-1 (node 0)", affinity.describe(0));
+  EXPECT_EQ("CPUs 2-3 (node 1)", affinity.describe(1));
+  EXPECT_EQ("CPUs 0-1 (node 0)", affinity.describe(2));
+  EXPECT_EQ(1, affinity.node(1));
+  EXPECT_EQ(1, affinity.max_node());
+}
@@ -0,0 +1,189 @@
+/**
+ * @file expirywheel_test.cpp UT for the ExpiryWheel class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "expirywheel.h"
+
+using namespace std;
+
+/// Fixture for ExpiryWheelTest.
+class ExpiryWheelTest : public BaseTest
+{
+  /// An arbitrary start time that isn't on a boundary of any level.
+  static const int START = 1383000123;
+
+  ExpiryWheel _wheel;
+
+  ExpiryWheelTest() :
+    _wheel(START)
+  {
+  }
+
+  virtual ~ExpiryWheelTest()
+  {
+  }
+
+  /// Turn the wheel a second at a time until a key is returned, and
+  /// return the time it was returned at, or -1 if not by the limit.
+  int time_expired(int limit)
+  {
+    std::vector<std::string> expired;
+    for (int now = START; now <= limit; ++now)
+    {
+      _wheel.pop_expired(now, expired);
+      if (!expired.empty())
+      {
+        return now;
+      }
+    }
+    return -1;
+  }
+};
+
+TEST_F(ExpiryWheelTest, AlreadyExpired)
+{
+  std::vector<std::string> expired;
+  _wheel.schedule("aor1", START);
+  _wheel.schedule("aor2", START - 100);
+  EXPECT_EQ(2u, _wheel.size());
+  _wheel.pop_expired(START, expired);
+  EXPECT_EQ(2u, expired.size());
+  EXPECT_EQ(0u, _wheel.size());
+}
+
+TEST_F(ExpiryWheelTest, ExpiresOnTime)
+{
+  // Check a key is returned at exactly its expiry time on each level.
+  int deltas[] = {1, 255, 256, 300, 3600, 16383, 16384, 16385, 100000, 1048576, 3000000};
+  for (size_t ii = 0; ii < sizeof(deltas) / sizeof(deltas[0]); ++ii)
+  {
+    ExpiryWheel wheel(START);
+    std::vector<std::string> expired;
+    wheel.schedule("aor1", START + deltas[ii]);
+    wheel.pop_expired(START + deltas[ii] - 1, expired);
+    EXPECT_EQ(0u, expired.size()) << "delta " << deltas[ii];
+    wheel.pop_expired(START + deltas[ii], expired);
+    EXPECT_EQ(1u, expired.size()) << "delta " << deltas[ii];
+  }
+}
+
+TEST_F(ExpiryWheelTest, SecondBySecond)
+{
+  _wheel.schedule("aor1", START + 600);
+  EXPECT_EQ(START + 600, time_expired(START + 1000));
+}
+
+TEST_F(ExpiryWheelTest, Reschedule)
+{
+  std::vector<std::string> expired;
+  _wheel.schedule("aor1", START + 300);
+  _wheel.schedule("aor1", START + 3600);
+  EXPECT_EQ(1u, _wheel.size());
+  _wheel.pop_expired(START + 3599, expired);
+  EXPECT_EQ(0u, expired.size());
+
+  // Bring it forward again.
+  _wheel.schedule("aor1", START + 3500);
+  _wheel.pop_expired(START + 3600, expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("aor1", expired[0]);
+}
+
+TEST_F(ExpiryWheelTest, Cancel)
+{
+  std::vector<std::string> expired;
+  _wheel.schedule("aor1", START + 300);
+  _wheel.schedule("aor2", START + 300);
+  _wheel.cancel("aor1");
+  _wheel.cancel("aor3");
+  EXPECT_EQ(1u, _wheel.size());
+  _wheel.pop_expired(START + 300, expired);
+  ASSERT_EQ(1u, expired.size());
+  EXPECT_EQ("aor2", expired[0]);
+}
+
+TEST_F(ExpiryWheelTest, BeyondRange)
+{
+  // A time beyond the top level is still returned on time.
+  std::vector<std::string> expired;
+  int expires = START + (1 << 26) + 1000;
+  _wheel.schedule("aor1", expires);
+  _wheel.pop_expired(expires - 1, expired);
+  EXPECT_EQ(0u, expired.size());
+  _wheel.pop_expired(expires, expired);
+  EXPECT_EQ(1u, expired.size());
+}
+
+TEST_F(ExpiryWheelTest, Random)
+{
+  // Schedule lots of keys at random times and check they all come out when
+  // they should, turning the wheel in random steps.
+  std::map<std::string, int> expected;
+  srand(1);
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    std::string key = "aor" + std::to_string(ii);
+    int expires = START + rand() % 100000;
+    _wheel.schedule(key, expires);
+    expected[key] = expires;
+  }
+
+  int now = START;
+  while (now < START + 100000)
+  {
+    now += rand() % 500;
+    std::vector<std::string> expired;
+    _wheel.pop_expired(now, expired);
+    for (size_t ii = 0; ii < expired.size(); ++ii)
+    {
+      ASSERT_TRUE(expected.find(expired[ii]) != expected.end());
+      EXPECT_LE(expected[expired[ii]], now);
+      EXPECT_GT(expected[expired[ii]], now - 500);
+      expected.erase(expired[ii]);
+    }
+  }
+  EXPECT_TRUE(expected.empty());
+  EXPECT_EQ(0u, _wheel.size());
+}
@@ -0,0 +1,69 @@
+/**
+ * @file fakelastvaluecache.hpp Header file for fake last value cache (for testing).
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "zmq_lvc.h"
+
+/// Last value cache that records what is published to it, rather than
+/// passing it on to subscribers.
+class FakeLastValueCache : public LastValueCache
+{
+public:
+  FakeLastValueCache();
+  virtual ~FakeLastValueCache();
+
+  void publish(const std::string& statname,
+               const std::vector<std::string>& value);
+
+  /// Returns the number of times a statistic has been published.
+  int published(const std::string& statname);
+
+  /// Returns the value a statistic was last published with.
+  std::vector<std::string> last_value(const std::string& statname);
+
+private:
+  pthread_mutex_t _lock;
+  std::map<std::string, int> _published;
+  std::map<std::string, std::vector<std::string> > _last_value;
+};
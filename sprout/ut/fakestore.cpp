@@ -0,0 +1,83 @@
+/**
+ * @file fakestore.cpp Fake registration store (for testing).
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+///
+///----------------------------------------------------------------------------
+
+#include "stack.h"
+#include "fakestore.hpp"
+
+FakeStore::FakeStore() :
+  RegData::LocalStore(),
+  _deferred(false),
+  _pending()
+{
+}
+
+FakeStore::~FakeStore()
+{
+}
+
+bool FakeStore::get_aor_data_async(const std::string& aor_id,
+                                   GetCallback* callback,
+                                   RegData::AoR*& aor_data)
+{
+  if (!_deferred)
+  {
+    return LocalStore::get_aor_data_async(aor_id, callback, aor_data);
+  }
+
+  _pending.push_back(std::make_pair(aor_id, callback));
+  return false;
+}
+
+void FakeStore::set_deferred(bool deferred)
+{
+  _deferred = deferred;
+}
+
+void FakeStore::complete_gets()
+{
+  std::vector<std::pair<std::string, GetCallback*> > pending;
+  pending.swap(_pending);
+  for (size_t ii = 0; ii < pending.size(); ++ii)
+  {
+    pending[ii].second->get_complete(pending[ii].first,
+                                     get_aor_data(pending[ii].first));
+  }
+  stack_run_continuations();
+}
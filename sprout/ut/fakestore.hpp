@@ -0,0 +1,72 @@
+/**
+ * @file fakestore.hpp Header file for fake registration store (for testing).
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "localstore.h"
+
+/// Local store whose asynchronous gets can be held until the test completes
+/// them, as if they were waiting for memcached.  Gets complete straight away
+/// unless the store has been told to defer them.
+class FakeStore : public RegData::LocalStore
+{
+public:
+  FakeStore();
+  virtual ~FakeStore();
+
+  bool get_aor_data_async(const std::string& aor_id,
+                          GetCallback* callback,
+                          RegData::AoR*& aor_data);
+
+  /// Set whether asynchronous gets wait for complete_gets().
+  void set_deferred(bool deferred);
+
+  /// Complete the waiting gets, then run the work they queue to continue on
+  /// the worker threads.
+  void complete_gets();
+
+  /// Returns the number of gets waiting.
+  int pending_gets() const { return _pending.size(); }
+
+private:
+  bool _deferred;
+  std::vector<std::pair<std::string, GetCallback*> > _pending;
+};
@@ -0,0 +1,185 @@
+/**
+ * @file histogram_test.cpp UT for histogram.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "histogram.h"
+
+using namespace std;
+
+/// Fixture for HistogramTest.
+class HistogramTest : public BaseTest
+{
+  Histogram _histogram;
+
+  HistogramTest() :
+    _histogram(999999999999) // make the period large to avoid intermittent failures due to timing
+  {
+  }
+
+  virtual ~HistogramTest()
+  {
+  }
+};
+
+/// Fixture for StatisticHistogramTest.
+class StatisticHistogramTest : public BaseTest
+{
+  StatisticHistogram _histogram;
+
+  StatisticHistogramTest() :
+    _histogram("queue_wait_us", 999999999999) // make the period large to avoid intermittent failures due to timing
+  {
+  }
+
+  virtual ~StatisticHistogramTest()
+  {
+  }
+};
+
+TEST_F(HistogramTest, Buckets)
+{
+  // Small values have a bucket each.
+  for (unsigned int ii = 0; ii < 32; ++ii)
+  {
+    EXPECT_EQ(ii, Histogram::bucket_index(ii));
+    EXPECT_EQ(ii, Histogram::bucket_max(ii));
+  }
+
+  // Larger values share buckets, with every value falling in a bucket whose
+  // upper bound is no more than about 3% above it.
+  unsigned int last_index = 31;
+  for (uint_fast64_t value = 32; value < 1000000; value += 7)
+  {
+    unsigned int index = Histogram::bucket_index(value);
+    EXPECT_GE(index, last_index);
+    EXPECT_GE(Histogram::bucket_max(index), value);
+    EXPECT_LE(Histogram::bucket_max(index), value + value / 16);
+    EXPECT_LT(Histogram::bucket_max(index - 1), value);
+    last_index = index;
+  }
+
+  // Huge values all go in the top bucket.
+  EXPECT_EQ(Histogram::NUM_BUCKETS - 1, Histogram::bucket_index(1ull << 36));
+  EXPECT_EQ(Histogram::NUM_BUCKETS - 1, Histogram::bucket_index(~0ull));
+  EXPECT_EQ(Histogram::NUM_BUCKETS - 1, Histogram::bucket_index((1ull << 36) - 1));
+}
+
+TEST_F(HistogramTest, NoSamples)
+{
+  _histogram.refresh(true);
+  EXPECT_EQ(0u, _histogram.get_n());
+  EXPECT_EQ(0u, _histogram.get_p50());
+  EXPECT_EQ(0u, _histogram.get_p999());
+  EXPECT_EQ(0u, _histogram.get_max());
+}
+
+TEST_F(HistogramTest, OneSample)
+{
+  _histogram.accumulate(12345);
+  _histogram.refresh(true);
+  EXPECT_EQ(12345u, _histogram.get_p50());
+  EXPECT_EQ(12345u, _histogram.get_p90());
+  EXPECT_EQ(12345u, _histogram.get_p99());
+  EXPECT_EQ(12345u, _histogram.get_p999());
+  EXPECT_EQ(12345u, _histogram.get_max());
+}
+
+TEST_F(HistogramTest, Percentiles)
+{
+  // Accumulate 1..10000, so the true percentiles are easy to work out.
+  for (unsigned long ii = 1; ii <= 10000; ++ii)
+  {
+    _histogram.accumulate(ii);
+  }
+  _histogram.refresh(true);
+
+  EXPECT_NEAR(5000, _histogram.get_p50(), 5000 / 16);
+  EXPECT_GE(_histogram.get_p50(), 5000u);
+  EXPECT_NEAR(9000, _histogram.get_p90(), 9000 / 16);
+  EXPECT_GE(_histogram.get_p90(), 9000u);
+  EXPECT_NEAR(9900, _histogram.get_p99(), 9900 / 16);
+  EXPECT_GE(_histogram.get_p99(), 9900u);
+  EXPECT_EQ(10000u, _histogram.get_p999());
+  EXPECT_EQ(10000u, _histogram.get_max());
+
+  // The histogram starts again for the next period.
+  _histogram.accumulate(10);
+  _histogram.refresh(true);
+  EXPECT_EQ(10u, _histogram.get_p50());
+  EXPECT_EQ(10u, _histogram.get_max());
+}
+
+TEST_F(HistogramTest, Tail)
+{
+  // 0.5% of samples are slow, which shows up in the 99.9th percentile but
+  // not the 99th.
+  for (int ii = 0; ii < 995; ++ii)
+  {
+    _histogram.accumulate(100);
+  }
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    _histogram.accumulate(50000);
+  }
+  _histogram.refresh(true);
+  EXPECT_LE(_histogram.get_p99(), 103u);
+  EXPECT_EQ(50000u, _histogram.get_p999());
+}
+
+TEST_F(HistogramTest, Timer)
+{
+  {
+    Histogram::Timer timer(&_histogram);
+  }
+  {
+    Histogram::Timer timer(NULL);
+  }
+  _histogram.refresh(true);
+  EXPECT_LT(_histogram.get_max(), 1000000u);
+}
+
+TEST_F(StatisticHistogramTest, BasicTest)
+{
+  _histogram.accumulate(1);
+  _histogram.refresh(true);
+  EXPECT_EQ(1u, _histogram.get_max());
+}
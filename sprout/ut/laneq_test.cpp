@@ -0,0 +1,207 @@
+/**
+ * @file laneq_test.cpp UT for weighted priority lane queue.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "laneq.h"
+
+using namespace std;
+
+/// Fixture for LaneqTest.
+class LaneqTest : public ::testing::Test
+{
+  LaneqTest()
+  {
+  }
+
+  virtual ~LaneqTest()
+  {
+  }
+
+  static vector<unsigned int> weights(unsigned int w0,
+                                      unsigned int w1,
+                                      unsigned int w2)
+  {
+    vector<unsigned int> w;
+    w.push_back(w0);
+    w.push_back(w1);
+    w.push_back(w2);
+    return w;
+  }
+};
+
+TEST_F(LaneqTest, Schedule)
+{
+  laneq<int> q(weights(4, 2, 1), 16);
+  EXPECT_EQ(3u, q.num_lanes());
+  ASSERT_EQ(7u, q._schedule.size());
+  EXPECT_EQ(0u, q._schedule[0]);
+  EXPECT_EQ(1u, q._schedule[1]);
+  EXPECT_EQ(2u, q._schedule[2]);
+  EXPECT_EQ(0u, q._schedule[3]);
+  EXPECT_EQ(1u, q._schedule[4]);
+  EXPECT_EQ(0u, q._schedule[5]);
+  EXPECT_EQ(0u, q._schedule[6]);
+}
+
+TEST_F(LaneqTest, WeightedDequeue)
+{
+  laneq<int> q(weights(4, 2, 1), 256);
+
+  for (int ii = 0; ii < 70; ++ii)
+  {
+    q.push(0, 0);
+    q.push(1, 1);
+    q.push(2, 2);
+  }
+  EXPECT_EQ(70u, q.size(0));
+  EXPECT_EQ(210u, q.size());
+
+  // While all lanes are backlogged, they are served in proportion to their
+  // weights.
+  int counts[3] = {0, 0, 0};
+  int item;
+  unsigned int lane;
+  for (int ii = 0; ii < 70; ++ii)
+  {
+    ASSERT_TRUE(q.pop(item, lane));
+    EXPECT_EQ((int)lane, item);
+    counts[lane]++;
+  }
+  EXPECT_EQ(40, counts[0]);
+  EXPECT_EQ(20, counts[1]);
+  EXPECT_EQ(10, counts[2]);
+}
+
+TEST_F(LaneqTest, EmptyLaneFallsBack)
+{
+  laneq<int> q(weights(4, 2, 1), 16);
+  int item;
+  unsigned int lane;
+
+  EXPECT_FALSE(q.try_pop(item, lane));
+
+  // Only the lowest priority lane has anything in, so it is served every
+  // time.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    q.push(ii, 2);
+  }
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    ASSERT_TRUE(q.try_pop(item, lane));
+    EXPECT_EQ(2u, lane);
+    EXPECT_EQ(ii, item);
+  }
+
+  // With lanes 1 and 2 empty, lane 0 is served on their turns.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    q.push(ii, 0);
+  }
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    ASSERT_TRUE(q.try_pop(item, lane));
+    EXPECT_EQ(0u, lane);
+  }
+}
+
+TEST_F(LaneqTest, PushNoBlockWhenFull)
+{
+  laneq<int> q(weights(4, 2, 1), 16);
+
+  for (int ii = 0; ii < 16; ++ii)
+  {
+    EXPECT_TRUE(q.push_noblock(ii, 2));
+  }
+  EXPECT_FALSE(q.push_noblock(16, 2));
+  EXPECT_EQ(16u, q.size(2));
+
+  // The other lanes are unaffected.
+  EXPECT_TRUE(q.push_noblock(0, 0));
+  EXPECT_EQ(17u, q.size());
+
+  // Once an item has been taken from the full lane there is room again.
+  int item;
+  unsigned int lane;
+  do
+  {
+    ASSERT_TRUE(q.try_pop(item, lane));
+  }
+  while (lane != 2);
+  EXPECT_TRUE(q.push_noblock(16, 2));
+}
+
+static void* consume(void* p)
+{
+  laneq<int>* q = (laneq<int>*)p;
+  int item;
+  unsigned int lane;
+  long sum = 0;
+  while (q->pop(item, lane))
+  {
+    sum += item;
+  }
+  return (void*)sum;
+}
+
+TEST_F(LaneqTest, Terminate)
+{
+  laneq<int> q(weights(4, 2, 1), 16);
+  pthread_t thread;
+  pthread_create(&thread, NULL, consume, &q);
+
+  for (int ii = 1; ii <= 10; ++ii)
+  {
+    q.push(ii, ii % 3);
+  }
+  while (q.size() > 0)
+  {
+    usleep(1000);
+  }
+
+  q.terminate();
+  EXPECT_TRUE(q.is_terminated());
+  void* sum;
+  pthread_join(thread, &sum);
+  EXPECT_EQ(55, (long)sum);
+}
@@ -44,6 +44,8 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>
+#include <thread>
 
 #include "utils.h"
 #include "sas.h"
@@ -187,3 +189,92 @@ TEST_F(LoggerTest, RealTime)
   int rc = system("grep '^[0-3][0-9]-[0-1][0-9]-[0-9][0-9][0-9][0-9] ..:..:..\\.... Wossat it sez for da test' /tmp/logtest_*.txt >/dev/null");
   EXPECT_EQ(0, WEXITSTATUS(rc));
 }
+
+TEST_F(LoggerTest, Async)
+{
+  Logger2 log("/tmp", "logtest");
+  time_t midnight = 1356048000u; // 2012-12-21T00:00:00 UTC
+  log.start_async();
+  log.settime(midnight - 30, 123456789l);
+  log.write("Some data goes here\n");
+  log.set_flags(0);
+  log.settime(midnight - 20, 234567890l);
+  log.write("Some more data goes there\n");
+  log.set_flags(Logger::ADD_TIMESTAMPS);
+  log.settime(midnight + 10, 345678901l);
+  log.write("And on the next day\n");
+  log.flush();
+
+  FILE* f;
+  char linebuf[1024];
+  char* line;
+
+  // Lines keep the time they were logged at, and still go to the file for
+  // that hour.
+  f = fopen("/tmp/logtest_20121220_2300.txt", "r");
+  ASSERT_TRUE(f != NULL);
+  line = fgets(linebuf, sizeof(linebuf), f);
+  EXPECT_STREQ("20-12-2012 23:59:30.123 Some data goes here\n", line);
+  line = fgets(linebuf, sizeof(linebuf), f);
+  EXPECT_STREQ("Some more data goes there\n", line);
+  line = fgets(linebuf, sizeof(linebuf), f);
+  EXPECT_TRUE(line == NULL);
+  fclose(f);
+
+  f = fopen("/tmp/logtest_20121221_0000.txt", "r");
+  ASSERT_TRUE(f != NULL);
+  line = fgets(linebuf, sizeof(linebuf), f);
+  EXPECT_STREQ("21-12-2012 00:00:10.345 And on the next day\n", line);
+  line = fgets(linebuf, sizeof(linebuf), f);
+  EXPECT_TRUE(line == NULL);
+  fclose(f);
+
+  // Lines are written by the flusher thread without an explicit flush.
+  log.settime(midnight + 20, 0);
+  log.write("Written in the background\n");
+  int rc = 1;
+  for (int ii = 0; (ii < 100) && (rc != 0); ++ii)
+  {
+    usleep(10000);
+    rc = system("grep -q 'Written in the background' /tmp/logtest_20121221_0000.txt");
+  }
+  EXPECT_EQ(0, WEXITSTATUS(rc));
+
+  log.stop_async();
+  EXPECT_EQ(0u, log.dropped());
+}
+
+TEST_F(LoggerTest, AsyncDrops)
+{
+  Logger2 log("/tmp", "logtest");
+  time_t midnight = 1356048000u; // 2012-12-21T00:00:00 UTC
+  log.settime(midnight, 0);
+  log.start_async(1024);
+
+  // Create this thread's ring, then hold the lock so the flusher thread
+  // can't empty it while we fill it.
+  log.get_ring();
+  pthread_mutex_lock(&log._lock);
+  std::string data(100, 'x');
+  data += "\n";
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    log.write(data.c_str());
+  }
+  pthread_mutex_unlock(&log._lock);
+
+  // Each line takes 128 bytes of the ring, so only 8 fit.
+  EXPECT_EQ(12u, log.dropped());
+
+  // Lines written from another thread go to their own ring.
+  std::thread other([&log, &data]() { log.write(data.c_str()); });
+  other.join();
+  EXPECT_EQ(12u, log.dropped());
+
+  log.stop_async();
+
+  int rc = system("test `grep -c xxxx /tmp/logtest_20121221_0000.txt` -eq 9");
+  EXPECT_EQ(0, WEXITSTATUS(rc));
+  rc = system("grep -q '12 log lines dropped, 12 in total' /tmp/logtest_20121221_0000.txt");
+  EXPECT_EQ(0, WEXITSTATUS(rc));
+}
@@ -38,6 +38,10 @@
 ///----------------------------------------------------------------------------
 
 #include <string>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <json/reader.h>
@@ -50,6 +54,7 @@
 #include "localstorefactory.h"
 #include "fakelogger.hpp"
 #include "test_utils.hpp"
+#include "test_interposer.hpp"
 
 using namespace std;
 using namespace RegData;
@@ -67,6 +72,12 @@ class MemcachedStoreTest : public ::testing::Test
   {
   }
 
+  /// Put the clock back even if a test that moved it on failed.
+  virtual void TearDown()
+  {
+    cwtest_reset_time();
+  }
+
   void do_test_simple(Store& store);
 };
 
@@ -126,9 +137,30 @@ TEST_F(MemcachedStoreTest, Serialization)
   b1->_path_headers.push_back("<sip:P1.EXAMPLEVISITED.COM;lr>");
   s = MemcachedStore::serialize_aor((MemcachedAoR*)aor_data1);
 
+  // Magic, version, header length, header (holding the max expires) and
+  // binding count, then the strings with a single byte length each, cseq,
+  // expires and priority, and the counts.
+  EXPECT_EQ(3ul + 1 + 6 + 1 + 48 + 54 + 33 + 3 + 5 + 1 + 1 + (14 + 50) + (7 + 2) + (9 + 1) + 1 + 28 + 31, s.length());
+
+  aor_data2 = (AoR*)MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
+
+  SCOPED_TRACE("");
+  do_expect_eq(aor_data1, aor_data2);
+  delete aor_data2;
+
+  // The header records the latest expiry time of the bindings.
+  EXPECT_EQ(now + 300, MemcachedStore::read_max_expires(s.data(), s.length()));
+
+  // Check the legacy format too, and that deserialize_aor still reads it.
+  // The legacy format has no header, so the expiry time isn't available.
+  s = MemcachedStore::serialize_legacy_aor((MemcachedAoR*)aor_data1);
+  EXPECT_EQ(-1, MemcachedStore::read_max_expires(s.data(), s.length()));
+
   EXPECT_EQ(4ul + 48 + 54 + 33 + 4 + 4 + 4 + 4 + 4 + (9 + 1) + (7 + 2) + (14 + 50) + (28 + 31), s.length());
 
   aor_data2 = (AoR*)MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
 
   SCOPED_TRACE("");
   do_expect_eq(aor_data1, aor_data2);
@@ -154,9 +186,19 @@ TEST_F(MemcachedStoreTest, Serialization)
   b1->_params.push_back(std::make_pair("+sip.ice", ""));
   s = MemcachedStore::serialize_aor((MemcachedAoR*)aor_data1);
 
+  aor_data2 = (AoR*)MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
+
+  SCOPED_TRACE("");
+  do_expect_eq(aor_data1, aor_data2);
+  delete aor_data2;
+
+  s = MemcachedStore::serialize_legacy_aor((MemcachedAoR*)aor_data1);
+
   EXPECT_EQ(4ul + 50 + 56 + 35 + 4 + 4 + 4 + 4 + 4 + (9 + 1) + (8 + 2) + (14 + 51), s.length());
 
   aor_data2 = (AoR*)MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
 
   SCOPED_TRACE("");
   do_expect_eq(aor_data1, aor_data2);
@@ -188,6 +230,7 @@ TEST_F(MemcachedStoreTest, Serialization)
   s = MemcachedStore::serialize_aor((MemcachedAoR*)aor_data1);
 
   aor_data2 = (AoR*)MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
 
   SCOPED_TRACE("");
   do_expect_eq(aor_data1, aor_data2);
@@ -212,6 +255,100 @@ TEST_F(MemcachedStoreTest, Serialization)
   delete aor_data2;
 }
 
+/// Test that the binary format copes with values which don't fit in a single
+/// byte, and with empty AoRs.
+TEST_F(MemcachedStoreTest, SerializationLargeValues)
+{
+  MemcachedAoR* aor_data1 = new MemcachedAoR();
+  std::string s = MemcachedStore::serialize_aor(aor_data1);
+  EXPECT_EQ(7u, s.length());
+  EXPECT_EQ(0, MemcachedStore::read_max_expires(s.data(), s.length()));
+  MemcachedAoR* aor_data2 = MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
+  EXPECT_EQ(0u, aor_data2->bindings().size());
+  delete aor_data2;
+
+  AoR::Binding* b1 = aor_data1->get_binding(std::string(300, 'i'));
+  b1->_uri = std::string(20000, 'u');
+  b1->_cid = "";
+  b1->_cseq = -1;
+  b1->_expires = 0x7FFFFFFF;
+  b1->_priority = -0x7FFFFFFF - 1;
+  b1->_params.push_back(std::make_pair("", ""));
+  b1 = aor_data1->get_binding("second");
+  b1->_cseq = 64;
+  b1->_expires = -64;
+  b1->_path_headers.push_back("");
+  s = MemcachedStore::serialize_aor(aor_data1);
+  aor_data2 = MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
+
+  SCOPED_TRACE("");
+  do_expect_eq(aor_data1, aor_data2);
+
+  delete aor_data1;
+  delete aor_data2;
+}
+
+/// Test that truncated, corrupt or future data is rejected rather than
+/// misread.
+TEST_F(MemcachedStoreTest, SerializationCorrupt)
+{
+  MemcachedAoR* aor_data1 = new MemcachedAoR();
+  AoR::Binding* b1 = aor_data1->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1");
+  b1->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+  b1->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+  b1->_cseq = 17038;
+  b1->_expires = 300;
+  b1->_params.push_back(std::make_pair("reg-id", "1"));
+  b1->_path_headers.push_back("<sip:P1.EXAMPLEVISITED.COM;lr>");
+  std::string s = MemcachedStore::serialize_aor(aor_data1);
+  delete aor_data1;
+
+  // Every truncation of the data must fail cleanly.
+  for (size_t len = 3; len < s.length(); ++len)
+  {
+    EXPECT_EQ(NULL, MemcachedStore::deserialize_aor(s.data(), len)) << "Length " << len;
+  }
+
+  // A later format version is rejected.
+  std::string future = s;
+  future[2] = 2;
+  EXPECT_EQ(NULL, MemcachedStore::deserialize_aor(future));
+
+  // A binding count bigger than the data is rejected without allocating.
+  std::string huge = s.substr(0, 4);
+  huge.append("\xff\xff\xff\xff\x0f", 5);
+  EXPECT_EQ(NULL, MemcachedStore::deserialize_aor(huge));
+
+  // A varint that never ends is rejected.
+  std::string endless = s.substr(0, 3);
+  endless.append(20, '\x80');
+  EXPECT_EQ(NULL, MemcachedStore::deserialize_aor(endless));
+
+  // A corrupt header is rejected.
+  std::string bad_header = s.substr(0, 3);
+  bad_header.append("\x02\x01\x80", 3);
+  bad_header.append(s.substr(4 + s[3]));
+  EXPECT_EQ(NULL, MemcachedStore::deserialize_aor(bad_header));
+  EXPECT_EQ(-1, MemcachedStore::read_max_expires(bad_header.data(), bad_header.length()));
+  EXPECT_EQ(-1, MemcachedStore::read_max_expires(future.data(), future.length()));
+
+  // Unknown header fields are skipped.
+  std::string header = s.substr(0, 3);
+  header.push_back(s[3] + 4);
+  header.append("\x63\x01", 2);
+  header.append(s.substr(4, s[3]));
+  header.append("\x64\x02", 2);
+  header.append(s.substr(4 + s[3]));
+  EXPECT_EQ(300, MemcachedStore::read_max_expires(header.data(), header.length()));
+  MemcachedAoR* aor_data2 = MemcachedStore::deserialize_aor(header);
+  ASSERT_TRUE(aor_data2 != NULL);
+  EXPECT_EQ(1u, aor_data2->bindings().size());
+  EXPECT_EQ(17038, aor_data2->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1")->_cseq);
+  delete aor_data2;
+}
+
 /// Test the local fake server.
 TEST_F(MemcachedStoreTest, SimpleLocal)
 {
@@ -222,6 +359,331 @@ TEST_F(MemcachedStoreTest, SimpleLocal)
   destroy_local_store(store);
 }
 
+/// Test that the local store rejects writes based on out of date data.
+TEST_F(MemcachedStoreTest, LocalConflict)
+{
+  LocalStore store;
+  int now = time(NULL);
+
+  // Two readers of a new AoR can't both add it.
+  AoR* aor_data1 = store.get_aor_data("5102175698@ngc.thewholeelephant.com");
+  AoR* aor_data2 = store.get_aor_data("5102175698@ngc.thewholeelephant.com");
+  aor_data1->get_binding("binding1")->_expires = now + 300;
+  aor_data2->get_binding("binding2")->_expires = now + 300;
+  EXPECT_TRUE(store.set_aor_data("5102175698@ngc.thewholeelephant.com", aor_data1));
+  EXPECT_FALSE(store.set_aor_data("5102175698@ngc.thewholeelephant.com", aor_data2));
+  delete aor_data2;
+
+  // The first writer's copy is up to date, so it can write again, but a
+  // copy read before that can't.
+  aor_data2 = store.get_aor_data("5102175698@ngc.thewholeelephant.com");
+  EXPECT_EQ(1u, aor_data2->bindings().size());
+  aor_data1->get_binding("binding1")->_cseq = 2;
+  EXPECT_TRUE(store.set_aor_data("5102175698@ngc.thewholeelephant.com", aor_data1));
+  EXPECT_FALSE(store.set_aor_data("5102175698@ngc.thewholeelephant.com", aor_data2));
+  delete aor_data1;
+  delete aor_data2;
+
+  // Removing the last binding removes the AoR, and a copy read before
+  // that can't write it back.
+  aor_data1 = store.get_aor_data("5102175698@ngc.thewholeelephant.com");
+  aor_data2 = store.get_aor_data("5102175698@ngc.thewholeelephant.com");
+  EXPECT_EQ(2, aor_data1->get_binding("binding1")->_cseq);
+  aor_data1->remove_binding("binding1");
+  EXPECT_TRUE(store.set_aor_data("5102175698@ngc.thewholeelephant.com", aor_data1));
+  EXPECT_EQ(0, store.size());
+  EXPECT_FALSE(store.set_aor_data("5102175698@ngc.thewholeelephant.com", aor_data2));
+  delete aor_data1;
+  delete aor_data2;
+
+  // Reading an AoR that doesn't exist doesn't add it.
+  aor_data1 = store.get_aor_data("5102175699@ngc.thewholeelephant.com");
+  EXPECT_EQ(0u, aor_data1->bindings().size());
+  EXPECT_EQ(0, store.size());
+  delete aor_data1;
+}
+
+/// Test that the local store purges AoRs whose bindings have expired.
+TEST_F(MemcachedStoreTest, LocalPurge)
+{
+  LocalStore store;
+  int now = time(NULL);
+
+  AoR* aor_data1 = store.get_aor_data("5102175698@ngc.thewholeelephant.com");
+  aor_data1->get_binding("binding1")->_expires = now + 1;
+  EXPECT_TRUE(store.set_aor_data("5102175698@ngc.thewholeelephant.com", aor_data1));
+  delete aor_data1;
+  aor_data1 = store.get_aor_data("5102175699@ngc.thewholeelephant.com");
+  aor_data1->get_binding("binding1")->_expires = now + 300;
+  EXPECT_TRUE(store.set_aor_data("5102175699@ngc.thewholeelephant.com", aor_data1));
+  delete aor_data1;
+
+  store.purge();
+  EXPECT_EQ(2, store.size());
+
+  // Move on until the first AoR's binding has expired.
+  cwtest_advance_time_ms(2000L);
+  EXPECT_FALSE(store.has_active_bindings("5102175698@ngc.thewholeelephant.com"));
+  EXPECT_TRUE(store.has_active_bindings("5102175699@ngc.thewholeelephant.com"));
+  store.purge();
+  EXPECT_EQ(1, store.size());
+}
+
+/// Test that writes to the local store purge expired AoRs from the shard
+/// they write to, a few at a time.
+TEST_F(MemcachedStoreTest, LocalPurgeOnWrite)
+{
+  LocalStore store(1);
+  int now = time(NULL);
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    std::string aor_id = "aor" + std::to_string(ii) + "@ngc.thewholeelephant.com";
+    AoR* aor_data = store.get_aor_data(aor_id);
+    aor_data->get_binding("binding1")->_expires = now + 1;
+    EXPECT_TRUE(store.set_aor_data(aor_id, aor_data));
+    delete aor_data;
+  }
+  EXPECT_EQ(100, store.size());
+
+  // Once they have expired, keep updating another AoR until every bucket
+  // has been checked.
+  cwtest_advance_time_ms(2000L);
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    AoR* aor_data = store.get_aor_data("5102175699@ngc.thewholeelephant.com");
+    aor_data->get_binding("binding1")->_expires = now + 300;
+    aor_data->get_binding("binding1")->_cseq = ii;
+    EXPECT_TRUE(store.set_aor_data("5102175699@ngc.thewholeelephant.com", aor_data));
+    delete aor_data;
+  }
+  EXPECT_EQ(1, store.size());
+}
+
+/// Arguments for a thread updating AoRs in the local store.
+struct LocalWriterArgs
+{
+  LocalStore* store;
+  int id;
+  int num_aors;
+  int num_updates;
+};
+
+/// Repeatedly update this thread's binding in each AoR, retrying on
+/// conflicts.
+static void* local_writer_thread(void* p)
+{
+  LocalWriterArgs* args = (LocalWriterArgs*)p;
+  std::string binding_id = "binding" + std::to_string(args->id);
+
+  for (int ii = 0; ii < args->num_updates; ++ii)
+  {
+    std::string aor_id = "aor" + std::to_string(ii % args->num_aors) + "@ngc.thewholeelephant.com";
+    AoR* aor_data = NULL;
+    do
+    {
+      delete aor_data;
+      aor_data = args->store->get_aor_data(aor_id);
+      bool existing = (aor_data->bindings().find(binding_id) !=
+                       aor_data->bindings().end());
+      AoR::Binding* b = aor_data->get_binding(binding_id);
+      b->_cseq = existing ? b->_cseq + 1 : 1;
+      b->_expires = time(NULL) + 300;
+    }
+    while (!args->store->set_aor_data(aor_id, aor_data));
+    delete aor_data;
+  }
+
+  return NULL;
+}
+
+/// Test that concurrent updates to the local store don't get lost.
+TEST_F(MemcachedStoreTest, LocalConcurrent)
+{
+  const int NUM_THREADS = 8;
+  const int NUM_AORS = 4;
+  const int NUM_UPDATES = 400;
+
+  LocalStore store(2);
+  LocalWriterArgs args[NUM_THREADS];
+  pthread_t threads[NUM_THREADS];
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    args[ii].store = &store;
+    args[ii].id = ii;
+    args[ii].num_aors = NUM_AORS;
+    args[ii].num_updates = NUM_UPDATES;
+    pthread_create(&threads[ii], NULL, &local_writer_thread, &args[ii]);
+  }
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  // Every thread's binding in every AoR has seen all its updates.
+  EXPECT_EQ(NUM_AORS, store.size());
+  for (int ii = 0; ii < NUM_AORS; ++ii)
+  {
+    AoR* aor_data = store.get_aor_data("aor" + std::to_string(ii) + "@ngc.thewholeelephant.com");
+    EXPECT_EQ((size_t)NUM_THREADS, aor_data->bindings().size());
+    for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+         i != aor_data->bindings().end();
+         ++i)
+    {
+      EXPECT_EQ(NUM_UPDATES / NUM_AORS, i->second->_cseq);
+    }
+    delete aor_data;
+  }
+}
+
+/// Records the results of asynchronous gets.
+class RecordingGetCallback : public Store::GetCallback
+{
+public:
+  RecordingGetCallback() : _completed(0), _failed(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~RecordingGetCallback()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void get_complete(const std::string& aor_id, AoR* aor_data)
+  {
+    pthread_mutex_lock(&_lock);
+    ++_completed;
+    if (aor_data == NULL)
+    {
+      ++_failed;
+    }
+    pthread_mutex_unlock(&_lock);
+    delete aor_data;
+  }
+
+  int completed()
+  {
+    pthread_mutex_lock(&_lock);
+    int completed = _completed;
+    pthread_mutex_unlock(&_lock);
+    return completed;
+  }
+
+  int failed()
+  {
+    pthread_mutex_lock(&_lock);
+    int failed = _failed;
+    pthread_mutex_unlock(&_lock);
+    return failed;
+  }
+
+private:
+  pthread_mutex_t _lock;
+  int _completed;
+  int _failed;
+};
+
+/// Test that the local store completes asynchronous gets straight away.
+TEST_F(MemcachedStoreTest, LocalAsync)
+{
+  LocalStore store;
+  RecordingGetCallback callback;
+
+  AoR* aor_data = NULL;
+  EXPECT_TRUE(store.get_aor_data_async("5102175698@ngc.thewholeelephant.com", &callback, aor_data));
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data;
+  EXPECT_EQ(0, callback.completed());
+}
+
+/// Test that asynchronous gets are passed to the I/O threads, and complete
+/// (here with an error, as there's no server) without blocking the caller.
+TEST_F(MemcachedStoreTest, MemcachedAsyncAlt)
+{
+  const int NUM_GETS = 100;
+
+  // Point the store at a port we hold bound but not listening, so every
+  // connection is refused whatever else is running on this host.
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(0, bind(fd, (struct sockaddr*)&addr, sizeof(addr)));
+  socklen_t addr_len = sizeof(addr);
+  getsockname(fd, (struct sockaddr*)&addr, &addr_len);
+
+  std::list<std::string> servers;
+  servers.push_back("127.0.0.1:" + std::to_string(ntohs(addr.sin_port)));
+  MemcachedStore* store = new MemcachedStore(servers, 10, true, 0, 0, 2);
+  RecordingGetCallback callback;
+
+  for (int ii = 0; ii < NUM_GETS; ++ii)
+  {
+    AoR* aor_data = NULL;
+    EXPECT_FALSE(store->get_aor_data_async("aor" + std::to_string(ii) + "@ngc.thewholeelephant.com",
+                                           &callback,
+                                           aor_data));
+    EXPECT_EQ(NULL, aor_data);
+  }
+
+  // Wait (for up to five seconds) for the gets to complete.
+  for (int ii = 0; (ii < 500) && (callback.completed() < NUM_GETS); ++ii)
+  {
+    usleep(10000);
+  }
+  EXPECT_EQ(NUM_GETS, callback.completed());
+  EXPECT_EQ(NUM_GETS, callback.failed());
+
+  // Any gets still queued when the store is destroyed also complete.
+  for (int ii = 0; ii < NUM_GETS; ++ii)
+  {
+    AoR* aor_data = NULL;
+    store->get_aor_data_async("aor" + std::to_string(ii) + "@ngc.thewholeelephant.com",
+                              &callback,
+                              aor_data);
+  }
+  delete store;
+  EXPECT_EQ(2 * NUM_GETS, callback.completed());
+  close(fd);
+}
+
+/// Test that stores write the legacy format unless configured to write the
+/// binary format, so that nodes running earlier releases can read the AoRs
+/// during an upgrade.
+TEST_F(MemcachedStoreTest, WriteFormat)
+{
+  std::list<std::string> servers;
+  servers.push_back(std::string("localhost:11209"));
+
+  MemcachedAoR aor_data;
+  AoR::Binding* b = aor_data.get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  b->_uri = std::string("<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>");
+  b->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+  b->_cseq = 17038;
+  b->_expires = time(NULL) + 300;
+  b->_priority = 0;
+
+  MemcachedStore legacy_store(servers, 10);
+  std::string s = legacy_store.serialize(&aor_data);
+  EXPECT_EQ(MemcachedStore::serialize_legacy_aor(&aor_data), s);
+  MemcachedAoR* aor_data2 = MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
+  EXPECT_EQ(1u, aor_data2->bindings().size());
+  delete aor_data2;
+
+  MemcachedStore binary_store(servers, 10, true, 0, 0, 0, true);
+  s = binary_store.serialize(&aor_data);
+  EXPECT_EQ(MemcachedStore::serialize_aor(&aor_data), s);
+  aor_data2 = MemcachedStore::deserialize_aor(s);
+  ASSERT_TRUE(aor_data2 != NULL);
+  EXPECT_EQ(1u, aor_data2->bindings().size());
+  delete aor_data2;
+}
+
 /// Test the real memcached server.  Disabled because we don't have a real memcached server to test against at UT time.
 TEST_F(MemcachedStoreTest, DISABLED_SimpleMemcached)
 {
@@ -337,6 +799,37 @@ void MemcachedStoreTest::do_test_simple(Store& store)
   EXPECT_EQ(now + 300, b1->_expires);
   EXPECT_EQ(0, b1->_priority);
 
+  // Get several AoRs at once, including one that doesn't exist yet and
+  // one that's asked for twice.
+  std::vector<std::string> aor_ids;
+  aor_ids.push_back("5102175698@ngc.thewholeelephant.com");
+  aor_ids.push_back("5102175699@ngc.thewholeelephant.com");
+  aor_ids.push_back("5102175698@ngc.thewholeelephant.com");
+  std::vector<AoR*> aors = store.get_aor_data_multi(aor_ids);
+  ASSERT_EQ(3u, aors.size());
+  ASSERT_TRUE(aors[0] != NULL);
+  ASSERT_TRUE(aors[1] != NULL);
+  ASSERT_TRUE(aors[2] != NULL);
+  EXPECT_NE(aors[0], aors[2]);
+  EXPECT_EQ(1u, aors[0]->bindings().size());
+  EXPECT_EQ(17040, aors[0]->bindings().begin()->second->_cseq);
+  EXPECT_EQ(0u, aors[1]->bindings().size());
+  EXPECT_EQ(1u, aors[2]->bindings().size());
+  EXPECT_EQ(17040, aors[2]->bindings().begin()->second->_cseq);
+  delete aors[0];
+  delete aors[1];
+  delete aors[2];
+
+  // The default implementation, which gets each AoR in turn, agrees.
+  aors = store.Store::get_aor_data_multi(aor_ids);
+  ASSERT_EQ(3u, aors.size());
+  EXPECT_EQ(1u, aors[0]->bindings().size());
+  EXPECT_EQ(0u, aors[1]->bindings().size());
+  EXPECT_EQ(1u, aors[2]->bindings().size());
+  delete aors[0];
+  delete aors[1];
+  delete aors[2];
+
   // Now check the maximum expiry is what we think.
   int max_exp = store.expire_bindings(aor_data1, now + 299);
   EXPECT_EQ(1u, aor_data1->bindings().size());
@@ -348,4 +841,20 @@ void MemcachedStoreTest::do_test_simple(Store& store)
   EXPECT_EQ(now + 301, max_exp);
 
   delete aor_data1;
+
+  // Now check whether AoRs have unexpired bindings, without getting them.
+  EXPECT_TRUE(store.has_active_bindings(std::string("5102175698@ngc.thewholeelephant.com")));
+  EXPECT_FALSE(store.has_active_bindings(std::string("5102175699@ngc.thewholeelephant.com")));
+
+  // The default implementation, which gets the AoR, agrees.
+  EXPECT_TRUE(store.Store::has_active_bindings(std::string("5102175698@ngc.thewholeelephant.com")));
+
+  aor_data1 = store.get_aor_data(std::string("5102175698@ngc.thewholeelephant.com"));
+  b1 = aor_data1->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  b1->_expires = now - 1;
+  rc = store.set_aor_data(std::string("5102175698@ngc.thewholeelephant.com"), aor_data1);
+  EXPECT_TRUE(rc);
+  delete aor_data1;
+  EXPECT_FALSE(store.has_active_bindings(std::string("5102175698@ngc.thewholeelephant.com")));
+  EXPECT_FALSE(store.Store::has_active_bindings(std::string("5102175698@ngc.thewholeelephant.com")));
 }
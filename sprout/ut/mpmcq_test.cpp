@@ -0,0 +1,242 @@
+/**
+ * @file mpmcq_test.cpp UT for lock-free multi-producer/multi-consumer queue.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "mpmcq.h"
+
+using namespace std;
+
+/// Fixture for MpmcqTest.
+class MpmcqTest : public ::testing::Test
+{
+  MpmcqTest()
+  {
+  }
+
+  virtual ~MpmcqTest()
+  {
+  }
+};
+
+/// Number of items each producer pushes in the threaded test.
+static const int ITEMS_PER_PRODUCER = 20000;
+
+struct producer_args
+{
+  mpmcq<int>* q;
+  int base;
+};
+
+static void* producer(void* p)
+{
+  producer_args* args = (producer_args*)p;
+  for (int ii = 0; ii < ITEMS_PER_PRODUCER; ++ii)
+  {
+    args->q->push(args->base + ii);
+  }
+  return NULL;
+}
+
+struct consumer_args
+{
+  mpmcq<int>* q;
+  long long sum;
+  int count;
+};
+
+static void* consumer(void* p)
+{
+  consumer_args* args = (consumer_args*)p;
+  int batch[8];
+  unsigned int n;
+  while ((n = args->q->pop_batch(batch, 8)) > 0)
+  {
+    for (unsigned int ii = 0; ii < n; ++ii)
+    {
+      args->sum += batch[ii];
+      ++args->count;
+    }
+  }
+  return NULL;
+}
+
+TEST_F(MpmcqTest, CapacityRoundsUp)
+{
+  mpmcq<int> q(100);
+  EXPECT_EQ(128u, q.capacity());
+  EXPECT_EQ(0u, q.size());
+}
+
+TEST_F(MpmcqTest, FifoOrder)
+{
+  mpmcq<int> q(4);
+  EXPECT_TRUE(q.push(1));
+  EXPECT_TRUE(q.push(2));
+  EXPECT_TRUE(q.push_noblock(3));
+  EXPECT_EQ(3u, q.size());
+
+  int item = 0;
+  EXPECT_TRUE(q.pop(item));
+  EXPECT_EQ(1, item);
+  EXPECT_TRUE(q.try_pop(item));
+  EXPECT_EQ(2, item);
+  EXPECT_TRUE(q.pop(item, 0));
+  EXPECT_EQ(3, item);
+
+  // Empty now.
+  EXPECT_FALSE(q.try_pop(item));
+  EXPECT_FALSE(q.pop(item, 0));
+  EXPECT_FALSE(q.pop(item, 10));
+}
+
+TEST_F(MpmcqTest, FullQueue)
+{
+  mpmcq<int> q(2);
+  EXPECT_TRUE(q.push_noblock(1));
+  EXPECT_TRUE(q.push_noblock(2));
+  EXPECT_FALSE(q.push_noblock(3));
+
+  // Wrap round the ring a few times.
+  int item;
+  for (int ii = 3; ii < 10; ++ii)
+  {
+    EXPECT_TRUE(q.pop(item));
+    EXPECT_EQ(ii - 2, item);
+    EXPECT_TRUE(q.push_noblock(ii));
+  }
+  q.purge();
+  EXPECT_EQ(0u, q.size());
+}
+
+TEST_F(MpmcqTest, Batch)
+{
+  mpmcq<int> q(16);
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    q.push(ii);
+  }
+
+  int batch[4];
+  EXPECT_EQ(4u, q.pop_batch(batch, 4));
+  EXPECT_EQ(0, batch[0]);
+  EXPECT_EQ(3, batch[3]);
+  EXPECT_EQ(4u, q.pop_batch(batch, 4));
+  EXPECT_EQ(2u, q.pop_batch(batch, 4));
+  EXPECT_EQ(9, batch[1]);
+  EXPECT_EQ(0u, q.pop_batch(batch, 4, 0));
+}
+
+TEST_F(MpmcqTest, OpenClose)
+{
+  mpmcq<int> q(4, false);
+  EXPECT_FALSE(q.push(1));
+  EXPECT_FALSE(q.push_noblock(1));
+  q.open();
+  EXPECT_TRUE(q.push(1));
+  q.close();
+  EXPECT_FALSE(q.push(2));
+  EXPECT_EQ(1u, q.size());
+}
+
+TEST_F(MpmcqTest, Terminate)
+{
+  mpmcq<int> q(4);
+  q.push(1);
+  EXPECT_FALSE(q.is_terminated());
+  q.terminate();
+  EXPECT_TRUE(q.is_terminated());
+
+  int item;
+  EXPECT_FALSE(q.pop(item));
+  EXPECT_FALSE(q.push(2));
+}
+
+TEST_F(MpmcqTest, MultiThreaded)
+{
+  const int num_producers = 4;
+  const int num_consumers = 4;
+  mpmcq<int> q(64);
+
+  pthread_t producers[num_producers];
+  producer_args pargs[num_producers];
+  pthread_t consumers[num_consumers];
+  consumer_args cargs[num_consumers];
+
+  for (int ii = 0; ii < num_consumers; ++ii)
+  {
+    cargs[ii].q = &q;
+    cargs[ii].sum = 0;
+    cargs[ii].count = 0;
+    pthread_create(&consumers[ii], NULL, &consumer, &cargs[ii]);
+  }
+  for (int ii = 0; ii < num_producers; ++ii)
+  {
+    pargs[ii].q = &q;
+    pargs[ii].base = ii * ITEMS_PER_PRODUCER;
+    pthread_create(&producers[ii], NULL, &producer, &pargs[ii]);
+  }
+  for (int ii = 0; ii < num_producers; ++ii)
+  {
+    pthread_join(producers[ii], NULL);
+  }
+
+  // Wait for the consumers to drain the queue before terminating it.
+  while (q.size() > 0)
+  {
+    usleep(1000);
+  }
+  q.terminate();
+
+  long long sum = 0;
+  int count = 0;
+  for (int ii = 0; ii < num_consumers; ++ii)
+  {
+    pthread_join(consumers[ii], NULL);
+    sum += cargs[ii].sum;
+    count += cargs[ii].count;
+  }
+
+  long long total = num_producers * ITEMS_PER_PRODUCER;
+  EXPECT_EQ(total, count);
+  EXPECT_EQ(total * (total - 1) / 2, sum);
+}
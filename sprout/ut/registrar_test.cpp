@@ -38,6 +38,7 @@
 ///----------------------------------------------------------------------------
 
 #include <string>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -50,6 +51,8 @@
 #include "registration_utils.h"
 #include "fakelogger.hpp"
 #include "fakehssconnection.hpp"
+#include "fakestore.hpp"
+#include "test_interposer.hpp"
 
 using namespace std;
 using testing::MatchesRegex;
@@ -64,7 +67,7 @@ public:
   {
     SipTest::SetUpTestCase();
 
-    _store = RegData::create_local_store();
+    _store = new FakeStore();
     _analytics = new AnalyticsLogger("foo");
     _hss_connection = new FakeHSSConnection();
     _hss_connection->set_json(std::string("/associatedpublicbypublic/sip%3A6505550231%40homedomain"),
@@ -72,7 +75,7 @@ public:
     _ifc_handler = new IfcHandler(_hss_connection, _store);
     delete _analytics->_logger;
     _analytics->_logger = NULL;
-    pj_status_t ret = init_registrar(_store, _hss_connection, _analytics, _ifc_handler, 300);
+    pj_status_t ret = init_registrar(_store, _hss_connection, _analytics, _ifc_handler, 300, NULL);
     ASSERT_EQ(PJ_SUCCESS, ret);
     stack_data.sprout_cluster_domain = pj_str("all.the.sprout.nodes");
   }
@@ -83,7 +86,7 @@ public:
     delete _ifc_handler; _ifc_handler = NULL;
     delete _hss_connection; _hss_connection = NULL;
     delete _analytics;
-    RegData::destroy_local_store(_store); _store = NULL;
+    delete _store; _store = NULL;
 
     SipTest::TearDownTestCase();
   }
@@ -92,6 +95,7 @@ public:
   {
     _analytics->_logger = &_log;
     _store->flush_all();  // start from a clean slate on each test
+    _store->set_deferred(false);
   }
 
   ~RegistrarTest()
@@ -99,14 +103,20 @@ public:
     _analytics->_logger = NULL;
   }
 
+  /// Put the clock back even if a test that moved it on failed.
+  virtual void TearDown()
+  {
+    cwtest_reset_time();
+  }
+
 protected:
-  static RegData::Store* _store;
+  static FakeStore* _store;
   static AnalyticsLogger* _analytics;
   static IfcHandler* _ifc_handler;
   static FakeHSSConnection* _hss_connection;
 };
 
-RegData::Store* RegistrarTest::_store;
+FakeStore* RegistrarTest::_store;
 AnalyticsLogger* RegistrarTest::_analytics;
 IfcHandler* RegistrarTest::_ifc_handler;
 FakeHSSConnection* RegistrarTest::_hss_connection;
@@ -224,6 +234,36 @@ TEST_F(RegistrarTest, SimpleMainlineExpiresHeader)
   free_txdata();
 }
 
+/// Check that a REGISTER waits for the store if it can't return the current
+/// bindings straight away, and completes once they arrive.
+TEST_F(RegistrarTest, AsyncStore)
+{
+  _store->set_deferred(true);
+
+  Message msg;
+  msg._expires = "Expires: 300";
+  msg._contact_params = ";+sip.ice;reg-id=1";
+  inject_msg(msg.get());
+
+  // Nothing is sent until the store returns the bindings.
+  ASSERT_EQ(0, txdata_count());
+  EXPECT_EQ(1, _store->pending_gets());
+  _store->complete_gets();
+
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  EXPECT_EQ("Contact: sip:f5cc3de4334589d89c661a7acf228ed7@10.114.61.213:5061;transport=tcp;ob;expires=300;+sip.ice;reg-id=1;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\"",
+            get_headers(out, "Contact"));
+  free_txdata();
+
+  // The binding was stored.
+  RegData::AoR* aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  delete aor_data;
+}
+
 /// Simple correct example with Expires parameter
 TEST_F(RegistrarTest, SimpleMainlineExpiresParameter)
 {
@@ -642,6 +682,126 @@ TEST_F(RegistrarTest, DeregisterAppServersWithNoBody)
   delete aor_data; aor_data = NULL;
 }
 
+/// Check that bindings are removed as they expire, and that the user is
+/// deregistered from the application servers when the last one goes
+TEST_F(RegistrarTest, ExpireBindingsAppServers)
+{
+  _hss_connection->set_user_ifc("sip:6505550231@homedomain",
+                                "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                                "<ServiceProfile>\n"
+                                "  <InitialFilterCriteria>\n"
+                                "    <Priority>1</Priority>\n"
+                                "    <TriggerPoint>\n"
+                                "    <ConditionTypeCNF>0</ConditionTypeCNF>\n"
+                                "    <SPT>\n"
+                                "      <ConditionNegated>0</ConditionNegated>\n"
+                                "      <Group>0</Group>\n"
+                                "      <Method>REGISTER</Method>\n"
+                                "      <Extension></Extension>\n"
+                                "    </SPT>\n"
+                                "  </TriggerPoint>\n"
+                                "  <ApplicationServer>\n"
+                                "    <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                                "    <DefaultHandling>1</DefaultHandling>\n"
+                                "  </ApplicationServer>\n"
+                                "  </InitialFilterCriteria>\n"
+                                "</ServiceProfile>");
+
+  TransportFlow tpAS(TransportFlow::Protocol::UDP, TransportFlow::Trust::TRUSTED, "1.2.3.4", 56789);
+
+  // Use an expirer without its thread, so the test controls when it runs.
+  BindingExpirer expirer(_store, _ifc_handler, stack_data.pool);
+
+  // Register two bindings, one of which expires almost immediately.
+  register_uri(_store, _hss_connection, "6505550231", "homedomain", "sip:f5cc3de4334589d89c661a7acf228ed7@10.114.61.213", 1);
+  register_uri(_store, _hss_connection, "6505550231", "homedomain", "sip:f5cc3de4334589d89c661a7acf228ed8@10.114.61.213", 4);
+  RegData::AoR* aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(2u, aor_data->_bindings.size());
+  expirer.update("sip:6505550231@homedomain", aor_data);
+  delete aor_data; aor_data = NULL;
+  EXPECT_EQ(1u, expirer.size());
+
+  // Nothing has expired yet.
+  expirer.expire(time(NULL));
+  EXPECT_EQ(0, txdata_count());
+  EXPECT_EQ(1u, expirer.size());
+
+  // Once the first binding expires, the AoR is still tracked for the
+  // second, but the user stays registered with the AS.
+  cwtest_advance_time_ms(2000L);
+  expirer.expire(time(NULL));
+  EXPECT_EQ(0, txdata_count());
+  EXPECT_EQ(1u, expirer.size());
+
+  // Once the second binding expires, we send a REGISTER to the AS.
+  cwtest_advance_time_ms(3000L);
+  expirer.expire(time(NULL));
+  EXPECT_EQ(0u, expirer.size());
+
+  SCOPED_TRACE("deREGISTER");
+  pjsip_msg* out = current_txdata()->msg;
+  ReqMatcher r1("REGISTER");
+  ASSERT_NO_FATAL_FAILURE(r1.matches(out));
+  EXPECT_EQ(NULL, out->body);
+
+  tpAS.expect_target(current_txdata(), false);
+
+  free_txdata();
+}
+
+/// Check that the expirer stops tracking AoRs with no bindings
+TEST_F(RegistrarTest, ExpireBindingsDeregistered)
+{
+  BindingExpirer expirer(_store, _ifc_handler, stack_data.pool);
+
+  register_uri(_store, _hss_connection, "6505550231", "homedomain", "sip:f5cc3de4334589d89c661a7acf228ed7@10.114.61.213", 300);
+  RegData::AoR* aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data != NULL);
+  expirer.update("sip:6505550231@homedomain", aor_data);
+  EXPECT_EQ(1u, expirer.size());
+
+  aor_data->clear();
+  expirer.update("sip:6505550231@homedomain", aor_data);
+  delete aor_data; aor_data = NULL;
+  EXPECT_EQ(0u, expirer.size());
+}
+
+/// Check that the expirer doesn't rewrite an AoR whose bindings have been
+/// refreshed since it was tracked, but tracks the new expiry time instead.
+TEST_F(RegistrarTest, ExpireBindingsRefreshed)
+{
+  BindingExpirer expirer(_store, _ifc_handler, stack_data.pool);
+
+  register_uri(_store, _hss_connection, "6505550231", "homedomain", "sip:f5cc3de4334589d89c661a7acf228ed7@10.114.61.213", 1);
+  RegData::AoR* aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data != NULL);
+  expirer.update("sip:6505550231@homedomain", aor_data);
+  delete aor_data; aor_data = NULL;
+
+  // Refresh the binding without telling the expirer, as another node
+  // would.
+  register_uri(_store, _hss_connection, "6505550231", "homedomain", "sip:f5cc3de4334589d89c661a7acf228ed7@10.114.61.213", 300);
+  aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data != NULL);
+  uint64_t cas = ((RegData::LocalAoR*)aor_data)->get_cas();
+  delete aor_data; aor_data = NULL;
+
+  cwtest_advance_time_ms(2000L);
+  expirer.expire(time(NULL));
+
+  // The AoR hasn't been written, the user stays registered with the AS,
+  // and the AoR is still tracked.
+  aor_data = _store->get_aor_data("sip:6505550231@homedomain");
+  ASSERT_TRUE(aor_data != NULL);
+  EXPECT_EQ(0, aor_data->expired());
+  EXPECT_EQ(1u, aor_data->bindings().size());
+  EXPECT_EQ(cas, ((RegData::LocalAoR*)aor_data)->get_cas());
+  delete aor_data; aor_data = NULL;
+  EXPECT_EQ(0, txdata_count());
+  EXPECT_EQ(1u, expirer.size());
+}
+
 /// Homestead fails associated URI request
 TEST_F(RegistrarTest, ErrorAssociatedUris)
 {
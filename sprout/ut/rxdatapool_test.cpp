@@ -0,0 +1,186 @@
+/**
+ * @file rxdatapool_test.cpp UT for received message clone pool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "stack.h"
+#include "rxdatapool.h"
+
+using namespace std;
+
+/// Fixture for RxDataPoolTest.
+class RxDataPoolTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  RxDataPoolTest() : SipTest(NULL)
+  {
+  }
+
+  ~RxDataPoolTest()
+  {
+  }
+
+  /// Build and parse a received message.
+  pjsip_rx_data* build_parsed_rxdata(const string& msg)
+  {
+    pjsip_rx_data* rdata = build_rxdata(msg);
+    parse_rxdata(rdata);
+    return rdata;
+  }
+};
+
+static const string INVITE =
+  "INVITE sip:6505550231@homedomain SIP/2.0\r\n"
+  "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+  "Via: SIP/2.0/TCP 10.114.61.213:5061;received=23.20.193.43;branch=z9hG4bK+7f6b263a983ef39b0bbda2135ee454871+sip+1+a64de9f6\r\n"
+  "Max-Forwards: 68\r\n"
+  "Route: <sip:testnode;transport=TCP;lr;orig>\r\n"
+  "Route: <sip:homedomain;lr>\r\n"
+  "Record-Route: <sip:10.114.61.213:5061;transport=tcp;lr>\r\n"
+  "Record-Route: <sip:10.83.18.38:36530;transport=tcp;lr>\r\n"
+  "From: <sip:6505551000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+  "To: <sip:6505550231@homedomain>\r\n"
+  "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+  "CSeq: 16567 INVITE\r\n"
+  "Require: 100rel\r\n"
+  "Supported: outbound, path\r\n"
+  "Content-Type: application/sdp\r\n"
+  "Content-Length: 8\r\n"
+  "\r\n"
+  "v=0\r\no=\r\n";
+
+TEST_F(RxDataPoolTest, Clone)
+{
+  RxDataPool pool(&stack_data.cp.factory, 4);
+  pjsip_rx_data* rdata = build_parsed_rxdata(INVITE);
+  set_trail(rdata, 1234);
+
+  pjsip_rx_data* clone;
+  ASSERT_EQ(PJ_SUCCESS, pool.clone(rdata, &clone));
+  EXPECT_EQ(1u, pool.pools_created());
+
+  // The clone has its own copy of the message.
+  EXPECT_NE(rdata->msg_info.msg, clone->msg_info.msg);
+  EXPECT_NE(rdata->msg_info.msg_buf, clone->msg_info.msg_buf);
+  EXPECT_EQ(INVITE, string(clone->msg_info.msg_buf, clone->msg_info.len));
+  EXPECT_EQ('\0', clone->msg_info.msg_buf[clone->msg_info.len]);
+  EXPECT_EQ(PJSIP_INVITE_METHOD, clone->msg_info.msg->line.req.method.id);
+  EXPECT_EQ(8u, clone->msg_info.msg->body->len);
+
+  // The header shortcuts point to the first header of each type in the
+  // cloned message.
+  EXPECT_EQ(PJSIP_H_CALL_ID, clone->msg_info.cid->type);
+  EXPECT_EQ(0, pj_strcmp(&rdata->msg_info.cid->id, &clone->msg_info.cid->id));
+  EXPECT_EQ(0, pj_strcmp(&rdata->msg_info.from->tag, &clone->msg_info.from->tag));
+  EXPECT_EQ(0, clone->msg_info.to->tag.slen);
+  EXPECT_EQ(0, pj_strcmp(&rdata->msg_info.via->branch_param, &clone->msg_info.via->branch_param));
+  EXPECT_EQ(16567, clone->msg_info.cseq->cseq);
+  EXPECT_EQ(68, clone->msg_info.max_fwd->ivalue);
+  EXPECT_EQ(PJSIP_H_ROUTE, clone->msg_info.route->type);
+  EXPECT_EQ(PJSIP_H_RECORD_ROUTE, clone->msg_info.record_route->type);
+  EXPECT_EQ(5061, ((pjsip_sip_uri*)clone->msg_info.record_route->name_addr.uri)->port);
+  EXPECT_EQ(PJSIP_H_CONTENT_TYPE, clone->msg_info.ctype->type);
+  EXPECT_EQ(8, clone->msg_info.clen->len);
+  EXPECT_EQ(1u, clone->msg_info.require->count);
+  EXPECT_EQ(2u, clone->msg_info.supported->count);
+
+  // The packet and module information is copied.
+  EXPECT_EQ(rdata->tp_info.transport, clone->tp_info.transport);
+  EXPECT_EQ(rdata->pkt_info.src_port, clone->pkt_info.src_port);
+  EXPECT_STREQ(rdata->pkt_info.src_name, clone->pkt_info.src_name);
+  EXPECT_EQ(1234u, get_trail(clone));
+
+  pool.release(clone);
+  EXPECT_EQ(1u, pool.pools_free());
+}
+
+TEST_F(RxDataPoolTest, Recycle)
+{
+  RxDataPool pool(&stack_data.cp.factory, 2);
+  pjsip_rx_data* rdata = build_parsed_rxdata(INVITE);
+  pjsip_rx_data* clones[3];
+
+  // Pools are reused once released.
+  ASSERT_EQ(PJ_SUCCESS, pool.clone(rdata, &clones[0]));
+  pool.release(clones[0]);
+  ASSERT_EQ(PJ_SUCCESS, pool.clone(rdata, &clones[0]));
+  EXPECT_EQ(1u, pool.pools_created());
+  EXPECT_EQ(0u, pool.pools_free());
+
+  // If more pools are released than fit on the free list, the extra ones
+  // are freed.
+  ASSERT_EQ(PJ_SUCCESS, pool.clone(rdata, &clones[1]));
+  ASSERT_EQ(PJ_SUCCESS, pool.clone(rdata, &clones[2]));
+  EXPECT_EQ(3u, pool.pools_created());
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    pool.release(clones[ii]);
+  }
+  EXPECT_EQ(2u, pool.pools_free());
+}
+
+TEST_F(RxDataPoolTest, Reserve)
+{
+  RxDataPool pool(&stack_data.cp.factory, 4);
+  pjsip_rx_data* rdata = build_parsed_rxdata(INVITE);
+
+  // Reserving fills the free list, but no further.
+  pool.reserve(8);
+  EXPECT_EQ(4u, pool.pools_free());
+
+  // Clones use the reserved pools rather than creating more.
+  unsigned long created = pool.pools_created();
+  pjsip_rx_data* clone;
+  ASSERT_EQ(PJ_SUCCESS, pool.clone(rdata, &clone));
+  EXPECT_EQ(created, pool.pools_created());
+  EXPECT_EQ(3u, pool.pools_free());
+  pool.release(clone);
+}
@@ -0,0 +1,311 @@
+/**
+ * @file sas_test.cpp UT for SAS message encoding.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <time.h>
+#include <arpa/inet.h>
+#include "gtest/gtest.h"
+
+#include "sas.h"
+#include "test_interposer.hpp"
+
+using namespace std;
+
+/// Fixture for SasTest.
+class SasTest : public ::testing::Test
+{
+  SasTest()
+  {
+  }
+
+  virtual ~SasTest()
+  {
+    // Put back the default policy.
+    SAS::set_policy(SAS::Policy());
+  }
+
+  virtual void TearDown()
+  {
+    cwtest_reset_time();
+  }
+
+  /// Move the clock on to the start of the next second, so a test has
+  /// (nearly) a whole event cap window before it rolls over.
+  static void advance_to_next_second()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    cwtest_advance_time_ms(1000L - ts.tv_nsec / 1000000L);
+  }
+
+  static uint16_t get16(const std::string& s, size_t offset)
+  {
+    uint16_t v;
+    memcpy(&v, s.data() + offset, sizeof(v));
+    return ntohs(v);
+  }
+
+  static uint32_t get32(const std::string& s, size_t offset)
+  {
+    uint32_t v;
+    memcpy(&v, s.data() + offset, sizeof(v));
+    return ntohl(v);
+  }
+};
+
+TEST_F(SasTest, Event)
+{
+  SAS::Event event(0x0102030405060708ull, 0x1234, 7);
+  event.add_static_param(42);
+  event.add_static_param(43);
+  event.add_var_param("hello");
+  event.add_var_param("");
+
+  std::string s = event.to_string();
+  ASSERT_EQ(event.encoded_length(), s.length());
+  ASSERT_EQ(12u + 16u + 2u + 8u + 7u + 2u, s.length());
+
+  // Common header - length, version, type, then an 8 byte timestamp.
+  EXPECT_EQ(s.length(), get16(s, 0));
+  EXPECT_EQ(1, s[2]);
+  EXPECT_EQ(3, s[3]);
+
+  // Trail, event ID and instance.
+  EXPECT_EQ(0x01020304u, get32(s, 12));
+  EXPECT_EQ(0x05060708u, get32(s, 16));
+  EXPECT_EQ(0x1234u, get32(s, 20));
+  EXPECT_EQ(7u, get32(s, 24));
+
+  // Static parameters in native byte order, then variable parameters.
+  EXPECT_EQ(8, get16(s, 28));
+  uint32_t param;
+  memcpy(&param, s.data() + 30, sizeof(param));
+  EXPECT_EQ(42u, param);
+  memcpy(&param, s.data() + 34, sizeof(param));
+  EXPECT_EQ(43u, param);
+  EXPECT_EQ(5, get16(s, 38));
+  EXPECT_EQ("hello", s.substr(40, 5));
+  EXPECT_EQ(0, get16(s, 45));
+}
+
+TEST_F(SasTest, EventTimestamp)
+{
+  // An event can report an earlier time than the one it is encoded at.
+  SAS::Event event(1, 0x1234, 7);
+  event.set_timestamp(0x0000012345678abcull);
+
+  std::string s = event.to_string();
+  EXPECT_EQ(0x00000123u, get32(s, 4));
+  EXPECT_EQ(0x45678abcu, get32(s, 8));
+}
+
+TEST_F(SasTest, Marker)
+{
+  SAS::Marker marker(99, 0x01000003, 1);
+  marker.add_var_param("call-id");
+
+  std::string s = marker.to_string(SAS::Marker::Scope::Branch);
+  ASSERT_EQ(marker.encoded_length(), s.length());
+  ASSERT_EQ(12u + 18u + 2u + 9u, s.length());
+  EXPECT_EQ(s.length(), get16(s, 0));
+  EXPECT_EQ(4, s[3]);
+  EXPECT_EQ(0u, get32(s, 12));
+  EXPECT_EQ(99u, get32(s, 16));
+  EXPECT_EQ(0x01000003u, get32(s, 20));
+  EXPECT_EQ(1, s[28]);
+  EXPECT_EQ(1, s[29]);
+  EXPECT_EQ(0, get16(s, 30));
+  EXPECT_EQ(7, get16(s, 32));
+  EXPECT_EQ("call-id", s.substr(34));
+
+  s = marker.to_string(SAS::Marker::Scope::None);
+  EXPECT_EQ(0, s[28]);
+  EXPECT_EQ(0, s[29]);
+}
+
+TEST_F(SasTest, BufferPool)
+{
+  SAS::BufferPool pool(1);
+
+  // Buffers are recycled rather than allocated each time.
+  SAS::Buffer* small = pool.get(100);
+  ASSERT_TRUE(small != NULL);
+  EXPECT_EQ(SAS::BufferPool::SMALL_BUFFER_SIZE, small->capacity);
+  pool.release(small);
+  EXPECT_EQ(small, pool.get(SAS::BufferPool::SMALL_BUFFER_SIZE));
+  EXPECT_EQ(1u, pool.buffers_created());
+
+  SAS::Buffer* large = pool.get(SAS::BufferPool::SMALL_BUFFER_SIZE + 1);
+  ASSERT_TRUE(large != NULL);
+  EXPECT_EQ(SAS::BufferPool::LARGE_BUFFER_SIZE, large->capacity);
+  EXPECT_EQ(2u, pool.buffers_created());
+
+  // Encode into the large buffer.
+  SAS::Event event(1, 2, 3);
+  std::string data(5000, 'x');
+  event.add_var_param(data);
+  event.encode(large->data(), event.encoded_length());
+  EXPECT_EQ(event.to_string().substr(12), std::string(large->data() + 12, event.encoded_length() - 12));
+
+  // Only one free buffer of each size is kept, so the second small buffer
+  // is freed on release.
+  SAS::Buffer* small2 = pool.get(10);
+  pool.release(large);
+  pool.release(small);
+  pool.release(small2);
+  EXPECT_EQ(3u, pool.buffers_created());
+
+  // Messages too big for the 16 bit length are refused.
+  EXPECT_TRUE(pool.get(SAS::BufferPool::LARGE_BUFFER_SIZE) == NULL);
+}
+
+TEST_F(SasTest, Sampling)
+{
+  // By default every trail is traced.
+  unsigned long created = SAS::trails_created();
+  unsigned long traced = SAS::trails_traced();
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    EXPECT_TRUE(SAS::is_traced(SAS::new_trail(1u)));
+  }
+  EXPECT_EQ(created + 100, SAS::trails_created());
+  EXPECT_EQ(traced + 100, SAS::trails_traced());
+
+  // Sample roughly a quarter of trails.
+  SAS::Policy policy;
+  policy.sample_percent = 25.0;
+  SAS::set_policy(policy);
+  traced = SAS::trails_traced();
+  int sampled = 0;
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    if (SAS::is_traced(SAS::new_trail(1u)))
+    {
+      ++sampled;
+    }
+  }
+  EXPECT_LT(2300, sampled);
+  EXPECT_GT(2700, sampled);
+  EXPECT_EQ(traced + sampled, SAS::trails_traced());
+
+  // Sample none.
+  policy.sample_percent = 0.0;
+  SAS::set_policy(policy);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    EXPECT_FALSE(SAS::is_traced(SAS::new_trail(1u)));
+  }
+}
+
+TEST_F(SasTest, ForceTrail)
+{
+  SAS::Policy policy;
+  policy.sample_percent = 0.0;
+  SAS::set_policy(policy);
+
+  SAS::TrailId trail1 = SAS::new_trail(1u);
+  SAS::TrailId trail2 = SAS::new_trail(1u);
+  EXPECT_FALSE(SAS::is_traced(trail1));
+  EXPECT_FALSE(SAS::is_traced(trail2));
+
+  // Forcing a trail traces it from then on, and counts it as traced.
+  unsigned long traced = SAS::trails_traced();
+  SAS::force_trail(trail1);
+  SAS::force_trail(trail1);
+  EXPECT_TRUE(SAS::is_traced(trail1));
+  EXPECT_FALSE(SAS::is_traced(trail2));
+  EXPECT_EQ(traced + 1, SAS::trails_traced());
+}
+
+TEST_F(SasTest, TracedUser)
+{
+  SAS::Policy policy;
+  policy.sample_percent = 0.0;
+  policy.traced_users.insert("6505550001");
+  policy.user_markers.insert(0x01000006);
+  SAS::set_policy(policy);
+
+  // Markers for other users, or with other IDs, don't force the trail.
+  SAS::TrailId trail = SAS::new_trail(1u);
+  SAS::Marker other_user(trail, 0x01000006, 1u);
+  other_user.add_var_param("6505550002");
+  SAS::report_marker(other_user);
+  SAS::Marker other_marker(trail, 0x01000007, 1u);
+  other_marker.add_var_param("6505550001");
+  SAS::report_marker(other_marker);
+  EXPECT_FALSE(SAS::is_traced(trail));
+
+  // A marker naming a traced user does.
+  SAS::Marker user(trail, 0x01000006, 1u);
+  user.add_var_param("6505550001");
+  SAS::report_marker(user);
+  EXPECT_TRUE(SAS::is_traced(trail));
+}
+
+TEST_F(SasTest, EventCaps)
+{
+  SAS::Policy policy;
+  policy.event_caps[0x1234] = 10;
+  SAS::set_policy(policy);
+
+  // Only 10 events with the capped ID are allowed each second.  Events with
+  // other IDs aren't affected.
+  advance_to_next_second();
+  SAS::TrailId trail = SAS::new_trail(1u);
+  int allowed = 0;
+  for (int ii = 0; ii < 15; ++ii)
+  {
+    if (SAS::check_cap(trail, 0x1234))
+    {
+      ++allowed;
+    }
+    EXPECT_TRUE(SAS::check_cap(trail, 0x1235));
+  }
+  EXPECT_EQ(10, allowed);
+  EXPECT_EQ(5ul, SAS::events_capped());
+
+  // The next second has a new allowance.
+  advance_to_next_second();
+  EXPECT_TRUE(SAS::check_cap(trail, 0x1234));
+  EXPECT_EQ(5ul, SAS::events_capped());
+
+  // Forced trails aren't capped.
+  SAS::TrailId forced = SAS::new_trail(1u) | SAS::UNSAMPLED_TRAIL;
+  SAS::force_trail(forced);
+  EXPECT_TRUE(SAS::check_cap(forced, 0x1234));
+}
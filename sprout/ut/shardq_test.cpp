@@ -0,0 +1,147 @@
+/**
+ * @file shardq_test.cpp UT for sharded queue.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "shardq.h"
+
+using namespace std;
+
+/// Fixture for ShardqTest.
+class ShardqTest : public ::testing::Test
+{
+  ShardqTest()
+  {
+  }
+
+  virtual ~ShardqTest()
+  {
+  }
+};
+
+TEST_F(ShardqTest, Affinity)
+{
+  shardq<int> q(4, 16);
+  EXPECT_EQ(4u, q.num_shards());
+  EXPECT_EQ(1u, q.shard(5));
+  EXPECT_EQ(1u, q.shard(9));
+
+  // Items with the same hash go to the same shard, in order.
+  q.push(1, 5);
+  q.push(2, 9);
+  q.push(3, 2);
+  EXPECT_EQ(2u, q.size(1));
+  EXPECT_EQ(1u, q.size(2));
+  EXPECT_EQ(3u, q.size());
+
+  int item;
+  EXPECT_TRUE(q.pop(1, item));
+  EXPECT_EQ(1, item);
+  EXPECT_TRUE(q.pop(1, item));
+  EXPECT_EQ(2, item);
+  EXPECT_TRUE(q.pop(2, item));
+  EXPECT_EQ(3, item);
+  EXPECT_EQ(0u, q.size());
+  EXPECT_EQ(0u, q.stolen(1));
+}
+
+TEST_F(ShardqTest, Steal)
+{
+  shardq<int> q(3, 16);
+
+  // A single item on another shard isn't stolen.
+  q.push(1, 1);
+  int item;
+  EXPECT_FALSE(q.steal(0, item));
+
+  // A backlog is, and the deepest shard is chosen.
+  q.push(2, 1);
+  q.push(3, 2);
+  q.push(4, 2);
+  q.push(5, 2);
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_EQ(3, item);
+  EXPECT_EQ(1u, q.stolen(2));
+  EXPECT_EQ(0u, q.stolen(1));
+
+  // The thief's own shard takes priority.
+  q.push(6, 0);
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_EQ(6, item);
+}
+
+static void* consume(void* p)
+{
+  shardq<int>* q = (shardq<int>*)p;
+  int item;
+  long sum = 0;
+  while (q->pop(1, item))
+  {
+    sum += item;
+  }
+  return (void*)sum;
+}
+
+TEST_F(ShardqTest, Terminate)
+{
+  shardq<int> q(2, 16, 2, 1);
+  pthread_t thread;
+  pthread_create(&thread, NULL, consume, &q);
+
+  // The consumer of shard 1 picks up work from shard 0's backlog, leaving
+  // the last item.
+  for (int ii = 1; ii <= 10; ++ii)
+  {
+    q.push(ii, 0);
+  }
+  while (q.size(0) > 1)
+  {
+    usleep(1000);
+  }
+
+  q.terminate();
+  EXPECT_TRUE(q.is_terminated());
+  void* sum;
+  pthread_join(thread, &sum);
+  EXPECT_EQ(45, (long)sum);
+  EXPECT_EQ(9u, q.stolen(0));
+}
@@ -144,9 +144,8 @@ void SipTest::SetUpTestCase(bool clear_host_mapping)
                                   "0.0.0.0",
                                   5060);
 
-  stack_data.stats_aggregator = new LastValueCache(Statistic::known_stats_count(),
-                                                   Statistic::known_stats(),
-                                                   10);  // Short period to reduce shutdown delays.
+  stack_data.stats_aggregator = new LastValueCache(10);  // Short period to reduce shutdown delays.
+  Statistic::set_last_value_cache(stack_data.stats_aggregator);
 
   pjsip_endpt_register_module(stack_data.endpt, &mod_siptest);
 }
@@ -155,6 +154,7 @@ void SipTest::SetUpTestCase(bool clear_host_mapping)
 void SipTest::TearDownTestCase()
 {
   FakeLogger _log(false);  // swallow logs during this method
+  Statistic::set_last_value_cache(NULL);
   delete stack_data.stats_aggregator;
   stack_data.stats_aggregator = NULL;
 
@@ -0,0 +1,123 @@
+/**
+ * @file spscq_test.cpp UT for single-producer single-consumer ring.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "spscq.h"
+
+using namespace std;
+
+/// Fixture for SpscqTest.
+class SpscqTest : public ::testing::Test
+{
+  SpscqTest()
+  {
+  }
+
+  virtual ~SpscqTest()
+  {
+  }
+};
+
+TEST_F(SpscqTest, Mainline)
+{
+  spscq<int> q(3);
+  EXPECT_EQ(4u, q.capacity());
+  EXPECT_EQ(0u, q.size());
+
+  int item;
+  EXPECT_FALSE(q.try_pop(item));
+
+  // Fill the ring, wrapping round a few times.
+  for (int round = 0; round < 3; ++round)
+  {
+    for (int ii = 0; ii < 4; ++ii)
+    {
+      EXPECT_TRUE(q.try_push(round * 10 + ii));
+    }
+    EXPECT_FALSE(q.try_push(99));
+    EXPECT_EQ(4u, q.size());
+
+    for (int ii = 0; ii < 4; ++ii)
+    {
+      ASSERT_TRUE(q.try_pop(item));
+      EXPECT_EQ(round * 10 + ii, item);
+    }
+    EXPECT_FALSE(q.try_pop(item));
+    EXPECT_EQ(0u, q.size());
+  }
+}
+
+/// Number of items passed in the threaded test.
+static const int NUM_ITEMS = 200000;
+
+static void* producer(void* p)
+{
+  spscq<int>* q = (spscq<int>*)p;
+  for (int ii = 0; ii < NUM_ITEMS; )
+  {
+    if (q->try_push(ii))
+    {
+      ++ii;
+    }
+  }
+  return NULL;
+}
+
+TEST_F(SpscqTest, Threads)
+{
+  // Items arrive complete and in order.
+  spscq<int> q(64);
+  pthread_t thread;
+  pthread_create(&thread, NULL, &producer, &q);
+
+  int expected = 0;
+  while (expected < NUM_ITEMS)
+  {
+    int item;
+    if (q.try_pop(item))
+    {
+      ASSERT_EQ(expected, item);
+      ++expected;
+    }
+  }
+
+  pthread_join(thread, NULL);
+  EXPECT_EQ(0u, q.size());
+}
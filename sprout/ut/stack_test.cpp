@@ -137,7 +137,15 @@ TEST_F(StackTest, DISABLED_SimpleLifeCycle)
                               "all-the-sprouts",            //sprout cluster hostname
                               "thatone.zalpha.example.com,other.example.org,192.168.0.4",  // alias hosts
                               7,                            // #PJsip threads
-                              9);                           // #worker threads
+                              9,                            // #worker threads
+                              false,                        // lock-free rx queue
+                              RX_DISPATCH_SHARED,           // rx dispatch mode
+                              0,                            // target latency (disabled)
+                              0,                            // max queue depth
+                              5,                            // Retry-After
+                              "",                           // PJSIP thread CPUs
+                              "",                           // worker thread CPUs
+                              1);                           // UDP sockets per port
   ASSERT_EQ(PJ_SUCCESS, rc) << PjStatus(rc);
   EXPECT_TRUE(_log.contains("Listening on port 9408"));
   EXPECT_TRUE(_log.contains("Local host aliases:"));
@@ -50,6 +50,7 @@
 #include "fakelogger.hpp"
 #include "fakehssconnection.hpp"
 #include "fakexdmconnection.hpp"
+#include "fakestore.hpp"
 #include "test_interposer.hpp"
 
 using namespace std;
@@ -205,7 +206,7 @@ public:
   {
     SipTest::SetUpTestCase(false);
 
-    _store = RegData::create_local_store();
+    _store = new FakeStore();
     _analytics = new AnalyticsLogger("foo");
     delete _analytics->_logger;
     _analytics->_logger = NULL;
@@ -250,7 +251,7 @@ public:
     // objects that might handle any callbacks!
     pjsip_tsx_layer_destroy();
     destroy_stateful_proxy();
-    RegData::destroy_local_store(_store);
+    delete _store;
     delete _analytics; _analytics = NULL;
     delete _call_services; _call_services = NULL;
     delete _ifc_handler; _ifc_handler = NULL;
@@ -267,6 +268,7 @@ public:
     _log_traffic = FakeLogger::isNoisy(); // true to see all traffic
     _analytics->_logger = &_log;
     _store->flush_all();  // start from a clean slate on each test
+    _store->set_deferred(false);
     if (_hss_connection)
     {
       _hss_connection->flush_all();
@@ -314,7 +316,7 @@ public:
   }
 
 protected:
-  static RegData::Store* _store;
+  static FakeStore* _store;
   static AnalyticsLogger* _analytics;
   static FakeHSSConnection* _hss_connection;
   static FakeXDMConnection* _xdm_connection;
@@ -337,7 +339,7 @@ protected:
                      bool pcpi);
 };
 
-RegData::Store* StatefulProxyTestBase::_store;
+FakeStore* StatefulProxyTestBase::_store;
 AnalyticsLogger* StatefulProxyTestBase::_analytics;
 FakeHSSConnection* StatefulProxyTestBase::_hss_connection;
 FakeXDMConnection* StatefulProxyTestBase::_xdm_connection;
@@ -1308,6 +1310,73 @@ TEST_F(StatefulProxyTest, TestForkedFlow4)
   expect_all_tsx_done();
 }
 
+/// Test an INVITE whose target's bindings aren't available from the store
+/// straight away.  It is forwarded once the store returns them.
+TEST_F(StatefulProxyTest, TestAsyncStore)
+{
+  SCOPED_TRACE("");
+  register_uri(_store, _hss_connection, "6505551234", "homedomain", "sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob");
+  _store->set_deferred(true);
+  Message msg;
+  pjsip_msg* out;
+
+  // Send INVITE.  Only the 100 Trying goes back while we wait for the store.
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+  EXPECT_EQ(1, _store->pending_gets());
+
+  // Once the store returns the bindings, the INVITE is passed on.
+  _store->complete_gets();
+  ASSERT_EQ(1, txdata_count());
+  out = current_txdata()->msg;
+  ReqMatcher req("INVITE");
+  ASSERT_NO_FATAL_FAILURE(req.matches(out));
+  EXPECT_EQ("sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob", req.uri());
+
+  // Send 200 OK back, and it goes back to the caller.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+}
+
+/// Test a CANCEL that arrives while an INVITE is waiting for the store to
+/// return its target's bindings.  The INVITE must not be forwarded once
+/// they arrive.
+TEST_F(StatefulProxyTest, TestAsyncStoreCancel)
+{
+  SCOPED_TRACE("");
+  register_uri(_store, _hss_connection, "6505551234", "homedomain", "sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob");
+  _store->set_deferred(true);
+  Message msg;
+
+  // Send INVITE.  Only the 100 Trying goes back while we wait for the store.
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+
+  // Send a CANCEL from the caller.  It gets OK'd, but there's nothing to
+  // pass it on to yet.
+  msg._method = "CANCEL";
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(200).matches(current_txdata()->msg);
+  free_txdata();
+
+  // Once the store returns the bindings, the INVITE is rejected rather than
+  // forwarded.
+  _store->complete_gets();
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(487).matches(current_txdata()->msg);
+  free_txdata();
+
+  // All done!
+  expect_all_tsx_done();
+}
+
 list<string> StatefulProxyTest::doProxyCalculateTargets(int max_targets)
 {
   SCOPED_TRACE("");
@@ -1322,7 +1391,7 @@ list<string> StatefulProxyTest::doProxyCalculateTargets(int max_targets)
   parse_rxdata(rdata);
 
   target_list targets;
-  proxy_calculate_targets(rdata->msg_info.msg, stack_data.pool, &TrustBoundary::TRUSTED, targets, max_targets, 1L);
+  proxy_calculate_targets(rdata->msg_info.msg, stack_data.pool, &TrustBoundary::TRUSTED, targets, max_targets, 1L, NULL);
 
   list<string> ret;
   for (target_list::const_iterator i = targets.begin();
@@ -0,0 +1,113 @@
+/**
+ * @file statistic_test.cpp UT for publishing statistics.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "stack.h"
+#include "statistic.h"
+#include "fakelastvaluecache.hpp"
+
+using namespace std;
+
+/// Fixture for StatisticTest.  Statistics are published to a fake last
+/// value cache for the duration of each test.
+class StatisticTest : public BaseTest
+{
+  FakeLastValueCache _lvc;
+
+  StatisticTest()
+  {
+    Statistic::set_last_value_cache(&_lvc);
+  }
+
+  virtual ~StatisticTest()
+  {
+    Statistic::set_last_value_cache(stack_data.stats_aggregator);
+    Statistic::set_min_interval(Statistic::DEFAULT_MIN_INTERVAL_MS);
+  }
+
+  /// Wait (for up to five seconds) until a statistic has been published
+  /// the specified number of times.
+  void wait_for_published(const string& statname, int count)
+  {
+    for (int ii = 0; (ii < 500) && (_lvc.published(statname) < count); ++ii)
+    {
+      usleep(10000);
+    }
+  }
+};
+
+TEST_F(StatisticTest, Announce)
+{
+  // A new statistic is announced with no value.
+  Statistic stat("test_statistic");
+  wait_for_published("test_statistic", 1);
+  EXPECT_EQ(1, _lvc.published("test_statistic"));
+  EXPECT_TRUE(_lvc.last_value("test_statistic").empty());
+}
+
+TEST_F(StatisticTest, CoalesceUpdates)
+{
+  // Changes reported while the reporter waits out the interval after
+  // publishing are sent together, as a single publish of the final value.
+  Statistic::set_min_interval(500);
+  Statistic stat("test_statistic");
+  wait_for_published("test_statistic", 1);
+  ASSERT_EQ(1, _lvc.published("test_statistic"));
+
+  for (int ii = 1; ii <= 10; ++ii)
+  {
+    vector<string> value;
+    value.push_back(to_string(ii));
+    stat.report_change(value);
+  }
+
+  wait_for_published("test_statistic", 2);
+  EXPECT_EQ(2, _lvc.published("test_statistic"));
+  ASSERT_EQ(1u, _lvc.last_value("test_statistic").size());
+  EXPECT_EQ("10", _lvc.last_value("test_statistic")[0]);
+
+  // Nothing more is published once the interval is up.
+  usleep(600000);
+  EXPECT_EQ(2, _lvc.published("test_statistic"));
+}
@@ -40,6 +40,7 @@
 #include <netdb.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <map>
 #include <string>
@@ -156,3 +157,23 @@ int clock_gettime(clockid_t clk_id, struct timespec *tp)
 
   return rc;
 }
+
+/// Replacement time, so that code which only needs whole seconds sees the
+/// same time offset as clock_gettime.
+time_t time(time_t* t)
+{
+  struct timespec ts;
+  time_t rc = (time_t)-1;
+
+  if (clock_gettime(CLOCK_REALTIME, &ts) == 0)
+  {
+    rc = ts.tv_sec;
+  }
+
+  if (t != NULL)
+  {
+    *t = rc;
+  }
+
+  return rc;
+}
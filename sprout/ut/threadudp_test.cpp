@@ -0,0 +1,267 @@
+/**
+ * @file threadudp_test.cpp UT for the per-thread UDP transports.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "siptest.hpp"
+#include "stack.h"
+#include "fakelogger.hpp"
+#include "threadudp.h"
+
+using namespace std;
+
+/// Transports on which each request was received.
+static vector<pjsip_transport*> rx_transports;
+
+static pj_bool_t on_rx_request(pjsip_rx_data* rdata)
+{
+  rx_transports.push_back(rdata->tp_info.transport);
+  return PJ_TRUE;
+}
+
+static pjsip_module mod_threadudp_test =
+{
+  NULL, NULL,                         /* prev, next.          */
+  pj_str("mod-threadudp-test"),       /* Name.                */
+  -1,                                 /* Id                   */
+  PJSIP_MOD_PRIORITY_TSX_LAYER - 1,   /* Priority             */
+  NULL,                               /* load()               */
+  NULL,                               /* start()              */
+  NULL,                               /* stop()               */
+  NULL,                               /* unload()             */
+  &on_rx_request,                     /* on_rx_request()      */
+  NULL,                               /* on_rx_response()     */
+  NULL,                               /* on_tx_request()      */
+  NULL,                               /* on_tx_response()     */
+  NULL,                               /* on_tsx_state()       */
+};
+
+/// Fixture for ThreadUdpTest.
+class ThreadUdpTest : public SipTest
+{
+public:
+  FakeLogger _log;
+
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+    pjsip_endpt_register_module(stack_data.endpt, &mod_threadudp_test);
+  }
+
+  static void TearDownTestCase()
+  {
+    pjsip_endpt_unregister_module(stack_data.endpt, &mod_threadudp_test);
+    SipTest::TearDownTestCase();
+  }
+
+  ThreadUdpTest() : SipTest(NULL)
+  {
+    rx_transports.clear();
+  }
+
+  /// Open a plain UDP socket bound to an ephemeral loopback port.
+  static int open_socket(struct sockaddr_in* addr)
+  {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr*)addr, sizeof(*addr));
+    socklen_t len = sizeof(*addr);
+    getsockname(fd, (struct sockaddr*)addr, &len);
+    return fd;
+  }
+
+  /// Wait briefly for a datagram on a plain socket, and return it.
+  static string recv_datagram(int fd, struct sockaddr_in* from)
+  {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (::poll(&pfd, 1, 1000) <= 0)
+    {
+      return "";
+    }
+    char buf[2048];
+    socklen_t len = sizeof(*from);
+    ssize_t size = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)from, &len);
+    return (size > 0) ? string(buf, size) : string("");
+  }
+
+  static string options(int ii, int port)
+  {
+    return "OPTIONS sip:127.0.0.1:" + to_string(port, dec) + " SIP/2.0\r\n"
+           "Via: SIP/2.0/UDP 127.0.0.1:5099;rport;branch=z9hG4bKthreadudp" + to_string(ii, dec) + "\r\n"
+           "Max-Forwards: 70\r\n"
+           "From: <sip:6505551000@homedomain>;tag=" + to_string(ii, dec) + "\r\n"
+           "To: <sip:127.0.0.1>\r\n"
+           "Call-ID: threadudp-" + to_string(ii, dec) + "@127.0.0.1\r\n"
+           "CSeq: 1 OPTIONS\r\n"
+           "Content-Length: 0\r\n\r\n";
+  }
+};
+
+TEST_F(ThreadUdpTest, SendReceiveShutdown)
+{
+  // Find a free port, then open two transports sharing it, each with its
+  // own poller as if owned by different threads.  Neither is the primary
+  // transport, which would displace the test UDP transport.
+  struct sockaddr_in probe_addr;
+  int probe_fd = open_socket(&probe_addr);
+  int port = ntohs(probe_addr.sin_port);
+  close(probe_fd);
+
+  pj_sockaddr_in addr;
+  pj_str_t loopback = pj_str("127.0.0.1");
+  pj_sockaddr_in_init(&addr, &loopback, (pj_uint16_t)port);
+  pjsip_host_port published_name;
+  published_name.host = loopback;
+  published_name.port = port;
+
+  const int NUM_TPS = 2;
+  thread_udp_transport* tps[NUM_TPS];
+  ThreadUdpPoller pollers[NUM_TPS];
+  for (int ii = 0; ii < NUM_TPS; ++ii)
+  {
+    ASSERT_EQ(PJ_SUCCESS,
+              thread_udp_transport_create(stack_data.endpt,
+                                          &addr,
+                                          &published_name,
+                                          PJ_FALSE,
+                                          &tps[ii]));
+    pollers[ii].add(tps[ii]);
+  }
+
+  // Each transport has a key of its own, so the transport manager keeps
+  // track of all of them.
+  pjsip_transport* tp0 = (pjsip_transport*)tps[0];
+  pjsip_transport* tp1 = (pjsip_transport*)tps[1];
+  EXPECT_NE(0, memcmp(&tp0->key, &tp1->key, sizeof(tp0->key)));
+
+  // Send requests from many source ports, so the kernel spreads them
+  // across the sockets, and check every one is received on the transport
+  // that read it.
+  const int NUM_CLIENTS = 64;
+  vector<int> client_fds;
+  for (int ii = 0; ii < NUM_CLIENTS; ++ii)
+  {
+    struct sockaddr_in client_addr;
+    int fd = open_socket(&client_addr);
+    client_fds.push_back(fd);
+    string msg = options(ii, port);
+    struct sockaddr_in server_addr = probe_addr;
+    sendto(fd, msg.data(), msg.length(), 0,
+           (struct sockaddr*)&server_addr, sizeof(server_addr));
+  }
+
+  for (int loops = 0;
+       (loops < 100) && (rx_transports.size() < (size_t)NUM_CLIENTS);
+       ++loops)
+  {
+    for (int ii = 0; ii < NUM_TPS; ++ii)
+    {
+      pollers[ii].poll(10);
+    }
+  }
+
+  ASSERT_EQ((size_t)NUM_CLIENTS, rx_transports.size());
+  map<pjsip_transport*, int> rx_counts;
+  for (size_t ii = 0; ii < rx_transports.size(); ++ii)
+  {
+    rx_counts[rx_transports[ii]]++;
+  }
+  EXPECT_EQ(2u, rx_counts.size());
+  EXPECT_LT(0, rx_counts[tp0]);
+  EXPECT_LT(0, rx_counts[tp1]);
+
+  // Send on each transport, and check the message comes from the shared
+  // port.
+  struct sockaddr_in client_addr;
+  int client_fd = open_socket(&client_addr);
+  for (int ii = 0; ii < NUM_TPS; ++ii)
+  {
+    pjsip_transport* tp = (pjsip_transport*)tps[ii];
+    pjsip_tx_data* tdata;
+    pjsip_endpt_create_tdata(stack_data.endpt, &tdata);
+    string msg = options(NUM_CLIENTS + ii, ntohs(client_addr.sin_port));
+    tdata->buf.start = (char*)pj_pool_alloc(tdata->pool, msg.length());
+    tdata->buf.end = tdata->buf.start + msg.length();
+    pj_memcpy(tdata->buf.start, msg.data(), msg.length());
+    tdata->buf.cur = tdata->buf.end;
+    EXPECT_EQ(PJ_SUCCESS,
+              tp->send_msg(tp, tdata, &client_addr, sizeof(client_addr), NULL, NULL));
+    pjsip_tx_data_dec_ref(tdata);
+
+    struct sockaddr_in from;
+    EXPECT_EQ(msg, recv_datagram(client_fd, &from));
+    EXPECT_EQ(port, ntohs(from.sin_port));
+  }
+
+  // Shutting down the transports closes their sockets, so sending fails,
+  // polling reads nothing, and the port is free again.
+  for (int ii = 0; ii < NUM_TPS; ++ii)
+  {
+    pjsip_transport* tp = (pjsip_transport*)tps[ii];
+    EXPECT_EQ(PJ_SUCCESS, pjsip_transport_shutdown(tp));
+
+    pjsip_tx_data* tdata;
+    pjsip_endpt_create_tdata(stack_data.endpt, &tdata);
+    tdata->buf.start = (char*)pj_pool_alloc(tdata->pool, 1);
+    tdata->buf.cur = tdata->buf.start;
+    tdata->buf.end = tdata->buf.start + 1;
+    EXPECT_NE(PJ_SUCCESS,
+              tp->send_msg(tp, tdata, &client_addr, sizeof(client_addr), NULL, NULL));
+    pjsip_tx_data_dec_ref(tdata);
+
+    pollers[ii].poll(0);
+  }
+
+  int rebind_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  EXPECT_EQ(0, bind(rebind_fd, (struct sockaddr*)&probe_addr, sizeof(probe_addr)));
+  close(rebind_fd);
+
+  close(client_fd);
+  for (size_t ii = 0; ii < client_fds.size(); ++ii)
+  {
+    close(client_fds[ii]);
+  }
+}
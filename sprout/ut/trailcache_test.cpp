@@ -0,0 +1,174 @@
+/**
+ * @file trailcache_test.cpp UT for the SAS trail cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///----------------------------------------------------------------------------
+
+
+#include <string>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "trailcache.h"
+
+using namespace std;
+
+/// Fixture for TrailCacheTest.
+class TrailCacheTest : public ::testing::Test
+{
+  TrailCacheTest()
+  {
+  }
+
+  virtual ~TrailCacheTest()
+  {
+  }
+
+  static void insert(TrailCache& cache, const string& branch, SAS::TrailId trail)
+  {
+    cache.insert(branch.data(), branch.length(), trail);
+  }
+
+  static SAS::TrailId lookup(TrailCache& cache, const string& branch)
+  {
+    return cache.lookup(branch.data(), branch.length());
+  }
+
+  static const int BRANCHES_PER_WRITER = 20000;
+
+  struct writer_args
+  {
+    TrailCache* cache;
+    int base;
+    int mismatches;
+  };
+
+  /// Inserts a run of branches, each with a trail derived from the branch,
+  /// and checks that every lookup of a recent branch finds its own trail or
+  /// nothing.
+  static void* writer(void* p)
+  {
+    writer_args* args = (writer_args*)p;
+    for (int ii = 0; ii < BRANCHES_PER_WRITER; ++ii)
+    {
+      int id = args->base + ii;
+      insert(*args->cache, "z9hG4bK" + to_string(id), id);
+      for (int jj = id; (jj >= args->base) && (jj > id - 4); --jj)
+      {
+        SAS::TrailId trail = lookup(*args->cache, "z9hG4bK" + to_string(jj));
+        if ((trail != 0) && (trail != (SAS::TrailId)jj))
+        {
+          args->mismatches++;
+        }
+      }
+    }
+    return NULL;
+  }
+};
+
+TEST_F(TrailCacheTest, InsertAndLookup)
+{
+  TrailCache cache(1024);
+  EXPECT_EQ(0u, lookup(cache, "z9hG4bKabc"));
+
+  insert(cache, "z9hG4bKabc", 1234);
+  insert(cache, "z9hG4bKdef", 5678);
+  EXPECT_EQ(1234u, lookup(cache, "z9hG4bKabc"));
+  EXPECT_EQ(5678u, lookup(cache, "z9hG4bKdef"));
+  EXPECT_EQ(0u, lookup(cache, "z9hG4bKxyz"));
+
+  // Inserting the same branch again replaces the trail.
+  insert(cache, "z9hG4bKabc", 4321);
+  EXPECT_EQ(4321u, lookup(cache, "z9hG4bKabc"));
+}
+
+TEST_F(TrailCacheTest, Eviction)
+{
+  // With a single slot each branch evicts the one before, and lookups of
+  // evicted branches miss rather than returning the wrong trail.
+  TrailCache cache(1);
+  insert(cache, "z9hG4bKabc", 1234);
+  insert(cache, "z9hG4bKdef", 5678);
+  EXPECT_EQ(0u, lookup(cache, "z9hG4bKabc"));
+  EXPECT_EQ(5678u, lookup(cache, "z9hG4bKdef"));
+}
+
+TEST_F(TrailCacheTest, ManyBranches)
+{
+  // Most recent branches are still found in a cache with room for them.
+  TrailCache cache(4096);
+  for (int ii = 1; ii <= 1000; ++ii)
+  {
+    insert(cache, "z9hG4bK" + to_string(ii), ii);
+  }
+  int found = 0;
+  for (int ii = 1; ii <= 1000; ++ii)
+  {
+    SAS::TrailId trail = lookup(cache, "z9hG4bK" + to_string(ii));
+    EXPECT_TRUE((trail == 0) || (trail == (SAS::TrailId)ii));
+    found += (trail != 0) ? 1 : 0;
+  }
+  EXPECT_GT(found, 800);
+}
+
+TEST_F(TrailCacheTest, ConcurrentWriters)
+{
+  // Several threads insert into a small cache at once, so they often
+  // update the same slot.  No lookup may return another branch's trail.
+  const int num_writers = 4;
+  TrailCache cache(16);
+
+  pthread_t writers[num_writers];
+  writer_args args[num_writers];
+  for (int ii = 0; ii < num_writers; ++ii)
+  {
+    args[ii].cache = &cache;
+    args[ii].base = 1 + ii * BRANCHES_PER_WRITER;
+    args[ii].mismatches = 0;
+    pthread_create(&writers[ii], NULL, &writer, &args[ii]);
+  }
+  for (int ii = 0; ii < num_writers; ++ii)
+  {
+    pthread_join(writers[ii], NULL);
+    EXPECT_EQ(0, args[ii].mismatches);
+  }
+
+  // Once the writers have finished, the slots are consistent.
+  for (int ii = 1; ii <= num_writers * BRANCHES_PER_WRITER; ++ii)
+  {
+    SAS::TrailId trail = lookup(cache, "z9hG4bK" + to_string(ii));
+    EXPECT_TRUE((trail == 0) || (trail == (SAS::TrailId)ii));
+  }
+}
@@ -52,14 +52,18 @@ XDMConnection::XDMConnection(const std::string& server) :
   _http(new HttpConnection(server,
                            true,
                            SASEvent::TX_XDM_GET_BASE,
-                           "connected_homers"))
+                           "connected_homers")),
+  _latency_histogram("xdm_latency_us"),
+  _error_counter("xdm_errors")
 {
 }
 
 /// Constructor supplying own connection. For UT use. Ownership passes
 /// to this object.
 XDMConnection::XDMConnection(HttpConnection* http) :
-  _http(http)
+  _http(http),
+  _latency_histogram("xdm_latency_us"),
+  _error_counter("xdm_errors")
 {
 }
 
@@ -74,6 +78,16 @@ bool XDMConnection::get_simservs(const std::string& user,
                                  const std::string& password,
                                  SAS::TrailId trail)
 {
-  return _http->get("/org.etsi.ngn.simservs/users/" + Utils::url_escape(user) + "/simservs.xml", xml_data, user, trail);
+  bool got_data;
+  {
+    Histogram::Timer timer(&_latency_histogram);
+    got_data = _http->get("/org.etsi.ngn.simservs/users/" + Utils::url_escape(user) + "/simservs.xml", xml_data, user, trail);
+  }
+
+  if (!got_data)
+  {
+    _error_counter.increment();
+  }
+  return got_data;
 }
 
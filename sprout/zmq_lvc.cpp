@@ -46,38 +46,37 @@
  * LastValueCache
  *
  * This class acts as an aggregating proxy for all statistics generated by the product code.
- * Statistics are internally sent over inproc:// connections encapsulated in Subscription
+ * Statistics are internally sent over an inproc:// connection encapsulated in Subscription
  * envelopes and externally are sent over a tcp:// publishing socket on port 6666.
  *
  * This proxy also caches the last known value for a statistic and re-publishes it when a
  * subscriber registers interest.  This allows a client to poll the last known value easily.
+ * There is no fixed list of statistics - each one is announced by the statistics reporter
+ * when it is created, and subscriptions to statistics that haven't been announced are
+ * answered with an Unknown status.
  */
-LastValueCache::LastValueCache(int statcount,
-                               std::string *statnames,
-                               long poll_timeout_ms) :  //< Poll period in milliseconds
-  _statcount(statcount),
-  _statnames(statnames),
+LastValueCache::LastValueCache(long poll_timeout_ms) :  //< Poll period in milliseconds
   _poll_timeout_ms(poll_timeout_ms),
   _terminate(false)
 {
   LOG_DEBUG("Initializing statistics aggregator");
   _context = zmq_ctx_new();
-  _subscriber = new void *[_statcount];
 
-  // Bind all the sockets first, before we try to connect. This is a
+  // Bind the internal socket first, before we try to connect. This is a
   // limitation of inproc sockets. See
   // http://zguide.zeromq.org/page:all#Unicast-Transports
   // and the thread at
   // http://lists.zeromq.org/pipermail/zeromq-dev/2010-November/008012.html
   // for the issues leading to this design.
-  for (int ii = 0; ii < _statcount; ii++)
-  {
-    std::string statname = _statnames[ii];
-    void* publisher = zmq_socket(_context, ZMQ_PUB);
-    zmq_bind(publisher, ("inproc://" + statname).c_str());
-    _internal_publishers[statname] = publisher;
-    LOG_DEBUG("Opened statistics socket inproc://%s", statname.c_str());
-  }
+  _internal_publisher = zmq_socket(_context, ZMQ_PUB);
+  zmq_bind(_internal_publisher, "inproc://statistics");
+  LOG_DEBUG("Opened statistics socket inproc://statistics");
+
+  // Connect the subscriber now, rather than on the cache thread, so that
+  // statistics announced before the thread gets going aren't lost.
+  _subscriber = zmq_socket(_context, ZMQ_SUB);
+  zmq_connect(_subscriber, "inproc://statistics");
+  zmq_setsockopt(_subscriber, ZMQ_SUBSCRIBE, "", 0);
 
   int rc = pthread_create(&_cache_thread,
                           NULL,
@@ -97,41 +96,53 @@ LastValueCache::~LastValueCache()
     _terminate = true;
     pthread_join(_cache_thread, NULL);
   }
-  delete[] _subscriber;
-
-  for (int ii = 0; ii < _statcount; ii++)
-  {
-    std::string statname = _statnames[ii];
-    LOG_DEBUG("Unbinding and closing statistics socket inproc://%s", statname.c_str());
 
-    zmq_unbind(_internal_publishers[statname], ("inproc://" + statname).c_str());
-    zmq_close(_internal_publishers[statname]);
-  }
+  LOG_DEBUG("Unbinding and closing statistics socket inproc://statistics");
+  zmq_unbind(_internal_publisher, "inproc://statistics");
+  zmq_close(_internal_publisher);
 
   zmq_ctx_destroy(_context);
 }
 
 /// Get the bound ZMQ publisher socket to use internally when
 /// publishing statistics to this cache.  At most one thread may
-/// publish to a given statistic at a time.
-void* LastValueCache::get_internal_publisher(std::string statname)
+/// publish at a time.
+void* LastValueCache::get_internal_publisher()
 {
-  assert(_internal_publishers.find(statname) != _internal_publishers.end());
-  return _internal_publishers[statname];
+  return _internal_publisher;
 }
 
-void LastValueCache::run()
+void LastValueCache::publish(const std::string& statname,
+                             const std::vector<std::string>& value)
 {
-  // One for each internal statistic (0.._statcount-1) and one for the publisher.
-  zmq_pollitem_t items[_statcount + 1];
+  LOG_DEBUG("Send new value for statistic %s, size %d", statname.c_str(), value.size());
+  std::string status = "OK";
 
-  for (int ii = 0; ii < _statcount; ii++)
+  // If there's no message, just send the envelope and status line.
+  if (value.empty())
   {
-    _subscriber[ii] = zmq_socket(_context, ZMQ_SUB);
-    LOG_DEBUG("Initializing inproc://%s statistic listener", _statnames[ii].c_str());
-    zmq_connect(_subscriber[ii], ("inproc://" + _statnames[ii]).c_str());
-    zmq_setsockopt(_subscriber[ii], ZMQ_SUBSCRIBE, "", 0);
+    zmq_send(_internal_publisher, statname.c_str(), statname.length(), ZMQ_SNDMORE);
+    zmq_send(_internal_publisher, status.c_str(), status.length(), 0);
   }
+  else
+  {
+    // Otherwise send the envelope, status line, and body, remembering to set SNDMORE on all
+    // but the last section.
+    zmq_send(_internal_publisher, statname.c_str(), statname.length(), ZMQ_SNDMORE);
+    zmq_send(_internal_publisher, status.c_str(), status.length(), ZMQ_SNDMORE);
+    std::vector<std::string>::const_iterator it;
+    for (it = value.begin(); it + 1 != value.end(); ++it)
+    {
+      zmq_send(_internal_publisher, it->c_str(), it->length(), ZMQ_SNDMORE);
+    }
+    zmq_send(_internal_publisher, it->c_str(), it->length(), 0);
+  }
+}
+
+void LastValueCache::run()
+{
+  // One for the internal statistics and one for the publisher.
+  zmq_pollitem_t items[2];
 
   _publisher = zmq_socket(_context, ZMQ_XPUB);
   zmq_bind(_publisher, "tcp://*:6666");
@@ -139,52 +150,60 @@ void LastValueCache::run()
   while (!_terminate)
   {
     // Reset the poll items
-    for (int ii = 0; ii < _statcount; ii++)
-    {
-      items[ii].socket = _subscriber[ii];
-      items[ii].fd = 0;
-      items[ii].events = ZMQ_POLLIN;
-      items[ii].revents = 0;
-    }
-    items[_statcount].socket = _publisher;
-    items[_statcount].fd = 0;
-    items[_statcount].events = ZMQ_POLLIN;
-    items[_statcount].revents = 0;
+    items[0].socket = _subscriber;
+    items[0].fd = 0;
+    items[0].events = ZMQ_POLLIN;
+    items[0].revents = 0;
+    items[1].socket = _publisher;
+    items[1].fd = 0;
+    items[1].events = ZMQ_POLLIN;
+    items[1].revents = 0;
 
     // Poll for an event
-    //LOG_DEBUG("Poll for %d items", _statcount + 1);
-    int rc = zmq_poll(items, _statcount + 1, _poll_timeout_ms);
+    int rc = zmq_poll(items, 2, _poll_timeout_ms);
     assert(rc >= 0 || errno == EINTR);
 
-    for (int ii = 0; ii < _statcount; ii++)
+    if (items[0].revents & ZMQ_POLLIN)
     {
-      if (items[ii].revents & ZMQ_POLLIN)
+      // Read every statistic that has arrived.  The first part of each
+      // message is the envelope naming the statistic.
+      while (true)
       {
-        LOG_DEBUG("Update to %s statistic", _statnames[ii].c_str());
-        clear_cache(_subscriber[ii]);
+        zmq_msg_t message;
+        zmq_msg_init(&message);
+        if (zmq_msg_recv(&message, _subscriber, ZMQ_DONTWAIT) < 0)
+        {
+          zmq_msg_close(&message);
+          break;
+        }
+
+        std::string statname((char*)zmq_msg_data(&message), zmq_msg_size(&message));
+        LOG_DEBUG("Update to %s statistic", statname.c_str());
+        clear_cache(statname);
+        std::vector<zmq_msg_t *>& cache_record = _cache[statname];
         while (1)
         {
-          zmq_msg_t message;
           zmq_msg_t *cached_message = (zmq_msg_t *)malloc(sizeof(zmq_msg_t));
           int more;
           size_t more_size = sizeof (more);
 
-          zmq_msg_init(&message);
           zmq_msg_init(cached_message);
-          zmq_msg_recv(&message, _subscriber[ii], 0);
           zmq_msg_copy(cached_message, &message);
-          _cache[_subscriber[ii]].push_back(cached_message);
-          zmq_getsockopt(_subscriber[ii], ZMQ_RCVMORE, &more, &more_size);
+          cache_record.push_back(cached_message);
+          zmq_getsockopt(_subscriber, ZMQ_RCVMORE, &more, &more_size);
           zmq_msg_send(&message, _publisher, more ? ZMQ_SNDMORE : 0);
           zmq_msg_close(&message);
           if (!more)
             break;      //  Last message frame
+
+          zmq_msg_init(&message);
+          zmq_msg_recv(&message, _subscriber, 0);
         }
       }
     }
 
     // Recognize incoming subscription events
-    if (items[_statcount].revents & ZMQ_POLLIN)
+    if (items[1].revents & ZMQ_POLLIN)
     {
       zmq_msg_t message;
       zmq_msg_init(&message);
@@ -195,31 +214,16 @@ void LastValueCache::run()
         // This is a new subscription
         std::string topic = std::string(msg_body + 1, zmq_msg_size(&message) - 1);
         LOG_DEBUG("New subscription for %s", topic.c_str());
-        bool recognized = false;
 
-        for (int ii = 0; ii < _statcount; ii++)
+        if (_cache.find(topic) != _cache.end())
         {
-          if (topic == _statnames[ii])
-          {
-            LOG_DEBUG("Statistic found, check for cached value");
-            recognized = true;
-
-            // Replay the cached message if one exists
-            if (_cache.find(_subscriber[ii]) != _cache.end())
-            {
-              replay_cache(_subscriber[ii]);
-            }
-            else
-            {
-              LOG_DEBUG("No cached record found, reporting empty statistic");
-              std::string status = "OK";
-              zmq_send(_publisher, _statnames[ii].c_str(), _statnames[ii].length(), ZMQ_SNDMORE);
-              zmq_send(_publisher, status.c_str(), status.length(), 0);
-            }
-          }
+          // Replay the cached message.  Every statistic is announced when
+          // it is created, so this is just the status line if it hasn't
+          // reported a value yet.
+          LOG_DEBUG("Statistic found, replay cached value");
+          replay_cache(topic);
         }
-
-        if (!recognized)
+        else
         {
           LOG_DEBUG("Subscription for unknown stat %s", topic.c_str());
           std::string status = "Unknown";
@@ -231,27 +235,25 @@ void LastValueCache::run()
     }
   }
 
-  for (int ii = 0; ii < _statcount; ii++)
+  zmq_disconnect(_subscriber, "inproc://statistics");
+  zmq_close(_subscriber);
+  for (std::map<std::string, std::vector<zmq_msg_t *>>::iterator it = _cache.begin();
+       it != _cache.end();
+       ++it)
   {
-    zmq_disconnect(_subscriber[ii], ("inproc://" + _statnames[ii]).c_str());
-    zmq_close(_subscriber[ii]);
-    clear_cache(_subscriber[ii]);
+    clear_cache(it->first);
   }
   zmq_unbind(_publisher, "tcp://*:6666");
   zmq_close(_publisher);
 }
 
-void LastValueCache::clear_cache(void *entry)
+void LastValueCache::clear_cache(const std::string& statname)
 {
-  LOG_DEBUG("Clearing message cache for %p", entry);
-  if (_cache.find(entry) == _cache.end())
-  {
-    // Entry not found, add a blank vector in as we're about to fill it.
-    _cache[entry] = std::vector<zmq_msg_t *>();
-  }
-  else
+  LOG_DEBUG("Clearing message cache for %s", statname.c_str());
+  std::map<std::string, std::vector<zmq_msg_t *>>::iterator entry = _cache.find(statname);
+  if (entry != _cache.end())
   {
-    std::vector<zmq_msg_t *> *msg_list = &_cache[entry];
+    std::vector<zmq_msg_t *> *msg_list = &entry->second;
     std::vector<zmq_msg_t *>::iterator it = msg_list->begin();
     while (it != msg_list->end())
     {
@@ -263,17 +265,16 @@ void LastValueCache::clear_cache(void *entry)
   }
 }
 
-void LastValueCache::replay_cache(void *entry)
+void LastValueCache::replay_cache(const std::string& statname)
 {
-  std::vector<zmq_msg_t *> *cache_record = &_cache[entry];
+  std::vector<zmq_msg_t *> *cache_record = &_cache[statname];
   if (cache_record->empty())
   {
     LOG_DEBUG("No cached record");
     return;
   }
 
-  LOG_DEBUG("Replaying cache for entry %p (length: %d)", cache_record, entry, cache_record->size());
-  std::vector<zmq_msg_t *>::iterator it;
+  LOG_DEBUG("Replaying cache for %s (length: %d)", statname.c_str(), cache_record->size());
   for (std::vector<zmq_msg_t *>::iterator it = cache_record->begin();
        it != cache_record->end();
        it++)
@@ -0,0 +1,176 @@
+/**
+ * @file accumulator-bench.cpp Benchmark of accumulating samples from many threads
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "accumulator.h"
+#include "accumulator-old.h"
+
+// The benchmark doesn't publish its statistics, so stub out the statistic
+// used by StatisticAccumulator rather than linking the whole of sprout.
+Statistic::~Statistic() {}
+void Statistic::report_change(std::vector<std::string> new_value) {}
+
+// Options variables.
+static int num_samples = 1000000;
+static int max_threads = 32;
+static int num_shards = 64;
+
+// Samples are accumulated over the default period, so the accumulators
+// refresh during each test just as they do in sprout.
+static const uint_fast64_t PERIOD_US = Accumulator::DEFAULT_PERIOD_US;
+
+static int num_threads;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+template<class T>
+static void* producer(void* p)
+{
+  T* accumulator = (T*)p;
+  for (int ii = 0; ii < num_samples; ++ii)
+  {
+    accumulator->accumulate(1000 + (ii & 1023));
+  }
+  return NULL;
+}
+
+/// Runs num_threads threads, each accumulating num_samples samples, and
+/// returns the mean time per sample in nanoseconds.
+template<class T>
+static double run(T* accumulator)
+{
+  pthread_t* threads = new pthread_t[num_threads];
+  uint64_t start_ns = now_ns();
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_create(&threads[ii], NULL, &producer<T>, accumulator);
+  }
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+  uint64_t elapsed_ns = now_ns() - start_ns;
+  delete[] threads;
+  accumulator->refresh(true);
+  return (double)elapsed_ns / ((double)num_samples * num_threads);
+}
+
+static void usage(char* command)
+{
+  printf("%s [options]\n", command);
+  printf("Options:\n\n"
+         " -n, --samples <N>              Samples accumulated by each thread (default is 1000000)\n"
+         " -t, --max-threads <N>          Largest number of threads to test (default is 32)\n"
+         " -s, --shards <N>               Shards in the sharded accumulator (default is 64)\n");
+}
+
+int main (int argc, char *argv[])
+{
+  // Parse the command line options
+  while (true)
+  {
+    static struct option long_options[] =
+    {
+      {"samples",             required_argument,         0, 'n'},
+      {"max-threads",         required_argument,         0, 't'},
+      {"shards",              required_argument,         0, 's'},
+      {0, 0, 0, 0}
+    };
+
+    // getopt_long stores the option index here.
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "n:t:s:", long_options, &option_index);
+
+    // Detect the end of the options.
+    if (c == -1)
+    {
+      break;
+    }
+
+    switch (c)
+    {
+      case 'n':
+        num_samples = atoi(optarg);
+        break;
+
+      case 't':
+        max_threads = atoi(optarg);
+        break;
+
+      case 's':
+        num_shards = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  printf("%d samples per thread, %d shards\n", num_samples, num_shards);
+  printf("%-10s %20s %20s %20s\n", "threads", "old ns/sample", "1 shard ns/sample", "sharded ns/sample");
+
+  for (num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+  {
+    OldAccumulator old_accumulator(PERIOD_US);
+    Accumulator shared_accumulator(PERIOD_US, 1);
+    Accumulator sharded_accumulator(PERIOD_US, num_shards);
+
+    double old_ns = run(&old_accumulator);
+    double shared_ns = run(&shared_accumulator);
+    double sharded_ns = run(&sharded_accumulator);
+    printf("%-10d %20.1f %20.1f %20.1f\n", num_threads, old_ns, shared_ns, sharded_ns);
+  }
+
+  exit(0);
+}
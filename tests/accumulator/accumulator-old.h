@@ -0,0 +1,122 @@
+/**
+ * @file accumulator-old.h The accumulator before it was sharded, for comparison
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#ifndef ACCUMULATOR_OLD_H__
+#define ACCUMULATOR_OLD_H__
+
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+
+/// The accumulator as it was before it was sharded - every thread updates
+/// the same set of atomics, which share a cache line with the timestamp.
+class OldAccumulator
+{
+public:
+  OldAccumulator(uint_fast64_t period_us) : _target_period_us(period_us)
+  {
+    _current._timestamp_us.store(get_timestamp_us());
+    _current._n.store(0);
+    _current._sigma.store(0);
+    _current._sigma_squared.store(0);
+    _current._lwm.store(UINT_FAST64_MAX);
+    _current._hwm.store(0);
+  }
+
+  void accumulate(unsigned long sample)
+  {
+    _current._n++;
+    _current._sigma += sample;
+    _current._sigma_squared += sample * sample;
+
+    uint_fast64_t lwm = _current._lwm.load();
+    while ((sample < lwm) &&
+           (!_current._lwm.compare_exchange_weak(lwm, sample)))
+    {
+      // Do nothing.
+    }
+    uint_fast64_t hwm = _current._hwm.load();
+    while ((sample > hwm) &&
+           (!_current._hwm.compare_exchange_weak(hwm, sample)))
+    {
+      // Do nothing.
+    }
+
+    refresh();
+  }
+
+  void refresh(bool force = false)
+  {
+    uint_fast64_t timestamp_us = _current._timestamp_us.load();
+    uint_fast64_t timestamp_us_now = get_timestamp_us();
+    if ((force ||
+         (timestamp_us_now >= timestamp_us + _target_period_us)) &&
+        (_current._timestamp_us.compare_exchange_weak(timestamp_us, timestamp_us_now)))
+    {
+      _n = _current._n.exchange(0);
+      _current._sigma.exchange(0);
+      _current._sigma_squared.exchange(0);
+      _current._lwm.exchange(UINT_FAST64_MAX);
+      _current._hwm.exchange(0);
+    }
+  }
+
+  uint_fast64_t get_n() const { return _n; }
+
+private:
+  uint_fast64_t _target_period_us;
+  struct {
+    std::atomic_uint_fast64_t _timestamp_us;
+    std::atomic_uint_fast64_t _n;
+    std::atomic_uint_fast64_t _sigma;
+    std::atomic_uint_fast64_t _sigma_squared;
+    std::atomic_uint_fast64_t _lwm;
+    std::atomic_uint_fast64_t _hwm;
+  } _current;
+  volatile uint_fast64_t _n;
+
+  static uint_fast64_t get_timestamp_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+};
+
+#endif
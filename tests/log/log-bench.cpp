@@ -0,0 +1,146 @@
+/**
+ * @file log-bench.cpp Benchmark of the cost of disabled debug logs
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "log.h"
+#include "logger.h"
+#include "log-bench.h"
+
+/// Logger that throws everything away, so the benchmark measures the cost
+/// of making log statements rather than of writing the file.
+class NullLogger : public Logger
+{
+public:
+  void write(const char* data) {}
+};
+
+static int num_messages = 1000000;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const char* bench_get_info(BenchMsg& msg)
+{
+  snprintf(msg.info, sizeof(msg.info), "Request msg REGISTER/cseq=%d (rdata%p)",
+           (int)msg.call_id.size(), &msg);
+  return msg.info;
+}
+
+/// Returns the time taken per message in nanoseconds.
+static double run_test(void (*fn)(BenchMsg&))
+{
+  BenchMsg msg;
+  msg.call_id = "0gQAAC8WAAACBAAALxYAAAL8gMxsY3PFBBSh7XAeEAbPlZxHZ1b@10.0.0.1";
+  msg.aor = "<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>";
+  msg.path = "<sip:GgAAAAAAAACYyAW4z38AABcUwStNKgAAa3WOL+1v72nFJg==@ec2-107-22-156-220.compute-1.amazonaws.com:5060;lr;ob>";
+
+  uint64_t start_ns = now_ns();
+  for (int ii = 0; ii < num_messages; ++ii)
+  {
+    fn(msg);
+  }
+  return (double)(now_ns() - start_ns) / num_messages;
+}
+
+static void usage(char* command)
+{
+  printf("%s [options]\n", command);
+  printf("Options:\n\n"
+         " -m, --messages <N>             Messages in each test (default is 1000000)\n");
+}
+
+int main (int argc, char *argv[])
+{
+  // Parse the command line options
+  while (true)
+  {
+    static struct option long_options[] =
+    {
+      {"messages",            required_argument,         0, 'm'},
+      {0, 0, 0, 0}
+    };
+
+    // getopt_long stores the option index here.
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "m:", long_options, &option_index);
+
+    // Detect the end of the options.
+    if (c == -1)
+    {
+      break;
+    }
+
+    switch (c)
+    {
+      case 'm':
+        num_messages = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  Log::setLogger(new NullLogger());
+
+  printf("%d messages per test, %d debug logs per message\n",
+         num_messages, 4 + 2 * BenchMsg::NUM_BINDINGS);
+  printf("%-40s %15s\n", "", "ns/message");
+
+  Log::setLoggingLevel(4);
+  printf("%-40s %15.1f\n", "Debug disabled, old macros", run_test(bench_msg_old));
+  printf("%-40s %15.1f\n", "Debug disabled, inline level check", run_test(bench_msg_inline));
+  printf("%-40s %15.1f\n", "Debug compiled out", run_test(bench_msg_nodebug));
+
+  Log::setLoggingLevel(5);
+  printf("%-40s %15.1f\n", "Debug enabled (discarded)", run_test(bench_msg_inline));
+
+  exit(0);
+}
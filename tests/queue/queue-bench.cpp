@@ -0,0 +1,289 @@
+/**
+ * @file queue-bench.cpp Microbenchmark comparing eventq with the lock-free mpmcq
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+
+#include "eventq.h"
+#include "mpmcq.h"
+
+// The queue entry mirrors the one used for received SIP messages.
+struct bench_qe
+{
+  void* rdata;
+  struct timespec rx_time;
+};
+
+// Options variables - all are read-only once the threads are started.
+int max_producers = 4;
+int max_consumers = 4;
+int num_messages = 1000000;
+unsigned int queue_size = 65536;
+unsigned int batch_size = 4;
+
+// Queues under test.  Only one is in use at a time.
+eventq<bench_qe>* event_q = NULL;
+mpmcq<bench_qe>* ring_q = NULL;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void push(bench_qe& qe)
+{
+  if (ring_q != NULL)
+  {
+    ring_q->push(qe);
+  }
+  else
+  {
+    event_q->push(qe);
+  }
+}
+
+static void* producer_thread(void* p)
+{
+  long count = (long)p;
+  bench_qe qe;
+  memset(&qe, 0, sizeof(qe));
+
+  for (long ii = 0; ii < count; ++ii)
+  {
+    qe.rdata = (void*)(ii + 1);
+    push(qe);
+  }
+
+  return NULL;
+}
+
+// Consumers stop when they see an entry with a NULL rdata.  These are
+// pushed after all the real messages, one per consumer.
+static void* consumer_thread(void* p)
+{
+  long received = 0;
+  bool done = false;
+
+  if (ring_q != NULL)
+  {
+    std::vector<bench_qe> batch(batch_size);
+    while (!done)
+    {
+      unsigned int count = ring_q->pop_batch(&batch[0], batch_size);
+      for (unsigned int ii = 0; ii < count; ++ii)
+      {
+        if (batch[ii].rdata != NULL)
+        {
+          ++received;
+        }
+        else if (!done)
+        {
+          done = true;
+        }
+        else
+        {
+          // Took another consumer's stop marker, so give it back.
+          push(batch[ii]);
+        }
+      }
+    }
+  }
+  else
+  {
+    bench_qe qe;
+    while ((!done) && (event_q->pop(qe)))
+    {
+      if (qe.rdata != NULL)
+      {
+        ++received;
+      }
+      else
+      {
+        done = true;
+      }
+    }
+  }
+
+  return (void*)received;
+}
+
+/// Runs a single test and returns the throughput in messages per second.
+static double run_test(bool lockfree, int producers, int consumers)
+{
+  if (lockfree)
+  {
+    ring_q = new mpmcq<bench_qe>(queue_size);
+  }
+  else
+  {
+    event_q = new eventq<bench_qe>(queue_size);
+  }
+
+  std::vector<pthread_t> producer_threads(producers);
+  std::vector<pthread_t> consumer_threads(consumers);
+
+  uint64_t start_ns = now_ns();
+
+  for (int ii = 0; ii < consumers; ++ii)
+  {
+    pthread_create(&consumer_threads[ii], NULL, &consumer_thread, NULL);
+  }
+  for (int ii = 0; ii < producers; ++ii)
+  {
+    pthread_create(&producer_threads[ii], NULL, &producer_thread, (void*)(long)(num_messages / producers));
+  }
+  for (int ii = 0; ii < producers; ++ii)
+  {
+    pthread_join(producer_threads[ii], NULL);
+  }
+
+  // Tell the consumers to stop once they have drained the queue.
+  bench_qe stop;
+  memset(&stop, 0, sizeof(stop));
+  for (int ii = 0; ii < consumers; ++ii)
+  {
+    push(stop);
+  }
+
+  long received = 0;
+  for (int ii = 0; ii < consumers; ++ii)
+  {
+    void* rc;
+    pthread_join(consumer_threads[ii], &rc);
+    received += (long)rc;
+  }
+
+  uint64_t elapsed_ns = now_ns() - start_ns;
+
+  delete ring_q;
+  ring_q = NULL;
+  delete event_q;
+  event_q = NULL;
+
+  return (double)received * 1000000000.0 / (double)elapsed_ns;
+}
+
+static void usage(char* command)
+{
+  printf("%s [options]\n", command);
+  printf("Options:\n\n"
+         " -p, --producers <N>            Maximum number of producer threads (default is 4)\n"
+         " -c, --consumers <N>            Maximum number of consumer threads (default is 4)\n"
+         " -m, --messages <N>             Messages to pass in each test (default is 1000000)\n"
+         " -q, --queue-size <N>           Queue capacity (default is 65536)\n"
+         " -b, --batch <N>                Lock-free queue batch size (default is 4)\n");
+}
+
+int main (int argc, char *argv[])
+{
+  // Parse the command line options
+  while (true)
+  {
+    static struct option long_options[] =
+    {
+      {"producers",           required_argument,         0, 'p'},
+      {"consumers",           required_argument,         0, 'c'},
+      {"messages",            required_argument,         0, 'm'},
+      {"queue-size",          required_argument,         0, 'q'},
+      {"batch",               required_argument,         0, 'b'},
+      {0, 0, 0, 0}
+    };
+
+    // getopt_long stores the option index here.
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "p:c:m:q:b:", long_options, &option_index);
+
+    // Detect the end of the options.
+    if (c == -1)
+    {
+      break;
+    }
+
+    switch (c)
+    {
+      case 'p':
+        max_producers = atoi(optarg);
+        break;
+
+      case 'c':
+        max_consumers = atoi(optarg);
+        break;
+
+      case 'm':
+        num_messages = atoi(optarg);
+        break;
+
+      case 'q':
+        queue_size = atoi(optarg);
+        break;
+
+      case 'b':
+        batch_size = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  printf("%d messages per test, queue size %u, batch size %u\n",
+         num_messages, queue_size, batch_size);
+  printf("%-10s %-10s %15s %15s %8s\n",
+         "producers", "consumers", "eventq msg/s", "mpmcq msg/s", "speedup");
+
+  for (int producers = 1; producers <= max_producers; producers *= 2)
+  {
+    for (int consumers = 1; consumers <= max_consumers; consumers *= 2)
+    {
+      double eventq_rate = run_test(false, producers, consumers);
+      double mpmcq_rate = run_test(true, producers, consumers);
+      printf("%-10d %-10d %15.0f %15.0f %7.2fx\n",
+             producers, consumers, eventq_rate, mpmcq_rate, mpmcq_rate / eventq_rate);
+    }
+  }
+
+  exit(0);
+}
@@ -0,0 +1,265 @@
+/**
+ * @file rxclone-bench.cpp Microbenchmark comparing pjsip_rx_data_clone with RxDataPool
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib-util.h>
+#include <pjlib.h>
+}
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+
+#include "rxdatapool.h"
+
+// Options variables - all are read-only once the threads are started.
+int max_threads = 4;
+int num_messages = 200000;
+
+// PJSIP state shared by all tests.
+pj_caching_pool cp;
+pjsip_endpoint* endpt = NULL;
+pjsip_transport* transport = NULL;
+
+// Message sizes to test, in bytes.  The largest is close to
+// PJSIP_MAX_PKT_LEN.
+static const int MSG_SIZES[] = {500, 1000, 2000, 3800};
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/// Build an INVITE of (roughly) the specified size, padded with a
+/// Subject header.
+static std::string build_msg(int size)
+{
+  std::string msg =
+    "INVITE sip:6505550231@homedomain SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+    "Max-Forwards: 68\r\n"
+    "Route: <sip:homedomain;lr>\r\n"
+    "From: <sip:6505551000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+    "To: <sip:6505550231@homedomain>\r\n"
+    "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqsUOO4ohntC@10.114.61.213\r\n"
+    "CSeq: 16567 INVITE\r\n"
+    "Supported: outbound, path\r\n"
+    "Content-Length: 0\r\n";
+  int padding = size - (int)msg.length() - (int)strlen("Subject: \r\n\r\n");
+  if (padding > 0)
+  {
+    msg += "Subject: " + std::string(padding, 'x') + "\r\n";
+  }
+  msg += "\r\n";
+  return msg;
+}
+
+/// Build and parse a received message, as a transport would.
+static pjsip_rx_data* build_rdata(pj_pool_t* pool, const std::string& msg)
+{
+  pjsip_rx_data* rdata = PJ_POOL_ZALLOC_T(pool, pjsip_rx_data);
+  rdata->tp_info.pool = pool;
+  rdata->tp_info.transport = transport;
+  memcpy(rdata->pkt_info.packet, msg.data(), msg.length());
+  rdata->pkt_info.len = msg.length();
+  pj_ansi_strcpy(rdata->pkt_info.src_name, "10.83.18.38");
+  rdata->pkt_info.src_port = 36530;
+  pj_gettimeofday(&rdata->pkt_info.timestamp);
+
+  pj_list_init(&rdata->msg_info.parse_err);
+  rdata->msg_info.msg = pjsip_parse_rdata(rdata->pkt_info.packet,
+                                          rdata->pkt_info.len,
+                                          rdata);
+  return rdata;
+}
+
+struct thread_args
+{
+  RxDataPool* rx_data_pool;  // NULL to use pjsip_rx_data_clone
+  const std::string* msg;
+};
+
+static void* clone_thread(void* p)
+{
+  thread_args* args = (thread_args*)p;
+
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  pj_bzero(desc, sizeof(desc));
+  pj_thread_register("bench", desc, &thread);
+
+  pj_pool_t* pool = pj_pool_create(&cp.factory, "bench", 16384, 4096, NULL);
+  pjsip_rx_data* rdata = build_rdata(pool, *args->msg);
+
+  for (int ii = 0; ii < num_messages; ++ii)
+  {
+    pjsip_rx_data* clone;
+    if (args->rx_data_pool != NULL)
+    {
+      args->rx_data_pool->clone(rdata, &clone);
+      args->rx_data_pool->release(clone);
+    }
+    else
+    {
+      pjsip_rx_data_clone(rdata, 0, &clone);
+      pjsip_rx_data_free_cloned(clone);
+    }
+  }
+
+  pj_pool_release(pool);
+  return NULL;
+}
+
+/// Clone and free messages of the given size on the given number of
+/// threads, and return the average cost of each clone in nanoseconds.
+static double run_test(bool pooled, int threads, const std::string& msg)
+{
+  RxDataPool* rx_data_pool = pooled ? new RxDataPool(&cp.factory, 1024) : NULL;
+  thread_args args = {rx_data_pool, &msg};
+  std::vector<pthread_t> thread_ids(threads);
+
+  uint64_t start_ns = now_ns();
+  for (int ii = 0; ii < threads; ++ii)
+  {
+    pthread_create(&thread_ids[ii], NULL, clone_thread, &args);
+  }
+  for (int ii = 0; ii < threads; ++ii)
+  {
+    pthread_join(thread_ids[ii], NULL);
+  }
+  uint64_t elapsed_ns = now_ns() - start_ns;
+
+  delete rx_data_pool;
+
+  // Report the cost in thread-time, so that results for different numbers
+  // of threads are comparable on a machine with enough cores.
+  return (double)elapsed_ns / (double)num_messages;
+}
+
+static void usage(char* command)
+{
+  printf("%s [options]\n", command);
+  printf("Options:\n\n"
+         " -t, --threads <N>              Maximum number of cloning threads (default is 4)\n"
+         " -m, --messages <N>             Messages cloned by each thread in each test\n"
+         "                                (default is 200000)\n");
+}
+
+int main (int argc, char *argv[])
+{
+  // Parse the command line options
+  while (true)
+  {
+    static struct option long_options[] =
+    {
+      {"threads",             required_argument,         0, 't'},
+      {"messages",            required_argument,         0, 'm'},
+      {0, 0, 0, 0}
+    };
+
+    // getopt_long stores the option index here.
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "t:m:", long_options, &option_index);
+
+    // Detect the end of the options.
+    if (c == -1)
+    {
+      break;
+    }
+
+    switch (c)
+    {
+      case 't':
+        max_threads = atoi(optarg);
+        break;
+
+      case 'm':
+        num_messages = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  // Set up enough of PJSIP to parse messages and hold a transport.
+  pj_init();
+  pjlib_util_init();
+  pj_log_set_level(0);
+  pj_caching_pool_init(&cp, &pj_pool_factory_default_policy, 0);
+  pjsip_endpt_create(&cp.factory, NULL, &endpt);
+
+  pj_sockaddr_in addr;
+  pj_sockaddr_in_init(&addr, NULL, 0);
+  if (pjsip_udp_transport_start(endpt, &addr, NULL, 1, &transport) != PJ_SUCCESS)
+  {
+    printf("Failed to create UDP transport\n");
+    exit(1);
+  }
+
+  printf("%d messages per thread per test\n", num_messages);
+  printf("%-10s %-10s %15s %15s %8s\n",
+         "size", "threads", "clone ns/msg", "pooled ns/msg", "speedup");
+
+  for (unsigned int ii = 0; ii < sizeof(MSG_SIZES) / sizeof(MSG_SIZES[0]); ++ii)
+  {
+    std::string msg = build_msg(MSG_SIZES[ii]);
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+      double clone_ns = run_test(false, threads, msg);
+      double pooled_ns = run_test(true, threads, msg);
+      printf("%-10d %-10d %15.0f %15.0f %7.2fx\n",
+             (int)msg.length(), threads, clone_ns, pooled_ns, clone_ns / pooled_ns);
+    }
+  }
+
+  pjsip_transport_shutdown(transport);
+  pjsip_endpt_destroy(endpt);
+  pj_caching_pool_destroy(&cp);
+  pj_shutdown();
+
+  exit(0);
+}
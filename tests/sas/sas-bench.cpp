@@ -0,0 +1,403 @@
+/**
+ * @file sas-bench.cpp Benchmark of SAS event reporting
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <new>
+#include <string>
+
+#include "eventq.h"
+#include "sas.h"
+
+// Count every allocation made through operator new or new[], in any thread.
+static std::atomic<unsigned long> allocations(0);
+
+static void* counted_alloc(size_t size)
+{
+  allocations++;
+  void* p = malloc(size);
+  if (p == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new(size_t size)
+{
+  return counted_alloc(size);
+}
+
+void* operator new[](size_t size)
+{
+  return counted_alloc(size);
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  free(p);
+}
+
+// Options variables.
+static int num_events = 1000000;
+static int body_size = 800;
+static int num_threads = 1;
+
+// Port SAS connects to.
+static const int SAS_PORT = 6761;
+
+// Bytes received by the sink.
+static std::atomic<unsigned long> bytes_received(0);
+static std::atomic<bool> sink_connected(false);
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/// Accepts the SAS connection and throws away everything sent on it.
+static void* sink_thread(void* p)
+{
+  int listener = (int)(long)p;
+  int sock = accept(listener, NULL, NULL);
+  sink_connected = true;
+  char buf[65536];
+  ssize_t len;
+  while ((len = recv(sock, buf, sizeof(buf), 0)) > 0)
+  {
+    bytes_received += len;
+  }
+  close(sock);
+  return NULL;
+}
+
+/// Build an event like the one reported for each received SIP message.
+static void build_event(SAS::Event& event, const std::string& body)
+{
+  event.add_static_param(5060);
+  event.add_static_param(12345);
+  event.add_var_param(body);
+  event.add_var_param("10.0.0.1");
+}
+
+/// Listens for a connection on the SAS port, and starts a thread to
+/// receive and discard everything sent on it.
+static bool start_sink(int& listener, pthread_t& sink)
+{
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(SAS_PORT);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if ((bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+      (listen(listener, 1) != 0))
+  {
+    printf("Failed to listen on port %d: %s\n", SAS_PORT, strerror(errno));
+    close(listener);
+    return false;
+  }
+
+  sink_connected = false;
+  bytes_received = 0;
+  pthread_create(&sink, NULL, &sink_thread, (void*)(long)listener);
+  return true;
+}
+
+static void stop_sink(int listener, pthread_t sink)
+{
+  pthread_join(sink, NULL);
+  close(listener);
+}
+
+static void report(const char* name,
+                   uint64_t elapsed_ns,
+                   unsigned long allocs,
+                   unsigned long dropped)
+{
+  // The rate only counts events that made it to the sink.
+  printf("%-40s %15.0f %15.2f %15lu\n",
+         name,
+         (double)(num_events - dropped) * 1000000000.0 / elapsed_ns,
+         (double)allocs / num_events,
+         dropped);
+}
+
+/// Runs num_threads threads, each reporting its share of the events.
+static void run_producers(void* (*producer)(void*))
+{
+  pthread_t* threads = new pthread_t[num_threads];
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_create(&threads[ii], NULL, producer, NULL);
+  }
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+  delete[] threads;
+}
+
+// The old path - encode to a string, pass it by value and queue a copy of
+// it, then send each message with its own system call.
+static eventq<std::string>* legacy_q;
+static int legacy_sock;
+
+static const std::string* event_body;
+
+static void legacy_send_msg(std::string msg)
+{
+  legacy_q->push_noblock(msg);
+}
+
+static void* legacy_producer(void* p)
+{
+  for (int ii = 0; ii < num_events / num_threads; ++ii)
+  {
+    SAS::Event event(ii, 0x010000, 0);
+    build_event(event, *event_body);
+    legacy_send_msg(event.to_string());
+  }
+  return NULL;
+}
+
+static void* legacy_writer(void* p)
+{
+  std::string msg;
+  while (legacy_q->pop(msg))
+  {
+    send(legacy_sock, msg.data(), msg.length(), 0);
+  }
+  return NULL;
+}
+
+static bool run_legacy(const std::string& body)
+{
+  int listener;
+  pthread_t sink;
+  if (!start_sink(listener, sink))
+  {
+    return false;
+  }
+
+  legacy_sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(SAS_PORT);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (connect(legacy_sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    printf("Failed to connect to sink: %s\n", strerror(errno));
+    return false;
+  }
+
+  legacy_q = new eventq<std::string>(0);
+  pthread_t writer;
+  pthread_create(&writer, NULL, &legacy_writer, NULL);
+
+  SAS::Event sample(0, 0x010000, 0);
+  build_event(sample, body);
+  unsigned long expected = (unsigned long)num_events * sample.encoded_length();
+
+  unsigned long start_allocs = allocations.load();
+  uint64_t start_ns = now_ns();
+  run_producers(&legacy_producer);
+  while (bytes_received.load() < expected)
+  {
+    usleep(100);
+  }
+  uint64_t elapsed_ns = now_ns() - start_ns;
+  unsigned long allocs = allocations.load() - start_allocs;
+  report("Locked string queue (previous)", elapsed_ns, allocs, 0);
+
+  legacy_q->terminate();
+  pthread_join(writer, NULL);
+  delete legacy_q;
+  close(legacy_sock);
+  stop_sink(listener, sink);
+  return true;
+}
+
+static void* sas_producer(void* p)
+{
+  for (int ii = 0; ii < num_events / num_threads; ++ii)
+  {
+    SAS::Event event(ii, 0x010000, 0);
+    build_event(event, *event_body);
+    SAS::report_event(event);
+  }
+  return NULL;
+}
+
+/// Reports the events through SAS to the sink.
+static bool run_sas(const std::string& body)
+{
+  int listener;
+  pthread_t sink;
+  if (!start_sink(listener, sink))
+  {
+    return false;
+  }
+
+  std::string system_name("sas-bench");
+  SAS::init(system_name.length(), system_name.c_str(), "127.0.0.1");
+
+  // Wait until the connection is up and the INIT message has arrived, then
+  // give the writer thread a moment to open its queue.
+  while ((!sink_connected) || (bytes_received.load() == 0))
+  {
+    usleep(1000);
+  }
+  usleep(100000);
+  unsigned long init_bytes = bytes_received.load();
+
+  SAS::Event sample(0, 0x010000, 0);
+  build_event(sample, body);
+
+  unsigned long start_allocs = allocations.load();
+  uint64_t start_ns = now_ns();
+  run_producers(&sas_producer);
+
+  // Events dropped because the writer fell behind are never sent.
+  unsigned long dropped = SAS::events_dropped();
+  unsigned long expected = init_bytes + (unsigned long)(num_events - dropped) * sample.encoded_length();
+  while (bytes_received.load() < expected)
+  {
+    usleep(100);
+  }
+  uint64_t elapsed_ns = now_ns() - start_ns;
+  unsigned long allocs = allocations.load() - start_allocs;
+  report("Per-thread rings and writev", elapsed_ns, allocs, dropped);
+
+  SAS::term();
+  stop_sink(listener, sink);
+  return true;
+}
+
+static void usage(char* command)
+{
+  printf("%s [options]\n", command);
+  printf("Options:\n\n"
+         " -e, --events <N>               Events to report in each test (default is 1000000)\n"
+         " -b, --body <N>                 Size of the message body in each event (default is 800)\n"
+         " -t, --threads <N>              Threads reporting events (default is 1)\n");
+}
+
+int main (int argc, char *argv[])
+{
+  // Parse the command line options
+  while (true)
+  {
+    static struct option long_options[] =
+    {
+      {"events",              required_argument,         0, 'e'},
+      {"body",                required_argument,         0, 'b'},
+      {"threads",             required_argument,         0, 't'},
+      {0, 0, 0, 0}
+    };
+
+    // getopt_long stores the option index here.
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "e:b:t:", long_options, &option_index);
+
+    // Detect the end of the options.
+    if (c == -1)
+    {
+      break;
+    }
+
+    switch (c)
+    {
+      case 'e':
+        num_events = atoi(optarg);
+        break;
+
+      case 'b':
+        body_size = atoi(optarg);
+        break;
+
+      case 't':
+        num_threads = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  if (num_threads < 1)
+  {
+    num_threads = 1;
+  }
+  num_events -= num_events % num_threads;
+
+  std::string body(body_size, 'x');
+  event_body = &body;
+
+  printf("%d events per test, %d byte body, %d threads\n", num_events, body_size, num_threads);
+  printf("%-40s %15s %15s %15s\n", "", "sent/s", "allocs/event", "dropped");
+
+  if ((!run_legacy(body)) || (!run_sas(body)))
+  {
+    exit(1);
+  }
+
+  exit(0);
+}
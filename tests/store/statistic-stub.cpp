@@ -0,0 +1,17 @@
+#include "statistic.h"
+
+// The store tools don't publish statistics, so stub out the statistics
+// used by the store (such as the AoR cache counters) rather than linking
+// the whole of sprout.
+Statistic::Statistic(std::string statname,
+                     const std::atomic_int_fast64_t* polled_value) :
+  _statname(statname),
+  _changed(false),
+  _polled_value(polled_value),
+  _published_value(0)
+{
+}
+
+Statistic::~Statistic()
+{
+}
@@ -0,0 +1,197 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include "log.h"
+#include "memcachedstore.h"
+
+// Options variables.
+static int num_iterations = 100000;
+static std::vector<int> binding_counts;
+
+template <class T>
+std::string to_string(T t,                                 ///< datum to convert
+                      std::ios_base & (*f)(std::ios_base&) ///< modifier to apply
+                     )
+{
+  std::ostringstream oss;
+  oss << f << t;
+  return oss.str();
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/// Builds an AoR with the specified number of bindings, each looking like
+/// a typical registration from a SIP outbound client behind a P-CSCF.
+static RegData::MemcachedAoR* build_aor(int num_bindings)
+{
+  RegData::MemcachedAoR* aor_data = new RegData::MemcachedAoR();
+  int now = time(NULL);
+
+  for (int ii = 0; ii < num_bindings; ++ii)
+  {
+    std::string instance = "00000000-0000-0000-0000-" + to_string<int>(100000000 + ii, std::dec);
+    RegData::AoR::Binding* binding = aor_data->get_binding("<urn:uuid:" + instance + ">:1");
+    binding->_uri = "<sip:5102175698@192.91.191." + to_string<int>(ii % 256, std::dec) + ":59934;transport=tcp;ob>";
+    binding->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq" + to_string<int>(ii, std::dec);
+    binding->_cseq = 17038 + ii;
+    binding->_expires = now + 300;
+    binding->_priority = 0;
+    binding->_params.push_back(std::make_pair("+sip.instance", "\"<urn:uuid:" + instance + ">\""));
+    binding->_params.push_back(std::make_pair("reg-id", "1"));
+    binding->_params.push_back(std::make_pair("+sip.ice", ""));
+    binding->_path_headers.push_back("<sip:P1.EXAMPLEVISITED.COM;lr>");
+  }
+
+  return aor_data;
+}
+
+/// Returns the mean time in nanoseconds to serialize the AoR.
+static double time_encode(RegData::MemcachedAoR* aor_data, bool legacy)
+{
+  size_t total = 0;
+  uint64_t start_ns = now_ns();
+  for (int ii = 0; ii < num_iterations; ++ii)
+  {
+    std::string s = (legacy) ?
+                    RegData::MemcachedStore::serialize_legacy_aor(aor_data) :
+                    RegData::MemcachedStore::serialize_aor(aor_data);
+    total += s.length();
+  }
+  uint64_t elapsed_ns = now_ns() - start_ns;
+
+  // Use the total so the compiler can't discard the loop.
+  if (total == 0)
+  {
+    printf("Nothing serialized\n");
+  }
+
+  return (double)elapsed_ns / num_iterations;
+}
+
+/// Returns the mean time in nanoseconds to deserialize the AoR from the
+/// buffer, as it would be from a memcached result.
+static double time_decode(const std::string& s)
+{
+  size_t total = 0;
+  uint64_t start_ns = now_ns();
+  for (int ii = 0; ii < num_iterations; ++ii)
+  {
+    RegData::MemcachedAoR* aor_data =
+                   RegData::MemcachedStore::deserialize_aor(s.data(), s.length());
+    total += aor_data->bindings().size();
+    delete aor_data;
+  }
+  uint64_t elapsed_ns = now_ns() - start_ns;
+
+  if (total == 0)
+  {
+    printf("Nothing deserialized\n");
+  }
+
+  return (double)elapsed_ns / num_iterations;
+}
+
+static void usage(char* command)
+{
+  printf("%s [options]\n", command);
+  printf("Options:\n\n"
+         " -n, --iterations <N>           Times to encode and decode each AoR (default is 100000)\n"
+         " -b, --bindings <N>             Number of bindings in the AoR, may be repeated (default is\n"
+         "                                1, 10 and 50)\n"
+         " -L, --log-level <log-level>    Specifies the log level (default is 2)\n");
+}
+
+int main (int argc, char *argv[])
+{
+  int log_level = 2;
+
+  // Parse the command line options
+  while (true)
+  {
+    static struct option long_options[] =
+    {
+      {"iterations",          required_argument,         0, 'n'},
+      {"bindings",            required_argument,         0, 'b'},
+      {"log-level",           required_argument,         0, 'L'},
+      {0, 0, 0, 0}
+    };
+
+    // getopt_long stores the option index here.
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "n:b:L:", long_options, &option_index);
+
+    // Detect the end of the options.
+    if (c == -1)
+    {
+      break;
+    }
+
+    switch (c)
+    {
+      case 'n':
+        num_iterations = atoi(optarg);
+        break;
+
+      case 'b':
+        binding_counts.push_back(atoi(optarg));
+        break;
+
+      case 'L':
+        log_level = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  if (binding_counts.empty())
+  {
+    binding_counts.push_back(1);
+    binding_counts.push_back(10);
+    binding_counts.push_back(50);
+  }
+
+  Log::setLoggingLevel(log_level);
+
+  printf("%d iterations\n", num_iterations);
+  printf("%-10s %-8s %10s %15s %15s\n", "bindings", "format", "bytes", "encode ns", "decode ns");
+
+  for (size_t ii = 0; ii < binding_counts.size(); ++ii)
+  {
+    RegData::MemcachedAoR* aor_data = build_aor(binding_counts[ii]);
+
+    std::string legacy = RegData::MemcachedStore::serialize_legacy_aor(aor_data);
+    printf("%-10d %-8s %10d %15.1f %15.1f\n",
+           binding_counts[ii],
+           "legacy",
+           (int)legacy.length(),
+           time_encode(aor_data, true),
+           time_decode(legacy));
+
+    std::string binary = RegData::MemcachedStore::serialize_aor(aor_data);
+    printf("%-10d %-8s %10d %15.1f %15.1f\n",
+           binding_counts[ii],
+           "binary",
+           (int)binary.length(),
+           time_encode(aor_data, false),
+           time_decode(binary));
+
+    delete aor_data;
+  }
+
+  exit(0);
+}
@@ -0,0 +1,293 @@
+#include <getopt.h>
+#include <sys/time.h>
+#include <vector>
+#include <string>
+#include <sstream>
+
+#include "log.h"
+#include "logger.h"
+#include "localstore.h"
+#include "utils.h"
+
+// Options variables - all are read-only once the threads are started.
+bool verbose = false;
+int num_threads = 1;
+int num_records = 1;
+int num_bindings = 1;
+int num_shards = RegData::LocalStore::DEFAULT_SHARDS;
+int expires = 300;
+bool contend = false;
+int log_level = 2;
+std::string aor_domain;
+
+// Pointer to the store object - read-only once the threads are started.
+RegData::LocalStore* store;
+
+// Number of writes each thread had to retry because of a conflict.
+std::vector<long> conflicts;
+
+template <class T>
+std::string to_string(T t,                                 ///< datum to convert
+                      std::ios_base & (*f)(std::ios_base&) ///< modifier to apply
+                     )
+{
+  std::ostringstream oss;
+  oss << f << t;
+  return oss.str();
+}
+
+static int64_t now_ms()
+{
+  struct timeval td;
+  gettimeofday(&td, NULL);
+  int64_t ms = td.tv_sec;
+  ms = ms * 1000;
+  int64_t usec = td.tv_usec;
+  usec = usec / 1000;
+  ms += usec;
+  return ms;
+}
+
+static std::string aor_name(long tid, int ii)
+{
+  // If the threads are contending, they all use the same AoRs.
+  std::string aor_base = "aor" + to_string<int>(contend ? 0 : tid, std::dec);
+  return aor_base + "-" + to_string<long>(ii, std::dec) + "@" + aor_domain;
+}
+
+static void* writer_thread(void* p)
+{
+  // Get the thread identifier from the parameter.  This ensures the AoRs
+  // and bindings from different threads are different but predictable.
+  long tid = (long)p;
+
+  for (int ii = 0; ii < num_records; ++ii)
+  {
+    std::string aor = aor_name(tid, ii);
+    RegData::AoR* aor_data = NULL;
+    bool first = true;
+
+    do
+    {
+      // Delete AoR data if we've already been round once.
+      if (!first)
+      {
+        delete aor_data;
+        ++conflicts[tid];
+      }
+      first = false;
+
+      // Get the data for the AoR.
+      aor_data = store->get_aor_data(aor);
+
+      for (int jj = 0; jj < num_bindings; ++jj)
+      {
+        // Find or add the specified binding.
+        std::string binding_id = "binding" + to_string<long>(tid, std::dec) +
+                                 "-" + to_string<int>(jj, std::dec);
+        RegData::AoR::Binding* binding = aor_data->get_binding(binding_id);
+
+        // Update the binding
+        binding->_uri = binding_id + "@127.0.0.1;transport=TCP";
+        binding->_cseq = ii;
+        binding->_priority = 1;
+        binding->_expires = time(NULL) + expires;
+      }
+
+    } while (!store->set_aor_data(aor, aor_data));
+
+    delete aor_data;
+  }
+
+  return NULL;
+}
+
+static void* reader_thread(void* p)
+{
+  long tid = (long)p;
+
+  for (int ii = 0; ii < num_records; ++ii)
+  {
+    std::string aor = aor_name(tid, ii);
+    RegData::AoR* aor_data = store->get_aor_data(aor);
+
+    // Check every thread's bindings were written without any being lost.
+    size_t expected = num_bindings * (contend ? num_threads : 1);
+    if (aor_data->bindings().size() != expected)
+    {
+      printf("%ld: %s has %d bindings, expected %d\n",
+             tid,
+             aor.c_str(),
+             (int)aor_data->bindings().size(),
+             (int)expected);
+      exit(1);
+    }
+
+    if (verbose)
+    {
+      printf("%ld: %s has %d bindings\n",
+             tid,
+             aor.c_str(),
+             (int)aor_data->bindings().size());
+    }
+
+    delete aor_data;
+  }
+
+  return NULL;
+}
+
+static int64_t run_threads(void* (*fn)(void*))
+{
+  std::vector<pthread_t> threads;
+
+  int64_t start_ms = now_ms();
+
+  // Create the threads.
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t tid;
+    pthread_create(&tid, NULL, fn, (void*)(long)ii);
+    threads.push_back(tid);
+  }
+
+  // Wait for the threads to exit.
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  return now_ms() - start_ms;
+}
+
+static void usage(char* command)
+{
+  printf("%s [options] <address of record domain>\n", command);
+  printf("Options:\n\n"
+         " -v, --verbose                  Verbose\n"
+         " -t, --threads <threads>        Specifies the number of threads to run (default is 1)\n"
+         " -r, --records <records>        Specifies the number of records to write per thread (default\n"
+         "                                is 1)\n"
+         " -b, --bindings <bindings>      Specifies the number of bindings to write per record per\n"
+         "                                thread (default is 1)\n"
+         " -e, --expires <expires>        Specifies the expires value for each record (default is 300)\n"
+         " -S, --shards <shards>          Specifies the number of shards in the store (default is %d)\n"
+         " -c, --contend                  All threads write the same records, rather than their own\n"
+         " -L, --log-level <log-level>    Specifies the log level (default is 2)\n",
+         RegData::LocalStore::DEFAULT_SHARDS);
+}
+
+int main (int argc, char *argv[])
+{
+  // Parse the command line options
+  while (true)
+  {
+    static struct option long_options[] =
+    {
+      {"verbose",             no_argument,               0, 'v'},
+      {"threads",             required_argument,         0, 't'},
+      {"records",             required_argument,         0, 'r'},
+      {"bindings",            required_argument,         0, 'b'},
+      {"expires",             required_argument,         0, 'e'},
+      {"shards",              required_argument,         0, 'S'},
+      {"contend",             no_argument,               0, 'c'},
+      {"log-level",           required_argument,         0, 'L'},
+      {0, 0, 0, 0}
+    };
+
+
+    // getopt_long stores the option index here.
+    int option_index = 0;
+
+    char c = getopt_long(argc, argv, "vt:r:b:e:S:cL:", long_options, &option_index);
+
+    // Detect the end of the options.
+    if (c == -1)
+    {
+      break;
+    }
+
+    switch (c)
+    {
+      case 'v':
+        verbose = true;
+        break;
+
+      case 't':
+        num_threads = atoi(optarg);
+        break;
+
+      case 'r':
+        num_records = atoi(optarg);
+        break;
+
+      case 'b':
+        num_bindings = atoi(optarg);
+        break;
+
+      case 'e':
+        expires = atoi(optarg);
+        break;
+
+      case 'S':
+        num_shards = atoi(optarg);
+        break;
+
+      case 'c':
+        contend = true;
+        break;
+
+      case 'L':
+        log_level = atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  if (optind >= argc)
+  {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  // Get the AoR string.
+  aor_domain = std::string(argv[optind]);
+
+  printf("%d threads writing %d %s records each\n",
+         num_threads, num_records, contend ? "shared" : "separate");
+  printf("%d bindings per record per thread\n", num_bindings);
+  printf("AOR domain = %s\n", aor_domain.c_str());
+  printf("Expires = %d\n", expires);
+  printf("Shards = %d\n", num_shards);
+
+  Log::setLoggingLevel(log_level);
+  Log::setLogger(new Logger());
+
+  store = new RegData::LocalStore(num_shards);
+  conflicts.resize(num_threads, 0);
+
+  int64_t write_ms = run_threads(&writer_thread);
+
+  long total_conflicts = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    total_conflicts += conflicts[ii];
+  }
+
+  printf("Completed writing %d records in %g seconds\n", num_records * num_threads, (double)write_ms / 1000.0);
+  printf("  = %2g r/w operations per second\n", (double)(num_records * num_threads * 1000.0) / (double)write_ms);
+  printf("  %ld writes retried after conflicts\n", total_conflicts);
+
+  int64_t read_ms = run_threads(&reader_thread);
+
+  printf("Completed reading %d records in %g seconds\n", num_records * num_threads, (double)read_ms / 1000.0);
+  printf("  = %2g r operations per second\n", (double)(num_records * num_threads * 1000.0) / (double)read_ms);
+  printf("%d AoRs stored\n", store->size());
+
+  delete store;
+
+  exit(0);
+}
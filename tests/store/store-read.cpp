@@ -15,6 +15,7 @@ bool verbose = false;
 std::string servers = "127.0.0.1:11211";
 int num_threads = 1;
 int num_records = 1;
+int batch_size = 0;
 std::string protocol = "memcached-ascii";
 int log_level = 2;
 std::string aor_domain;
@@ -58,6 +59,40 @@ static void* reader_thread(void* p)
 
   std::string aor_base = "aor" + to_string<int>(tid, std::dec);
 
+  if (batch_size > 0)
+  {
+    // Read the AoRs in batches, with one multi-get per batch.
+    for (int ii = 0; ii < num_records; ii += batch_size)
+    {
+      std::vector<std::string> aor_names;
+      for (int jj = ii; (jj < ii + batch_size) && (jj < num_records); ++jj)
+      {
+        aor_names.push_back(aor_base + "-" + to_string<long>(jj, std::dec) + "@" + aor_domain);
+      }
+
+      std::vector<RegData::AoR*> aors = store->get_aor_data_multi(aor_names);
+
+      for (size_t jj = 0; jj < aors.size(); ++jj)
+      {
+        if (aors[jj] == NULL)
+        {
+          printf("%ld: Failed to get aor_data for %s\n", tid, aor_names[jj].c_str());
+          exit(1);
+        }
+
+        if (verbose)
+        {
+          // Print the data.
+          log_bindings(tid, aor_names[jj], aors[jj]);
+        }
+
+        delete aors[jj];
+      }
+    }
+
+    return NULL;
+  }
+
   for (int ii = 0; ii < num_records; ++ii)
   {
     std::string aor_name = aor_base + "-" + to_string<long>(ii, std::dec) + "@" + aor_domain;
@@ -93,6 +128,8 @@ static void usage(char* command)
          " -t, --threads <threads>        Specifies the number of threads to run (default is 1)\n"
          " -r, --records <records>        Specifies the number of records to read per thread (default\n"
          "                                is 1)\n"
+         " -b, --batch <size>             Read the records in batches of this size, with one\n"
+         "                                multi-get per batch (default is to read them one at a time)\n"
          " -p, --protocol <protocol>      Specifies protocol to use (memcached-ascii, memcached-binary,\n"
          "                                default is memcached-ascii)\n"
          " -L, --log-level <log-level>    Specifies the log level (default is 2)\n");
@@ -109,6 +146,7 @@ int main (int argc, char *argv[])
       {"servers",             required_argument,         0, 's'},
       {"threads",             required_argument,         0, 't'},
       {"records",             required_argument,         0, 'r'},
+      {"batch",               required_argument,         0, 'b'},
       {"protocol",            required_argument,         0, 'p'},
       {"log-level",           required_argument,         0, 'L'},
       {0, 0, 0, 0}
@@ -118,7 +156,7 @@ int main (int argc, char *argv[])
     // getopt_long stores the option index here.
     int option_index = 0;
 
-    char c = getopt_long(argc, argv, "vs:t:r:p:L:", long_options, &option_index);
+    char c = getopt_long(argc, argv, "vs:t:r:b:p:L:", long_options, &option_index);
 
     // Detect the end of the options.
     if (c == -1)
@@ -144,6 +182,10 @@ int main (int argc, char *argv[])
         num_records = atoi(optarg);
         break;
 
+      case 'b':
+        batch_size = atoi(optarg);
+        break;
+
       case 'p':
         protocol = std::string(optarg);
         if ((protocol != "memcached-ascii") &&
@@ -176,6 +218,10 @@ int main (int argc, char *argv[])
 
   printf("Servers = %s\n", servers.c_str());
   printf("%d threads reading %d records each\n", num_threads, num_records);
+  if (batch_size > 0)
+  {
+    printf("Batch size = %d\n", batch_size);
+  }
   printf("AOR domain = %s\n", aor_domain.c_str());
   printf("Protocol = %s\n", protocol.c_str());
 